@@ -1,5 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+/* System headers */
+#include <stdio.h>
+#include <unistd.h>
+
 /* GLib2 headers */
 #include <glib.h>
 #include <glib-unix.h>
@@ -7,39 +11,75 @@
 /* AV headers */
 #include <av.h>
 #include <av_mm.h>
+#include <av_config.h>
+#include <av_prompt.h>
 
 /* global AV lifecycle state structure */
 struct av_ll *ll;
 
+/* What the main loop polls with, when we count its wakeups. */
+static GPollFunc av_loop_poll;
+
+static gint av_loop_poll_counted(GPollFD *ufds, guint nfds, gint timeout) {
+	ll->loop_wakeups++;
+	return av_loop_poll(ufds, nfds, timeout);
+}
+
+/* Resident memory, in KiB: 0 if unknown. */
+static gulong av_loop_rss(void) {
+	gchar *statm;
+	gulong pages = 0;
+
+	if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL)) {
+		sscanf(statm, "%*u %lu", &pages);
+		g_free(statm);
+	}
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 /*
- * This function runs as a timeout GSource, and as such follows GLib2 semantics.
- * It's purpose is to give time for things to deinit "cleanly".
+ * Prints how often the main and MM loops woke up and how much memory we use,
+ * e.g. to compare D-Bus subscription modes (see av_mm_lean.c). Timeout GSource.
 */
-static gboolean av_handle_exit(gpointer user_data) {
-	if (!ll->async_counter) {
-		g_print("Exiting...\n");
-		g_main_loop_quit(ll->loop);
-		ll->exit_timeout_src_tag = 0; /* to be understood */
-		return G_SOURCE_REMOVE;
-	}
+static gboolean av_loop_stats(gpointer user_data) {
+	gint interval = GPOINTER_TO_INT(user_data);
+	gint mm_wakeups;
+
+	/* Whatever the MM thread counts meanwhile goes to the next round. */
+	mm_wakeups = g_atomic_int_get(&ll->mm_wakeups);
+	g_atomic_int_add(&ll->mm_wakeups, -mm_wakeups);
+
+	g_print("Main loop: %u wakeups, MM loop: %d wakeups in %d s (%.1f and %.1f per minute), RSS %lu KiB\n",
+		ll->loop_wakeups, mm_wakeups, interval, ll->loop_wakeups * 60.0 / interval, mm_wakeups * 60.0 / interval, av_loop_rss());
+	ll->loop_wakeups = 0;
 
 	return G_SOURCE_CONTINUE;
 }
 
 /*
  * AV exit logic. This function should be invoked to exit the program.
- * It's purpose is to start deinitializing e.g.: MM interaction code, while
- * the main event loop still runs.
+ * It's purpose is to have the MM thread deinitialize MM interaction code,
+ * while the main event loop still runs: it quits once the MM thread is done.
  *
  * Returns:
  * nothing, since if an error occurs here we have no way to handle that in a
  * way that makes sense.
 */
 static void av_exit(void) {
-	av_mm_deinit();
-	ll->exit_timeout_src_tag = g_timeout_add_seconds(1, G_SOURCE_FUNC(av_handle_exit), NULL);
-	if (!ll->exit_timeout_src_tag)
-		g_printerr("Failure when starting exit logic.\n");
+	/* Already on our way out. */
+	if (ll->exiting)
+		return;
+	ll->exiting = TRUE;
+
+	/* No more reloads: modems are going away. */
+	av_config_watch_stop();
+	if (ll->sighup_src_tag) {
+		g_source_remove(ll->sighup_src_tag);
+		ll->sighup_src_tag = 0;
+	}
+
+	av_mm_stop();
 
 	return;
 }
@@ -55,6 +95,13 @@ static gboolean av_sigint(void) {
 	return G_SOURCE_REMOVE;
 }
 
+/* Reloads the configuration on SIGHUP, as daemons do. */
+static gboolean av_sighup(void) {
+	g_print("Got SIGHUP!\n");
+	av_config_reload();
+	return G_SOURCE_CONTINUE;
+}
+
 /*
  * Prepares before entering the main loop.
  * In particular:
@@ -86,6 +133,10 @@ static struct av_ll *av_ll_prepare(void) {
 	if (!new_ll->unix_signals_src_tag)
 		g_printerr("Failure connecting UNIX signal source to GMainContext\n");
 
+	new_ll->sighup_src_tag = g_unix_signal_add(SIGHUP, G_SOURCE_FUNC(av_sighup), NULL);
+	if (!new_ll->sighup_src_tag)
+		g_printerr("Failure connecting UNIX signal source to GMainContext\n");
+
 	return new_ll;
 }
 
@@ -96,14 +147,25 @@ static struct av_ll *av_ll_prepare(void) {
  * nothing.
 */
 static void av_ll_end(void) {
+	/* Audio threads may stream prompts until the MM thread is gone. */
+	av_mm_teardown();
+
+	av_prompt_cache_deinit();
+	av_config_unload();
+
 	if (ll->unix_signals_src_tag) {
 		g_source_remove(ll->unix_signals_src_tag);
 		ll->unix_signals_src_tag = 0;
 	}
 
-	if (ll->exit_timeout_src_tag) {
-		g_source_remove(ll->exit_timeout_src_tag);
-		ll->exit_timeout_src_tag = 0;
+	if (ll->sighup_src_tag) {
+		g_source_remove(ll->sighup_src_tag);
+		ll->sighup_src_tag = 0;
+	}
+
+	if (ll->loop_stats_src_tag) {
+		g_source_remove(ll->loop_stats_src_tag);
+		ll->loop_stats_src_tag = 0;
 	}
 
 	if (ll->loop) {
@@ -117,15 +179,43 @@ static void av_ll_end(void) {
 
 /*
  * Starts the main loop dependant logic and enters main loop.
+ * The configuration and pre-encoded prompts are loaded here as well.
  *
  * Returns:
  * nothing.
 */
 static void av_ll_start(void) {
-	if (av_mm_init())
-		av_exit();
+	gchar *prompts_dir;
+	gint loop_stats;
+
+	av_startup_init();
+
+	/* Without it modems stay unconfigured, until it's fixed and reloaded. */
+	if (av_config_load())
+		g_printerr("Failure loading the configuration\n");
+
+	loop_stats = av_config_loop_stats();
+	if (loop_stats) {
+		av_loop_poll = g_main_context_get_poll_func(NULL);
+		g_main_context_set_poll_func(NULL, av_loop_poll_counted);
+		ll->loop_stats_src_tag = g_timeout_add_seconds(loop_stats, av_loop_stats, GINT_TO_POINTER(loop_stats));
+	}
+
+	/* Prompts must be mapped before any audio thread may stream them. */
+	prompts_dir = av_config_prompts_dir();
+	if (!av_prompt_cache_init(prompts_dir))
+		g_print("No prompts found in %s; callers will hear silence while dialing\n",prompts_dir);
+	g_clear_pointer(&prompts_dir, g_free);
+
+	/* Nothing would ever quit the main loop without the MM thread. */
+	if (av_mm_init()) {
+		g_printerr("Failure starting the MM thread\n");
+		return;
+	}
+	av_config_watch(av_mm_config_changed);
 
 	g_main_loop_run(ll->loop);
+	g_print("Exiting...\n");
 
 	return;
 }
@@ -5,37 +5,88 @@
 /* ModemManager's libmm-glib headers */
 #include <libmm-glib.h>
 
+/* AV headers */
+#include <av_gobjects.h>
+#include <av_sip.h>
+#include <av_storage.h>
+#include <av_startup.h>
+#include <av_mm_lean.h>
+
+struct av_thread;
+
+/*
+ * A line of the SIP reactor. The slot stays taken after its modem went away,
+ * until the reactor confirms the line is gone: messages about it may still
+ * be on their way meanwhile.
+*/
+struct av_sip_line_slot {
+	gboolean in_use;
+	AvModem *m;
+
+	/* Startup accounting: see av_startup.c. */
+	gboolean up;
+	gboolean registered;
+};
+
 /* AV lifecycle data. */
 struct av_ll {
 	/* async operations counter for a "clean exit" */
 	gint async_counter;
 
+	/* How long it takes to get going. */
+	struct av_startup startup;
+
 	/* GLib main event loop */
 	GMainLoop *loop;
 
 	/* GSources */
 	guint unix_signals_src_tag;
-	guint exit_timeout_src_tag;
+	guint sighup_src_tag;
+	guint loop_stats_src_tag;
+	guint mm_events_src_tag;
 
-	/* "Of modems and men": MM related stuff */
+	/* Main loop wakeups since last printed */
+	guint loop_wakeups;
 
-	/* D-Bus connection */
+	/* Asked the MM thread to exit already. */
+	gboolean exiting;
+
+	/* "Of modems and men": MM related stuff, on the MM thread: see av_mm.c */
+	struct av_thread *mmthread;
+	GMainContext *mm_context;
+	GMainLoop *mm_loop;
+	gboolean mm_exiting;
+
+	/* MM loop wakeups since last printed, counted atomically */
+	gint mm_wakeups;
+
+	/* D-Bus connection, and how to give up getting it */
 	GDBusConnection *dbus_connection;
+	GCancellable *dbus_cancellable;
 
 	/* MM watch ID */
 	guint mm_watch;
 
-	/* manager object */
+	/* manager object, or lean watching instead: see av_mm_lean.c */
 	MMManager *manager;
+	struct av_mm_lean lean;
 
 	/* "modem added" and "modem removed" GSignals IDs */
 	gulong modem_added;
 	gulong modem_removed;
 
-	/* list of managed modems */
-	GList *av_modems;
+	/* managed modems: see av_storage.c */
+	struct av_storage storage;
+
+	/* The SIP reactor, serving all modems, and its lines. */
+	struct av_thread *sipthread;
+	gboolean sip_ready;
+	GIOChannel *sip_giochannel;
+	guint sip_giochannel_watch_id;
+	struct av_sip_line_slot sip_lines[AV_SIP_MAX_LINES];
 };
 
 extern struct av_ll *ll;
 
+
 #endif
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/timerfd.h>
 
 /* AV headers */
 #include <av.h>
@@ -13,8 +14,14 @@
 #include <av_sip.h>
 #include <av_thread.h>
 #include <av_threadcomm.h>
+#include <av_prompt.h>
+#include <av_poll.h>
+#include <av_sip_codec.h>
 
-#define AV_AUDIO_POLL_NUM_FDS 2
+#define AV_AUDIO_POLL_NUM_FDS 3
+
+/* Prompts are streamed one frame each 20 ms. */
+#define AV_AUDIO_PROMPT_FRAME_NSEC 20000000
 /*
  * The following #define is also a tribute to the Wys project, found at
  * https://source.puri.sm/Librem5/wys
@@ -24,9 +31,78 @@
 struct av_audio_state {
 	struct av_thread *self;
 	struct pollfd poll_data[AV_AUDIO_POLL_NUM_FDS];
+	struct av_poll_source poll_sources[AV_AUDIO_POLL_NUM_FDS];
+	struct av_poll poll;
 	RtpSession *session;
+
+	/* No remote party yet: calls from the GSM network ring before SIP answers. */
+	gboolean remote;
+	int payload_type;
+	enum av_sip_codec_id codec;
 	uint32_t user_ts;
-} *astate;
+	struct av_prompt_cursor prompt;
+	gboolean ortp_user;
+};
+
+/* One audio thread per modem line: each of them has its own state. */
+static __thread struct av_audio_state *astate;
+
+/* oRTP global state is shared by all audio threads. */
+static GMutex av_audio_ortp_lock;
+static guint av_audio_ortp_users;
+
+/*
+ * The modem gives us mu-law: callers wanting A-law get it through this
+ * table, shared by all audio threads and filled by the first one.
+*/
+static guint8 av_audio_ulaw_to_alaw[256];
+static gsize av_audio_ulaw_to_alaw_ready;
+
+/* G.711 mu-law to 16 bits linear. */
+static gint av_audio_ulaw_decode(guint8 u) {
+	gint t;
+
+	u = ~u;
+	t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+
+	return (u & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+/* 16 bits linear to G.711 A-law. */
+static guint8 av_audio_alaw_encode(gint pcm) {
+	static const gint seg_end[8] = { 0x1f, 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff };
+	guint8 mask = 0xd5;
+	gint seg;
+	gint val = pcm >> 3;
+
+	if (val < 0) {
+		mask = 0x55;
+		val = -val - 1;
+	}
+
+	for (seg = 0; (seg < 8) && (val > seg_end[seg]); seg++);
+	if (seg == 8)
+		return 0x7f ^ mask;
+
+	return ((seg << 4) | ((val >> (seg < 2 ? 1 : seg)) & 0x0f)) ^ mask;
+}
+
+static void av_audio_alaw_init(void) {
+	int i;
+
+	if (g_once_init_enter(&av_audio_ulaw_to_alaw_ready)) {
+		for (i = 0; i < 256; i++)
+			av_audio_ulaw_to_alaw[i] = av_audio_alaw_encode(av_audio_ulaw_decode(i));
+		g_once_init_leave(&av_audio_ulaw_to_alaw_ready, 1);
+	}
+}
+
+static void av_audio_set_codec(const struct av_rtp_connection *c) {
+	astate->payload_type = c->payload_type;
+	astate->codec = c->codec;
+	if (astate->codec == AV_SIP_CODEC_PCMA)
+		av_audio_alaw_init();
+}
 
 void av_audio_astate_free(void) {
 	g_clear_pointer(&astate, g_free);
@@ -159,25 +235,22 @@ out:
 	return retval;
 }
 
-static int *av_audio_rtp_get_local_port(void) {
-	int *rtp_port;
-
-	rtp_port = g_try_malloc0(sizeof *rtp_port);
-	if (!rtp_port)
-		return rtp_port;
-
-	*rtp_port = rtp_session_get_local_port(astate->session);
-
-	return rtp_port;
+static int av_audio_rtp_get_local_port(void) {
+	return rtp_session_get_local_port(astate->session);
 }
 
 static int av_audio_rtp_init(const char *ip, int port) {
 
-	ortp_init();
-	ortp_scheduler_init();
+	g_mutex_lock(&av_audio_ortp_lock);
+	if (!av_audio_ortp_users++) {
+		ortp_init();
+		ortp_scheduler_init();
 
-	//ortp_set_log_level_mask(NULL, ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
-	ortp_set_log_level_mask(NULL, ORTP_DEBUG|ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
+		//ortp_set_log_level_mask(NULL, ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
+		ortp_set_log_level_mask(NULL, ORTP_DEBUG|ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
+	}
+	g_mutex_unlock(&av_audio_ortp_lock);
+	astate->ortp_user = TRUE;
 
 	astate->session = rtp_session_new(RTP_SESSION_SENDRECV);
 	if (!astate->session) {
@@ -188,8 +261,85 @@ static int av_audio_rtp_init(const char *ip, int port) {
 	rtp_session_set_scheduling_mode(astate->session,0);
 	rtp_session_set_blocking_mode(astate->session,0);
 	rtp_session_set_connected_mode(astate->session,TRUE);
-	rtp_session_set_remote_addr(astate->session,ip,port);
-	rtp_session_set_payload_type(astate->session,0);
+	if (ip) {
+		rtp_session_set_remote_addr(astate->session,ip,port);
+		astate->remote = TRUE;
+	}
+	rtp_session_set_payload_type(astate->session,astate->payload_type);
+
+	return 0;
+}
+
+static void av_audio_prompt_timer_arm(gboolean arm) {
+	struct itimerspec frame_timer = { 0 };
+
+	if (arm) {
+		frame_timer.it_value.tv_nsec = AV_AUDIO_PROMPT_FRAME_NSEC;
+		frame_timer.it_interval.tv_nsec = AV_AUDIO_PROMPT_FRAME_NSEC;
+	}
+
+	if (timerfd_settime(astate->poll_data[2].fd, 0, &frame_timer, NULL))
+		g_printerr("timerfd_settime: %s\n",strerror(errno));
+}
+
+/*
+ * Starts streaming a cached prompt as early media, with the codec of the
+ * current RTP session. Ringback and the queue music loop until stopped (the
+ * latter being ringback too, if there's none), announcements are played once.
+*/
+static void av_audio_prompt_play(enum AV_PROMPT_ID id) {
+	const struct av_prompt *p;
+	struct av_thread_cmd *done;
+	enum AV_PROMPT_CODEC codec;
+
+	codec = av_prompt_codec_from_rtp(av_sip_codec_get(astate->codec)->static_pt);
+	p = av_prompt_get(id, codec);
+	if (!p && (id == AV_PROMPT_QUEUE))
+		p = av_prompt_get((id = AV_PROMPT_RINGBACK), codec);
+	if (!p || !astate->session) {
+		g_print("No prompt %d for payload type %d\n",id,astate->payload_type);
+		/* Nothing to play, so we are already done. */
+		if ( (id == AV_PROMPT_UNAVAILABLE) && (done = av_thread_cmd(AUDIO_EVENT_PROMPT_DONE, NULL)) )
+			av_thread_txcmd(astate->self, done, 1);
+		return;
+	}
+
+	av_prompt_cursor_init(&astate->prompt, p, (id == AV_PROMPT_RINGBACK) || (id == AV_PROMPT_QUEUE));
+	av_audio_prompt_timer_arm(TRUE);
+}
+
+static void av_audio_prompt_stop(void) {
+	if (!astate->prompt.prompt)
+		return;
+
+	av_prompt_cursor_init(&astate->prompt, NULL, FALSE);
+	av_audio_prompt_timer_arm(FALSE);
+}
+
+static gint av_audio_prompt_send_frame(void) {
+	uint64_t n_expirations;
+	const guchar *frame;
+	gsize frame_len;
+	struct av_thread_cmd *done;
+
+	/* No expiration to account for: no frame is due either. */
+	if (read(astate->poll_data[2].fd, &n_expirations, sizeof n_expirations) < 0) {
+		if (errno != EAGAIN)
+			g_printerr("Error reading prompt timer: %s\n",strerror(errno));
+		return 0;
+	}
+
+	frame_len = av_prompt_cursor_next_frame(&astate->prompt, &frame);
+	if (!frame_len) {
+		av_audio_prompt_stop();
+		done = av_thread_cmd(AUDIO_EVENT_PROMPT_DONE, NULL);
+		if (done)
+			av_thread_txcmd(astate->self, done, 1);
+		return 0;
+	}
+
+	rtp_session_send_with_ts(astate->session, frame, frame_len, astate->user_ts);
+	astate->user_ts += av_prompt_codec_frame_ts(astate->prompt.prompt->codec);
 
 	return 0;
 }
@@ -220,131 +370,199 @@ static int av_audio_do_serial_read(int fd) {
 	if (retries > 10)
 		g_print("Could happen, retries = %d\n",retries);
 
+	/* While a prompt is being streamed, it owns the RTP timeline. */
+	if (astate->prompt.prompt || !astate->remote)
+		return 0;
+
+	if (astate->codec == AV_SIP_CODEC_PCMA)
+		for (bufptr = audiobuf; bufptr < audiobuf + nbytes; bufptr++)
+			*bufptr = av_audio_ulaw_to_alaw[*bufptr];
+
 	rtp_session_send_with_ts(astate->session, audiobuf, nbytes, astate->user_ts);
 	astate->user_ts += nbytes;
 
 	return 0;
 }
 
-static gint av_audio_sip_msg(void) {
+static gint av_audio_sip_msg(gpointer data, guint budget, gboolean *more) {
 	struct av_thread_cmd *cmd;
 	gint retval = 0;
-	const struct av_rtp_connection *pbx_connection;
+	struct av_rtp_connection *pbx_connection;
 	struct av_thread_cmd *acmd;
 
-	cmd = av_thread_rxcmd(astate->self, 1);
+	while (!retval && budget && (cmd = av_thread_rxcmd(astate->self, 1))) {
+		budget--;
+		switch(cmd->msgtype) {
+			case CMD_AUDIO_INIT:
+				g_print("Attempting audio init\n");
+				pbx_connection = cmd->payload;
+				av_audio_set_codec(pbx_connection);
+
+				if (av_audio_rtp_init(pbx_connection->addr, pbx_connection->port)) {
+					av_sip_rtp_connection_free(&pbx_connection);
+					retval++;
+					break;
+				}
 
-	if (!cmd)
-		return retval;
+				/* Queued calls have no modem yet: see CMD_AUDIO_SERIAL. */
+				g_print("Attempting serial init, even tough %s is NULL\n",pbx_connection->serial_device);
+				if (pbx_connection->serial_device && av_audio_serial_init(pbx_connection->serial_device)) {
+					av_sip_rtp_connection_free(&pbx_connection);
+					retval++;
+					break;
+				}
 
-	switch(cmd->msgtype) {
-		case CMD_AUDIO_INIT:
-			g_print("Attempting audio init\n");
-			pbx_connection = cmd->payload;
+				av_sip_rtp_connection_free(&pbx_connection);
 
-			if (av_audio_rtp_init(pbx_connection->addr, pbx_connection->port)) {
-				retval++;
-				break;
-			}
+				acmd = av_thread_cmd_str(AUDIO_EVENT_RTP_OK, av_audio_rtp_get_local_port(), NULL);
+				if (acmd) {
+					av_thread_txcmd(astate->self, acmd, 1);
+					g_print("Answered that AUDIO_EVENT_RTP_OK\n");
+				}
 
-			g_print("Attempting serial init, even tough %s is NULL\n",pbx_connection->serial_device);
-			if (av_audio_serial_init(pbx_connection->serial_device)) {
+				break;
+			case CMD_AUDIO_EXIT:
 				retval++;
 				break;
-			}
-
-			acmd = av_thread_cmd(AUDIO_EVENT_RTP_OK, NULL);
-			if (acmd) {
-				acmd->payload = av_audio_rtp_get_local_port();
-
-				if (acmd->payload) {
-					av_thread_txcmd(astate->self, acmd, 1);
-					g_print("Answered that AUDIO_EVENT_RTP_OK\n");
+			case CMD_AUDIO_PROMPT_PLAY:
+				av_audio_prompt_play(GPOINTER_TO_INT(cmd->payload));
+				break;
+			case CMD_AUDIO_PROMPT_STOP:
+				av_audio_prompt_stop();
+				break;
+			case CMD_AUDIO_RETARGET:
+				/* Same RTP session, new remote party: another call became active, or the caller moved its stream. */
+				pbx_connection = cmd->payload;
+				g_print("Switching RTP to %s:%d\n",pbx_connection->addr,pbx_connection->port);
+				av_audio_set_codec(pbx_connection);
+				if (astate->session) {
+					rtp_session_set_remote_addr(astate->session,pbx_connection->addr,pbx_connection->port);
+					rtp_session_set_payload_type(astate->session,astate->payload_type);
+					astate->remote = TRUE;
+				}
+				av_sip_rtp_connection_free(&pbx_connection);
+				break;
+			case CMD_AUDIO_SERIAL:
+				/*
+				 * A queued call got a modem: same RTP session, the modem audio
+				 * port joins in. Unless there's no session yet, CMD_AUDIO_INIT
+				 * then opening both.
+				*/
+				if (!astate->session || (astate->poll_data[1].fd >= 0))
+					break;
+
+				g_print("Opening %s for a queued call\n",cmd->data);
+				if (av_audio_serial_init(cmd->data)) {
+					retval++;
+					break;
 				}
 
-				g_clear_pointer(&acmd, g_free);
-			}
+				acmd = av_thread_cmd_str(AUDIO_EVENT_RTP_OK, av_audio_rtp_get_local_port(), NULL);
+				if (acmd)
+					av_thread_txcmd(astate->self, acmd, 1);
+				break;
+			default:
+				g_printerr("Unknown command received (%d)!\n",cmd->msgtype);
+				retval++;
+				break;
+		}
 
-			break;
-		case CMD_AUDIO_EXIT:
-			retval++;
-			break;
-		default:
-			g_printerr("Unknown command received (%d)!\n",cmd->msgtype);
-			retval++;
-			break;
+		g_clear_pointer(&cmd, av_thread_cmd_free);
 	}
 
-	g_clear_pointer(&cmd, g_free);
+	*more = !budget;
 
 	return retval;
 }
 
-static gint av_audio_do_poll(void) {
-	gint n_events;
+static gint av_audio_serial_dispatch(gpointer data, guint budget, gboolean *more) {
+	return av_audio_do_serial_read(astate->poll_data[1].fd);
+}
 
-	n_events = poll(astate->poll_data, AV_AUDIO_POLL_NUM_FDS, -1);
-	if (n_events < 0) {
-		g_printerr("Failure while poll()ing: %s\n",strerror(errno));
-		return -1;
-	}
+static gint av_audio_prompt_dispatch(gpointer data, guint budget, gboolean *more) {
+	return av_audio_prompt_send_frame();
+}
 
-	/* SipStack is telling something to us... */
-	if (astate->poll_data[0].revents == POLLIN) {
-		astate->poll_data[0].revents = 0;
-		return av_audio_sip_msg();
-	}
+/* Poll sources, in poll_data order. A serial read or a prompt frame is one unit of work. */
+static const struct av_poll_source av_audio_poll_sources[AV_AUDIO_POLL_NUM_FDS] = {
+	{ .name = "SIP", .dispatch = av_audio_sip_msg, .budget = 16 },
+	{ .name = "serial", .dispatch = av_audio_serial_dispatch, .budget = 1 },
+	{ .name = "prompt", .dispatch = av_audio_prompt_dispatch, .budget = 1 },
+};
 
-	/* We could read from serial... */
-	if (astate->poll_data[1].revents == POLLIN) {
-		astate->poll_data[1].revents = 0;
-		return av_audio_do_serial_read(astate->poll_data[1].fd);
-	}
-
-	return 0;
+static gint av_audio_do_poll(void) {
+	return av_poll_run(&astate->poll, -1);
 }
 
 static void av_audio_rtp_deinit(void) {
 	astate->user_ts = 0;
 	g_clear_pointer(&astate->session, rtp_session_destroy);
-	ortp_exit();
-	ortp_global_stats_display();
+
+	if (!astate->ortp_user)
+		return;
+
+	/* The last audio thread around shuts oRTP down. */
+	g_mutex_lock(&av_audio_ortp_lock);
+	if (!--av_audio_ortp_users) {
+		ortp_exit();
+		ortp_global_stats_display();
+	}
+	g_mutex_unlock(&av_audio_ortp_lock);
+	astate->ortp_user = FALSE;
 }
 
-static void av_audio_poll_init(void) {
+static gint av_audio_poll_init(void) {
 	int i;
 
 	for (i=0;i<AV_AUDIO_POLL_NUM_FDS;i++) {
 		astate->poll_data[i].events = POLLIN;
 	}
 
-	astate->poll_data[0].fd = astate->self->sockets[1];
+	astate->poll_data[0].fd = av_thread_eventfd(astate->self, 1);
+
+	/* Prompts frame timer: armed only while a prompt is being streamed. */
+	astate->poll_data[2].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (astate->poll_data[2].fd < 0) {
+		g_printerr("timerfd_create: %s\n",strerror(errno));
+		return 1;
+	}
+
+	return 0;
 }
 
 void *av_audiothread_startup(gpointer data) {
 	struct av_thread *t = data;
 	struct av_thread_cmd *ready;
+	struct av_thread_cmd *exited;
 
 	if (av_audio_astate_alloc())
-		return astate;
+		goto out;
 
 	astate->self = t;
 
 	ready = av_thread_cmd(AUDIO_EVENT_READY, NULL);
-	if (ready) {
+	if (ready)
 		av_thread_txcmd(t, ready, 1);
-		g_clear_pointer(&ready, g_free);
-	}
-
-	av_audio_poll_init();
 
 	/* do poll() */
-	while(!av_audio_do_poll());
+	if (!av_audio_poll_init()) {
+		av_poll_init(&astate->poll, astate->poll_data, astate->poll_sources, av_audio_poll_sources, AV_AUDIO_POLL_NUM_FDS);
+		while(!av_audio_do_poll());
+		av_poll_report(&astate->poll, "Audio");
+	}
 
 	g_print("Audio thread exiting...\n");
 
 	av_audio_rtp_deinit();
 	av_audio_close_fd(astate->poll_data[1].fd);
+	av_audio_close_fd(astate->poll_data[2].fd);
 	av_audio_astate_free();
+
+out:
+	/* Our parent doesn't wait for us: let it know it can join us now. */
+	exited = av_thread_cmd(AUDIO_EVENT_EXITED, NULL);
+	if (exited)
+		av_thread_txcmd(t, exited, 1);
+
 	return NULL;
 }
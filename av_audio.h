@@ -8,11 +8,17 @@
 enum AUDIO_EVENTS {
 	AUDIO_EVENT_READY,
 	AUDIO_EVENT_RTP_OK,
+	AUDIO_EVENT_PROMPT_DONE,
+	AUDIO_EVENT_EXITED,
 };
 
 enum AUDIO_CMDs {
 	CMD_AUDIO_INIT,
 	CMD_AUDIO_EXIT,
+	CMD_AUDIO_PROMPT_PLAY,
+	CMD_AUDIO_PROMPT_STOP,
+	CMD_AUDIO_RETARGET,
+	CMD_AUDIO_SERIAL,
 };
 
 #endif
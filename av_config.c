@@ -1,11 +1,59 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+/*
+ * Configuration. AirVoice.cfg is parsed once into a snapshot, modem sections
+ * ("MM_<equipment ID>") being resolved into per-modem settings right away,
+ * fallbacks to top level settings included: getters don't touch the file,
+ * and modem settings are a hash table lookup.
+ *
+ * Snapshots never change once loaded. Reloading (on SIGHUP, or when the file
+ * is written to) builds a new one and swaps it in, RCU style: whoever holds
+ * the old one, on whatever thread, keeps it until done with it. Modems whose
+ * settings changed are then told about, see av_config_watch().
+*/
+
+/* System headers */
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* GLib2 headers */
+#include <glib-unix.h>
+
 /* libconfig header */
 #include <libconfig.h>
 
 /* AV headers */
 #include <av_config.h>
 
+/* How long calls from the GSM network ring on SIP when not configured, in seconds. */
+#define AV_CONFIG_FORWARD_TIMEOUT 30
+
+/* The configuration file, relative to the working directory at startup. */
+#define AV_CONFIG_FILE "AirVoice.cfg"
+
+/* Modem sections are named after equipment IDs, with this in front. */
+#define AV_CONFIG_MODEM_PREFIX "MM_"
+
+struct av_config_snapshot {
+	gint refcount;
+	config_t *lc;
+
+	/* struct av_modem_config by equipment ID. */
+	GHashTable *modems;
+};
+
+/* The current snapshot, and how it gets reloaded. */
+static struct {
+	GMutex lock;
+	struct av_config_snapshot *current;
+	gchar *path;
+	int inotify_fd;
+	guint inotify_src;
+	av_config_changed_func changed;
+	guint n_reloads;
+} av_config = { .inotify_fd = -1 };
+
 static void av_config_deinit(config_t **c) {
 	config_destroy(*c);
 	g_clear_pointer(c, g_free);
@@ -39,22 +87,216 @@ failure:
 	return lc_context;
 }
 
-static gchar *av_config_search(config_t *l, const gchar *base, const gchar *value) {
-	gchar *config_path;
-	gchar *result = NULL;
+static gchar *av_config_search(config_setting_t *modem, const gchar *value) {
 	const gchar *config_value;
 
-	config_path = g_strdup_printf("MM_%s.%s", base, value);
-	if (config_lookup_string(l, config_path, &config_value) == CONFIG_TRUE)
-		result = g_strdup(config_value);
+	if (config_setting_lookup_string(modem, value, &config_value) == CONFIG_TRUE)
+		return g_strdup(config_value);
+
+	return NULL;
+}
+
+static gint av_config_search_int(config_setting_t *modem, const gchar *value, gint fallback) {
+	int config_value;
+
+	if (config_setting_lookup_int(modem, value, &config_value) == CONFIG_TRUE)
+		return config_value;
+
+	return fallback;
+}
+
+static struct av_modem_config *av_config_extract_data(config_t *lc, config_setting_t *modem, const gchar *equipment_id) {
+	struct av_modem_config *mc;
+	const gchar *codecs;
+	const gchar *forward_to;
+	int forward_timeout = AV_CONFIG_FORWARD_TIMEOUT;
+
+	mc = g_try_malloc0(sizeof *mc);
+	if (!mc) {
+		g_printerr("Failure allocating AVModem config structure\n");
+		return mc;
+	}
+
+	mc->username = av_config_search(modem, "username");
+	mc->password = av_config_search(modem, "password");
+	mc->sip_host = av_config_search(modem, "sip_host");
+	mc->sip_id = av_config_search(modem, "sip_id");
+	mc->modem_audio_port = av_config_search(modem, "audio_port");
+	mc->sip_local_ip_addr = av_config_search(modem, "local_ip");
+	mc->equipment_id = g_strdup(equipment_id);
+	mc->group = av_config_search(modem, "group");
+
+	/* Modems without codec preferences of their own get everybody's. */
+	mc->codecs = av_config_search(modem, "codecs");
+	if (!mc->codecs && (config_lookup_string(lc, "codecs", &codecs) == CONFIG_TRUE))
+		mc->codecs = g_strdup(codecs);
+
+	mc->sim_minutes = MAX(0, av_config_search_int(modem, "sim_minutes", 0));
+
+	/* Same for where calls from the GSM network go, and for how long they ring. */
+	mc->forward_to = av_config_search(modem, "forward_to");
+	if (!mc->forward_to && (config_lookup_string(lc, "forward_to", &forward_to) == CONFIG_TRUE))
+		mc->forward_to = g_strdup(forward_to);
 
-	g_clear_pointer(&config_path, g_free);
+	config_lookup_int(lc, "forward_timeout", &forward_timeout);
+	mc->forward_timeout = av_config_search_int(modem, "forward_timeout", forward_timeout);
+	if (mc->forward_timeout <= 0)
+		mc->forward_timeout = AV_CONFIG_FORWARD_TIMEOUT;
 
-	return result;
+	return mc;
+}
+
+static struct av_modem_config *av_config_dup(const struct av_modem_config *c) {
+	struct av_modem_config *mc;
+
+	mc = g_try_malloc0(sizeof *mc);
+	if (!mc) {
+		g_printerr("Failure allocating AVModem config structure\n");
+		return mc;
+	}
+
+	mc->username = g_strdup(c->username);
+	mc->password = g_strdup(c->password);
+	mc->sip_host = g_strdup(c->sip_host);
+	mc->sip_id = g_strdup(c->sip_id);
+	mc->modem_audio_port = g_strdup(c->modem_audio_port);
+	mc->sip_local_ip_addr = g_strdup(c->sip_local_ip_addr);
+	mc->equipment_id = g_strdup(c->equipment_id);
+	mc->group = g_strdup(c->group);
+	mc->codecs = g_strdup(c->codecs);
+	mc->sim_minutes = c->sim_minutes;
+	mc->forward_to = g_strdup(c->forward_to);
+	mc->forward_timeout = c->forward_timeout;
+
+	return mc;
+}
+
+static gboolean av_config_equal(const struct av_modem_config *a, const struct av_modem_config *b) {
+	if (!a || !b)
+		return a == b;
+
+	return !g_strcmp0(a->username, b->username) &&
+		!g_strcmp0(a->password, b->password) &&
+		!g_strcmp0(a->sip_host, b->sip_host) &&
+		!g_strcmp0(a->sip_id, b->sip_id) &&
+		!g_strcmp0(a->modem_audio_port, b->modem_audio_port) &&
+		!g_strcmp0(a->sip_local_ip_addr, b->sip_local_ip_addr) &&
+		!g_strcmp0(a->group, b->group) &&
+		!g_strcmp0(a->codecs, b->codecs) &&
+		(a->sim_minutes == b->sim_minutes) &&
+		!g_strcmp0(a->forward_to, b->forward_to) &&
+		(a->forward_timeout == b->forward_timeout);
 }
 
-static struct av_modem_config *av_config_extract_data(AvModem *m, config_t *lc) {
+static void av_config_modem_free(gpointer data) {
+	struct av_modem_config *mc = data;
+
+	av_config_free(&mc);
+}
+
+static void av_config_snapshot_unref(struct av_config_snapshot *s) {
+	if (!g_atomic_int_dec_and_test(&s->refcount))
+		return;
+
+	g_hash_table_destroy(s->modems);
+	av_config_deinit(&s->lc);
+	g_free(s);
+}
+
+/* Parses the configuration file. Returns: a snapshot of it, NULL on failure. */
+static struct av_config_snapshot *av_config_snapshot_load(const gchar *path) {
+	struct av_config_snapshot *s;
+	struct av_modem_config *mc;
+	config_setting_t *root;
+	config_setting_t *modem;
+	const gchar *name;
+	int i;
+
+	s = g_new0(struct av_config_snapshot, 1);
+	s->refcount = 1;
+	s->modems = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, av_config_modem_free);
+
+	s->lc = av_config_init(path);
+	if (!s->lc) {
+		av_config_snapshot_unref(s);
+		return NULL;
+	}
+
+	root = config_root_setting(s->lc);
+	for (i = 0; i < config_setting_length(root); i++) {
+		modem = config_setting_get_elem(root, i);
+		name = config_setting_name(modem);
+		if (!name || !g_str_has_prefix(name, AV_CONFIG_MODEM_PREFIX) || !config_setting_is_group(modem))
+			continue;
+
+		/* Keyed by its own copy of the equipment ID. */
+		mc = av_config_extract_data(s->lc, modem, name + strlen(AV_CONFIG_MODEM_PREFIX));
+		if (mc)
+			g_hash_table_insert(s->modems, mc->equipment_id, mc);
+	}
+
+	return s;
+}
+
+/* Gets the current snapshot, NULL if there's none: it must be given back with av_config_put(). */
+static struct av_config_snapshot *av_config_get(void) {
+	struct av_config_snapshot *s;
+
+	g_mutex_lock(&av_config.lock);
+	s = av_config.current;
+	if (s)
+		g_atomic_int_inc(&s->refcount);
+	g_mutex_unlock(&av_config.lock);
+
+	return s;
+}
+
+static void av_config_put(struct av_config_snapshot *s) {
+	av_config_snapshot_unref(s);
+}
+
+/*
+ * Loads the configuration, for the getters below to use. The file is looked
+ * for where we're started from: it stays the same file, whatever the working
+ * directory becomes.
+ *
+ * Returns: non-zero if it could not be parsed, getters using defaults then.
+*/
+gint av_config_load(void) {
+	gchar *cwd;
+
+	if (g_path_is_absolute(AV_CONFIG_FILE))
+		av_config.path = g_strdup(AV_CONFIG_FILE);
+	else {
+		cwd = g_get_current_dir();
+		av_config.path = g_build_filename(cwd, AV_CONFIG_FILE, NULL);
+		g_free(cwd);
+	}
+
+	av_config.current = av_config_snapshot_load(av_config.path);
+	if (!av_config.current)
+		return 1;
+
+	g_print("Configuration loaded from %s: %u modem(s)\n",av_config.path,g_hash_table_size(av_config.current->modems));
+
+	return 0;
+}
+
+void av_config_unload(void) {
+	av_config_watch_stop();
+
+	g_mutex_lock(&av_config.lock);
+	g_clear_pointer(&av_config.current, av_config_snapshot_unref);
+	g_mutex_unlock(&av_config.lock);
+
+	g_clear_pointer(&av_config.path, g_free);
+}
+
+/* Gets the settings of a modem, for its SIP line to own: NULL if it has none. */
+struct av_modem_config *av_config_parse(AvModem *m) {
+	struct av_config_snapshot *s;
 	struct av_modem_config *mc = NULL;
+	const struct av_modem_config *template;
 	const gchar *equipment_id;
 	MMModem *modem;
 
@@ -64,40 +306,248 @@ static struct av_modem_config *av_config_extract_data(AvModem *m, config_t *lc)
 	equipment_id = mm_modem_get_equipment_identifier(modem);
 	if (!equipment_id) {
 		g_printerr("No equipment ID for this modem; unable to determine it's configuration data!\n");
-		goto failure;
+		return mc;
 	}
 
-	mc = g_try_malloc0(sizeof *mc);
-	if (!mc) {
-		g_printerr("Failure allocating AVModem config structure\n");
-		goto failure;
+	s = av_config_get();
+	if (s) {
+		template = g_hash_table_lookup(s->modems, equipment_id);
+		if (template)
+			mc = av_config_dup(template);
+		else
+			g_printerr("No configuration for modem %s\n",equipment_id);
+		av_config_put(s);
 	}
 
-	mc->username = av_config_search(lc, equipment_id, "username");
-	mc->password = av_config_search(lc, equipment_id, "password");
-	mc->sip_host = av_config_search(lc, equipment_id, "sip_host");
-	mc->sip_id = av_config_search(lc, equipment_id, "sip_id");
-	mc->modem_audio_port = av_config_search(lc, equipment_id, "audio_port");
-	mc->sip_local_ip_addr = av_config_search(lc, equipment_id, "local_ip");
-
 	return mc;
+}
 
-failure:
-	av_config_free(&mc);
-	return mc;
+/*
+ * Gets the directory pre-encoded prompts are loaded from: the top level
+ * "prompts_dir" setting, or "prompts" when not configured.
+*/
+gchar *av_config_prompts_dir(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	const gchar *config_value;
+	gchar *dir = NULL;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_string(lc, "prompts_dir", &config_value) == CONFIG_TRUE)
+			dir = g_strdup(config_value);
+		av_config_put(s);
+	}
+
+	return dir ? dir : g_strdup("prompts");
 }
 
-struct av_modem_config *av_config_parse(AvModem *m) {
+/*
+ * Gets the port the SIP reactor listens on, for all modems: the top level
+ * "sip_port" setting, or 5556 when not configured.
+*/
+gint av_config_sip_port(void) {
+	struct av_config_snapshot *s;
 	config_t *lc;
-	struct av_modem_config *mc = NULL;
+	int config_value;
+	gint port = 5556;
 
-	lc = av_config_init("AirVoice.cfg");
-	if (lc) {
-		mc = av_config_extract_data(m, lc);
-		av_config_deinit(&lc);
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if ( (config_lookup_int(lc, "sip_port", &config_value) == CONFIG_TRUE) && (config_value > 0) && (config_value <= 65535) )
+			port = config_value;
+		av_config_put(s);
 	}
 
-	return mc;
+	return port;
+}
+
+/*
+ * Gets the transport of the SIP reactor, for all modems: the top level
+ * "sip_transport" setting ("udp", "tcp" or "tls"), or UDP when not configured.
+*/
+enum av_sip_transport av_config_sip_transport(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	const gchar *config_value;
+	enum av_sip_transport transport = AV_SIP_TRANSPORT_UDP;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_string(lc, "sip_transport", &config_value) == CONFIG_TRUE) {
+			if (!g_ascii_strcasecmp(config_value, "tcp"))
+				transport = AV_SIP_TRANSPORT_TCP;
+			else if (!g_ascii_strcasecmp(config_value, "tls"))
+				transport = AV_SIP_TRANSPORT_TLS;
+			else if (g_ascii_strcasecmp(config_value, "udp"))
+				g_printerr("Unknown SIP transport \"%s\", using UDP\n",config_value);
+		}
+		av_config_put(s);
+	}
+
+	return transport;
+}
+
+/*
+ * Gets how often connections to registrars are kept alive, in seconds: the
+ * top level "sip_keepalive" setting, 30 when not configured, 0 to disable.
+*/
+gint av_config_sip_keepalive(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	int config_value;
+	gint keepalive = 30;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if ( (config_lookup_int(lc, "sip_keepalive", &config_value) == CONFIG_TRUE) && (config_value >= 0) )
+			keepalive = config_value;
+		av_config_put(s);
+	}
+
+	return keepalive;
+}
+
+/*
+ * Gets the TLS settings: "tls_ca_file" to verify servers with (verification
+ * can be turned off with "tls_verify"), and our own "tls_certificate" and
+ * "tls_private_key", if servers want one.
+*/
+void av_config_tls(struct av_tls_config *tls) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	const gchar *config_value;
+	int config_bool;
+
+	memset(tls, 0, sizeof *tls);
+	tls->verify = TRUE;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_string(lc, "tls_ca_file", &config_value) == CONFIG_TRUE)
+			tls->ca_file = g_strdup(config_value);
+		if (config_lookup_string(lc, "tls_certificate", &config_value) == CONFIG_TRUE)
+			tls->certificate = g_strdup(config_value);
+		if (config_lookup_string(lc, "tls_private_key", &config_value) == CONFIG_TRUE)
+			tls->private_key = g_strdup(config_value);
+		if (config_lookup_bool(lc, "tls_verify", &config_bool) == CONFIG_TRUE)
+			tls->verify = config_bool;
+		av_config_put(s);
+	}
+}
+
+void av_config_tls_clear(struct av_tls_config *tls) {
+	g_clear_pointer(&tls->ca_file, g_free);
+	g_clear_pointer(&tls->certificate, g_free);
+	g_clear_pointer(&tls->private_key, g_free);
+}
+
+/*
+ * Gets the REGISTER token bucket settings: "register_rate" REGISTERs per
+ * second, with bursts of up to "register_burst" of them. Defaults are 2 per
+ * second, and bursts of 4.
+*/
+void av_config_register_limits(gdouble *rate, gint *burst) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	double config_rate;
+	int config_burst;
+
+	*rate = 2;
+	*burst = 4;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if ( (config_lookup_float(lc, "register_rate", &config_rate) == CONFIG_TRUE) && (config_rate > 0) )
+			*rate = config_rate;
+		if ( (config_lookup_int(lc, "register_burst", &config_burst) == CONFIG_TRUE) && (config_burst > 0) )
+			*burst = config_burst;
+		av_config_put(s);
+	}
+}
+
+/*
+ * Gets the DNS server SIP hosts are looked up with: the top level "dns_server"
+ * setting ("address" or "address:port"), or NULL to use the system ones.
+*/
+gchar *av_config_dns_server(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	const gchar *config_value;
+	gchar *server = NULL;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_string(lc, "dns_server", &config_value) == CONFIG_TRUE)
+			server = g_strdup(config_value);
+		av_config_put(s);
+	}
+
+	return server;
+}
+
+/* Tells whether DNS answers are cached: the top level "dns_cache" setting, on by default. */
+gboolean av_config_dns_cache(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	int config_value;
+	gboolean cache = TRUE;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_bool(lc, "dns_cache", &config_value) == CONFIG_TRUE)
+			cache = config_value;
+		av_config_put(s);
+	}
+
+	return cache;
+}
+
+/*
+ * Gets the dial plan settings: "dialplan_country_code" (none by default),
+ * "dialplan_national_prefix" ("0" by default), "dialplan_international_prefix"
+ * ("00" by default), and the "dialplan_routes" file, if any.
+*/
+void av_config_dialplan(struct av_dialplan_config *dp) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	const gchar *config_value;
+
+	memset(dp, 0, sizeof *dp);
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_string(lc, "dialplan_country_code", &config_value) == CONFIG_TRUE)
+			dp->country_code = g_strdup(config_value);
+		if (config_lookup_string(lc, "dialplan_national_prefix", &config_value) == CONFIG_TRUE)
+			dp->national_prefix = g_strdup(config_value);
+		if (config_lookup_string(lc, "dialplan_international_prefix", &config_value) == CONFIG_TRUE)
+			dp->international_prefix = g_strdup(config_value);
+		if (config_lookup_string(lc, "dialplan_routes", &config_value) == CONFIG_TRUE)
+			dp->routes_file = g_strdup(config_value);
+		av_config_put(s);
+	}
+
+	if (!dp->national_prefix)
+		dp->national_prefix = g_strdup("0");
+	if (!dp->international_prefix)
+		dp->international_prefix = g_strdup("00");
+}
+
+void av_config_dialplan_clear(struct av_dialplan_config *dp) {
+	g_clear_pointer(&dp->country_code, g_free);
+	g_clear_pointer(&dp->national_prefix, g_free);
+	g_clear_pointer(&dp->international_prefix, g_free);
+	g_clear_pointer(&dp->routes_file, g_free);
 }
 
 void av_config_free(struct av_modem_config **c) {
@@ -108,8 +558,261 @@ void av_config_free(struct av_modem_config **c) {
 		g_clear_pointer(&(*c)->sip_id, g_free);
 		g_clear_pointer(&(*c)->modem_audio_port, g_free);
 		g_clear_pointer(&(*c)->sip_local_ip_addr, g_free);
+		g_clear_pointer(&(*c)->codecs, g_free);
+		g_clear_pointer(&(*c)->equipment_id, g_free);
+		g_clear_pointer(&(*c)->group, g_free);
+		g_clear_pointer(&(*c)->forward_to, g_free);
 		g_clear_pointer(c, g_free);
 	}
 
 	return;
 }
+
+/*
+ * Gets the admission control settings: "invite_rate" and "invite_burst" for
+ * all INVITEs (20 per second, bursts of 40 by default), "invite_source_rate"
+ * and "invite_source_burst" for those of a single source (5 and 10),
+ * "max_queued_calls" waiting for their modem call at once (8), and
+ * "max_backlog", how long SIP events may wait for us before new calls are
+ * turned down (200 ms).
+*/
+void av_config_admission(struct av_admission_config *adm) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	double config_rate;
+	int config_value;
+
+	adm->rate = 20;
+	adm->burst = 40;
+	adm->source_rate = 5;
+	adm->source_burst = 10;
+	adm->max_queued = 8;
+	adm->max_delay = 200;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if ( (config_lookup_float(lc, "invite_rate", &config_rate) == CONFIG_TRUE) && (config_rate > 0) )
+			adm->rate = config_rate;
+		if ( (config_lookup_int(lc, "invite_burst", &config_value) == CONFIG_TRUE) && (config_value > 0) )
+			adm->burst = config_value;
+		if ( (config_lookup_float(lc, "invite_source_rate", &config_rate) == CONFIG_TRUE) && (config_rate > 0) )
+			adm->source_rate = config_rate;
+		if ( (config_lookup_int(lc, "invite_source_burst", &config_value) == CONFIG_TRUE) && (config_value > 0) )
+			adm->source_burst = config_value;
+		if ( (config_lookup_int(lc, "max_queued_calls", &config_value) == CONFIG_TRUE) && (config_value > 0) )
+			adm->max_queued = config_value;
+		if ( (config_lookup_int(lc, "max_backlog", &config_value) == CONFIG_TRUE) && (config_value > 0) )
+			adm->max_delay = config_value;
+		av_config_put(s);
+	}
+}
+
+/*
+ * Gets how many calls may wait for a modem: the top level "call_queue"
+ * setting, or 0 (no queue, calls are turned down) when not configured.
+*/
+gint av_config_call_queue(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	int config_value;
+	gint size = 0;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if ( (config_lookup_int(lc, "call_queue", &config_value) == CONFIG_TRUE) && (config_value > 0) )
+			size = config_value;
+		av_config_put(s);
+	}
+
+	return size;
+}
+
+/*
+ * Tells whether ModemManager is watched in lean mode (see av_mm_lean.c): the
+ * top level "dbus_subscriptions" setting, "lean" (the default) or "all" for
+ * an object manager following every interface of every modem.
+*/
+gboolean av_config_dbus_lean(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	const gchar *config_value;
+	gboolean lean = TRUE;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if (config_lookup_string(lc, "dbus_subscriptions", &config_value) == CONFIG_TRUE) {
+			if (!g_ascii_strcasecmp(config_value, "all"))
+				lean = FALSE;
+			else if (g_ascii_strcasecmp(config_value, "lean"))
+				g_printerr("Unknown D-Bus subscriptions \"%s\", using lean ones\n",config_value);
+		}
+		av_config_put(s);
+	}
+
+	return lean;
+}
+
+/*
+ * Gets how often main loop wakeups and memory usage are printed, in seconds:
+ * the top level "loop_stats" setting, or 0 (never) when not configured.
+*/
+gint av_config_loop_stats(void) {
+	struct av_config_snapshot *s;
+	config_t *lc;
+	int config_value;
+	gint interval = 0;
+
+	s = av_config_get();
+	if (s) {
+		lc = s->lc;
+		if ( (config_lookup_int(lc, "loop_stats", &config_value) == CONFIG_TRUE) && (config_value > 0) )
+			interval = config_value;
+		av_config_put(s);
+	}
+
+	return interval;
+}
+
+/* Takes note of the modems whose settings differ between two snapshots, from possibly none. */
+static void av_config_diff(GHashTable *from, GHashTable *to, GPtrArray *changed, gboolean added_only) {
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	struct av_modem_config *other;
+
+	g_hash_table_iter_init(&iter, to);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		other = from ? g_hash_table_lookup(from, key) : NULL;
+		if (added_only ? !other : !av_config_equal(other, value))
+			g_ptr_array_add(changed, g_strdup(key));
+	}
+}
+
+/*
+ * Reads the configuration file again. The current snapshot is only replaced
+ * if the new one parses: a half written file doesn't take modems down.
+ *
+ * Returns: non-zero on failure.
+*/
+gint av_config_reload(void) {
+	struct av_config_snapshot *s;
+	struct av_config_snapshot *old;
+	GPtrArray *changed;
+	gint64 start = g_get_monotonic_time();
+	guint i;
+
+	if (!av_config.path)
+		return 1;
+
+	s = av_config_snapshot_load(av_config.path);
+	if (!s) {
+		g_printerr("Keeping the configuration in use\n");
+		return 1;
+	}
+
+	changed = g_ptr_array_new_with_free_func(g_free);
+	av_config_diff(av_config.current ? av_config.current->modems : NULL, s->modems, changed, FALSE);
+	if (av_config.current)
+		av_config_diff(s->modems, av_config.current->modems, changed, TRUE);
+
+	g_mutex_lock(&av_config.lock);
+	old = av_config.current;
+	av_config.current = s;
+	g_mutex_unlock(&av_config.lock);
+
+	if (old)
+		av_config_snapshot_unref(old);
+
+	av_config.n_reloads++;
+	g_print("Configuration reloaded (#%u) in %" G_GINT64_FORMAT " us: %u modem(s), %u changed\n",
+		av_config.n_reloads, g_get_monotonic_time() - start, g_hash_table_size(s->modems), changed->len);
+
+	if (av_config.changed) {
+		for (i = 0; i < changed->len; i++)
+			av_config.changed(g_ptr_array_index(changed, i));
+		av_config.changed(NULL);
+	}
+
+	g_ptr_array_free(changed, TRUE);
+
+	return 0;
+}
+
+static gboolean av_config_inotify_cb(gint fd, GIOCondition condition, gpointer user_data) {
+	gchar buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	gchar *basename;
+	gboolean reload = FALSE;
+	ssize_t len;
+	gchar *p;
+
+	basename = g_path_get_basename(av_config.path);
+
+	/* Editors write the file in place, or write another one and move it over. */
+	while ( (len = read(fd, buf, sizeof buf)) > 0 ) {
+		for (p = buf; p < buf + len; p += sizeof *ev + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len && !strcmp(ev->name, basename))
+				reload = TRUE;
+		}
+	}
+
+	g_free(basename);
+
+	if (reload)
+		av_config_reload();
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Watches the configuration file, reloading it when written to; a SIGHUP
+ * does it too, see av.c. Then changed gets called on the main loop with
+ * the equipment ID of every modem whose settings changed, appeared or went
+ * away, and once with NULL for settings that aren't a modem's.
+ *
+ * Returns: non-zero if the file can't be watched.
+*/
+gint av_config_watch(av_config_changed_func changed) {
+	gchar *dir;
+	int wd;
+
+	av_config.changed = changed;
+
+	av_config.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (av_config.inotify_fd < 0) {
+		g_printerr("Unable to watch the configuration file: %s\n",g_strerror(errno));
+		return 1;
+	}
+
+	/* The directory, the file being replaced by some. */
+	dir = g_path_get_dirname(av_config.path);
+	wd = inotify_add_watch(av_config.inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0) {
+		g_printerr("Unable to watch %s: %s\n",dir,g_strerror(errno));
+		g_free(dir);
+		close(av_config.inotify_fd);
+		av_config.inotify_fd = -1;
+		return 1;
+	}
+	g_free(dir);
+
+	av_config.inotify_src = g_unix_fd_add(av_config.inotify_fd, G_IO_IN, av_config_inotify_cb, NULL);
+
+	return 0;
+}
+
+void av_config_watch_stop(void) {
+	if (av_config.inotify_src)
+		g_source_remove(av_config.inotify_src);
+	av_config.inotify_src = 0;
+
+	if (av_config.inotify_fd >= 0)
+		close(av_config.inotify_fd);
+	av_config.inotify_fd = -1;
+
+	av_config.changed = NULL;
+}
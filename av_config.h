@@ -5,6 +5,7 @@
 
 /* AV headers */
 #include <av_gobjects.h>
+#include <av_dialplan.h>
 
 struct av_modem_config {
 	gchar *username;
@@ -13,9 +14,72 @@ struct av_modem_config {
 	gchar *sip_id;
 	gchar *modem_audio_port;
 	gchar *sip_local_ip_addr;
+	gchar *equipment_id;
+
+	/* Dial plan target the modem belongs to, besides its equipment ID. */
+	gchar *group;
+
+	/* Comma separated codec names, most preferred first: NULL for the defaults. */
+	gchar *codecs;
+
+	/* Call minutes the SIM may carry, 0 for no limit. */
+	gint sim_minutes;
+
+	/*
+	 * Comma separated SIP URIs calls from the GSM network ring at once (NULL:
+	 * such calls are left alone), and for how long, in seconds.
+	*/
+	gchar *forward_to;
+	gint forward_timeout;
+};
+
+enum av_sip_transport {
+	AV_SIP_TRANSPORT_UDP = 0,
+	AV_SIP_TRANSPORT_TCP,
+	AV_SIP_TRANSPORT_TLS
 };
 
+struct av_tls_config {
+	gchar *ca_file;
+	gchar *certificate;
+	gchar *private_key;
+	gboolean verify;
+};
+
+/* INVITE rates are per second, the backlog in milliseconds. */
+struct av_admission_config {
+	gdouble rate;
+	gdouble burst;
+	gdouble source_rate;
+	gdouble source_burst;
+	guint max_queued;
+	gint max_delay;
+};
+
+/* A modem's settings changed: see av_config_watch(). */
+typedef void (*av_config_changed_func)(const gchar *equipment_id);
+
+gint av_config_load(void);
+void av_config_unload(void);
+gint av_config_reload(void);
+gint av_config_watch(av_config_changed_func changed);
+void av_config_watch_stop(void);
 struct av_modem_config *av_config_parse(AvModem *m);
 void av_config_free(struct av_modem_config **c);
+gchar *av_config_prompts_dir(void);
+gint av_config_sip_port(void);
+enum av_sip_transport av_config_sip_transport(void);
+gint av_config_sip_keepalive(void);
+void av_config_tls(struct av_tls_config *tls);
+void av_config_tls_clear(struct av_tls_config *tls);
+void av_config_register_limits(gdouble *rate, gint *burst);
+gchar *av_config_dns_server(void);
+gboolean av_config_dns_cache(void);
+void av_config_dialplan(struct av_dialplan_config *dp);
+void av_config_dialplan_clear(struct av_dialplan_config *dp);
+void av_config_admission(struct av_admission_config *adm);
+gint av_config_call_queue(void);
+gboolean av_config_dbus_lean(void);
+gint av_config_loop_stats(void);
 
 #endif
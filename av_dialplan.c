@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Dial plan for calls to the GSM network. Destination numbers are normalized
+ * first, to E.164 where we can tell:
+ * - visual separators (spaces, dashes, dots, slashes, brackets) go away;
+ * - the international prefix ("00" by default) becomes "+";
+ * - the national (trunk) prefix ("0" by default) becomes "+" and the country
+ *   code, if one is configured;
+ * - anything else (short codes, service numbers) is dialed as it is.
+ *
+ * E.164 numbers are then matched against destination prefixes, longest one
+ * winning, each of them naming where calls to it should go: a group of
+ * modems, or a single modem (see av_sip_pool.c). A lone "+" prefix matches
+ * any of them. Prefixes come from a routes
+ * file, one "<prefix> <target>" per line ('#' starts a comment), and get
+ * compiled into a trie stored as an array of nodes: a lookup is one array
+ * access per digit, and takes no lock. Dial plans are never changed once
+ * compiled, so that reloading one is just swapping it for the new one.
+*/
+
+/* AV headers */
+#include <av_dialplan.h>
+
+/* Characters people put in numbers to read them better. */
+#define AV_DIALPLAN_SEPARATORS " -./()"
+
+static gint32 av_dialplan_node_new(GArray *nodes) {
+	struct av_dialplan_node n;
+	int i;
+
+	for (i = 0; i < AV_DIALPLAN_DIGITS; i++)
+		n.child[i] = -1;
+	n.target = -1;
+
+	g_array_append_val(nodes, n);
+
+	return nodes->len - 1;
+}
+
+static gint32 av_dialplan_target(struct av_dialplan *dp, GHashTable *index, const gchar *target) {
+	gpointer value;
+
+	if (g_hash_table_lookup_extended(index, target, NULL, &value))
+		return GPOINTER_TO_INT(value);
+
+	g_ptr_array_add(dp->targets, g_strdup(target));
+	g_hash_table_insert(index, g_ptr_array_index(dp->targets, dp->targets->len - 1), GINT_TO_POINTER(dp->targets->len - 1));
+
+	return dp->targets->len - 1;
+}
+
+/* Adds a prefix to the trie. Returns: non-zero if it's not made of digits. */
+static gint av_dialplan_add(struct av_dialplan *dp, GHashTable *index, const gchar *prefix, const gchar *target) {
+	struct av_dialplan_node *n;
+	const gchar *p;
+	gint32 id = 0;
+	gint32 child;
+	int digit;
+
+	if (*prefix == '+')
+		prefix++;
+
+	for (p = prefix; *p; p++)
+		if (!g_ascii_isdigit(*p))
+			return 1;
+
+	for (p = prefix; *p; p++) {
+		digit = *p - '0';
+		child = g_array_index(dp->nodes, struct av_dialplan_node, id).child[digit];
+		if (child < 0) {
+			/* May move nodes around: no pointer to them is kept. */
+			child = av_dialplan_node_new(dp->nodes);
+			g_array_index(dp->nodes, struct av_dialplan_node, id).child[digit] = child;
+		}
+		id = child;
+	}
+
+	n = &g_array_index(dp->nodes, struct av_dialplan_node, id);
+	if (n->target >= 0)
+		g_printerr("Dial plan prefix +%s listed twice, the last one wins\n",prefix);
+	else
+		dp->n_prefixes++;
+	n->target = av_dialplan_target(dp, index, target);
+
+	return 0;
+}
+
+static gint av_dialplan_load_routes(struct av_dialplan *dp, const gchar *filename) {
+	GHashTable *index;
+	GError *e = NULL;
+	gchar *contents;
+	gchar *line;
+	gchar *next;
+	gchar *comment;
+	gchar *target;
+	guint lineno = 0;
+	guint n_invalid = 0;
+
+	if (!g_file_get_contents(filename, &contents, NULL, &e)) {
+		g_printerr("Unable to read dial plan routes: %s\n",e->message);
+		g_clear_error(&e);
+		return 1;
+	}
+
+	index = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (line = contents; line; line = next) {
+		lineno++;
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if ( (comment = strchr(line, '#')) )
+			*comment = '\0';
+
+		g_strstrip(line);
+		if (!*line)
+			continue;
+
+		/* Split in place: there may be a lot of them. */
+		target = line + strcspn(line, " \t");
+		if (*target) {
+			*target++ = '\0';
+			target = g_strchug(target);
+		}
+
+		if (!*target || av_dialplan_add(dp, index, line, target)) {
+			if (!n_invalid++)
+				g_printerr("Invalid dial plan route at %s:%u\n",filename,lineno);
+		}
+	}
+
+	if (n_invalid)
+		g_printerr("%u invalid dial plan route(s) skipped\n",n_invalid);
+
+	g_hash_table_destroy(index);
+	g_free(contents);
+
+	return 0;
+}
+
+/*
+ * Compiles a dial plan.
+ *
+ * Returns: the dial plan, NULL if its routes could not be read.
+*/
+struct av_dialplan *av_dialplan_load(const struct av_dialplan_config *conf) {
+	struct av_dialplan *dp;
+	gint64 start = g_get_monotonic_time();
+
+	dp = g_new0(struct av_dialplan, 1);
+	dp->country_code = g_strdup(conf->country_code);
+	dp->national_prefix = g_strdup(conf->national_prefix);
+	dp->international_prefix = g_strdup(conf->international_prefix);
+	dp->nodes = g_array_new(FALSE, FALSE, sizeof(struct av_dialplan_node));
+	dp->targets = g_ptr_array_new_with_free_func(g_free);
+
+	/* The root, for the empty prefix. */
+	av_dialplan_node_new(dp->nodes);
+
+	if (conf->routes_file && av_dialplan_load_routes(dp, conf->routes_file)) {
+		av_dialplan_free(dp);
+		return NULL;
+	}
+
+	g_print("Dial plan: %u prefixes to %u targets, %u nodes (%zu KiB), compiled in %" G_GINT64_FORMAT " ms\n",
+		dp->n_prefixes, dp->targets->len, dp->nodes->len, (gsize)dp->nodes->len * sizeof(struct av_dialplan_node) / 1024,
+		(g_get_monotonic_time() - start)/1000);
+
+	return dp;
+}
+
+void av_dialplan_free(struct av_dialplan *dp) {
+	struct av_dialplan_stats *st;
+
+	if (!dp)
+		return;
+
+	st = &dp->stats;
+	if (st->n_lookups)
+		g_print("Dial plan: %" G_GUINT64_FORMAT " lookups (%" G_GUINT64_FORMAT " matched) in %.2f us on average, max %" G_GINT64_FORMAT " us\n",
+			st->n_lookups, st->n_matches, (gdouble)st->lookup_total/st->n_lookups, st->lookup_max);
+
+	g_free(dp->country_code);
+	g_free(dp->national_prefix);
+	g_free(dp->international_prefix);
+	g_array_free(dp->nodes, TRUE);
+	g_ptr_array_free(dp->targets, TRUE);
+	g_free(dp);
+}
+
+static gboolean av_dialplan_has_prefix(const gchar *number, const gchar *prefix, gsize *len) {
+	*len = prefix ? strlen(prefix) : 0;
+
+	return *len && !strncmp(number, prefix, *len);
+}
+
+/*
+ * Writes the normalized form of a number into buf.
+ *
+ * Returns: non-zero if the number is not made of digits (and '+', '*', '#'
+ * where they belong), or doesn't fit.
+*/
+gint av_dialplan_normalize(const struct av_dialplan *dp, const gchar *number, gchar *buf, gsize size) {
+	gchar digits[AV_DIALPLAN_NUMBER_LEN];
+	gsize written;
+	gsize len = 0;
+	gsize prefix_len;
+	const gchar *p;
+
+	for (p = number; *p; p++) {
+		if (strchr(AV_DIALPLAN_SEPARATORS, *p))
+			continue;
+		if ( !g_ascii_isdigit(*p) && (*p != '*') && (*p != '#') && ((*p != '+') || len) )
+			return 1;
+		if (len == sizeof digits - 1)
+			return 1;
+		digits[len++] = *p;
+	}
+	digits[len] = '\0';
+
+	if (!len)
+		return 1;
+
+	if (av_dialplan_has_prefix(digits, dp->international_prefix, &prefix_len))
+		written = g_snprintf(buf, size, "+%s", digits + prefix_len);
+	else if (dp->country_code && av_dialplan_has_prefix(digits, dp->national_prefix, &prefix_len))
+		written = g_snprintf(buf, size, "+%s%s", dp->country_code, digits + prefix_len);
+	else
+		written = g_strlcpy(buf, digits, size);
+
+	return written >= size;
+}
+
+/*
+ * Finds where calls to a normalized number should go: only E.164 numbers
+ * are routed.
+ *
+ * Returns: the target of the longest matching prefix, NULL if none.
+*/
+const gchar *av_dialplan_route(struct av_dialplan *dp, const gchar *number) {
+	struct av_dialplan_stats *st = &dp->stats;
+	const struct av_dialplan_node *nodes = (const struct av_dialplan_node *)dp->nodes->data;
+	const gchar *p;
+	gint32 id = 0;
+	gint32 target = -1;
+	gint64 start = g_get_monotonic_time();
+	gint64 elapsed;
+
+	/* The root stands for "+": a route for any E.164 number. */
+	if (*number == '+') {
+		target = nodes[0].target;
+		for (p = number + 1; g_ascii_isdigit(*p) && (id >= 0); p++) {
+			id = nodes[id].child[*p - '0'];
+			if ( (id >= 0) && (nodes[id].target >= 0) )
+				target = nodes[id].target;
+		}
+	}
+
+	elapsed = g_get_monotonic_time() - start;
+	st->n_lookups++;
+	st->lookup_total += elapsed;
+	if (elapsed > st->lookup_max)
+		st->lookup_max = elapsed;
+
+	if (target < 0)
+		return NULL;
+
+	st->n_matches++;
+
+	return g_ptr_array_index(dp->targets, target);
+}
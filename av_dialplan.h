@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_dialplan_h__
+#define __av_dialplan_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* Longest number we dial, NUL included. */
+#define AV_DIALPLAN_NUMBER_LEN 64
+
+#define AV_DIALPLAN_DIGITS 10
+
+/* A trie node: children by digit, -1 for none. */
+struct av_dialplan_node {
+	gint32 child[AV_DIALPLAN_DIGITS];
+
+	/* Target of the prefix ending here, -1 if none. */
+	gint32 target;
+};
+
+/* Settings, see av_config_dialplan(). */
+struct av_dialplan_config {
+	gchar *country_code;
+	gchar *national_prefix;
+	gchar *international_prefix;
+	gchar *routes_file;
+};
+
+struct av_dialplan_stats {
+	guint64 n_lookups;
+	guint64 n_matches;
+	gint64 lookup_total;
+	gint64 lookup_max;
+};
+
+/*
+ * A compiled dial plan. Once loaded it never changes: reloading builds a new
+ * one, which replaces the old one at once.
+*/
+struct av_dialplan {
+	gchar *country_code;
+	gchar *national_prefix;
+	gchar *international_prefix;
+
+	GArray *nodes;
+	GPtrArray *targets;
+	guint n_prefixes;
+
+	struct av_dialplan_stats stats;
+};
+
+struct av_dialplan *av_dialplan_load(const struct av_dialplan_config *conf);
+void av_dialplan_free(struct av_dialplan *dp);
+gint av_dialplan_normalize(const struct av_dialplan *dp, const gchar *number, gchar *buf, gsize size);
+const gchar *av_dialplan_route(struct av_dialplan *dp, const gchar *number);
+
+#endif
@@ -0,0 +1,811 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * SIP hosts resolution, out of the SIP reactor way. Looking a registrar up
+ * used to be left to eXosip, blocking on whatever the resolver felt like
+ * doing, while calls of every line were waiting. Now:
+ * - lookups (RFC 3263: NAPTR, then SRV, then A, for the transport in use)
+ *   run in a resolver thread, one at a time, answers coming back as messages;
+ * - answers are cached for their TTL, negative ones too (RFC 2308), and the
+ *   ones that got used are looked up again before they expire, so that a busy
+ *   host never has to wait for the resolver.
+ *
+ * The "dns_server" setting points the resolver to another server than the
+ * system ones (e.g.: a local stub serving test zones), and caching can be
+ * turned off with "dns_cache" to see what it's worth.
+*/
+
+/* System headers */
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+/* AV headers */
+#include <av_dns.h>
+#include <av_threadcomm.h>
+#include <av_poll.h>
+
+/* Answers are never trusted longer than this. */
+#define AV_DNS_TTL_MAX 86400
+
+/* Negative answers: as long as the zone SOA says, within reason. */
+#define AV_DNS_NEGATIVE_TTL_MIN 5
+#define AV_DNS_NEGATIVE_TTL_MAX 300
+
+/* No answer at all (timeout, SERVFAIL...): try again soon. */
+#define AV_DNS_FAILURE_TTL 10
+
+/*
+ * Answers used during their lifetime are looked up again when this much of it
+ * is gone, unless their TTL is too short to bother.
+*/
+#define AV_DNS_PREFETCH_PERCENT 80
+#define AV_DNS_PREFETCH_TTL_MIN 10
+
+/* RFC 3263 NAPTR service and SRV prefix of each SIP transport. */
+static const struct {
+	const gchar *name;
+	const gchar *naptr;
+	const gchar *srv;
+} av_dns_services[] = {
+	[AV_DNS_A] = { "A", NULL, NULL },
+	[AV_DNS_SIP_UDP] = { "SIP", "SIP+D2U", "_sip._udp" },
+	[AV_DNS_SIP_TCP] = { "SIP/TCP", "SIP+D2T", "_sip._tcp" },
+	[AV_DNS_SIPS_TCP] = { "SIPS", "SIPS+D2T", "_sips._tcp" },
+};
+
+enum DNS_EVENTS {
+	DNS_EVENT_EXITED = 11
+};
+
+/* A cached host, or one being looked up. */
+struct av_dns_entry {
+	struct av_dns *dns;
+	gchar *key;
+	gchar *host;
+	enum av_dns_service service;
+
+	gboolean resolved;
+	gboolean failed;
+	gchar addr[48];
+	gint port;
+	gint64 expires;
+
+	/* Got asked for since the last answer: worth a prefetch. */
+	gboolean used;
+
+	gboolean pending;
+	gint64 requested;
+	GSList *waiters;
+
+	/* Prefetch, then expiry. */
+	struct av_timer timer;
+};
+
+struct av_dns_waiter {
+	av_dns_func func;
+	gpointer data;
+};
+
+/* Resolver thread state. */
+struct av_dns_resolver {
+	struct av_thread *self;
+	struct __res_state res;
+	struct pollfd poll_data[1];
+	struct av_poll_source poll_sources[1];
+	struct av_poll poll;
+};
+
+/* Lookups of a host for different services are not the same answer. */
+static gchar *av_dns_key(const gchar *host, enum av_dns_service service) {
+	return g_strdup_printf("%s/%s",av_dns_services[service].name,host);
+}
+
+/* Resolver thread side. */
+
+/* How long a name is known not to exist, from the SOA of the authority section. */
+static guint av_dns_negative_ttl(ns_msg *msg) {
+	const guchar *rdata;
+	const guchar *end;
+	ns_rr rr;
+	int n;
+	int i;
+	int k;
+
+	for (i = 0; i < ns_msg_count(*msg, ns_s_ns); i++) {
+		if (ns_parserr(msg, ns_s_ns, i, &rr) || (ns_rr_type(rr) != ns_t_soa))
+			continue;
+
+		rdata = ns_rr_rdata(rr);
+		end = rdata + ns_rr_rdlen(rr);
+
+		/* MNAME and RNAME, then serial, refresh, retry, expire and minimum. */
+		for (k = 0; k < 2; k++) {
+			if ( (n = dn_skipname(rdata, end)) < 0 )
+				return AV_DNS_FAILURE_TTL;
+			rdata += n;
+		}
+
+		if (end - rdata < 20)
+			return AV_DNS_FAILURE_TTL;
+
+		return CLAMP(MIN(ns_rr_ttl(rr), ns_get32(rdata + 16)), AV_DNS_NEGATIVE_TTL_MIN, AV_DNS_NEGATIVE_TTL_MAX);
+	}
+
+	return AV_DNS_FAILURE_TTL;
+}
+
+/*
+ * Sends a query and parses the answer. The smallest TTL of the answer records
+ * lowers *ttl.
+ *
+ * Returns: 0 if there are answer records, 1 if there are none (*neg_ttl says
+ * for how long), -1 if no answer came.
+*/
+static gint av_dns_query(res_state statp, const gchar *name, int type, guchar *answer, int size, ns_msg *msg, guint *ttl, guint *neg_ttl) {
+	guchar query[NS_PACKETSZ];
+	ns_rr rr;
+	int len;
+	int i;
+
+	*neg_ttl = AV_DNS_FAILURE_TTL;
+
+	len = res_nmkquery(statp, ns_o_query, name, ns_c_in, type, NULL, 0, NULL, query, sizeof query);
+	if (len < 0)
+		return -1;
+
+	len = res_nsend(statp, query, len, answer, size);
+	if ( (len < 0) || ns_initparse(answer, len, msg) )
+		return -1;
+
+	switch (ns_msg_getflag(*msg, ns_f_rcode)) {
+		case ns_r_noerror:
+			if (ns_msg_count(*msg, ns_s_an))
+				break;
+			/* No data */
+			/* fall through */
+		case ns_r_nxdomain:
+			*neg_ttl = av_dns_negative_ttl(msg);
+			return 1;
+		default:
+			return -1;
+	}
+
+	for (i = 0; i < ns_msg_count(*msg, ns_s_an); i++)
+		if (!ns_parserr(msg, ns_s_an, i, &rr) && (ns_rr_ttl(rr) < *ttl))
+			*ttl = ns_rr_ttl(rr);
+
+	return 0;
+}
+
+/* Reads a <character-string> of NAPTR RDATA. */
+static const guchar *av_dns_naptr_string(const guchar *p, const guchar *end, gchar *buf, gsize size) {
+	gsize len;
+
+	if ( (p >= end) || (p + 1 + *p > end) )
+		return NULL;
+
+	len = MIN(*p, size - 1);
+	memcpy(buf, p + 1, len);
+	buf[len] = '\0';
+
+	return p + 1 + *p;
+}
+
+/*
+ * Looks for the SRV records of a SIP service, as NAPTR records tell.
+ *
+ * Returns: 0 if one was found, non-zero otherwise.
+*/
+static gint av_dns_lookup_naptr(res_state statp, const gchar *host, const gchar *service, gchar *target, gsize size, guint *ttl) {
+	guchar answer[NS_MAXMSG];
+	gchar name[NS_MAXDNAME];
+	gchar flags[8];
+	gchar services[32];
+	gchar regexp[8];
+	const guchar *p;
+	const guchar *end;
+	guint order;
+	guint pref;
+	guint best = G_MAXUINT;
+	guint neg_ttl;
+	ns_msg msg;
+	ns_rr rr;
+	int i;
+
+	if (av_dns_query(statp, host, ns_t_naptr, answer, sizeof answer, &msg, ttl, &neg_ttl))
+		return 1;
+
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) || (ns_rr_type(rr) != ns_t_naptr) || (ns_rr_rdlen(rr) < 4))
+			continue;
+
+		p = ns_rr_rdata(rr);
+		end = p + ns_rr_rdlen(rr);
+		order = ns_get16(p);
+		pref = ns_get16(p + 2);
+		p += 4;
+
+		if ( !(p = av_dns_naptr_string(p, end, flags, sizeof flags)) ||
+			!(p = av_dns_naptr_string(p, end, services, sizeof services)) ||
+			!(p = av_dns_naptr_string(p, end, regexp, sizeof regexp)) )
+			continue;
+
+		if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), p, name, sizeof name) < 0)
+			continue;
+
+		if (g_ascii_strcasecmp(flags, "s") || g_ascii_strcasecmp(services, service))
+			continue;
+
+		if (((order << 16) | pref) < best) {
+			best = (order << 16) | pref;
+			g_strlcpy(target, name, size);
+		}
+	}
+
+	return (best == G_MAXUINT);
+}
+
+/*
+ * Picks the SRV record to use: lowest priority, heaviest weight.
+ *
+ * Returns: 0 if one was found, non-zero otherwise.
+*/
+static gint av_dns_lookup_srv(res_state statp, const gchar *name, gchar *target, gsize size, gint *port, guint *ttl) {
+	guchar answer[NS_MAXMSG];
+	gchar host[NS_MAXDNAME];
+	const guchar *p;
+	guint prio;
+	guint weight;
+	guint best = G_MAXUINT;
+	guint neg_ttl;
+	ns_msg msg;
+	ns_rr rr;
+	int i;
+
+	if (av_dns_query(statp, name, ns_t_srv, answer, sizeof answer, &msg, ttl, &neg_ttl))
+		return 1;
+
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) || (ns_rr_type(rr) != ns_t_srv) || (ns_rr_rdlen(rr) < 7))
+			continue;
+
+		p = ns_rr_rdata(rr);
+		prio = ns_get16(p);
+		weight = ns_get16(p + 2);
+
+		/* "." means no service at all. */
+		if ( (dn_expand(ns_msg_base(msg), ns_msg_end(msg), p + 6, host, sizeof host) < 0) || !host[0] )
+			continue;
+
+		if (((prio << 16) | (0xffff - weight)) < best) {
+			best = (prio << 16) | (0xffff - weight);
+			*port = ns_get16(p + 4);
+			g_strlcpy(target, host, size);
+		}
+	}
+
+	return (best == G_MAXUINT);
+}
+
+/* Returns: 0 if an address was found, non-zero otherwise (*ttl says for how long). */
+static gint av_dns_lookup_a(res_state statp, const gchar *host, gchar *addr, gsize size, guint *ttl) {
+	guchar answer[NS_MAXMSG];
+	guint neg_ttl;
+	ns_msg msg;
+	ns_rr rr;
+	int i;
+
+	if (av_dns_query(statp, host, ns_t_a, answer, sizeof answer, &msg, ttl, &neg_ttl)) {
+		*ttl = neg_ttl;
+		return 1;
+	}
+
+	/* CNAMEs come along, and their TTL counts as well. */
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) || (ns_rr_type(rr) != ns_t_a) || (ns_rr_rdlen(rr) != 4))
+			continue;
+
+		if (inet_ntop(AF_INET, ns_rr_rdata(rr), addr, size))
+			return 0;
+	}
+
+	*ttl = neg_ttl;
+	return 1;
+}
+
+static void av_dns_lookup(res_state statp, const gchar *host, enum av_dns_service service, struct av_dns_answer *a) {
+	gchar naptr[NS_MAXDNAME];
+	gchar target[NS_MAXDNAME];
+	gint port = 0;
+
+	a->ttl = AV_DNS_TTL_MAX;
+
+	/* RFC 3263: NAPTR records tell which SRV records to look at, or we guess. */
+	if (service != AV_DNS_A) {
+		if (av_dns_lookup_naptr(statp, host, av_dns_services[service].naptr, naptr, sizeof naptr, &a->ttl))
+			g_snprintf(naptr, sizeof naptr, "%s.%s", av_dns_services[service].srv, host);
+
+		if (!av_dns_lookup_srv(statp, naptr, target, sizeof target, &port, &a->ttl)) {
+			host = target;
+			a->port = port;
+		}
+	}
+
+	a->failed = av_dns_lookup_a(statp, host, a->addr, sizeof a->addr, &a->ttl);
+}
+
+static void av_dns_resolver_lookup(struct av_dns_resolver *r, struct av_thread_cmd *cmd) {
+	struct av_dns_answer *a;
+	struct av_thread_cmd *reply;
+	gint64 start;
+
+	if ( (cmd->arg < 0) || (cmd->arg >= (int)G_N_ELEMENTS(av_dns_services)) ) {
+		g_printerr("Unknown DNS service %d\n",cmd->arg);
+		return;
+	}
+
+	a = g_try_malloc0(sizeof *a);
+	if (!a) {
+		g_printerr("Failure allocating DNS answer\n");
+		return;
+	}
+
+	a->key = av_dns_key(cmd->data, cmd->arg);
+
+	start = g_get_monotonic_time();
+	av_dns_lookup(&r->res, cmd->data, cmd->arg, a);
+	a->elapsed = g_get_monotonic_time() - start;
+
+	reply = av_thread_cmd(DNS_EVENT_ANSWER, a);
+	if (!reply) {
+		g_clear_pointer(&a->key, g_free);
+		g_clear_pointer(&a, g_free);
+		return;
+	}
+
+	av_thread_txcmd(r->self, reply, 1);
+}
+
+/* Points the resolver to another server than the system ones: "address" or "address:port". */
+static void av_dns_resolver_server(struct av_dns_resolver *r, const gchar *server) {
+	gchar **parts;
+	struct in_addr addr;
+	gint port = NS_DEFAULTPORT;
+
+	parts = g_strsplit(server, ":", 2);
+	if (parts[1])
+		port = atoi(parts[1]);
+
+	if ( (inet_pton(AF_INET, parts[0], &addr) == 1) && (port > 0) && (port <= 65535) ) {
+		r->res.nscount = 1;
+		r->res.nsaddr_list[0].sin_family = AF_INET;
+		r->res.nsaddr_list[0].sin_addr = addr;
+		r->res.nsaddr_list[0].sin_port = htons(port);
+		g_print("DNS: using server %s\n",server);
+	}
+	else
+		g_printerr("Invalid DNS server \"%s\", using the system ones\n",server);
+
+	g_strfreev(parts);
+}
+
+/* A lookup is a unit of work, and a slow one. */
+static gint av_dns_resolver_msg(gpointer data, guint budget, gboolean *more) {
+	struct av_dns_resolver *r = data;
+	struct av_thread_cmd *cmd;
+	gint retval = 0;
+
+	while (!retval && budget && (cmd = av_thread_rxcmd(r->self, 1))) {
+		budget--;
+		switch(cmd->msgtype) {
+			case DNS_CMD_EXIT:
+				retval++;
+				break;
+			case DNS_CMD_RESOLVE:
+				av_dns_resolver_lookup(r, cmd);
+				break;
+			case DNS_CMD_SERVER:
+				av_dns_resolver_server(r, cmd->data);
+				break;
+			default:
+				g_printerr("Unknown DNS command received (%d)!\n",cmd->msgtype);
+				break;
+		}
+
+		g_clear_pointer(&cmd, av_thread_cmd_free);
+	}
+
+	*more = !budget;
+
+	return retval;
+}
+
+static void *av_dns_resolver_startup(gpointer data) {
+	struct av_thread *t = data;
+	struct av_thread_cmd *exited;
+	struct av_dns_resolver *r;
+	struct av_poll_source template = { .name = "resolver", .dispatch = av_dns_resolver_msg, .budget = 4 };
+
+	r = g_try_malloc0(sizeof *r);
+	if (!r) {
+		g_printerr("Failure while allocating DNS resolver state!\n");
+		goto out;
+	}
+
+	r->self = t;
+
+	if (res_ninit(&r->res)) {
+		g_printerr("Failure initializing DNS resolver\n");
+		g_clear_pointer(&r, g_free);
+		goto out;
+	}
+
+	/* A lookup never takes more than a few seconds. */
+	r->res.retrans = 2;
+	r->res.retry = 2;
+
+	r->poll_data[0].fd = av_thread_eventfd(t, 1);
+	r->poll_data[0].events = POLLIN;
+	template.data = r;
+
+	av_poll_init(&r->poll, r->poll_data, r->poll_sources, &template, 1);
+	while (!av_poll_run(&r->poll, -1));
+	av_poll_report(&r->poll, "DNS");
+
+	res_nclose(&r->res);
+	g_clear_pointer(&r, g_free);
+
+out:
+	exited = av_thread_cmd(DNS_EVENT_EXITED, NULL);
+	if (exited)
+		av_thread_txcmd(t, exited, 1);
+
+	return NULL;
+}
+
+/* Reactor side. */
+
+static void av_dns_answer_free(struct av_dns_answer *a) {
+	g_clear_pointer(&a->key, g_free);
+	g_free(a);
+}
+
+static void av_dns_entry_free(gpointer data) {
+	struct av_dns_entry *e = data;
+
+	av_timer_cancel(e->dns->wheel, &e->timer);
+	g_slist_free_full(e->waiters, g_free);
+	g_clear_pointer(&e->key, g_free);
+	g_clear_pointer(&e->host, g_free);
+	g_free(e);
+}
+
+static gint av_dns_request(struct av_dns_entry *e) {
+	struct av_thread_cmd *cmd;
+
+	if (e->dns->exited)
+		return 1;
+
+	cmd = av_thread_cmd_str(DNS_CMD_RESOLVE, e->service, e->host);
+	if (!cmd)
+		return 1;
+
+	e->pending = TRUE;
+	e->requested = g_get_monotonic_time();
+
+	return av_thread_txcmd(e->dns->resolver, cmd, 0);
+}
+
+static void av_dns_entry_timer(struct av_timer *t, gpointer data) {
+	struct av_dns_entry *e = data;
+	struct av_dns *d = e->dns;
+
+	/* Prefetch time: expiry comes next. */
+	if (g_get_monotonic_time() < e->expires) {
+		if (e->used && !e->pending) {
+			d->stats.n_prefetches++;
+			av_dns_request(e);
+		}
+		av_timer_arm(d->wheel, &e->timer, e->expires);
+		return;
+	}
+
+	/* A lookup is on its way: whoever asks meanwhile waits for it. */
+	if (e->pending) {
+		e->resolved = FALSE;
+		return;
+	}
+
+	g_hash_table_remove(d->cache, e->key);
+}
+
+static void av_dns_answered(struct av_dns *d, struct av_dns_answer *a) {
+	struct av_dns_stats *st = &d->stats;
+	struct av_dns_entry *e;
+	struct av_dns_waiter *w;
+	GSList *waiters;
+	GSList *iter;
+	gchar addr[sizeof a->addr];
+	gint64 now = g_get_monotonic_time();
+	gint64 elapsed;
+
+	e = g_hash_table_lookup(d->cache, a->key);
+	if (!e || !e->pending)
+		return;
+
+	e->pending = FALSE;
+
+	elapsed = now - e->requested;
+	st->n_lookups++;
+	st->lookup_total += elapsed;
+	if (elapsed > st->lookup_max)
+		st->lookup_max = elapsed;
+
+	if (a->failed) {
+		st->n_failures++;
+		g_printerr("DNS: unable to resolve %s, not trying again for %u seconds (%" G_GINT64_FORMAT " ms)\n",e->host,a->ttl,elapsed/1000);
+
+		/* A failed prefetch: the answer we have is good until it expires. */
+		if (e->resolved && !e->failed)
+			return;
+	}
+	else
+		g_print("DNS: %s is %s:%d for %u seconds (%" G_GINT64_FORMAT " ms, %" G_GINT64_FORMAT " ms in the resolver)\n",
+			e->host,a->addr,a->port,a->ttl,elapsed/1000,a->elapsed/1000);
+
+	e->resolved = TRUE;
+	e->failed = a->failed;
+	g_strlcpy(e->addr, a->addr, sizeof e->addr);
+	e->port = a->port;
+	e->expires = now + (gint64)a->ttl * G_USEC_PER_SEC;
+	e->used = FALSE;
+
+	if (!e->failed && (a->ttl >= AV_DNS_PREFETCH_TTL_MIN))
+		av_timer_arm(d->wheel, &e->timer, now + (gint64)a->ttl * G_USEC_PER_SEC * AV_DNS_PREFETCH_PERCENT / 100);
+	else
+		av_timer_arm(d->wheel, &e->timer, e->expires);
+
+	waiters = e->waiters;
+	e->waiters = NULL;
+	g_strlcpy(addr, e->addr, sizeof addr);
+
+	/* Not caching: whoever asks next has to wait for the resolver again. */
+	if (!d->caching)
+		g_hash_table_remove(d->cache, a->key);
+
+	for (iter = waiters; iter; iter = iter->next) {
+		w = iter->data;
+		w->func(a->failed ? NULL : addr, a->port, w->data);
+	}
+
+	g_slist_free_full(waiters, g_free);
+}
+
+/* The resolver is gone: lookups still waiting for it fail. */
+static void av_dns_fail_pending(struct av_dns *d) {
+	struct av_dns_entry *e;
+	struct av_dns_waiter *w;
+	GHashTableIter iter;
+	GSList *waiters = NULL;
+	GSList *l;
+
+	g_hash_table_iter_init(&iter, d->cache);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+		if (!e->pending)
+			continue;
+
+		waiters = g_slist_concat(waiters, e->waiters);
+		e->waiters = NULL;
+		g_hash_table_iter_remove(&iter);
+	}
+
+	for (l = waiters; l; l = l->next) {
+		w = l->data;
+		w->func(NULL, 0, w->data);
+	}
+
+	g_slist_free_full(waiters, g_free);
+}
+
+gint av_dns_dispatch(gpointer data, guint budget, gboolean *more) {
+	struct av_dns *d = data;
+	struct av_thread_cmd *cmd;
+	struct av_dns_answer *a;
+
+	while (budget && (cmd = av_thread_rxcmd(d->resolver, 0))) {
+		budget--;
+		switch(cmd->msgtype) {
+			case DNS_EVENT_ANSWER:
+				a = cmd->payload;
+				av_dns_answered(d, a);
+				av_dns_answer_free(a);
+				break;
+			case DNS_EVENT_EXITED:
+				g_printerr("DNS resolver exited on its own\n");
+				d->exited = TRUE;
+				av_dns_fail_pending(d);
+				break;
+			default:
+				g_printerr("Unknown DNS event received (%d)!\n",cmd->msgtype);
+				break;
+		}
+
+		g_clear_pointer(&cmd, av_thread_cmd_free);
+	}
+
+	*more = !budget;
+
+	return 0;
+}
+
+/*
+ * Resolves a SIP host: by NAPTR and SRV records of the given service first
+ * (that is, when no port was given), or just by its A record with AV_DNS_A.
+ * func is called right away if the answer is in the cache, once the resolver
+ * answered otherwise.
+*/
+void av_dns_resolve(struct av_dns *d, const gchar *host, enum av_dns_service service, av_dns_func func, gpointer data) {
+	struct av_dns_entry *e;
+	struct av_dns_waiter *w;
+	GSList *waiters;
+	GSList *l;
+	gchar *key;
+
+	d->stats.n_requests++;
+
+	key = av_dns_key(host, service);
+	e = g_hash_table_lookup(d->cache, key);
+
+	if (e && e->resolved) {
+		g_free(key);
+		e->used = TRUE;
+
+		if (e->failed) {
+			d->stats.n_negative_hits++;
+			func(NULL, 0, data);
+		}
+		else {
+			d->stats.n_hits++;
+			func(e->addr, e->port, data);
+		}
+		return;
+	}
+
+	w = g_try_malloc0(sizeof *w);
+	if (!w) {
+		g_free(key);
+		func(NULL, 0, data);
+		return;
+	}
+
+	w->func = func;
+	w->data = data;
+
+	if (!e) {
+		e = g_malloc0(sizeof *e);
+		e->dns = d;
+		e->key = key;
+		e->host = g_strdup(host);
+		e->service = service;
+		av_timer_init(&e->timer, av_dns_entry_timer, e);
+		g_hash_table_insert(d->cache, e->key, e);
+	}
+	else
+		g_free(key);
+
+	e->waiters = g_slist_append(e->waiters, w);
+
+	/* Everybody waiting on the entry fails along with us, not just us. */
+	if (!e->pending && av_dns_request(e)) {
+		g_printerr("Unable to ask the resolver about %s\n",host);
+		waiters = e->waiters;
+		e->waiters = NULL;
+		g_hash_table_remove(d->cache, e->key);
+
+		for (l = waiters; l; l = l->next) {
+			w = l->data;
+			w->func(NULL, 0, w->data);
+		}
+
+		g_slist_free_full(waiters, g_free);
+	}
+}
+
+/* Whoever data stands for is going away: forget about its lookups. */
+void av_dns_cancel(struct av_dns *d, gpointer data) {
+	struct av_dns_entry *e;
+	struct av_dns_waiter *w;
+	GHashTableIter iter;
+	GSList *l;
+	GSList *next;
+
+	g_hash_table_iter_init(&iter, d->cache);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+		for (l = e->waiters; l; l = next) {
+			next = l->next;
+			w = l->data;
+			if (w->data != data)
+				continue;
+
+			e->waiters = g_slist_delete_link(e->waiters, l);
+			g_free(w);
+		}
+	}
+}
+
+/*
+ * Starts the resolver. server, if not NULL, is the one to ask instead of the
+ * system ones: it's set before any lookup, being the first message.
+*/
+gint av_dns_init(struct av_dns *d, struct av_timer_wheel *wheel, const gchar *server, gboolean caching) {
+	struct av_thread_cmd *cmd;
+
+	memset(d, 0, sizeof *d);
+
+	d->wheel = wheel;
+	d->caching = caching;
+	d->cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, av_dns_entry_free);
+
+	d->resolver = av_thread_setup("DNSResolver", av_dns_resolver_startup);
+	if (!d->resolver) {
+		g_printerr("Failure starting DNS resolver\n");
+		g_clear_pointer(&d->cache, g_hash_table_destroy);
+		return 1;
+	}
+
+	if (server) {
+		cmd = av_thread_cmd_str(DNS_CMD_SERVER, 0, server);
+		if (cmd)
+			av_thread_txcmd(d->resolver, cmd, 0);
+	}
+
+	if (!caching)
+		g_print("DNS: caching is off\n");
+
+	return 0;
+}
+
+int av_dns_fd(struct av_dns *d) {
+	return av_thread_eventfd(d->resolver, 0);
+}
+
+void av_dns_deinit(struct av_dns *d) {
+	struct av_dns_stats *st = &d->stats;
+	struct av_thread_cmd *cmd;
+	struct pollfd pfd;
+	gboolean exited = FALSE;
+
+	if (d->resolver) {
+		cmd = d->exited ? NULL : av_thread_cmd(DNS_CMD_EXIT, NULL);
+		if (cmd && !av_thread_txcmd(d->resolver, cmd, 0)) {
+			/* Answers still on their way get dropped, up to the resolver goodbye. */
+			pfd.fd = av_dns_fd(d);
+			pfd.events = POLLIN;
+			while (!exited) {
+				while ( (cmd = av_thread_rxcmd(d->resolver, 0)) ) {
+					if (cmd->msgtype == DNS_EVENT_EXITED)
+						exited = TRUE;
+					else if (cmd->msgtype == DNS_EVENT_ANSWER)
+						av_dns_answer_free(cmd->payload);
+					g_clear_pointer(&cmd, av_thread_cmd_free);
+				}
+
+				if (!exited && (poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+					break;
+			}
+		}
+
+		g_clear_pointer(&d->resolver, av_thread_teardown);
+	}
+
+	g_clear_pointer(&d->cache, g_hash_table_destroy);
+
+	g_print("DNS: %" G_GUINT64_FORMAT " requests, %" G_GUINT64_FORMAT " cache hits, %" G_GUINT64_FORMAT " negative hits, %" G_GUINT64_FORMAT " lookups (%" G_GUINT64_FORMAT " failed, %" G_GUINT64_FORMAT " prefetches), lookup average %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms\n",
+		st->n_requests, st->n_hits, st->n_negative_hits, st->n_lookups, st->n_failures, st->n_prefetches,
+		st->n_lookups ? st->lookup_total/(gint64)st->n_lookups/1000 : 0, st->lookup_max/1000);
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_dns_h__
+#define __av_dns_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_thread.h>
+#include <av_timer.h>
+
+enum DNS_CMDs {
+	DNS_CMD_EXIT = 0,
+	DNS_CMD_RESOLVE = 1,
+	DNS_CMD_SERVER = 2
+};
+
+enum DNS_MSG {
+	DNS_EVENT_ANSWER = 10
+};
+
+/* What a host is looked up for. */
+enum av_dns_service {
+	AV_DNS_A = 0,
+	AV_DNS_SIP_UDP,
+	AV_DNS_SIP_TCP,
+	AV_DNS_SIPS_TCP
+};
+
+/*
+ * Where a SIP host was found: an address and, when SRV records told so, a
+ * port (0 otherwise). addr is NULL if the host could not be resolved.
+*/
+typedef void (*av_dns_func)(const gchar *addr, gint port, gpointer data);
+
+/* Resolver thread to reactor: the outcome of a lookup. */
+struct av_dns_answer {
+	gchar *key;
+	gchar addr[48];
+	gint port;
+	guint ttl;
+	gboolean failed;
+	gint64 elapsed;
+};
+
+struct av_dns_stats {
+	guint64 n_requests;
+	guint64 n_hits;
+	guint64 n_negative_hits;
+	guint64 n_lookups;
+	guint64 n_failures;
+	guint64 n_prefetches;
+	gint64 lookup_total;
+	gint64 lookup_max;
+};
+
+/*
+ * Asynchronous SIP hosts resolution: lookups run in a resolver thread, and
+ * their answers are cached here, on the reactor side.
+*/
+struct av_dns {
+	struct av_thread *resolver;
+	gboolean exited;
+	struct av_timer_wheel *wheel;
+	GHashTable *cache;
+	gboolean caching;
+	struct av_dns_stats stats;
+};
+
+gint av_dns_init(struct av_dns *d, struct av_timer_wheel *wheel, const gchar *server, gboolean caching);
+void av_dns_deinit(struct av_dns *d);
+int av_dns_fd(struct av_dns *d);
+gint av_dns_dispatch(gpointer data, guint budget, gboolean *more);
+void av_dns_resolve(struct av_dns *d, const gchar *host, enum av_dns_service service, av_dns_func func, gpointer data);
+void av_dns_cancel(struct av_dns *d, gpointer data);
+
+#endif
@@ -16,9 +16,11 @@ G_DECLARE_FINAL_TYPE(AvModem, av_modem, AV, MODEM, GObject)
 G_END_DECLS
 
 AvModem *av_modem_new(MMObject *mmobject);
+AvModem *av_modem_new_lean(MMModem *modem);
 
-/* MMObject */
+/* MMObject, NULL in lean mode */
 MMObject *avmodem_get_mmobject(AvModem *m);
+const gchar *avmodem_get_path(AvModem *m);
 
 /* MMModem */
 MMModem *avmodem_get_mmmodem(AvModem *m);
@@ -27,23 +29,22 @@ AvModem *avmodem_set_mmmodem_signal_statechange(AvModem *m, gulong value);
 
 /* MMModemVoice */
 MMModemVoice *avmodem_get_mmmodemvoice(AvModem *m);
+AvModem *avmodem_set_mmmodemvoice(AvModem *m, MMModemVoice *v);
 gulong avmodem_get_mmmodemvoice_signal_call_added(AvModem *m);
 AvModem *avmodem_set_mmmodemvoice_signal_call_added(AvModem *m, gulong value);
 gulong avmodem_get_mmmodemvoice_signal_call_deleted(AvModem *m);
 AvModem *avmodem_set_mmmodemvoice_signal_call_deleted(AvModem *m, gulong value);
 
-GList *avmodem_get_mmmodemvoice_calls_list(AvModem *m);
-AvModem *avmodem_update_mmmodemvoice_calls_list(AvModem *m, GList *l);
+/* MMCall */
+GList *avmodem_get_mmcalls(AvModem *m);
+MMCall *avmodem_find_mmcall(AvModem *m, const gchar *path);
+AvModem *avmodem_add_mmcall(AvModem *m, MMCall *c);
+gboolean avmodem_remove_mmcall(AvModem *m, MMCall *c);
 
 gint avmodem_get_active_calls_counter(AvModem *m);
 AvModem *avmodem_set_active_calls_counter(AvModem *m, gint counter);
 
-struct av_thread *avmodem_get_sipthread(AvModem *m);
-AvModem *avmodem_set_sipthread(AvModem *m, struct av_thread *t);
-
-GIOChannel *avmodem_get_sip_GIOchannel(AvModem *m);
-AvModem *avmodem_set_sip_GIOchannel(AvModem *m, GIOChannel *sip_giochannel);
-guint avmodem_get_sip_GIOchannel_gsource_id(AvModem *m);
-AvModem *avmodem_set_sip_GIOchannel_gsource_id(AvModem *m, guint src_id);
+gint avmodem_get_sip_line(AvModem *m);
+AvModem *avmodem_set_sip_line(AvModem *m, gint line);
 
 #endif
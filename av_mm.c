@@ -4,18 +4,40 @@
  * Most of the code in here, deals with MM watching.
  * When MM connects and disconnects from the bus, we act accordingly, mainly
  * getting rid of AvModem objects we still track.
+ *
+ * Nothing here waits: the system bus connection is set up asynchronously,
+ * while the SIP reactor starts on its own thread, so that modems get their
+ * lines as soon as ModemManager lists them.
+ *
+ * All of MM interaction, SIP events included, runs on a thread of its own,
+ * with its own GMainContext: D-Bus signals, proxies and async calls are
+ * dispatched there, since that's the thread default context they're set up
+ * from. The main thread only deals with UNIX signals and configuration
+ * changes, and talks to the MM thread through the same kind of message
+ * queue the SIP reactor uses. SIP events are dispatched ahead of D-Bus
+ * traffic: see av_mm_voice_start_sip_eventchannel().
 */
 
 /* GLib2 headers */
 #include <glib.h>
+#include <glib-unix.h>
 
 /* AV headers */
 #include <av.h>
 #include <av_mm.h>
 #include <av_mm_manager.h>
+#include <av_mm_lean.h>
 #include <av_mm_modem.h>
 #include <av_mm_voice.h>
 #include <av_utils.h>
+#include <av_storage.h>
+#include <av_startup.h>
+#include <av_config.h>
+#include <av_thread.h>
+#include <av_threadcomm.h>
+
+/* The MM thread, as seen from itself. */
+static struct av_thread *av_mm_self;
 
 /*
  * Used to free all AvModem objects we still track.
@@ -24,8 +46,7 @@
  * - an allocated AV state structure
 */
 static gint av_mm_unref_modems(void) {
-	g_list_free_full(ll->av_modems, g_object_unref);
-	ll->av_modems = NULL;
+	av_storage_clear();
 
 	return 0;
 }
@@ -33,7 +54,7 @@ static gint av_mm_unref_modems(void) {
 /*
  * So MM appeared! And you're looking at a GBusNameAppearedCallback function.
  * As such, we hope it follows GLib2 semantics. Basically, this function calls
- * av_mm_manager_init().
+ * av_mm_manager_init(), or av_mm_lean_init() in lean mode.
  *
  * Parameters:
  * - a working D-Bus connection
@@ -47,7 +68,10 @@ static void av_mm_on(GDBusConnection *connection,
 	gpointer user_data) {
 
 	g_print("MM is connected!\n");
-	av_mm_manager_init();
+	if (ll->lean.enabled)
+		av_mm_lean_init();
+	else
+		av_mm_manager_init();
 	return;
 }
 
@@ -56,10 +80,13 @@ static void av_mm_on(GDBusConnection *connection,
  * track via av_mm_unref_modems and the manager object via av_mm_manager_deinit.
 */
 static void av_mm_mm_is_gone_common(void) {
-	if (ll->av_modems)
+	if (av_storage_count())
 		av_mm_unref_modems();
 
-	av_mm_manager_deinit();
+	if (ll->lean.enabled)
+		av_mm_lean_deinit();
+	else
+		av_mm_manager_deinit();
 	return;
 
 }
@@ -86,8 +113,15 @@ static void av_mm_off(GDBusConnection *connection,
 /*
  * Deinitializes MM interaction. That is, we stop watching for it.
 */
-gint av_mm_deinit(void) {
+static gint av_mm_deinit(void) {
 	av_mm_mm_is_gone_common();
+
+	/* Still connecting: the callback will find out we gave up. */
+	if (ll->dbus_cancellable) {
+		g_cancellable_cancel(ll->dbus_cancellable);
+		g_clear_object(&ll->dbus_cancellable);
+	}
+
 	if (ll->mm_watch) {
 		g_bus_unwatch_name(ll->mm_watch);
 		ll->mm_watch = 0;
@@ -98,33 +132,80 @@ gint av_mm_deinit(void) {
 		ll->dbus_connection = NULL;
 	}
 
+	/* It's started without modems: see av_mm_init(). */
+	av_mm_voice_sip_stop();
+
+	av_storage_deinit();
+
 	g_print("No longer watching for MM...\n");
 
 	return 0;
 }
 
 /*
- * Initializes MM interaction. In particular, we prepare to watch for MM
- * appearing and disappearing from the bus, acting accordingly.
+ * This function runs as a timeout GSource of the MM thread, and as such
+ * follows GLib2 semantics. It's purpose is to give time for things to deinit
+ * "cleanly".
 */
-gint av_mm_init(void) {
+static gboolean av_mm_handle_exit(gpointer user_data) {
+	if (!ll->async_counter) {
+		g_print("MM thread exiting...\n");
+		g_main_loop_quit(ll->mm_loop);
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Stops MM interaction: the MM thread exits once async operations are done,
+ * and the main loop along with it.
+*/
+static void av_mm_exit(void) {
+	GSource *src;
+
+	if (ll->mm_exiting)
+		return;
+	ll->mm_exiting = TRUE;
+
+	av_mm_deinit();
+
+	src = g_timeout_source_new_seconds(1);
+	g_source_set_callback(src, av_mm_handle_exit, NULL, NULL);
+	g_source_attach(src, ll->mm_context);
+	g_source_unref(src);
+}
+
+/*
+ * Invoked when the system bus connection is ready, be it success or not.
+ * This is a GAsyncReadyCallback. Then we prepare to watch for MM appearing
+ * and disappearing from the bus, acting accordingly. Failing to do so is
+ * fatal, as failing to connect to the bus is.
+*/
+static void av_mm_bus_ready(GObject *source, GAsyncResult *res, gpointer user_data) {
 	GError *dbus_connection_error = NULL;
+	GDBusConnection *connection;
 
-	/* Sanity check: AV modems list should be empty at this point. */
-	if (ll->av_modems) {
-		g_printerr("BUG: AV modems list is not empty!\n");
-		return 1;
+	connection = g_bus_get_finish(res, &dbus_connection_error);
+	av_utils_async_end(NULL);
+
+	/* We're exiting. */
+	if (g_error_matches(dbus_connection_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_clear_error(&dbus_connection_error);
+		return;
 	}
 
-	/* connects to D-Bus, system bus */
-	ll->dbus_connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM,
-		NULL,                    /* GCancellable is not used (at least yet) */
-		&dbus_connection_error); /* GError to report errors */
-	if (!ll->dbus_connection) {
+	g_clear_object(&ll->dbus_cancellable);
+
+	if (!connection) {
 		av_utils_print_gerror(&dbus_connection_error);
-		return 1;              /* main loop is never started and program exits */
+		av_mm_exit();
+		return;
 	}
 
+	ll->dbus_connection = connection;
+	av_startup_mark(AV_STARTUP_BUS);
+
 	ll->mm_watch = g_bus_watch_name_on_connection(ll->dbus_connection,
 		"org.freedesktop.ModemManager1", /* watch for ModemManager well-known service name */
 		G_BUS_NAME_WATCHER_FLAGS_NONE,   /* no flags */
@@ -134,11 +215,165 @@ gint av_mm_init(void) {
 		NULL);                          /* no GDestroyNotify ?? */
 	if (!ll->mm_watch) {
 		g_printerr("Failure while starting to watch for MM in the system bus\n");
-		av_mm_deinit();
-		return 1;              /* main loop is never started and program exits */
+		av_mm_exit();
+		return;
 	}
 
 	g_print("Watching for MM...\n");
+}
+
+/*
+ * Initializes MM interaction: connects to the system bus, and starts the SIP
+ * reactor meanwhile.
+*/
+static gint av_mm_start(void) {
+	/* Sanity check: AV modems list should be empty at this point. */
+	if (av_storage_count()) {
+		g_printerr("BUG: AV modems list is not empty!\n");
+		return 1;
+	}
+
+	av_storage_init();
+	ll->lean.enabled = av_config_dbus_lean();
+
+	/* Modems will wait for it otherwise: a failure here isn't fatal, the next modem tries again. */
+	if (av_mm_voice_sip_start())
+		g_printerr("Failure starting the SIP reactor\n");
+
+	/* connects to D-Bus, system bus */
+	ll->dbus_cancellable = g_cancellable_new();
+	av_utils_async_start(NULL);
+	g_bus_get(G_BUS_TYPE_SYSTEM, ll->dbus_cancellable, av_mm_bus_ready, NULL);
 
 	return 0;
 }
+
+/* Counts MM thread wakeups, for the main thread to print: see av.c. */
+static gint av_mm_poll_counted(GPollFD *ufds, guint nfds, gint timeout) {
+	g_atomic_int_inc(&ll->mm_wakeups);
+	return g_poll(ufds, nfds, timeout);
+}
+
+/* Messages from the main thread. */
+static gboolean av_mm_thread_msg(gint fd, GIOCondition condition, gpointer user_data) {
+	struct av_thread_cmd *cmd;
+
+	while ( (cmd = av_thread_rxcmd(av_mm_self, 1)) ) {
+		switch(cmd->msgtype) {
+			case MM_CMD_EXIT:
+				av_mm_exit();
+				break;
+			case MM_CMD_CONFIG_CHANGED:
+				av_mm_voice_config_changed(cmd->arg ? NULL : cmd->data);
+				break;
+			default:
+				g_printerr("Unknown MM thread command (%d)!\n",cmd->msgtype);
+				break;
+		}
+
+		g_clear_pointer(&cmd, av_thread_cmd_free);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * The MM thread: its GMainContext is the thread default one for all of MM
+ * interaction, and its loop runs until av_mm_exit() is done.
+*/
+static gpointer av_mm_thread(gpointer data) {
+	struct av_thread_cmd *cmd;
+	GSource *inbox;
+
+	av_mm_self = data;
+
+	ll->mm_context = g_main_context_new();
+	g_main_context_push_thread_default(ll->mm_context);
+	ll->mm_loop = g_main_loop_new(ll->mm_context, FALSE);
+
+	if (av_config_loop_stats())
+		g_main_context_set_poll_func(ll->mm_context, av_mm_poll_counted);
+
+	inbox = g_unix_fd_source_new(av_thread_eventfd(av_mm_self, 1), G_IO_IN);
+	g_source_set_callback(inbox, G_SOURCE_FUNC(av_mm_thread_msg), NULL, NULL);
+	g_source_set_priority(inbox, G_PRIORITY_HIGH);
+	g_source_attach(inbox, ll->mm_context);
+
+	if (av_mm_start())
+		av_mm_exit();
+
+	g_main_loop_run(ll->mm_loop);
+
+	g_source_destroy(inbox);
+	g_source_unref(inbox);
+	g_clear_pointer(&ll->mm_loop, g_main_loop_unref);
+	g_main_context_pop_thread_default(ll->mm_context);
+	g_clear_pointer(&ll->mm_context, g_main_context_unref);
+
+	/* The main loop quits along with us. */
+	if ( (cmd = av_thread_cmd(MM_EVENT_EXITED, NULL)) )
+		av_thread_txcmd(av_mm_self, cmd, 1);
+
+	return NULL;
+}
+
+/* Messages from the MM thread, on the main thread. */
+static gboolean av_mm_events(gint fd, GIOCondition condition, gpointer user_data) {
+	struct av_thread_cmd *cmd;
+
+	while ( (cmd = av_thread_rxcmd(ll->mmthread, 0)) ) {
+		switch(cmd->msgtype) {
+			case MM_EVENT_EXITED:
+				g_print("MM thread is done\n");
+				g_main_loop_quit(ll->loop);
+				break;
+			default:
+				g_printerr("Unknown MM thread event (%d)!\n",cmd->msgtype);
+				break;
+		}
+
+		g_clear_pointer(&cmd, av_thread_cmd_free);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Starts the MM thread, from the main one. The configuration must be loaded
+ * already.
+*/
+gint av_mm_init(void) {
+	ll->mmthread = av_thread_setup("MM", av_mm_thread);
+	if (!ll->mmthread)
+		return 1;
+
+	ll->mm_events_src_tag = g_unix_fd_add(av_thread_eventfd(ll->mmthread, 0), G_IO_IN, av_mm_events, NULL);
+
+	return 0;
+}
+
+/* Asks the MM thread to exit, from the main one: the main loop quits when it did. */
+void av_mm_stop(void) {
+	struct av_thread_cmd *cmd;
+
+	if (ll->mmthread && (cmd = av_thread_cmd(MM_CMD_EXIT, NULL)))
+		av_thread_txcmd(ll->mmthread, cmd, 0);
+}
+
+/* Joins the MM thread, once the main loop is over. */
+void av_mm_teardown(void) {
+	if (ll->mm_events_src_tag) {
+		g_source_remove(ll->mm_events_src_tag);
+		ll->mm_events_src_tag = 0;
+	}
+
+	g_clear_pointer(&ll->mmthread, av_thread_teardown);
+}
+
+/* Configuration changes, from the main thread: see av_config_watch(). */
+void av_mm_config_changed(const gchar *equipment_id) {
+	struct av_thread_cmd *cmd;
+
+	if (ll->mmthread && (cmd = av_thread_cmd_str(MM_CMD_CONFIG_CHANGED, !equipment_id, equipment_id)))
+		av_thread_txcmd(ll->mmthread, cmd, 0);
+}
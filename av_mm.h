@@ -5,8 +5,17 @@
 /* AV headers */
 #include <av_gobjects.h>
 
-/* Inits or deinits MM code. */
+/* Main thread <-> MM thread messages. */
+enum MM_MSG {
+	MM_CMD_EXIT = 20,
+	MM_CMD_CONFIG_CHANGED = 21,
+	MM_EVENT_EXITED = 22
+};
+
+/* Starts or stops the MM thread, from the main one. */
 gint av_mm_init(void);
-gint av_mm_deinit(void);
+void av_mm_stop(void);
+void av_mm_teardown(void);
+void av_mm_config_changed(const gchar *equipment_id);
 
 #endif
@@ -4,17 +4,56 @@
 #include <av.h>
 #include <av_utils.h>
 #include <av_gobjects.h>
+#include <av_thread.h>
 #include <av_threadcomm.h>
 #include <av_sip.h>
 
 static void av_mm_call_unregister_mmcall(AvModem *m, MMCall *c);
 
+/* Ties an asynchronous modem call setup to the SIP call that asked for it. */
+struct av_mm_call_sipcall_ctx {
+	AvModem *m;
+	int cid;
+};
+
+/*
+ * Sends a command about the line of the given modem to the SIP reactor, if the
+ * modem has a line. The SIP call ID and the call path, if any, travel inline.
+*/
+static void av_mm_call_notify_sip(AvModem *m, int msg, int cid, const gchar *call_path) {
+	struct av_thread_cmd *cmd;
+	gint line;
+
+	line = avmodem_get_sip_line(m);
+	if ( (line >= 0) && ll->sipthread && (cmd = av_thread_cmd_str(msg, cid, call_path)) ) {
+		cmd->line = line;
+		av_thread_txcmd(ll->sipthread, cmd, 0);
+	}
+}
+
+/*
+ * Tells the SIP reactor a modem call is ringing in, for it to be bridged to
+ * SIP. The caller number, if any, travels as the payload.
+*/
+static void av_mm_call_notify_sip_ringing(AvModem *m, MMCall *c) {
+	struct av_thread_cmd *cmd;
+	const gchar *number;
+	gint line;
+
+	line = avmodem_get_sip_line(m);
+	if ( (line < 0) || !ll->sipthread || !(cmd = av_thread_cmd_str(SIP_CMD_CALL_RINGING_IN, 0, mm_call_get_path(c))) )
+		return;
+
+	number = mm_call_get_number(c);
+	cmd->payload = number ? g_strdup(number) : NULL;
+	cmd->line = line;
+	av_thread_txcmd(ll->sipthread, cmd, 0);
+}
+
 static void av_mm_call_state_eval(MMCall *c,
 	MMCallState oldstate,
 	MMCallState newstate,
 	AvModem *m) {
-	GList *mmcalls;
-
 	gint n_calls = avmodem_get_active_calls_counter(m);
 
 	if (
@@ -27,16 +66,28 @@ static void av_mm_call_state_eval(MMCall *c,
 			g_print("Activating audio IO...\n");
 		}
 	}
+	/* Calls from the GSM network are offered to SIP: see av_sip_bridge_fork(). */
+	if ( (newstate == MM_CALL_STATE_RINGING_IN) && (oldstate != newstate) && (mm_call_get_direction(c) == MM_CALL_DIRECTION_INCOMING) )
+		av_mm_call_notify_sip_ringing(m, c);
+
+	/* Lets the SIP side answer the call and move media to it. */
+	if (newstate == MM_CALL_STATE_ACTIVE)
+		av_mm_call_notify_sip(m, SIP_CMD_CALL_ACTIVE, 0, mm_call_get_path(c));
+
+	if (newstate == MM_CALL_STATE_HELD)
+		av_mm_call_notify_sip(m, SIP_CMD_CALL_HELD, 0, mm_call_get_path(c));
+
 	if (newstate == MM_CALL_STATE_TERMINATED) {
+		/* The other party may have hung up: the SIP side has to follow. */
+		av_mm_call_notify_sip(m, SIP_CMD_CALL_TERMINATED, 0, mm_call_get_path(c));
+
 		n_calls--;
 		if (!n_calls) {
 			g_print("Deactivating audio IO...\n");
 		}
 
-		mmcalls = avmodem_get_mmmodemvoice_calls_list(m);
-		mmcalls = g_list_remove(mmcalls, c);
-		av_mm_call_unregister_mmcall(m, c);
-		avmodem_update_mmmodemvoice_calls_list(m, mmcalls);
+		if (avmodem_remove_mmcall(m, c))
+			av_mm_call_unregister_mmcall(m, c);
 	}
 
 	avmodem_set_active_calls_counter(m, n_calls);
@@ -73,14 +124,9 @@ static guint av_mm_call_gsignals(AvModem *m, MMCall *c, gboolean connect) {
 }
 
 void av_mm_call_register(AvModem *m, MMCall *call) {
-	GList *mmcalls;
-
-	mmcalls = avmodem_get_mmmodemvoice_calls_list(m);
-
 	g_print("Registering %s\n",mm_call_get_path(call));
 
-	mmcalls = g_list_append(mmcalls, call);
-	avmodem_update_mmmodemvoice_calls_list(m, mmcalls);
+	avmodem_add_mmcall(m, call);
 
 	av_mm_call_gsignals(m, call, TRUE);
 
@@ -100,16 +146,12 @@ static void av_mm_call_unregister_mmcall(AvModem *m, MMCall *c) {
 
 void av_mm_call_unregister(AvModem *m, const gchar *call_path) {
 	MMCall *current_call;
-	GList *mmcalls;
-
-	mmcalls = avmodem_get_mmmodemvoice_calls_list(m);
 
-	current_call = av_utils_mm_call_search(mmcalls, call_path);
+	current_call = avmodem_find_mmcall(m, call_path);
 
 	if (current_call) {
-		mmcalls = g_list_remove(mmcalls, current_call);
+		avmodem_remove_mmcall(m, current_call);
 		av_mm_call_unregister_mmcall(m, current_call);
-		avmodem_update_mmmodemvoice_calls_list(m, mmcalls);
 	}
 
 	return;
@@ -119,43 +161,34 @@ void av_mm_call_release_mmcalls(AvModem *m) {
 	MMCall *voicecall;
 	GList *mmcalls;
 
-	mmcalls = avmodem_get_mmmodemvoice_calls_list(m);
-
-	while(g_list_length(mmcalls)) {
+	while ( (mmcalls = avmodem_get_mmcalls(m)) ) {
 		voicecall = MM_CALL(mmcalls->data);
-		mmcalls = g_list_remove(mmcalls, mmcalls->data);
+		avmodem_remove_mmcall(m, voicecall);
 		av_mm_call_unregister_mmcall(m, voicecall);
 	}
 
-	g_list_free(mmcalls);
-
-	avmodem_update_mmmodemvoice_calls_list(m, NULL);
-
 	return;
 }
 
 static void av_mm_call_sipcall_start_call(MMCall *c, GAsyncResult *res, gpointer user_data) {
 	GError *e = NULL;
-	struct av_thread_cmd *call_started_cmd;
-	AvModem *m = user_data;
+	struct av_mm_call_sipcall_ctx *ctx = user_data;
 
-	if (!mm_call_start_finish(c, res, &e))
+	if (!mm_call_start_finish(c, res, &e)) {
 		av_utils_print_gerror(&e);
-	else {
-		call_started_cmd = av_thread_cmd(SIP_CMD_CALL_IN_PROGRESS, mm_call_dup_path(c));
-		if (call_started_cmd) {
-			av_thread_txcmd(avmodem_get_sipthread(m), call_started_cmd, 0);
-			g_clear_pointer(&call_started_cmd, g_free);
-		}
+		av_mm_call_notify_sip(ctx->m, SIP_CMD_CALL_FAILED, ctx->cid, NULL);
 	}
+	else
+		av_mm_call_notify_sip(ctx->m, SIP_CMD_CALL_IN_PROGRESS, ctx->cid, mm_call_get_path(c));
 
+	g_free(ctx);
 	av_utils_async_end(G_OBJECT(c));
 
 	return;
 }
 
 static void av_mm_call_sipcall_with_call(MMModemVoice *v, GAsyncResult *res, gpointer user_data) {
-	AvModem *m = user_data;
+	struct av_mm_call_sipcall_ctx *ctx = user_data;
 	MMCall *c;
 	GError *e = NULL;;
 
@@ -163,35 +196,178 @@ static void av_mm_call_sipcall_with_call(MMModemVoice *v, GAsyncResult *res, gpo
 	if (!c) {
 		g_printerr("Unable to create MM call...\n");
 		av_utils_print_gerror(&e);
+		av_mm_call_notify_sip(ctx->m, SIP_CMD_CALL_FAILED, ctx->cid, NULL);
+		g_free(ctx);
 		av_utils_async_end(NULL);
 		return;
 	}
 
-	mm_call_start(c, NULL, (GAsyncReadyCallback)av_mm_call_sipcall_start_call, m);
+	mm_call_start(c, NULL, (GAsyncReadyCallback)av_mm_call_sipcall_start_call, ctx);
 
 	return;
 }
 
 /*
- * DO WE NEED TO SANITIZE dest_number HERE?? HOW?
+ * dest_number comes normalized by the dial plan of the SIP reactor, when
+ * there's one (see av_dialplan.c).
+ * The SIP call id travels along, so that the SIP side knows which of its
+ * calls the modem call belongs to.
 */
-void av_mm_call_sipcall(AvModem *m, const char *dest_number) {
+void av_mm_call_sipcall(AvModem *m, int cid, const char *dest_number) {
 	MMCallProperties *cprops;
 	gchar *normalized_number;
+	struct av_mm_call_sipcall_ctx *ctx;
 
 	normalized_number = g_str_to_ascii(dest_number, "C");
-	if (!normalized_number || !strlen(normalized_number))
+	if (!normalized_number || !strlen(normalized_number)) {
+		g_clear_pointer(&normalized_number, g_free);
+		av_mm_call_notify_sip(m, SIP_CMD_CALL_FAILED, cid, NULL);
 		return;
+	}
 
 	cprops = mm_call_properties_new();
 
 	mm_call_properties_set_number(cprops, normalized_number);
 
+	ctx = g_new0(struct av_mm_call_sipcall_ctx, 1);
+	ctx->m = m;
+	ctx->cid = cid;
+
 	av_utils_async_start(NULL);
-	mm_modem_voice_create_call(avmodem_get_mmmodemvoice(m), cprops, NULL, (GAsyncReadyCallback)av_mm_call_sipcall_with_call, m);
+	mm_modem_voice_create_call(avmodem_get_mmmodemvoice(m), cprops, NULL, (GAsyncReadyCallback)av_mm_call_sipcall_with_call, ctx);
 
 	g_clear_pointer(&cprops, g_object_unref);
 	g_clear_pointer(&normalized_number, g_free);
 
 	return;
 }
+
+static void av_mm_call_hangup_ready(MMCall *c, GAsyncResult *res, gpointer user_data) {
+	GError *e = NULL;
+
+	if (!mm_call_hangup_finish(c, res, &e))
+		av_utils_print_gerror(&e);
+
+	av_utils_async_end(G_OBJECT(c));
+
+	return;
+}
+
+static void av_mm_call_hangup_and_accept_ready(MMModemVoice *v, GAsyncResult *res, gpointer user_data) {
+	GError *e = NULL;
+
+	if (!mm_modem_voice_hangup_and_accept_finish(v, res, &e))
+		av_utils_print_gerror(&e);
+
+	av_utils_async_end(G_OBJECT(v));
+
+	return;
+}
+
+static gboolean av_mm_call_has_held(AvModem *m) {
+	GList *l;
+
+	for (l = avmodem_get_mmcalls(m); l; l = g_list_next(l))
+		if (mm_call_get_state(MM_CALL(l->data)) == MM_CALL_STATE_HELD)
+			return TRUE;
+
+	return FALSE;
+}
+
+/*
+ * Hangs up a modem call the SIP side no longer needs, e.g.: because the
+ * caller went away while the modem call was still being set up.
+ * When the active call goes away while another one is on hold, the held
+ * call is retrieved in the same step, as a phone would do.
+*/
+void av_mm_call_hangup(AvModem *m, const gchar *call_path) {
+	MMCall *c;
+	MMModemVoice *v;
+
+	c = avmodem_find_mmcall(m, call_path);
+	if (!c) {
+		g_print("%s is already gone\n",call_path);
+		return;
+	}
+
+	if (mm_call_get_state(c) == MM_CALL_STATE_TERMINATED)
+		return;
+
+	if ((mm_call_get_state(c) == MM_CALL_STATE_ACTIVE) && av_mm_call_has_held(m)) {
+		g_print("Hanging up %s, retrieving held call\n",call_path);
+		v = avmodem_get_mmmodemvoice(m);
+		av_utils_async_start(G_OBJECT(v));
+		mm_modem_voice_hangup_and_accept(v, NULL, (GAsyncReadyCallback)av_mm_call_hangup_and_accept_ready, NULL);
+		return;
+	}
+
+	g_print("Hanging up %s\n",call_path);
+
+	av_utils_async_start(G_OBJECT(c));
+	mm_call_hangup(c, NULL, (GAsyncReadyCallback)av_mm_call_hangup_ready, NULL);
+
+	return;
+}
+
+static void av_mm_call_accept_ready(MMCall *c, GAsyncResult *res, gpointer user_data) {
+	GError *e = NULL;
+
+	if (!mm_call_accept_finish(c, res, &e))
+		av_utils_print_gerror(&e);
+
+	av_utils_async_end(G_OBJECT(c));
+
+	return;
+}
+
+/*
+ * Answers a modem call ringing in, once a SIP party answered it. The SIP side
+ * learns it's done when the call becomes active.
+*/
+void av_mm_call_accept(AvModem *m, const gchar *call_path) {
+	MMCall *c;
+
+	c = avmodem_find_mmcall(m, call_path);
+	if (!c || (mm_call_get_state(c) != MM_CALL_STATE_RINGING_IN)) {
+		g_print("%s is not ringing anymore\n",call_path);
+		return;
+	}
+
+	g_print("Accepting %s\n",call_path);
+
+	av_utils_async_start(G_OBJECT(c));
+	mm_call_accept(c, NULL, (GAsyncReadyCallback)av_mm_call_accept_ready, NULL);
+
+	return;
+}
+
+static void av_mm_call_swap_ready(MMModemVoice *v, GAsyncResult *res, gpointer user_data) {
+	GError *e = NULL;
+
+	if (!mm_modem_voice_hold_and_accept_finish(v, res, &e))
+		av_utils_print_gerror(&e);
+
+	av_utils_async_end(G_OBJECT(v));
+
+	return;
+}
+
+/*
+ * Puts the active call on hold and makes the held (or waiting) one active,
+ * if any. ModemManager has no way to hold a single call: this is what a
+ * phone does when you press "swap".
+*/
+void av_mm_call_swap(AvModem *m) {
+	MMModemVoice *v;
+
+	v = avmodem_get_mmmodemvoice(m);
+	if (!v)
+		return;
+
+	g_print("Swapping calls\n");
+
+	av_utils_async_start(G_OBJECT(v));
+	mm_modem_voice_hold_and_accept(v, NULL, (GAsyncReadyCallback)av_mm_call_swap_ready, NULL);
+
+	return;
+}
@@ -4,6 +4,9 @@
 void av_mm_call_register(AvModem *m, MMCall *call);
 void av_mm_call_unregister(AvModem *m, const gchar *call_path);
 void av_mm_call_release_mmcalls(AvModem *m);
-void av_mm_call_sipcall(AvModem *m, const char *dest_number);
+void av_mm_call_sipcall(AvModem *m, int cid, const char *dest_number);
+void av_mm_call_hangup(AvModem *m, const gchar *call_path);
+void av_mm_call_accept(AvModem *m, const gchar *call_path);
+void av_mm_call_swap(AvModem *m);
 
 #endif
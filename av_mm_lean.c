@@ -0,0 +1,368 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Lean ModemManager watching. The MMManager object manager follows every
+ * interface of every modem, with a single match rule taking in all of the
+ * signals of ModemManager: each property change (signal quality, location,
+ * bearers, SIM, 3GPP registration...) wakes the main loop up and updates a
+ * proxy, most of which we never read.
+ *
+ * Here we only subscribe to what we use:
+ * - InterfacesAdded and InterfacesRemoved of the object manager, and a single
+ *   GetManagedObjects when MM shows up, to learn about modems;
+ * - the Modem and Voice interfaces of each modem, as proxies of their own,
+ *   whose match rules are for their path and interface only (calls already
+ *   get theirs: see av_mm_voice.c).
+ *
+ * AvModem objects then have no MMObject, their services being set instead:
+ * nothing else tells the difference.
+*/
+
+/* AV headers */
+#include <av.h>
+#include <av_utils.h>
+#include <av_storage.h>
+#include <av_startup.h>
+#include <av_mm_lean.h>
+#include <av_mm_modem.h>
+#include <av_mm_voice.h>
+
+#define AV_MM_LEAN_OBJECT_MANAGER "org.freedesktop.DBus.ObjectManager"
+
+/* A modem, or the voice service of one, being set up. */
+struct av_mm_lean_ctx {
+	guint generation;
+	gchar *path;
+	gboolean voice;
+	gboolean listing;
+	MMModem *modem;
+	gint64 start;
+};
+
+static struct av_mm_lean_ctx *av_mm_lean_ctx_new(const gchar *path, gboolean voice) {
+	struct av_mm_lean_ctx *ctx;
+
+	ctx = g_new0(struct av_mm_lean_ctx, 1);
+	ctx->generation = ll->lean.generation;
+	ctx->path = g_strdup(path);
+	ctx->voice = voice;
+	ctx->start = g_get_monotonic_time();
+
+	return ctx;
+}
+
+static gboolean av_mm_lean_ctx_stale(struct av_mm_lean_ctx *ctx) {
+	return !ll->lean.active || (ctx->generation != ll->lean.generation);
+}
+
+/* The initial listing is done once its last modem is. */
+static void av_mm_lean_listing_check(void) {
+	if (ll->lean.listed && !ll->lean.n_listing)
+		av_startup_mark(AV_STARTUP_MANAGER);
+}
+
+static void av_mm_lean_ctx_free(struct av_mm_lean_ctx *ctx) {
+	if (ctx->listing && !av_mm_lean_ctx_stale(ctx)) {
+		ll->lean.n_listing--;
+		av_mm_lean_listing_check();
+	}
+
+	g_clear_object(&ctx->modem);
+	g_free(ctx->path);
+	g_free(ctx);
+}
+
+/* Builds a proxy for an interface of a modem, the way libmm-glib would. */
+static void av_mm_lean_proxy_new(GType type, const gchar *interface_name, struct av_mm_lean_ctx *ctx, GAsyncReadyCallback callback) {
+	av_utils_async_start(NULL);
+	g_async_initable_new_async(type,
+		G_PRIORITY_DEFAULT,
+		NULL,
+		callback,
+		ctx,
+		"g-flags", G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+		"g-name", MM_DBUS_SERVICE,
+		"g-connection", ll->dbus_connection,
+		"g-object-path", ctx->path,
+		"g-interface-name", interface_name,
+		NULL);
+}
+
+/* Both proxies of a new modem are ready: it's registered like the object manager's ones. */
+static void av_mm_lean_add(struct av_mm_lean_ctx *ctx, MMModemVoice *voice) {
+	AvModem *m;
+
+	if (av_storage_find_path(ctx->path)) {
+		g_print("%s already known\n",ctx->path);
+		g_clear_object(&voice);
+		return;
+	}
+
+	m = av_storage_add(av_modem_new_lean(g_steal_pointer(&ctx->modem)));
+	if (voice)
+		avmodem_set_mmmodemvoice(m, voice);
+
+	if (!av_mm_modem_register(m))
+		g_print("%s added in %" G_GINT64_FORMAT " ms\n",ctx->path,(g_get_monotonic_time() - ctx->start)/1000);
+}
+
+static void av_mm_lean_voice_ready(GObject *source, GAsyncResult *res, gpointer user_data) {
+	struct av_mm_lean_ctx *ctx = user_data;
+	GError *e = NULL;
+	GObject *voice;
+	AvModem *m;
+
+	voice = g_async_initable_new_finish(G_ASYNC_INITABLE(source), res, &e);
+	av_utils_async_end(NULL);
+
+	if (av_mm_lean_ctx_stale(ctx)) {
+		g_clear_object(&voice);
+		g_clear_error(&e);
+		av_mm_lean_ctx_free(ctx);
+		return;
+	}
+
+	if (!voice) {
+		g_printerr("No MMModemVoice object for %s\n",ctx->path);
+		av_utils_print_gerror(&e);
+	}
+
+	/* A new modem, with or without voice. */
+	if (ctx->modem) {
+		av_mm_lean_add(ctx, voice ? MM_MODEM_VOICE(voice) : NULL);
+		av_mm_lean_ctx_free(ctx);
+		return;
+	}
+
+	/* Voice service of a modem we know: there's nothing to attach to before. */
+	m = av_storage_find_path(ctx->path);
+	if (voice && m && !avmodem_get_mmmodemvoice(m)) {
+		avmodem_set_mmmodemvoice(m, MM_MODEM_VOICE(voice));
+		if (mm_modem_get_state(avmodem_get_mmmodem(m)) == MM_MODEM_STATE_REGISTERED)
+			av_mm_voice_init(m);
+	}
+	else
+		g_clear_object(&voice);
+
+	av_mm_lean_ctx_free(ctx);
+}
+
+static void av_mm_lean_modem_ready(GObject *source, GAsyncResult *res, gpointer user_data) {
+	struct av_mm_lean_ctx *ctx = user_data;
+	GError *e = NULL;
+	GObject *modem;
+
+	modem = g_async_initable_new_finish(G_ASYNC_INITABLE(source), res, &e);
+	av_utils_async_end(NULL);
+
+	if (av_mm_lean_ctx_stale(ctx)) {
+		g_clear_object(&modem);
+		g_clear_error(&e);
+		av_mm_lean_ctx_free(ctx);
+		return;
+	}
+
+	if (!modem) {
+		g_printerr("No MMModem object for %s\n",ctx->path);
+		av_utils_print_gerror(&e);
+		av_mm_lean_ctx_free(ctx);
+		return;
+	}
+
+	ctx->modem = MM_MODEM(modem);
+
+	if (ctx->voice) {
+		av_mm_lean_proxy_new(MM_TYPE_MODEM_VOICE, MM_DBUS_INTERFACE_MODEM_VOICE, ctx, av_mm_lean_voice_ready);
+		return;
+	}
+
+	av_mm_lean_add(ctx, NULL);
+	av_mm_lean_ctx_free(ctx);
+}
+
+/*
+ * Interfaces of an object showed up: a new modem (its voice service comes
+ * along, if any), or the voice service of a modem we know, which MM only
+ * exports once the modem is enabled.
+ *
+ * Returns: the context of what's being set up, NULL if nothing is.
+*/
+static struct av_mm_lean_ctx *av_mm_lean_object(const gchar *path, GVariant *interfaces) {
+	struct av_mm_lean_ctx *ctx = NULL;
+	gboolean has_modem;
+	gboolean has_voice;
+	GVariant *v;
+	AvModem *m;
+
+	if ( (v = g_variant_lookup_value(interfaces, MM_DBUS_INTERFACE_MODEM, NULL)) )
+		g_variant_unref(v);
+	has_modem = (v != NULL);
+
+	if ( (v = g_variant_lookup_value(interfaces, MM_DBUS_INTERFACE_MODEM_VOICE, NULL)) )
+		g_variant_unref(v);
+	has_voice = (v != NULL);
+
+	m = av_storage_find_path(path);
+	if (!m && has_modem) {
+		ctx = av_mm_lean_ctx_new(path, has_voice);
+		av_mm_lean_proxy_new(MM_TYPE_MODEM, MM_DBUS_INTERFACE_MODEM, ctx, av_mm_lean_modem_ready);
+	}
+	else if (m && has_voice && !avmodem_get_mmmodemvoice(m)) {
+		ctx = av_mm_lean_ctx_new(path, TRUE);
+		av_mm_lean_proxy_new(MM_TYPE_MODEM_VOICE, MM_DBUS_INTERFACE_MODEM_VOICE, ctx, av_mm_lean_voice_ready);
+	}
+
+	return ctx;
+}
+
+static void av_mm_lean_interfaces_added(GDBusConnection *connection,
+	const gchar *sender_name,
+	const gchar *object_path,
+	const gchar *interface_name,
+	const gchar *signal_name,
+	GVariant *parameters,
+	gpointer user_data) {
+	const gchar *path;
+	GVariant *interfaces;
+
+	g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &interfaces);
+	av_mm_lean_object(path, interfaces);
+	g_variant_unref(interfaces);
+}
+
+static void av_mm_lean_interfaces_removed(GDBusConnection *connection,
+	const gchar *sender_name,
+	const gchar *object_path,
+	const gchar *interface_name,
+	const gchar *signal_name,
+	GVariant *parameters,
+	gpointer user_data) {
+	const gchar *path;
+	const gchar **interfaces;
+	AvModem *m;
+
+	g_variant_get(parameters, "(&o^a&s)", &path, &interfaces);
+
+	m = av_storage_find_path(path);
+	if (m && g_strv_contains(interfaces, MM_DBUS_INTERFACE_MODEM)) {
+		g_print("%s is gone\n",path);
+		av_storage_remove_path(path);
+	}
+	else if (m && g_strv_contains(interfaces, MM_DBUS_INTERFACE_MODEM_VOICE)) {
+		g_print("Voice service of %s is gone\n",path);
+		av_mm_voice_deinit(m);
+		avmodem_set_mmmodemvoice(m, NULL);
+	}
+
+	g_free(interfaces);
+}
+
+/* Modems MM has when it shows up, in a single round trip. */
+static void av_mm_lean_listed(GObject *source, GAsyncResult *res, gpointer user_data) {
+	struct av_mm_lean_ctx *ctx;
+	GVariantIter *iter;
+	GVariant *interfaces;
+	GVariant *reply;
+	GError *e = NULL;
+	const gchar *path;
+	guint n = 0;
+
+	reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &e);
+	av_utils_async_end(NULL);
+
+	if (!ll->lean.active || (GPOINTER_TO_UINT(user_data) != ll->lean.generation)) {
+		g_clear_pointer(&reply, g_variant_unref);
+		g_clear_error(&e);
+		return;
+	}
+
+	if (!reply) {
+		av_utils_print_gerror(&e);
+		return;
+	}
+
+	g_variant_get(reply, "(a{oa{sa{sv}}})", &iter);
+	while (g_variant_iter_next(iter, "{&o@a{sa{sv}}}", &path, &interfaces)) {
+		if ( (ctx = av_mm_lean_object(path, interfaces)) ) {
+			ctx->listing = TRUE;
+			ll->lean.n_listing++;
+			n++;
+		}
+		g_variant_unref(interfaces);
+	}
+	g_variant_iter_free(iter);
+	g_variant_unref(reply);
+
+	if (!n)
+		g_printerr("No modems\n");
+
+	ll->lean.listed = TRUE;
+	av_mm_lean_listing_check();
+}
+
+/* MM showed up: learns about its modems, and keeps doing so. */
+void av_mm_lean_init(void) {
+	struct av_mm_lean *lean = &ll->lean;
+
+	g_print("Lean MM watching\n");
+
+	lean->active = TRUE;
+	lean->n_listing = 0;
+	lean->listed = FALSE;
+
+	/* Before listing, not to miss anything: modems seen twice are told apart by path. */
+	lean->interfaces_added = g_dbus_connection_signal_subscribe(ll->dbus_connection,
+		MM_DBUS_SERVICE,
+		AV_MM_LEAN_OBJECT_MANAGER,
+		"InterfacesAdded",
+		MM_DBUS_PATH,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		av_mm_lean_interfaces_added,
+		NULL,
+		NULL);
+	lean->interfaces_removed = g_dbus_connection_signal_subscribe(ll->dbus_connection,
+		MM_DBUS_SERVICE,
+		AV_MM_LEAN_OBJECT_MANAGER,
+		"InterfacesRemoved",
+		MM_DBUS_PATH,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		av_mm_lean_interfaces_removed,
+		NULL,
+		NULL);
+
+	av_utils_async_start(NULL);
+	g_dbus_connection_call(ll->dbus_connection,
+		MM_DBUS_SERVICE,
+		MM_DBUS_PATH,
+		AV_MM_LEAN_OBJECT_MANAGER,
+		"GetManagedObjects",
+		NULL,
+		G_VARIANT_TYPE("(a{oa{sa{sv}}})"),
+		G_DBUS_CALL_FLAGS_NO_AUTO_START,
+		-1,
+		NULL,
+		av_mm_lean_listed,
+		GUINT_TO_POINTER(lean->generation));
+}
+
+/* MM is gone, or we are: whatever is still being set up is dropped when done. */
+void av_mm_lean_deinit(void) {
+	struct av_mm_lean *lean = &ll->lean;
+
+	if (!lean->active)
+		return;
+
+	if (lean->interfaces_added)
+		g_dbus_connection_signal_unsubscribe(ll->dbus_connection, lean->interfaces_added);
+	if (lean->interfaces_removed)
+		g_dbus_connection_signal_unsubscribe(ll->dbus_connection, lean->interfaces_removed);
+	lean->interfaces_added = 0;
+	lean->interfaces_removed = 0;
+
+	lean->active = FALSE;
+	lean->generation++;
+
+	g_print("Lean MM watching stopped\n");
+}
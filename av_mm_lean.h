@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_mm_lean_h__
+#define __av_mm_lean_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* Lean ModemManager watching: see av_mm_lean.c. */
+struct av_mm_lean {
+	gboolean enabled;
+	gboolean active;
+
+	/* Bumped when MM goes away: async operations of older ones are stale. */
+	guint generation;
+
+	/* Object manager signal subscriptions */
+	guint interfaces_added;
+	guint interfaces_removed;
+
+	/* Modems of the initial listing still being set up, and whether it's done. */
+	guint n_listing;
+	gboolean listed;
+};
+
+void av_mm_lean_init(void);
+void av_mm_lean_deinit(void);
+
+#endif
@@ -11,10 +11,11 @@
 #include <av_utils.h>
 #include <av_storage.h>
 #include <av_mm_modem.h>
+#include <av_startup.h>
 
 /*
  * Given a MMObject, this function:
- * - gets an AvModem object via av_storage_add_mmobject()
+ * - gets an AvModem object, added via av_storage_add()
  * - registers it via av_mm_modem_register
  *
  * Parameters:
@@ -33,13 +34,13 @@
 static gint av_mm_manager_addmodem(MMObject *object) {
 	AvModem *m;
 
-	m = av_storage_find_mmobject(object);
+	m = av_storage_find_path(mm_object_get_path(object));
 	if (m) {
 		g_printerr("BUG - a (probably) stale object has been found\n");
 		return 1;
 	}
 
-	m = av_storage_add_mmobject(object);
+	m = av_storage_add(av_modem_new(object));
 	if (av_mm_modem_register(m)) {
 		g_printerr("Unable to get MMModem object\n");
 		return 1;
@@ -69,7 +70,7 @@ static void av_mm_manager_modem_added(MMManager *manager, MMObject *object, gpoi
 
 /*
  * This is the GSignal c_handler invoked when a modem object (MMObject) is
- * removed. We call av_storage_remove_avmodem() that drops a reference of the AVModem object for this MMObject.
+ * removed. We call av_storage_remove_path() that drops a reference of the AVModem object for this MMObject.
  *
  * Parameters:
  * - the object manager from ModemManager
@@ -80,7 +81,7 @@ static void av_mm_manager_modem_added(MMManager *manager, MMObject *object, gpoi
 static void av_mm_manager_modem_removed(MMManager *manager, MMObject *object, gpointer user_data) {
 	AvModem *m;
 
-	m = av_storage_find_mmobject(object);
+	m = av_storage_find_path(mm_object_get_path(object));
 	if (!m) {
 		g_printerr("BUG - can not find object for %s\n",mm_object_get_path(object));
 		return;
@@ -88,7 +89,7 @@ static void av_mm_manager_modem_removed(MMManager *manager, MMObject *object, gp
 
 	g_print("%s is gone\n",mm_object_get_path(object));
 
-	if (av_storage_remove_avmodem(object)) {
+	if (av_storage_remove_path(mm_object_get_path(object))) {
 		g_printerr("BUG - storage can not remove %s\n",mm_object_get_path(object));
 		return;
 	}
@@ -207,6 +208,7 @@ static void av_mm_manager_init_finish(GDBusConnection *c, GAsyncResult *res, gpo
 
 	/* list all present modems and register them */
 	av_mm_manager_get_modems();
+	av_startup_mark(AV_STARTUP_MANAGER);
 
 	return;
 }
@@ -11,6 +11,10 @@
 #include <av_gobjects.h>
 #include <av_storage.h>
 #include <av_mm_voice.h>
+#include <av_mm_modem.h>
+#include <av_thread.h>
+#include <av_threadcomm.h>
+#include <av_sip.h>
 
 /*
  * GSignal c_handler invoked when a modem changes it's state.
@@ -31,6 +35,28 @@ static void av_mm_modem_statechange(MMModem *modem,
 	return;
 }
 
+/*
+ * Tells the SIP reactor how good the signal of a modem is, for the pool of
+ * its line to route calls by it.
+*/
+void av_mm_modem_signal_notify_sip(AvModem *m) {
+	struct av_thread_cmd *cmd;
+	MMModem *modem;
+	gint line;
+
+	modem = avmodem_get_mmmodem(m);
+	line = avmodem_get_sip_line(m);
+	if ( modem && (line >= 0) && ll->sipthread && (cmd = av_thread_cmd_str(SIP_CMD_LINE_SIGNAL, mm_modem_get_signal_quality(modem, NULL), NULL)) ) {
+		cmd->line = line;
+		av_thread_txcmd(ll->sipthread, cmd, 0);
+	}
+}
+
+/* GSignal c_handler invoked when the signal quality of a modem changes. */
+static void av_mm_modem_signal_quality(MMModem *modem, GParamSpec *pspec, AvModem *m) {
+	av_mm_modem_signal_notify_sip(m);
+}
+
 /*
  * Disconnects, and optionally re-connects, GSignals handlers. GSignals
  * handlers IDs stored in the passed AvModem object are updated accordingly.
@@ -60,6 +86,10 @@ static guint av_mm_modem_gsignals(AvModem *m, gboolean connect_signals) {
 		m);
 	avmodem_set_mmmodem_signal_statechange(m, 0);
 
+	n_handlers = n_handlers + g_signal_handlers_disconnect_by_func(modem,
+		av_mm_modem_signal_quality,
+		m);
+
 	if (connect_signals) {
 		statechange_gsignal = g_signal_connect(modem, /* instance */
 			"state-changed",                            /* detailed_signal */
@@ -70,6 +100,9 @@ static guint av_mm_modem_gsignals(AvModem *m, gboolean connect_signals) {
 		else
 			avmodem_set_mmmodem_signal_statechange(m, statechange_gsignal);
 
+		if (!g_signal_connect(modem, "notify::signal-quality", G_CALLBACK(av_mm_modem_signal_quality), m))
+			g_printerr("Unable to connect signal quality notifications to %s\n",mm_modem_get_path(modem));
+
 	}
 
 	return n_handlers;
@@ -93,7 +126,7 @@ gint av_mm_modem_register(AvModem *m) {
 	/* get a MMModem object for this AvModem object (not guaranteed to exist) */
 	modem = avmodem_get_mmmodem(m);
 	if (!modem) {
-		g_printerr("Unable to obtain MMModem object for %s\n",mm_object_get_path(avmodem_get_mmobject(m)));
+		g_printerr("Unable to obtain MMModem object for %s\n",avmodem_get_path(m));
 		return 1;
 	}
 
@@ -12,4 +12,7 @@
 gint av_mm_modem_register(AvModem *m);
 gint av_mm_modem_unregister(AvModem *m);
 
+/* lets the SIP reactor know about the signal quality of a modem */
+void av_mm_modem_signal_notify_sip(AvModem *m);
+
 #endif
@@ -6,12 +6,13 @@
  *   notified about MMCall objects additions and removals.
  * - invoked the code responsible for audio calls tracking and management.
  *
- * The code is a little bit more convoluted due to the fact that signal
- * handlers for voice calls objects additions/removals, give us only the object
- * path. Subsequently, each time a MMCall object is added, we search for the
- * corresponding object in ModemManager's calls list, via libmm-glib of course.
- * When a MMCall object is removed instead, we check for the corresponding
- * MMCall object in a GList of MMCall objects we maintain, to unref it.
+ * Signal handlers for voice calls objects additions/removals give us only the
+ * object path. When a call is added, we build the MMCall proxy for that path
+ * ourselves: one D-Bus round-trip (its properties), however many calls the
+ * modem has. libmm-glib's calls list would build a proxy for each of them,
+ * only for us to throw all but one away. When a call is removed, we just
+ * look it up among the MMCall objects we keep, to unref it: ModemManager has
+ * nothing to tell us about it anymore.
 */
 
 /* GLib2 headers */
@@ -28,6 +29,8 @@
 #include <av_threadcomm.h>
 #include <av_sip.h>
 #include <av_config.h>
+#include <av_mm_modem.h>
+#include <av_startup.h>
 
 /*
  * This data structure has been created to solve the problem of going from a
@@ -38,23 +41,28 @@ struct MMCall_ctx {
 	/* This is the AvModem object we are working with... */
 	AvModem *avm;
 
-	/* Object path of the MMCall object we are searching. */
+	/* Object path of the MMCall object we are building. */
 	gchar *object_path;
 
-	/* Was the call added (TRUE) or removed (FALSE). */
-	gboolean added;
+	/* When the call was signalled (monotonic time). */
+	gint64 start;
 };
 
+/* Proxy creation statistics since startup. */
+static struct {
+	guint n_calls;
+	gint64 total;
+	gint64 max;
+} av_mm_voice_call_stats;
+
 /*
  * Allocates a MMCall_ctx structure, given the data needed to do so as input.
  *
  * Parameters:
- * - AvModem object for which we are searching calls (in case of additions) or
- *   our a MMCall object to unregister (in case of removals).
+ * - AvModem object the call was added to
  * - object path of the MMCall object
- * - a gboolean: is the call being added? If not, it's being removed.
 */
-static struct MMCall_ctx *MMCall_ctx_alloc(AvModem *m, const gchar *object_path, gboolean added) {
+static struct MMCall_ctx *MMCall_ctx_alloc(AvModem *m, const gchar *object_path) {
 	struct MMCall_ctx *callctx;
 
 	callctx = g_try_malloc0(sizeof *callctx);
@@ -63,7 +71,7 @@ static struct MMCall_ctx *MMCall_ctx_alloc(AvModem *m, const gchar *object_path,
 
 	callctx->avm = m;
 	callctx->object_path = g_strdup(object_path);
-	callctx->added = added;
+	callctx->start = g_get_monotonic_time();
 
 	return callctx;
 }
@@ -85,28 +93,24 @@ static void MMCall_ctx_free(struct MMCall_ctx *ctx) {
 }
 
 /* Forward declaration, as suggested by GLib docs... */
-static void av_mm_voice_find_call_list_ready(MMModemVoice *v, GAsyncResult *res, struct MMCall_ctx *callcontext);
+static void av_mm_voice_call_ready(GObject *source, GAsyncResult *res, struct MMCall_ctx *callcontext);
 
 /*
-* As suggested by its name, this function has the purpose of "finding calls",
- * that is is - finding MMCall objects. both in the ModemManager calls list for
- * a modem (MMCall objects are being added) or on our own MMCalls GList
- * (removals). As you can guess, this is only the first chunk of this function.
- * the second part, follows when async operation is completed.
+ * Builds the MMCall proxy for a call that was just added, the way libmm-glib
+ * does it for each call of its calls list: same bus connection as the voice
+ * interface, properties fetched on initialization. The second part follows
+ * when the async operation is completed.
  *
  * Parameters:
  * - the AvModem object to which the event is related
  * - the MMModemVoice object who generated the event itself
  * - the object path of the MMCall object to which the event relates
 */
-static void av_mm_voice_find_call(AvModem *m, MMModemVoice *v, const gchar *object_path, gboolean added) {
+static void av_mm_voice_new_call(AvModem *m, MMModemVoice *v, const gchar *object_path) {
 	struct MMCall_ctx *callcontext;
 
 	/* <Boris> ... come Durok! </Boris> */
-	callcontext = MMCall_ctx_alloc(
-		m,
-		object_path,
-		added);
+	callcontext = MMCall_ctx_alloc(m, object_path);
 
 	if (!callcontext) {
 		g_print("Failure when allocating temporary call context structure\n");
@@ -117,63 +121,57 @@ static void av_mm_voice_find_call(AvModem *m, MMModemVoice *v, const gchar *obje
 	/* Starts async operation, taking an extra reference to avoid the AvModem object
 	   going away, should e.g.: the modem do so. */
 	av_utils_async_start(G_OBJECT(m));
-	mm_modem_voice_list_calls(v,
+	g_async_initable_new_async(MM_TYPE_CALL,
+		G_PRIORITY_DEFAULT,
 		NULL,
-		(GAsyncReadyCallback)av_mm_voice_find_call_list_ready,
-		callcontext);
+		(GAsyncReadyCallback)av_mm_voice_call_ready,
+		callcontext,
+		"g-flags", G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+		"g-name", MM_DBUS_SERVICE,
+		"g-connection", g_dbus_proxy_get_connection(G_DBUS_PROXY(v)),
+		"g-object-path", object_path,
+		"g-interface-name", MM_DBUS_INTERFACE_CALL,
+		NULL);
 
 	return;
 }
 
 /*
- * This function continues what av_mm_voice_find_call() started. the logic here
- * maybe a little bit convoluted. A consideration that may help is:
- * - when a call is added, it is expected to be present in ModemManager's calls
- *   list for a specified modem.
- * - when a call goes away, it is not expected to be there
- * - when last call is removed, no GList will be provided.
- *
- * Or, since NULL is a valid GList, an empty list is provided to caller.
+ * This function continues what av_mm_voice_new_call() started: the new proxy
+ * is handed over to av_mm_call_register(), along with its reference. Unless
+ * the modem stopped caring about calls meanwhile.
 */
-static void av_mm_voice_find_call_list_ready(MMModemVoice *v, GAsyncResult *res, struct MMCall_ctx *callcontext) {
-	GList *calls_list;
+static void av_mm_voice_call_ready(GObject *source, GAsyncResult *res, struct MMCall_ctx *callcontext) {
 	GError *e = NULL;
-	MMCall *current_call = NULL;
-
-	calls_list = mm_modem_voice_list_calls_finish(v, res, &e);
+	GObject *call;
+	gint64 elapsed;
 
-	/* if given GList is empty, no error will be printed */
-	if (!calls_list)
+	call = g_async_initable_new_finish(G_ASYNC_INITABLE(source), res, &e);
+	if (!call) {
+		g_printerr("No MMCall object for %s\n",callcontext->object_path);
 		av_utils_print_gerror(&e);
-
-	/*
-	 * When a call is added, then we expect to find it in the calls list.
-	 * However, when a call is being removed, this will not happen. So, we avoid
-	 * searching at all, and proceed with unregistration without an object.
-	*/
-	if (callcontext->added) {
-		/* if a call was added but we have no list, terminate the program */
-		g_assert(calls_list);
-		current_call = av_utils_mm_call_search(calls_list, callcontext->object_path);
-
-		if (current_call)
-			av_mm_call_register(callcontext->avm, g_object_ref(current_call));
-
+	}
+	else if (!avmodem_get_mmmodemvoice_signal_call_added(callcontext->avm)) {
+		g_print("Voice service of the modem went away, dropping %s\n",callcontext->object_path);
+		g_object_unref(call);
 	}
 	else {
-		/* MMCall object being removed */
-		av_mm_call_unregister(callcontext->avm, callcontext->object_path);
+		elapsed = g_get_monotonic_time() - callcontext->start;
+		av_mm_voice_call_stats.n_calls++;
+		av_mm_voice_call_stats.total += elapsed;
+		if (elapsed > av_mm_voice_call_stats.max)
+			av_mm_voice_call_stats.max = elapsed;
+
+		g_print("MMCall object for %s ready in %" G_GINT64_FORMAT " ms (average %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms over %u)\n",
+			callcontext->object_path, elapsed/1000, av_mm_voice_call_stats.total/av_mm_voice_call_stats.n_calls/1000,
+			av_mm_voice_call_stats.max/1000, av_mm_voice_call_stats.n_calls);
+
+		av_mm_call_register(callcontext->avm, MM_CALL(call));
 	}
 
 	av_utils_async_end(G_OBJECT(callcontext->avm));
 	MMCall_ctx_free(callcontext);
 
-	/*
-	 * If the call was added, we add an extra reference to it in the process of passing it to av_mm_call_register.
-	 * Thus, our object will survive.
-	*/
-	g_list_free_full(calls_list, g_object_unref);
-
 	return;
 }
 
@@ -182,15 +180,16 @@ static void av_mm_voice_find_call_list_ready(MMModemVoice *v, GAsyncResult *res,
 static void av_mm_voice_call_added(MMModemVoice *voice, const gchar *object_path, AvModem *m) {
 	g_print("Modem %s got call %s\n",mm_modem_voice_get_path(voice),object_path);
 
-	av_mm_voice_find_call(m, voice, object_path, TRUE);
+	av_mm_voice_new_call(m, voice, object_path);
 
 	return;
 }
 
+/* MMCall object being removed: nothing to ask ModemManager. */
 static void av_mm_voice_call_deleted(MMModemVoice *voice, const gchar *object_path, AvModem *m) {
 	g_print("Call %s was removed from %s\n",object_path,mm_modem_voice_get_path(voice));
 
-	av_mm_voice_find_call(m, voice, object_path, FALSE);
+	av_mm_call_unregister(m, object_path);
 
 	return;
 }
@@ -241,18 +240,21 @@ static guint av_mm_voice_gsignals(AvModem *m, gboolean connect) {
 static void av_mm_voice_send_sip_config(AvModem *m) {
 	struct av_modem_config *mc;
 	struct av_thread_cmd *config_data;
-	struct av_thread *sipthread;
 
 	mc = av_config_parse(m);
-	if (!mc)
+	if (!mc) {
+		/* Nothing to wait for at startup. */
+		av_startup_line_up(avmodem_get_sip_line(m), FALSE);
 		return;
-
-	sipthread = avmodem_get_sipthread(m);
+	}
 
 	config_data = av_thread_cmd(SIP_CMD_REGISTER, mc);
 	if (config_data) {
-		av_thread_txcmd(sipthread, config_data, 0);
-		g_clear_pointer(&config_data, g_free);
+		config_data->line = avmodem_get_sip_line(m);
+		av_thread_txcmd(ll->sipthread, config_data, 0);
+
+		/* Later changes are notified: see av_mm_modem.c. */
+		av_mm_modem_signal_notify_sip(m);
 	}
 	else {
 		g_printerr("Failure while allocating config data\n");
@@ -261,37 +263,104 @@ static void av_mm_voice_send_sip_config(AvModem *m) {
 
 }
 
-static gboolean av_mm_voice_process_sip_event(AvModem *m) {
+/*
+ * The configuration was reloaded: the line of a modem whose settings changed
+ * gets the new ones (none if its section went away, the line then stays
+ * unregistered), and NULL stands for reactor-wide settings. The reactor
+ * applies them once the line has no call going on.
+*/
+void av_mm_voice_config_changed(const gchar *equipment_id) {
+	struct av_modem_config *mc = NULL;
+	struct av_thread_cmd *cmd;
+	AvModem *m;
+
+	if (!ll->sip_ready)
+		return;
+
+	if (!equipment_id) {
+		if ( (cmd = av_thread_cmd(SIP_CMD_RELOAD, NULL)) )
+			av_thread_txcmd(ll->sipthread, cmd, 0);
+		return;
+	}
+
+	m = av_storage_find_equipment_id(equipment_id);
+	if (!m || (avmodem_get_sip_line(m) < 0))
+		return;
+
+	mc = av_config_parse(m);
+
+	cmd = av_thread_cmd(SIP_CMD_LINE_RECONFIGURE, mc);
+	if (!cmd) {
+		g_printerr("Failure while allocating config data\n");
+		av_config_free(&mc);
+		return;
+	}
+
+	cmd->line = avmodem_get_sip_line(m);
+	av_thread_txcmd(ll->sipthread, cmd, 0);
+
+	if (mc)
+		av_mm_modem_signal_notify_sip(m);
+}
+
+/*
+ * Events from the SIP reactor. Those about a line whose modem went away are
+ * dropped: the reactor will forget about the line soon.
+*/
+static gboolean av_mm_voice_process_sip_event(void) {
 	struct av_thread_cmd *cmd;
-	struct av_thread *sipthread;
+	struct av_sip_line_slot *slot;
+	int i;
+
+	while ( (cmd = av_thread_rxcmd(ll->sipthread, 0)) ) {
+		slot = ((cmd->line >= 0) && (cmd->line < AV_SIP_MAX_LINES)) ? &ll->sip_lines[cmd->line] : NULL;
 
-	sipthread = avmodem_get_sipthread(m);
-	if ( (cmd = av_thread_rxcmd(sipthread, 0)) ) {
 		switch(cmd->msgtype) {
 			case SIP_EVENT_READY:
 				g_print("Sending SIP config...\n");
-				av_mm_voice_send_sip_config(m);
+				ll->sip_ready = TRUE;
+				for (i = 0; i < AV_SIP_MAX_LINES; i++)
+					if (ll->sip_lines[i].m)
+						av_mm_voice_send_sip_config(ll->sip_lines[i].m);
+				av_startup_mark(AV_STARTUP_SIP);
+				break;
+			case SIP_EVENT_LINE_REGISTERED:
+				av_startup_line_up(cmd->line, cmd->arg);
+				break;
+			case SIP_EVENT_LINE_REMOVED:
+				if (slot && !slot->m)
+					slot->in_use = FALSE;
 				break;
 			case SIP_EVENT_INCOMING_CALL:
-				av_mm_call_sipcall(m, cmd->payload);
-				g_clear_pointer(&cmd->payload, g_free);
+				if (slot && slot->m)
+					av_mm_call_sipcall(slot->m, cmd->arg, cmd->data);
+				break;
+			case SIP_EVENT_CALL_ENDED:
+				if (slot && slot->m)
+					av_mm_call_hangup(slot->m, cmd->data);
+				break;
+			case SIP_EVENT_CALL_SWAP:
+				if (slot && slot->m)
+					av_mm_call_swap(slot->m);
+				break;
+			case SIP_EVENT_CALL_ACCEPT:
+				if (slot && slot->m)
+					av_mm_call_accept(slot->m, cmd->data);
 				break;
 			default:
 				g_print("Unknown event %d received!\n",cmd->msgtype);
 		}
-	}
 
-	g_clear_pointer(&cmd, g_free);
+		g_clear_pointer(&cmd, av_thread_cmd_free);
+	}
 
 	return TRUE;
 }
 
 static gboolean av_mm_voice_process_sip_event_msg(GIOChannel *channel, GIOCondition condition, gpointer data) {
-	AvModem *m = AV_MODEM(data);
-
 	switch(condition) {
 		case G_IO_IN:
-			return av_mm_voice_process_sip_event(m);
+			return av_mm_voice_process_sip_event();
 		case G_IO_PRI:
 		case G_IO_ERR:
 		case G_IO_NVAL:
@@ -304,41 +373,36 @@ static gboolean av_mm_voice_process_sip_event_msg(GIOChannel *channel, GIOCondit
 	return TRUE;
 }
 
-static void av_mm_voice_stop_sip_eventchannel(AvModem *m) {
-	guint id;
-	GIOChannel *c;
+static void av_mm_voice_stop_sip_eventchannel(void) {
 	GSource *src;
 
-	id = avmodem_get_sip_GIOchannel_gsource_id(m);
-	if (id) {
-		src = g_main_context_find_source_by_id(NULL, id);
+	if (ll->sip_giochannel_watch_id) {
+		src = g_main_context_find_source_by_id(g_main_context_get_thread_default(), ll->sip_giochannel_watch_id);
 		if (src)
 			g_source_destroy(src);
 		else
 			g_printerr("Failure while destroying SIP events channel processing source\n");
 
-		avmodem_set_sip_GIOchannel_gsource_id(m, 0);
+		ll->sip_giochannel_watch_id = 0;
 	}
 
-	c = avmodem_get_sip_GIOchannel(m);
-	if (c) {
-		g_io_channel_unref(c);
-		avmodem_set_sip_GIOchannel(m, NULL);
-	}
+	g_clear_pointer(&ll->sip_giochannel, g_io_channel_unref);
 }
 
-static void av_mm_voice_start_sip_eventchannel(AvModem *m) {
+/*
+ * SIP events are watched on the MM thread context, at a higher priority than
+ * D-Bus traffic: a burst of ModemManager signals won't hold up call setup.
+*/
+static void av_mm_voice_start_sip_eventchannel(void) {
 	GIOChannel *c;
-	struct av_thread *t;
+	GSource *src;
 	GError *e = NULL;
-	guint id;
 
 	/*
 	 * This function won't fail, and we already know our thread and related FDs are ok if we reach here.
 	*/
-	t = avmodem_get_sipthread(m);
-	c = g_io_channel_unix_new(t->sockets[0]);
-	avmodem_set_sip_GIOchannel(m, c);
+	c = g_io_channel_unix_new(av_thread_eventfd(ll->sipthread, 0));
+	ll->sip_giochannel = c;
 
 	/*
 	 * The FD will get closed in av_thread_teardown, so make sure it's not closed on channel unref.
@@ -348,49 +412,114 @@ static void av_mm_voice_start_sip_eventchannel(AvModem *m) {
 	g_io_channel_set_close_on_unref(c, FALSE);
 	if (g_io_channel_set_encoding(c, NULL, &e) != G_IO_STATUS_NORMAL) {
 		av_utils_print_gerror(&e);
-		av_mm_voice_stop_sip_eventchannel(m);
+		av_mm_voice_stop_sip_eventchannel();
 		return;
 	}
 
-	id = g_io_add_watch(c, G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_NVAL | G_IO_HUP, av_mm_voice_process_sip_event_msg, m);
-	if (!id) {
+	src = g_io_create_watch(c, G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_NVAL | G_IO_HUP);
+	g_source_set_callback(src, G_SOURCE_FUNC(av_mm_voice_process_sip_event_msg), NULL, NULL);
+	g_source_set_priority(src, G_PRIORITY_HIGH);
+	ll->sip_giochannel_watch_id = g_source_attach(src, g_main_context_get_thread_default());
+	g_source_unref(src);
+	if (!ll->sip_giochannel_watch_id) {
 		g_printerr("Failure adding IO watch\n");
-		av_mm_voice_stop_sip_eventchannel(m);
+		av_mm_voice_stop_sip_eventchannel();
 	}
+}
+
+/*
+ * Starts the SIP reactor, if it's not running. At startup this is done right
+ * away, while we're still waiting for the bus and ModemManager, so that it's
+ * ready by the time modems are.
+ *
+ * Returns: non-zero on failure.
+*/
+gint av_mm_voice_sip_start(void) {
+	if (ll->sipthread)
+		return 0;
+
+	ll->sipthread = av_thread_setup("SIPStack", av_sip_init);
+	if (!ll->sipthread)
+		return 1;
+
+	av_mm_voice_start_sip_eventchannel();
 
-	avmodem_set_sip_GIOchannel_gsource_id(m, id);
+	return 0;
+}
+
+/* Stops the SIP reactor: lines it didn't confirm are gone along with it. */
+void av_mm_voice_sip_stop(void) {
+	struct av_thread_cmd *cmd;
+
+	if (!ll->sipthread)
+		return;
+
+	av_mm_voice_stop_sip_eventchannel();
+
+	if ( (cmd = av_thread_cmd(SIP_CMD_EXIT, NULL)) ) {
+		av_thread_txcmd(ll->sipthread, cmd, 0);
+		g_clear_pointer(&ll->sipthread, av_thread_teardown);
+	}
+
+	memset(ll->sip_lines, 0, sizeof ll->sip_lines);
+	ll->sip_ready = FALSE;
 }
 
+/*
+ * Gives a modem a line of the SIP reactor, starting the reactor itself if
+ * needed. All modems share the reactor thread, its eXosip context and its
+ * socket.
+*/
 static void av_mm_voice_startsip(AvModem *m) {
-	struct av_thread *sipthread;
+	int i;
+
+	for (i = 0; (i < AV_SIP_MAX_LINES) && ll->sip_lines[i].in_use; i++);
+	if (i == AV_SIP_MAX_LINES) {
+		g_printerr("No SIP line left for %s\n",avmodem_get_path(m));
+		return;
+	}
 
-	/* Starts up the SIP thread for this modem. */
-	sipthread = av_thread_setup("SIPStack", av_sip_init);
-	if (!sipthread)
+	if (av_mm_voice_sip_start())
 		return;
 
-	avmodem_set_sipthread(m, sipthread);
+	memset(&ll->sip_lines[i], 0, sizeof ll->sip_lines[i]);
+	ll->sip_lines[i].in_use = TRUE;
+	ll->sip_lines[i].m = m;
+	avmodem_set_sip_line(m, i);
 
-	av_mm_voice_start_sip_eventchannel(m);
+	/* Otherwise, configuration is sent when the reactor is ready. */
+	if (ll->sip_ready)
+		av_mm_voice_send_sip_config(m);
 }
 
+/* Takes the line of a modem back, and stops the reactor along with the last line. */
 static void av_mm_voice_stopsip(AvModem *m) {
-	struct av_thread *sipthread;
-	struct av_thread_cmd *deinit_cmd;
+	struct av_thread_cmd *cmd;
+	gint line;
+	int i;
+
+	line = avmodem_get_sip_line(m);
+	if (line < 0)
+		return;
 
-	av_mm_voice_stop_sip_eventchannel(m);
+	avmodem_set_sip_line(m, -1);
+	ll->sip_lines[line].m = NULL;
 
-	sipthread = avmodem_get_sipthread(m);
-	if ( sipthread && (deinit_cmd = av_thread_cmd(0, NULL)) ) {
-		av_thread_txcmd(sipthread, deinit_cmd, 0);
-		av_thread_teardown(sipthread);
-		g_clear_pointer(&deinit_cmd, g_free);
+	if ( (cmd = av_thread_cmd(SIP_CMD_LINE_REMOVE, NULL)) ) {
+		cmd->line = line;
+		av_thread_txcmd(ll->sipthread, cmd, 0);
 	}
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		if (ll->sip_lines[i].m)
+			return;
+
+	av_mm_voice_sip_stop();
 }
 
 gint av_mm_voice_init(AvModem *m) {
 	MMModemVoice *voice;
-	const gchar *dbus_path = mm_object_get_path(avmodem_get_mmobject(m));
+	const gchar *dbus_path = avmodem_get_path(m);
 
 	voice = avmodem_get_mmmodemvoice(m);
 
@@ -407,7 +536,7 @@ gint av_mm_voice_init(AvModem *m) {
 
 	av_mm_voice_gsignals(m, TRUE);
 
-	/* Starts up the SIP thread. */
+	/* Gets a line of the SIP reactor. */
 	av_mm_voice_startsip(m);
 
 	return 0;
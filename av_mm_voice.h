@@ -8,5 +8,8 @@
 
 gint av_mm_voice_init(AvModem *m);
 gint av_mm_voice_deinit(AvModem *m);
+void av_mm_voice_config_changed(const gchar *equipment_id);
+gint av_mm_voice_sip_start(void);
+void av_mm_voice_sip_stop(void);
 
 #endif
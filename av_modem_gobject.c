@@ -9,7 +9,13 @@
 struct _AvModem {
 	GObject parent;
 
-	/* MMObject is guaranteed to exist when a modem exists */
+	/* D-Bus path of the modem */
+	gchar *path;
+
+	/*
+	 * MMObject from the object manager, if we use one: in lean mode (see
+	 * av_mm_lean.c) services below are proxies of their own instead.
+	*/
 	MMObject *object;
 
 	/* services (D-Bus interfaces), and the signals we are interested in */
@@ -27,24 +33,24 @@ struct _AvModem {
 	gulong voice_signal_call_added;
 	gulong voice_signal_call_deleted;
 
-	/* MMCall objects list for this modem */
-	GList *mmcalls;
+	/* MMCall objects of this modem, in the order they came, and their list links by path */
+	GQueue mmcalls;
+	GHashTable *mmcalls_by_path;
 
 	/* To keep track of active calls. */
 	gint active_calls_counter;
 
-	/* Thread handling SIP communications for this MMModemVoice object. */
-	struct av_thread *sipthread;
-
-	/* Communications with SIP stack thread. */
-	GIOChannel *voice_sip_giochannel;
-	guint voice_sip_giochannel_watch_id;
+	/* Line of the SIP reactor serving this MMModemVoice object, -1 if none. */
+	gint sip_line;
 };
 
 G_DEFINE_TYPE(AvModem, av_modem, G_TYPE_OBJECT)
 
 static void av_modem_init(AvModem *self) {
 	g_print("%s invoked\n",__FUNCTION__);
+	self->sip_line = -1;
+	g_queue_init(&self->mmcalls);
+	self->mmcalls_by_path = g_hash_table_new(g_str_hash, g_str_equal);
 }
 
 static void av_modem_dispose(GObject *gobject) {
@@ -62,8 +68,11 @@ static void av_modem_dispose(GObject *gobject) {
 }
 
 static void av_modem_finalize(GObject *gobject) {
+	AvModem *m = AV_MODEM(gobject);
 	g_print("%s invoked\n",__FUNCTION__);
-	/* e.g.: g_free for filename */
+	/* Calls were released along with the voice service. */
+	g_hash_table_destroy(m->mmcalls_by_path);
+	g_free(m->path);
 	G_OBJECT_CLASS (av_modem_parent_class)->finalize (gobject);
 }
 
@@ -77,6 +86,15 @@ static void av_modem_class_init(AvModemClass *klass) {
 AvModem *av_modem_new(MMObject *mmobject) {
 	AvModem *m = g_object_new(AV_TYPE_MODEM, NULL);
 	AV_MODEM(m)->object = g_object_ref(mmobject);
+	AV_MODEM(m)->path = g_strdup(mm_object_get_path(mmobject));
+	return m;
+}
+
+/* A modem without MMObject: its services get set instead. The modem takes the reference passed along. */
+AvModem *av_modem_new_lean(MMModem *modem) {
+	AvModem *m = g_object_new(AV_TYPE_MODEM, NULL);
+	AV_MODEM(m)->modem = modem;
+	AV_MODEM(m)->path = g_strdup(mm_modem_get_path(modem));
 	return m;
 }
 
@@ -84,9 +102,13 @@ MMObject *avmodem_get_mmobject(AvModem *m) {
 	return AV_MODEM(m)->object;
 }
 
+const gchar *avmodem_get_path(AvModem *m) {
+	return AV_MODEM(m)->path;
+}
+
 /* MMModem */
 MMModem *avmodem_get_mmmodem(AvModem *m) {
-	if (!m->modem)
+	if (!m->modem && m->object)
 		m->modem = mm_object_get_modem(m->object);
 
 	return m->modem;
@@ -103,13 +125,20 @@ AvModem *avmodem_set_mmmodem_signal_statechange(AvModem *m, gulong value) {
 
 /* MMModemVoice */
 MMModemVoice *avmodem_get_mmmodemvoice(AvModem *m) {
-	if (!m->voice) {
+	if (!m->voice && m->object) {
 		m->voice = mm_object_get_modem_voice(m->object);
 	}
 
 	return m->voice;
 }
 
+/* Lean mode only: the modem takes the reference passed along, NULL drops the current one. */
+AvModem *avmodem_set_mmmodemvoice(AvModem *m, MMModemVoice *v) {
+	g_clear_object(&m->voice);
+	m->voice = v;
+	return m;
+}
+
 gulong avmodem_get_mmmodemvoice_signal_call_added(AvModem *m) {
 	return m->voice_signal_call_added;
 }
@@ -128,47 +157,53 @@ AvModem *avmodem_set_mmmodemvoice_signal_call_deleted(AvModem *m, gulong value)
 	return m;
 }
 
-GList *avmodem_get_mmmodemvoice_calls_list(AvModem *m) {
-	return m->mmcalls;
+/* MMCall objects, in the order they came: the list is ours. */
+GList *avmodem_get_mmcalls(AvModem *m) {
+	return m->mmcalls.head;
 }
 
-AvModem *avmodem_update_mmmodemvoice_calls_list(AvModem *m, GList *l) {
-	m->mmcalls = l;
-	return m;
-}
+MMCall *avmodem_find_mmcall(AvModem *m, const gchar *path) {
+	GList *link;
 
-gint avmodem_get_active_calls_counter(AvModem *m) {
-	return m->active_calls_counter;
+	link = g_hash_table_lookup(m->mmcalls_by_path, path);
+
+	return link ? MM_CALL(link->data) : NULL;
 }
 
-AvModem *avmodem_set_active_calls_counter(AvModem *m, gint counter) {
-	m->active_calls_counter = counter;
+/* The modem takes the reference passed along with the call. */
+AvModem *avmodem_add_mmcall(AvModem *m, MMCall *c) {
+	g_queue_push_tail(&m->mmcalls, c);
+	g_hash_table_insert(m->mmcalls_by_path, (gpointer)mm_call_get_path(c), m->mmcalls.tail);
 	return m;
 }
 
-struct av_thread *avmodem_get_sipthread(AvModem *m) {
-	return m->sipthread;
-}
+/* Gives the reference to the call back to the caller. */
+gboolean avmodem_remove_mmcall(AvModem *m, MMCall *c) {
+	GList *link;
 
-AvModem *avmodem_set_sipthread(AvModem *m, struct av_thread *t) {
-	m->sipthread = t;
-	return m;
+	link = g_hash_table_lookup(m->mmcalls_by_path, mm_call_get_path(c));
+	if (!link || (link->data != c))
+		return FALSE;
+
+	g_hash_table_remove(m->mmcalls_by_path, mm_call_get_path(c));
+	g_queue_delete_link(&m->mmcalls, link);
+	return TRUE;
 }
 
-GIOChannel *avmodem_get_sip_GIOchannel(AvModem *m) {
-	return m->voice_sip_giochannel;
+gint avmodem_get_active_calls_counter(AvModem *m) {
+	return m->active_calls_counter;
 }
 
-AvModem *avmodem_set_sip_GIOchannel(AvModem *m, GIOChannel *sip_giochannel) {
-	m->voice_sip_giochannel = sip_giochannel;
+AvModem *avmodem_set_active_calls_counter(AvModem *m, gint counter) {
+	m->active_calls_counter = counter;
 	return m;
 }
 
-guint avmodem_get_sip_GIOchannel_gsource_id(AvModem *m) {
-	return m->voice_sip_giochannel_watch_id;
+gint avmodem_get_sip_line(AvModem *m) {
+	return m->sip_line;
 }
 
-AvModem *avmodem_set_sip_GIOchannel_gsource_id(AvModem *m, guint src_id) {
-	m->voice_sip_giochannel_watch_id = src_id;
+AvModem *avmodem_set_sip_line(AvModem *m, gint line) {
+	m->sip_line = line;
 	return m;
 }
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * poll() loop shared by our threads. Each wakeup serves every ready source,
+ * not just the first one, starting from a different source each time, and
+ * each source gets a work budget: a busy source (e.g.: a registration storm
+ * on the SIP socket) can't keep the others waiting for more than its budget.
+*/
+
+/* System headers */
+#include <errno.h>
+
+/* AV headers */
+#include <av_poll.h>
+
+/* Sources waiting longer than this get reported right away. */
+#define AV_POLL_SLOW_USEC 20000
+
+void av_poll_init(struct av_poll *p, struct pollfd *fds, struct av_poll_source *sources, const struct av_poll_source *templates, guint n) {
+	guint i;
+
+	p->fds = fds;
+	p->sources = sources;
+	p->n = n;
+	p->next = 0;
+
+	for (i = 0; i < n; i++) {
+		sources[i] = templates[i];
+		sources[i].more = FALSE;
+		sources[i].n_dispatches = 0;
+		sources[i].latency_total = 0;
+		sources[i].latency_max = 0;
+	}
+}
+
+static void av_poll_account(struct av_poll_source *s, gint64 latency) {
+	s->n_dispatches++;
+	s->latency_total += latency;
+	if (latency > s->latency_max)
+		s->latency_max = latency;
+
+	if (latency > AV_POLL_SLOW_USEC)
+		g_printerr("%s source waited %" G_GINT64_FORMAT " ms to be served\n",s->name,latency/1000);
+}
+
+/*
+ * One loop iteration: waits for events (unless a source has work left from
+ * the previous round), then serves all ready sources.
+ *
+ * Returns: non-zero when the loop should stop, -1 on poll() failure.
+*/
+gint av_poll_run(struct av_poll *p, int timeout) {
+	struct av_poll_source *s;
+	gint n_events;
+	gint64 wakeup;
+	guint i;
+	guint k;
+	gint retval = 0;
+
+	for (i = 0; i < p->n; i++)
+		if (p->sources[i].more)
+			timeout = 0;
+
+	n_events = poll(p->fds, p->n, timeout);
+	if (n_events < 0) {
+		if (errno == EINTR)
+			return 0;
+		g_printerr("Failure while poll()ing: %s\n",strerror(errno));
+		return -1;
+	}
+
+	wakeup = g_get_monotonic_time();
+
+	for (k = 0; !retval && (k < p->n); k++) {
+		i = (p->next + k) % p->n;
+		s = &p->sources[i];
+
+		if ( !(p->fds[i].revents & POLLIN) && !(s->more && (p->fds[i].fd >= 0)) ) {
+			s->more = FALSE;
+			continue;
+		}
+
+		p->fds[i].revents = 0;
+		s->more = FALSE;
+
+		av_poll_account(s, g_get_monotonic_time() - wakeup);
+		retval = s->dispatch(s->data, s->budget, &s->more);
+	}
+
+	p->next = (p->next + 1) % p->n;
+
+	return retval;
+}
+
+void av_poll_report(struct av_poll *p, const gchar *name) {
+	struct av_poll_source *s;
+	guint i;
+
+	for (i = 0; i < p->n; i++) {
+		s = &p->sources[i];
+		if (!s->n_dispatches)
+			continue;
+
+		g_print("%s %s source: served %" G_GUINT64_FORMAT " times, latency average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n",
+			name, s->name, s->n_dispatches, s->latency_total/(gint64)s->n_dispatches, s->latency_max);
+	}
+}
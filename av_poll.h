@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_poll_h__
+#define __av_poll_h__
+
+/* System headers */
+#include <poll.h>
+
+/* GLib2 headers */
+#include <glib.h>
+
+/*
+ * Handles the events of a poll source. At most budget units of work (messages,
+ * SIP events, ...) should be done per call: if there's more to do, the source
+ * sets *more, and is called again right after the other sources had their
+ * turn, without blocking in poll(). data is the source own one, e.g.: the
+ * line an audio thread works for.
+ *
+ * Returns: non-zero to stop the loop.
+*/
+typedef gint (*av_poll_dispatch_func)(gpointer data, guint budget, gboolean *more);
+
+struct av_poll_source {
+	const gchar *name;
+	av_poll_dispatch_func dispatch;
+	gpointer data;
+	guint budget;
+	gboolean more;
+
+	/* Service latency: from poll() wakeup to the source being served. */
+	guint64 n_dispatches;
+	gint64 latency_total;
+	gint64 latency_max;
+};
+
+/* sources[i] serves fds[i]. */
+struct av_poll {
+	struct pollfd *fds;
+	struct av_poll_source *sources;
+	guint n;
+	guint next;
+};
+
+void av_poll_init(struct av_poll *p, struct pollfd *fds, struct av_poll_source *sources, const struct av_poll_source *templates, guint n);
+gint av_poll_run(struct av_poll *p, int timeout);
+void av_poll_report(struct av_poll *p, const gchar *name);
+
+#endif
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Pre-encoded prompts (ringback, announcements) cache.
+ *
+ * Prompt files are mmap()ed once at startup, before any audio thread exists,
+ * and never modified afterwards. Audio threads only keep a cursor into the
+ * shared mapping, so any number of concurrent listeners of the same prompt
+ * share the same pages, and streaming a frame boils down to handing a pointer
+ * to oRTP: no transcoding and no allocations on our side.
+ *
+ * Files are looked up as <dir>/<prompt>.<codec>, .pcmu and .pcma files being
+ * raw 8 kHz G.711 samples: those are the codecs calls are negotiated with
+ * (see av_sip_codec.c).
+*/
+
+/* System headers */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* AV headers */
+#include <av_prompt.h>
+
+/* G.711 at 8 kHz: 20 ms worth of samples, one byte each. */
+#define AV_PROMPT_G711_FRAME_SIZE 160
+
+static const gchar *av_prompt_names[AV_PROMPT_MAX] = {
+	[AV_PROMPT_RINGBACK] = "ringback",
+	[AV_PROMPT_UNAVAILABLE] = "unavailable",
+	[AV_PROMPT_QUEUE] = "queue",
+};
+
+static const gchar *av_prompt_codec_extensions[AV_PROMPT_CODEC_MAX] = {
+	[AV_PROMPT_CODEC_PCMU] = "pcmu",
+	[AV_PROMPT_CODEC_PCMA] = "pcma",
+};
+
+/* Written only by av_prompt_cache_init() / av_prompt_cache_deinit(). */
+static struct av_prompt av_prompts[AV_PROMPT_MAX][AV_PROMPT_CODEC_MAX];
+
+static void av_prompt_unmap(struct av_prompt *p) {
+	if (p->data && munmap((void *)p->data, p->len))
+		g_printerr("Failure unmapping prompt: %s\n",strerror(errno));
+
+	p->data = NULL;
+	p->len = 0;
+}
+
+static gint av_prompt_map(struct av_prompt *p, const gchar *filename, enum AV_PROMPT_CODEC codec) {
+	int fd;
+	struct stat st;
+	void *data;
+	gsize valid_len;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return 1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		g_printerr("Failure mapping %s: %s\n",filename,strerror(errno));
+		return 1;
+	}
+
+	/* Prompts are small and played over and over: keep them resident. */
+	if (madvise(data, st.st_size, MADV_WILLNEED))
+		g_printerr("madvise on %s: %s\n",filename,strerror(errno));
+
+	p->data = data;
+	p->len = st.st_size;
+	p->codec = codec;
+
+	valid_len = p->len - (p->len % AV_PROMPT_G711_FRAME_SIZE);
+
+	if (!valid_len) {
+		g_printerr("Prompt %s holds no complete frame\n",filename);
+		av_prompt_unmap(p);
+		return 1;
+	}
+
+	/* The mapping length stays the same: only the playable part shrinks. */
+	if (valid_len != p->len)
+		g_printerr("Prompt %s: ignoring %" G_GSIZE_FORMAT " trailing bytes\n",filename,p->len-valid_len);
+
+	return 0;
+}
+
+/*
+ * Maps every prompt found in dir. Missing prompts are not an error: callers
+ * will simply get no prompt from av_prompt_get(), and the caller hears silence
+ * as it did before.
+ *
+ * Returns: the number of mapped prompts.
+*/
+gint av_prompt_cache_init(const gchar *dir) {
+	gint id, codec;
+	gchar *filename;
+	gint n_prompts = 0;
+
+	for (id = 0; id < AV_PROMPT_MAX; id++) {
+		for (codec = 0; codec < AV_PROMPT_CODEC_MAX; codec++) {
+			filename = g_strdup_printf("%s/%s.%s", dir, av_prompt_names[id], av_prompt_codec_extensions[codec]);
+			if (!av_prompt_map(&av_prompts[id][codec], filename, codec)) {
+				g_print("Prompt %s cached (%" G_GSIZE_FORMAT " bytes)\n",filename,av_prompts[id][codec].len);
+				n_prompts++;
+			}
+			g_clear_pointer(&filename, g_free);
+		}
+	}
+
+	return n_prompts;
+}
+
+/*
+ * Unmaps all prompts. Must only be invoked once no audio thread may be
+ * streaming from the cache anymore.
+*/
+void av_prompt_cache_deinit(void) {
+	gint id, codec;
+
+	for (id = 0; id < AV_PROMPT_MAX; id++)
+		for (codec = 0; codec < AV_PROMPT_CODEC_MAX; codec++)
+			av_prompt_unmap(&av_prompts[id][codec]);
+}
+
+const struct av_prompt *av_prompt_get(enum AV_PROMPT_ID id, enum AV_PROMPT_CODEC codec) {
+	if (id >= AV_PROMPT_MAX || codec >= AV_PROMPT_CODEC_MAX)
+		return NULL;
+
+	return av_prompts[id][codec].data ? &av_prompts[id][codec] : NULL;
+}
+
+/*
+ * Maps the RTP payload type of a session to the codec prompts should be
+ * streamed with. Only static payload types can be mapped here.
+*/
+enum AV_PROMPT_CODEC av_prompt_codec_from_rtp(int payload_type) {
+	switch(payload_type) {
+		case 0:
+			return AV_PROMPT_CODEC_PCMU;
+		case 8:
+			return AV_PROMPT_CODEC_PCMA;
+		default:
+			return AV_PROMPT_CODEC_MAX;
+	}
+}
+
+/* RTP timestamp increment for one prompt frame: G.711 has one sample per byte. */
+guint32 av_prompt_codec_frame_ts(enum AV_PROMPT_CODEC codec) {
+	return AV_PROMPT_G711_FRAME_SIZE;
+}
+
+void av_prompt_cursor_init(struct av_prompt_cursor *c, const struct av_prompt *p, gboolean loop) {
+	c->prompt = p;
+	c->offset = 0;
+	c->loop = loop;
+}
+
+/*
+ * Gets the next frame of a prompt, as a pointer inside the shared mapping.
+ *
+ * Returns: the frame length, or 0 when the prompt is over (never happens for
+ * looping cursors).
+*/
+gsize av_prompt_cursor_next_frame(struct av_prompt_cursor *c, const guchar **frame) {
+	const struct av_prompt *p = c->prompt;
+	gsize frame_len;
+
+	if (!p)
+		return 0;
+
+	if (c->offset + AV_PROMPT_G711_FRAME_SIZE > p->len) {
+		if (!c->loop || !c->offset)
+			return 0;
+		c->offset = 0;
+	}
+	frame_len = AV_PROMPT_G711_FRAME_SIZE;
+	*frame = p->data + c->offset;
+	c->offset += frame_len;
+
+	return frame_len;
+}
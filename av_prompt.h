@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_prompt_h__
+#define __av_prompt_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+enum AV_PROMPT_ID {
+	AV_PROMPT_RINGBACK,
+	AV_PROMPT_UNAVAILABLE,
+	AV_PROMPT_QUEUE,
+	AV_PROMPT_MAX
+};
+
+enum AV_PROMPT_CODEC {
+	AV_PROMPT_CODEC_PCMU,
+	AV_PROMPT_CODEC_PCMA,
+	AV_PROMPT_CODEC_MAX
+};
+
+/*
+ * A pre-encoded prompt, as mapped from disk. Mappings are read-only and are
+ * shared by every listener: nobody owns a copy of the audio data.
+*/
+struct av_prompt {
+	const guchar *data;
+	gsize len;
+	enum AV_PROMPT_CODEC codec;
+};
+
+/* Per-listener playback position inside a shared prompt. */
+struct av_prompt_cursor {
+	const struct av_prompt *prompt;
+	gsize offset;
+	gboolean loop;
+};
+
+gint av_prompt_cache_init(const gchar *dir);
+void av_prompt_cache_deinit(void);
+
+const struct av_prompt *av_prompt_get(enum AV_PROMPT_ID id, enum AV_PROMPT_CODEC codec);
+enum AV_PROMPT_CODEC av_prompt_codec_from_rtp(int payload_type);
+guint32 av_prompt_codec_frame_ts(enum AV_PROMPT_CODEC codec);
+
+void av_prompt_cursor_init(struct av_prompt_cursor *c, const struct av_prompt *p, gboolean loop);
+gsize av_prompt_cursor_next_frame(struct av_prompt_cursor *c, const guchar **frame);
+
+#endif
@@ -4,7 +4,6 @@
 #include <unistd.h>
 #include <poll.h>
 #include <netinet/ip.h>
-#include <sys/timerfd.h>
 
 /* GLib2 headers */
 #include <glib.h>
@@ -15,26 +14,192 @@
 #include <av_threadcomm.h>
 #include <av_config.h>
 #include <av_audio.h>
+#include <av_prompt.h>
+#include <av_sip_call.h>
+#include <av_poll.h>
+#include <av_timer.h>
+#include <av_sip_reg.h>
+#include <av_dns.h>
+#include <av_sip_sdp.h>
+#include <av_sip_codec.h>
+#include <av_sip_pool.h>
+#include <av_dialplan.h>
+#include <av_sip_admit.h>
+#include <av_sip_queue.h>
+
+/*
+ * Core messages, SIP events, automatic action timer and DNS answers, followed
+ * by the audio thread messages of each line, then of each queued call.
+*/
+#define AV_SIP_POLL_FIXED_FDS 4
+#define AV_SIP_POLL_DNS 3
+#define AV_SIP_POLL_NUM_FDS (AV_SIP_POLL_FIXED_FDS + AV_SIP_MAX_LINES + AV_SIP_QUEUE_MAX)
+#define AV_SIP_POLL_AUDIO(line) (AV_SIP_POLL_FIXED_FDS + (line))
+#define AV_SIP_POLL_QUEUE(slot) (AV_SIP_POLL_FIXED_FDS + AV_SIP_MAX_LINES + (slot))
+
+/* Smallest session interval we accept (RFC 4028 recommended minimum). */
+#define AV_SIP_MIN_SE 90
+
+/*
+ * eXosip housekeeping (registration refreshes, authentication retries,
+ * terminated dialogs cleanup) pace: faster while calls are up or SIP traffic
+ * was seen within the lifetime of a transaction (64*T1), slower otherwise.
+ * Retransmissions are not our business: eXosip runs them in its own thread.
+*/
+#define AV_SIP_HOUSEKEEPING_BUSY_USEC (5 * G_USEC_PER_SEC)
+#define AV_SIP_HOUSEKEEPING_IDLE_USEC (15 * G_USEC_PER_SEC)
+#define AV_SIP_TRANSACTION_LIFETIME_USEC (32 * G_USEC_PER_SEC)
+
+/* When callers turned down by admission control may try again, in seconds. */
+#define AV_SIP_SHED_RETRY_AFTER "5"
+
+/* Registration lifetime we ask for, in seconds. */
+#define AV_SIP_REG_EXPIRES 200
+
+static const gchar *av_sip_transport_names[] = {
+	[AV_SIP_TRANSPORT_UDP] = "UDP",
+	[AV_SIP_TRANSPORT_TCP] = "TCP",
+	[AV_SIP_TRANSPORT_TLS] = "TLS",
+};
+
+/* Where registrars of each transport are looked for, when they have no port. */
+static const enum av_dns_service av_sip_transport_dns[] = {
+	[AV_SIP_TRANSPORT_UDP] = AV_DNS_SIP_UDP,
+	[AV_SIP_TRANSPORT_TCP] = AV_DNS_SIP_TCP,
+	[AV_SIP_TRANSPORT_TLS] = AV_DNS_SIPS_TCP,
+};
 
 enum CALL_DIRECTION {
 	SIP_CALL_OUTGOING,
 	SIP_CALL_INCOMING
 };
 
-struct av_sip_state {
-	struct eXosip_t *sipctx;
-	struct av_thread *self;
-	struct pollfd poll_data[4];
-	struct itimerspec automatic_action_timer;
+/* Post-dial delay (INVITE to 183) statistics since thread start. */
+struct av_sip_pdd_stats {
+	guint n_calls;
+	gint64 total;
+	gint64 max;
+};
+
+/*
+ * Call teardown statistics since thread start: how long BYE handling keeps
+ * the SIP event loop busy, and how long audio threads take to shut down in
+ * the background.
+*/
+struct av_sip_teardown_stats {
+	guint n_byes;
+	gint64 bye_total;
+	gint64 bye_max;
+	guint n_media;
+	gint64 media_total;
+	gint64 media_max;
+};
+
+/* SDP answers statistics since thread start: building them, that is. */
+struct av_sip_sdp_stats {
+	guint n_answers;
+	gint64 total;
+	gint64 max;
+};
+
+/*
+ * Calls from the GSM network bridged to SIP, since thread start: how long
+ * after the modem started ringing a SIP contact answered, and the modem call
+ * became active.
+*/
+struct av_sip_bridge_stats {
+	guint n_calls;
+	gint64 sip_total;
+	gint64 sip_max;
+	gint64 modem_total;
+	gint64 modem_max;
+};
+
+/*
+ * A modem line: its SIP account and registration, its calls, and the audio
+ * thread they share. Lines are numbered by the main thread, which tells us
+ * about modems coming and going.
+*/
+struct av_sip_line {
+	gboolean in_use;
+	gboolean removing;
+	int id;
+	gchar name[16];
 	int reg_id;
+	struct av_sip_reg reg;
+	gchar *reg_host;
+	gboolean reg_port_explicit;
+	struct av_sip_sdp sdp;
+	struct av_sip_codec_prefs codecs;
+	gchar **forward;
+	struct av_sip_pool_member pool;
 	struct av_modem_config *sipconf;
-	eXosip_event_t *current_call_event;
+
+	/* Settings to switch to once the line has no call: see av_sip_line_reconfigure(). */
+	gboolean reconfigure;
+	struct av_modem_config *sipconf_next;
+
+	struct av_sip_calltable calls;
 	struct av_thread *audiothread;
-	struct av_rtp_connection *current_call_connection;
-	gchar *current_call_path;
+	struct av_thread *audiothread_stopping;
+	gboolean media_ready;
 	int local_rtp_port;
+	gint64 media_stop_start;
+};
+
+/*
+ * A call waiting for a modem of its pool (see av_sip_queue.c). It's not on
+ * any line yet: it has an audio thread of its own, without a modem audio
+ * port, which plays the queue music and becomes the audio thread of the line
+ * the call is dispatched to.
+*/
+struct av_sip_queued {
+	gboolean in_use;
+	int id;
+	gchar name[16];
+	struct av_sip_queue_entry entry;
+	struct av_sip_call call;
+	gchar *identity;
+	struct av_sip_sdp sdp;
+	struct av_thread *audiothread;
+	struct av_thread *audiothread_stopping;
+	int local_rtp_port;
+};
+
+/*
+ * The SIP reactor: a single eXosip context and transport socket for all modem
+ * lines, dialogs being routed to lines by account.
+*/
+struct av_sip_state {
+	struct eXosip_t *sipctx;
+	enum av_sip_transport transport;
+	struct av_thread *self;
+	struct pollfd poll_data[AV_SIP_POLL_NUM_FDS];
+	struct av_poll_source poll_sources[AV_SIP_POLL_NUM_FDS];
+	struct av_poll poll;
+	struct av_timer_wheel timers;
+	struct av_timer automatic_action;
+	gint64 last_activity;
+	struct av_sip_reg_bucket reg_bucket;
+	struct av_dns dns;
+	struct av_sip_pools pools;
+	struct av_dialplan *dialplan;
+	struct av_sip_admit admit;
+	struct av_sip_line lines[AV_SIP_MAX_LINES];
+	guint n_lines;
+	struct av_sip_queue queue;
+	struct av_sip_queued queued[AV_SIP_QUEUE_MAX];
+	struct av_timer queue_dispatch;
+	struct av_sip_pdd_stats pdd;
+	struct av_sip_teardown_stats teardown;
+	struct av_sip_sdp_stats sdp;
+	struct av_sip_bridge_stats bridge;
 } *sstate;
 
+static void av_sip_protocol_session_timer_expired(struct av_timer *t, gpointer data);
+static void av_sip_bridge_timeout(struct av_timer *t, gpointer data);
+static void av_sip_line_reconfigure(struct av_sip_line *l);
+
 static struct av_rtp_connection *av_sip_rtp_connection_alloc(const char *addr, int rtp_port, const gchar *serial_device) {
 	struct av_rtp_connection *c;
 
@@ -50,7 +215,20 @@ static struct av_rtp_connection *av_sip_rtp_connection_alloc(const char *addr, i
 	return c;
 }
 
-static void av_sip_rtp_connection_free(struct av_rtp_connection **c) {
+struct av_rtp_connection *av_sip_rtp_connection_dup(const struct av_rtp_connection *c) {
+	struct av_rtp_connection *dup;
+
+	dup = av_sip_rtp_connection_alloc(c->addr, c->port, c->serial_device);
+	if (dup) {
+		dup->call_direction = c->call_direction;
+		dup->payload_type = c->payload_type;
+		dup->codec = c->codec;
+	}
+
+	return dup;
+}
+
+void av_sip_rtp_connection_free(struct av_rtp_connection **c) {
 	if (*c) {
 		g_clear_pointer(&(*c)->addr, g_free);
 		g_clear_pointer(&(*c)->serial_device, g_free);
@@ -68,12 +246,73 @@ static gint av_sip_stackteardown(void) {
 	osip_free(sstate->sipctx);
 	sstate->sipctx = NULL;
 
-	av_config_free(&sstate->sipconf);
-
 	return 0;
 }
 
+/* TLS credentials, and whether servers get verified. */
+static gint av_sip_tls_setup(void) {
+	struct av_tls_config tls;
+	eXosip_tls_ctx_t *ctx;
+	int verify;
+	gint retval = 1;
+
+	ctx = g_try_malloc0(sizeof *ctx);
+	if (!ctx) {
+		g_printerr("Failure allocating TLS context\n");
+		return retval;
+	}
+
+	av_config_tls(&tls);
+
+	if (tls.ca_file)
+		g_strlcpy(ctx->root_ca_cert, tls.ca_file, sizeof ctx->root_ca_cert);
+	if (tls.certificate && tls.private_key) {
+		g_strlcpy(ctx->client.cert, tls.certificate, sizeof ctx->client.cert);
+		g_strlcpy(ctx->client.priv_key, tls.private_key, sizeof ctx->client.priv_key);
+	}
+
+	verify = tls.verify;
+
+	if (eXosip_set_option(sstate->sipctx, EXOSIP_OPT_SET_TLS_CERTIFICATES_INFO, ctx))
+		g_printerr("Failure setting TLS certificates\n");
+	else if (eXosip_set_option(sstate->sipctx, EXOSIP_OPT_SET_TLS_VERIFY_CERTIFICATE, &verify))
+		g_printerr("Failure setting TLS verification\n");
+	else
+		retval = 0;
+
+	if (!verify)
+		g_printerr("TLS servers are not verified!\n");
+
+	av_config_tls_clear(&tls);
+	g_free(ctx);
+
+	return retval;
+}
+
+/*
+ * Connection oriented transports: connections to registrars are long-lived,
+ * shared by all lines and all transactions towards the same registrar, and
+ * kept alive (RFC 5626 CRLF pings) so that NATs and firewalls don't drop them
+ * behind our back. A connection going away costs a new one, and with TLS a new
+ * handshake: keeping them up is what makes reconnects rare.
+*/
+static void av_sip_connection_setup(void) {
+	int reuse = 1;
+	int keepalive;
+
+	/* Outgoing connections come from the port we listen on, the one in our Contact. */
+	if (eXosip_set_option(sstate->sipctx, EXOSIP_OPT_ENABLE_REUSE_TCP_PORT, &reuse))
+		g_printerr("Failure enabling SIP connections port reuse\n");
+
+	keepalive = av_config_sip_keepalive() * 1000;
+	if (keepalive && eXosip_set_option(sstate->sipctx, EXOSIP_OPT_UDP_KEEP_ALIVE, &keepalive))
+		g_printerr("Failure enabling SIP connections keepalive\n");
+}
+
 static gint av_sip_stacksetup(void) {
+	gint port;
+	int dns_capabilities = 0;
+
 	if ( !(sstate->sipctx = eXosip_malloc()) ) {
 		g_printerr("Failure allocating SIP context\n");
 		return 1;
@@ -95,13 +334,28 @@ static gint av_sip_stacksetup(void) {
 	}
 	sstate->poll_data[1].events = POLLIN;
 
-	if (eXosip_listen_addr(sstate->sipctx, IPPROTO_UDP, NULL, 5556, AF_INET, 0)) {
-		g_printerr("Failure when calling eXosip_listen_addr\n");
+	sstate->transport = av_config_sip_transport();
+	if ( (sstate->transport == AV_SIP_TRANSPORT_TLS) && av_sip_tls_setup() )
+		goto failure;
+
+	/* One socket (or listening one) for all lines. */
+	port = av_config_sip_port();
+	if (eXosip_listen_addr(sstate->sipctx, (sstate->transport == AV_SIP_TRANSPORT_UDP) ? IPPROTO_UDP : IPPROTO_TCP, NULL, port, AF_INET, sstate->transport == AV_SIP_TRANSPORT_TLS)) {
+		g_printerr("Failure when calling eXosip_listen_addr (%s, port %d)\n",av_sip_transport_names[sstate->transport],port);
 		goto failure;
 	}
 
+	if (sstate->transport != AV_SIP_TRANSPORT_UDP)
+		av_sip_connection_setup();
+
+	g_print("SIP over %s, port %d\n",av_sip_transport_names[sstate->transport],port);
+
 	eXosip_set_user_agent(sstate->sipctx, "AirVoice");
 
+	/* NAPTR and SRV lookups are ours: eXosip only gets to see our answers, see av_sip_dns_update(). */
+	if (eXosip_set_option(sstate->sipctx, EXOSIP_OPT_DNS_CAPABILITIES, &dns_capabilities))
+		g_printerr("Failure disabling eXosip NAPTR/SRV lookups\n");
+
 	return 0;
 
 failure:
@@ -109,35 +363,166 @@ failure:
 	return 1;
 }
 
-static gint av_sip_protocol_call_stage0_check_username(eXosip_event_t *e) {
+static struct av_sip_line *av_sip_line_get(int id) {
+	if ( (id < 0) || (id >= AV_SIP_MAX_LINES) || !sstate->lines[id].in_use )
+		return NULL;
+
+	return &sstate->lines[id];
+}
+
+static struct av_sip_line *av_sip_call_line(struct av_sip_call *c) {
+	return &sstate->lines[c->line];
+}
+
+/* Call IDs are unique across lines: they all share the same eXosip context. */
+static struct av_sip_call *av_sip_find_call_by_cid(int cid) {
+	struct av_sip_call *c;
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		if (sstate->lines[i].in_use && (c = av_sip_call_find_by_cid(&sstate->lines[i].calls, cid)))
+			return c;
+
+	return NULL;
+}
+
+static struct av_sip_line *av_sip_line_find_by_rid(int rid) {
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		if (sstate->lines[i].in_use && (sstate->lines[i].reg_id == rid))
+			return &sstate->lines[i];
+
+	return NULL;
+}
+
+/*
+ * Where a request comes from, as far as admission control is concerned: the
+ * address its top Via was received from, or the one it claims.
+*/
+static const char *av_sip_protocol_request_source(osip_message_t *req) {
+	osip_generic_param_t *received = NULL;
+	osip_via_t *via = NULL;
+
+	if (osip_message_get_via(req, 0, &via) < 0 || !via)
+		return "unknown";
+
+	if (!osip_via_param_get_byname(via, "received", &received) && received && received->gvalue)
+		return received->gvalue;
+
+	return via_get_host(via) ? via_get_host(via) : "unknown";
+}
+
+/* Turns an INVITE admission control didn't let in down, as cheaply as possible. */
+static void av_sip_protocol_call_shed(eXosip_event_t *e, int status) {
+	osip_message_t *answer;
+
+	if (eXosip_call_build_answer(sstate->sipctx, e->tid, status, &answer)) {
+		g_printerr("Failure building %d answer\n",status);
+		return;
+	}
+
+	/* RFC 3261, section 21.5.4: come back later. */
+	if (status == 503)
+		osip_message_set_header(answer, "Retry-After", AV_SIP_SHED_RETRY_AFTER);
+
+	if (eXosip_call_send_answer(sstate->sipctx, e->tid, status, answer))
+		g_printerr("Failure sending %d answer\n",status);
+}
+
+static const char *av_sip_protocol_call_stage0_extract_dest_number(osip_message_t *req) {
+
+	/*
+	 * Can this happen?
+	*/
+	if (!req->req_uri) {
+		g_print("Request contained no URI; please report this back.\n");
+		return NULL;
+	}
+
+	return osip_uri_get_username(req->req_uri);
+}
+
+/* Normalizes the number to call, the way the dial plan says. */
+static gint av_sip_protocol_call_stage0_normalize(const char *dest_number, gchar *number) {
+	if (av_dialplan_normalize(sstate->dialplan, dest_number, number, AV_DIALPLAN_NUMBER_LEN)) {
+		g_printerr("Invalid number to call \"%s\"\n",dest_number);
+		return 1;
+	}
+
+	if (g_strcmp0(dest_number, number))
+		g_print("Number to call %s normalized to %s\n",dest_number,number);
+
+	return 0;
+}
+
+/*
+ * Routes an INVITE to the pool of lines of an account: the request should
+ * come from the username lines are configured with (insecure security check,
+ * as it always was). The Request-URI user part is the number to call, so it
+ * can't tell lines apart: the pool picks the best of its modems, among those
+ * the dial plan says the number should go through if it can.
+ *
+ * Returns: the line, and the normalized number in number; or NULL with the
+ * status to reject the call with (and the pool, if it's the modems that are
+ * busy).
+*/
+static struct av_sip_line *av_sip_protocol_call_stage0_route(eXosip_event_t *e, gchar *number, struct av_sip_pool **pool, int *status) {
 	osip_from_t *from;
 	osip_uri_t *uri;
 	const char *username;
+	const char *dest_number;
+	const gchar *target = NULL;
+	struct av_sip_pool *p;
+	struct av_sip_line *l;
+
+	*status = 403;
 
 	from = osip_message_get_from(e->request);
 	if (!from) {
 		g_printerr("SIP \"From\" header was missing\n");
-		return 1;
+		return NULL;
 	}
 
 	uri = osip_from_get_url(from);
 	if (!uri) {
 		g_printerr("URL not present in the \"From\" header\n");
-		return 1;
+		return NULL;
 	}
 
 	username = osip_uri_get_username(uri);
 	if (!username) {
 		g_printerr("seems the URL has no username part\n");
-		return 1;
+		return NULL;
 	}
 
-	if (g_strcmp0(sstate->sipconf->username, username)) {
+	*pool = p = av_sip_pool_find(&sstate->pools, username);
+	if (!p) {
 		g_printerr("Request coming from unexpected username\n");
-		return 1;
+		return NULL;
 	}
 
-	return 0;
+	dest_number = av_sip_protocol_call_stage0_extract_dest_number(e->request);
+	if (!dest_number) {
+		*status = 404;
+		return NULL;
+	}
+
+	if (sstate->dialplan) {
+		if (av_sip_protocol_call_stage0_normalize(dest_number, number)) {
+			*status = 484;
+			return NULL;
+		}
+		target = av_dialplan_route(sstate->dialplan, number);
+	}
+	else
+		g_strlcpy(number, dest_number, AV_DIALPLAN_NUMBER_LEN);
+
+	l = av_sip_pool_route(&sstate->pools, p, target);
+	if (!l)
+		*status = 486;
+
+	return l;
 }
 
 static gint av_sip_protocol_call_stage0_connection_check_supported(sdp_connection_t *c, const char *rtp_port) {
@@ -180,56 +565,39 @@ static gint av_sip_protocol_call_stage0_connection_setup(sdp_message_t *sdp_data
 		return 1;
 	}
 
-	*c = av_sip_rtp_connection_alloc(rtp_connection->c_addr, int_rtp_port, sstate->sipconf->modem_audio_port);
+	/* The serial device is up to the line the call belongs to. */
+	*c = av_sip_rtp_connection_alloc(rtp_connection->c_addr, int_rtp_port, NULL);
 
 	return 0;
 }
 
-static gint av_sip_protocol_call_stage0_check_audio_media_payload_ok(sdp_message_t *sdp_data, int pos_media, const char *payload, const char *format_desc, struct av_rtp_connection **c) {
-	sdp_attribute_t *a;
-	int i = 0;
-	int retval = 1;
-	gchar *expected_value;
-
-	expected_value = g_strdup_printf("%s %s",payload, format_desc);
-
-	while ( (a = sdp_message_attribute_get(sdp_data, pos_media, i)) ) {
-		if (!g_strcmp0(a->a_att_field, "rtpmap") && !g_strcmp0(a->a_att_value, expected_value) ) {
-			if (!av_sip_protocol_call_stage0_connection_setup(sdp_data, pos_media, c))
-				retval--;
-			break;
-		}
-		i++;
-	}
-
-	g_clear_pointer(&expected_value, g_free);
+/*
+ * Looks for an audio stream we can handle in an SDP offer, with the codecs
+ * the line prefers, and gets where the caller wants it.
+*/
+static gint av_sip_protocol_sdp_audio_connection(sdp_message_t *sdp_data, const struct av_sip_codec_prefs *prefs, struct av_rtp_connection **c, struct av_sip_codec_choice *choice) {
+	int i;
+	const char *media_type;
 
-	return retval;
-}
+	for (i=0; !sdp_message_endof_media(sdp_data,i); i++) {
+		media_type = sdp_message_m_media_get(sdp_data,i);
+		if (g_strcmp0(media_type, "audio") || av_sip_codec_negotiate(sdp_data, i, prefs, choice))
+			continue;
 
-static gint av_sip_protocol_call_stage0_check_audio_media_payload(sdp_message_t *sdp_data, int pos_media, struct av_rtp_connection **c) {
-	const char *payload;
-	int i = 0;
-	int retval = 1;
+		if (av_sip_protocol_call_stage0_connection_setup(sdp_data, i, c) || !*c)
+			return 1;
 
-	/* If I am right, we can be sure that if payload 0 is present, it should be good for us. */
-	while( (payload = sdp_message_m_payload_get(sdp_data, pos_media, i)) ) {
-		g_print("Checking payload %s...\n",payload);
-		if (!av_sip_protocol_call_stage0_check_audio_media_payload_ok(sdp_data, pos_media, payload, "PCMU/8000", c)) {
-			retval--;
-			break;
-		}
-		i++;
+		(*c)->payload_type = choice->payload_type;
+		(*c)->codec = choice->codec;
+		return 0;
 	}
 
-	return retval;
+	return 1;
 }
 
-static gint av_sip_protocol_call_stage0_handle_remote_sdp(eXosip_event_t *e, struct av_rtp_connection **c) {
+static gint av_sip_protocol_call_stage0_handle_remote_sdp(eXosip_event_t *e, struct av_sip_line *l, struct av_rtp_connection **c, struct av_sip_codec_choice *choice) {
 	sdp_message_t *sdp_data;
-	int i;
-	const char *media_type;
-	int audio_payload_ok = 0;
+	gint retval;
 
 	sdp_data = eXosip_get_remote_sdp(sstate->sipctx, e->did);
 	if (!sdp_data) {
@@ -239,509 +607,2511 @@ static gint av_sip_protocol_call_stage0_handle_remote_sdp(eXosip_event_t *e, str
 
 	g_print("Got SDP...\n");
 
-	for (i=0; !sdp_message_endof_media(sdp_data,i); i++) {
-		media_type = sdp_message_m_media_get(sdp_data,i);
-		if (!g_strcmp0(media_type, "audio"))
-			if (!av_sip_protocol_call_stage0_check_audio_media_payload(sdp_data, i, c)) {
-				audio_payload_ok++;
-				break;
-			}
-	}
+	retval = av_sip_protocol_sdp_audio_connection(sdp_data, &l->codecs, c, choice);
 
 	sdp_message_free(sdp_data);
 
-	return audio_payload_ok ? 0 : 1;
+	return retval;
 }
 
-static void av_sip_protocol_call_end_free_state(eXosip_event_t **e, struct av_rtp_connection **c, gchar **path) {
-	g_clear_pointer(e, eXosip_event_free);
-	av_sip_rtp_connection_free(c);
-	g_clear_pointer(path, g_free);
-}
+/*
+ * Sends a message about a line to the main thread. The payload is not freed
+ * on failure.
+*/
+static gint av_sip_core_send(int line, int msg, void *payload) {
+	struct av_thread_cmd *cmd;
 
-static void av_sip_protocol_call_end(eXosip_event_t *e) {
-	struct av_thread_cmd *exit_cmd;
+	cmd = av_thread_cmd(msg, payload);
+	if (!cmd)
+		return 1;
 
-	if (sstate->current_call_event) {
-		if (e && (e->cid != sstate->current_call_event->cid))
-			return;
+	cmd->line = line;
+	av_thread_txcmd(sstate->self, cmd, 1);
 
-		exit_cmd = av_thread_cmd(CMD_AUDIO_EXIT, NULL);
-		if (exit_cmd) {
-			av_thread_txcmd(sstate->audiothread, exit_cmd, 0);
-			g_clear_pointer(&exit_cmd, g_free);
-			sstate->poll_data[3].fd = -1;
-			g_clear_pointer(&sstate->audiothread, av_thread_teardown);
-		}
+	return 0;
+}
 
-		av_sip_protocol_call_end_free_state(&sstate->current_call_event, &sstate->current_call_connection, &sstate->current_call_path);
+/*
+ * Tell the main thread a line got registered (at last: refreshes don't
+ * count), or that it won't, for want of usable settings.
+*/
+static void av_sip_core_line_up(int line, gboolean registered) {
+	struct av_thread_cmd *cmd;
+
+	cmd = av_thread_cmd_str(SIP_EVENT_LINE_REGISTERED, registered, NULL);
+	if (cmd) {
+		cmd->line = line;
+		av_thread_txcmd(sstate->self, cmd, 1);
 	}
+}
+
+/*
+ * Tell the main thread the modem call we started is of no use anymore: the
+ * SIP side went away, possibly while the call was still being set up.
+*/
+static void av_sip_core_call_ended(int line, const gchar *call_path) {
+	struct av_thread_cmd *cmd;
 
+	cmd = av_thread_cmd_str(SIP_EVENT_CALL_ENDED, 0, call_path);
+	if (cmd) {
+		cmd->line = line;
+		av_thread_txcmd(sstate->self, cmd, 1);
+	}
 }
 
-static gint av_sip_start_audio_thread(void) {
-	sstate->audiothread = av_thread_setup("AudioThread", av_audiothread_startup);
-	if (!sstate->audiothread)
-		return 1;
+static void av_sip_audio_cmd(struct av_sip_line *l, int msg, void *payload) {
+	struct av_thread_cmd *cmd;
 
-	sstate->poll_data[3].fd = sstate->audiothread->sockets[0];
-	sstate->poll_data[3].events = POLLIN;
-	return 0;
+	if (!l->audiothread)
+		return;
+
+	cmd = av_thread_cmd(msg, payload);
+	if (cmd)
+		av_thread_txcmd(l->audiothread, cmd, 0);
 }
 
 /*
- * For the better or the worse, I tried to understand how things are supposed to work from here:
- * https://tools.ietf.org/html/rfc3666#section-2.1
- * and here we are at F5, so you shouldn't be "basito" yet! :)
- * Infact, eXosip2 answers for us with a "100 Trying" message to stop the other party from re-transmitting (when using something like UDP).
- *
- * Returns:
- *   non-zero when we know we're going to use our event structure; zero in any other case.
+ * Points the media path to the given call: RTP goes to the caller of the
+ * call the modem has just made active. The audio engine stays up.
 */
-static gint av_sip_protocol_call_stage0(eXosip_event_t *e) {
+static void av_sip_audio_retarget(struct av_sip_call *c) {
+	struct av_sip_line *l = av_sip_call_line(c);
 	struct av_rtp_connection *connection;
 
-	if (sstate->current_call_event) {
-		g_printerr("Sorry, we currently support only one incoming call at once\n");
-		return 0;
-	}
-
-	/* Insecure security check: the message we received should come from the configured username. */
-	if (av_sip_protocol_call_stage0_check_username(e))
-		return 0;
+	l->calls.media_owner = c;
 
-	if (av_sip_protocol_call_stage0_handle_remote_sdp(e, &connection))
-		return 0;
+	connection = av_sip_rtp_connection_dup(c->connection);
+	if (!connection)
+		return;
 
-	g_print("RTP (%s:%d)...\n",connection->addr,connection->port);
+	av_sip_audio_cmd(l, CMD_AUDIO_RETARGET, connection);
+}
 
-	connection->call_direction = SIP_CALL_INCOMING;
-	sstate->current_call_event = e;
-	sstate->current_call_connection = connection;
+/*
+ * Asks the audio thread of a line to exit, without waiting for it: closing
+ * the RTP session and the modem audio port may take a while, and SIP
+ * processing (other calls and lines, registration refreshes) must go on
+ * meanwhile. The thread is joined once it tells us it's done, see
+ * av_sip_audio_stopped().
+*/
+static void av_sip_audio_stop(struct av_sip_line *l) {
+	struct av_thread_cmd *exit_cmd;
 
-	if (av_sip_start_audio_thread()) {
-		av_sip_protocol_call_end(NULL);
-		return 0;
+	if (l->audiothread && (exit_cmd = av_thread_cmd(CMD_AUDIO_EXIT, NULL)) ) {
+		av_thread_txcmd(l->audiothread, exit_cmd, 0);
+		l->audiothread_stopping = g_steal_pointer(&l->audiothread);
+		l->media_stop_start = g_get_monotonic_time();
 	}
 
-	return 1;
+	l->media_ready = FALSE;
+	l->local_rtp_port = 0;
 }
 
-static gint av_sip_protocol_events(void) {
-	eXosip_event_t *event;
-	gint keep_event = 0;
+/*
+ * Forgets about a queued call, hung up or dispatched: its audio thread is
+ * stopped the same way lines' are, unless it went along with the call.
+*/
+static void av_sip_queued_release(struct av_sip_queued *q) {
+	struct av_thread_cmd *exit_cmd;
 
-	while ( (event = eXosip_event_wait(sstate->sipctx, 0, 0) )) {
-		eXosip_lock(sstate->sipctx);
+	av_sip_queue_abandoned(&sstate->queue, &q->entry);
 
-		switch(event->type) {
-			case EXOSIP_REGISTRATION_SUCCESS:
-				g_print("SIP registration was successful\n");
-				break;
-			case EXOSIP_REGISTRATION_FAILURE:
-				g_printerr("SIP registration failure occurred\n");
-				break;
-			case EXOSIP_CALL_ACK:
-				g_print("Call ACK received\n");
-				break;
-			case EXOSIP_CALL_CLOSED:
-			case EXOSIP_CALL_CANCELLED:
-			case EXOSIP_CALL_RELEASED:
-				g_print("Call termination event (%d): %s\n",event->type, event->textinfo ? event->textinfo : "no event text");
-				av_sip_protocol_call_end(event);
-				break;
-			case EXOSIP_CALL_INVITE:
-				g_print("SIP INVITE received\n");
-				keep_event = av_sip_protocol_call_stage0(event);
-				break;
-			default:
-				g_printerr("Unknown SIP event (%d): %s\n",event->type, event->textinfo ? event->textinfo : "no event text");
-				break;
-		}
+	if (q->audiothread && (exit_cmd = av_thread_cmd(CMD_AUDIO_EXIT, NULL)) )
+		av_thread_txcmd(q->audiothread, exit_cmd, 0);
+	q->audiothread_stopping = g_steal_pointer(&q->audiothread);
+	q->local_rtp_port = 0;
 
-		eXosip_unlock(sstate->sipctx);
+	g_clear_pointer(&q->call.event, eXosip_event_free);
+	av_sip_rtp_connection_free(&q->call.connection);
+	av_timer_cancel(&sstate->timers, &q->call.session_timer.timer);
+	q->call.in_use = FALSE;
 
-		if (!keep_event)
-			g_clear_pointer(&event, eXosip_event_free);
+	av_sip_sdp_deinit(&q->sdp);
+	g_clear_pointer(&q->identity, g_free);
+	q->in_use = FALSE;
+}
+
+static struct av_sip_queued *av_sip_queued_find_by_cid(int cid) {
+	int i;
+
+	for (i = 0; i < AV_SIP_QUEUE_MAX; i++)
+		if (sstate->queued[i].in_use && sstate->queued[i].call.event && (sstate->queued[i].call.event->cid == cid))
+			return &sstate->queued[i];
+
+	return NULL;
+}
+
+/* Turns a queued call down. The caller must hold eXosip lock. */
+static void av_sip_queued_reject(struct av_sip_queued *q, int status) {
+	if (eXosip_call_send_answer(sstate->sipctx, q->call.event->tid, status, NULL))
+		g_printerr("Failure sending %d answer\n",status);
+
+	av_sip_queued_release(q);
+}
+
+/*
+ * A line may be free to take a queued call. Dispatching it may take eXosip
+ * lock, which our caller may be holding: it's done from the timer wheel.
+*/
+static void av_sip_queue_kick(void) {
+	if (sstate->queue.n && !av_timer_pending(&sstate->queue_dispatch))
+		av_timer_arm(&sstate->timers, &sstate->queue_dispatch, g_get_monotonic_time());
+}
+
+/* The modem call of a SIP call was created, or won't be: admission control counts it no more. */
+static void av_sip_protocol_call_dequeue(struct av_sip_call *c) {
+	if (!(c->setup_flags & AV_SIP_SETUP_MODEM_QUEUED))
+		return;
+
+	c->setup_flags &= ~AV_SIP_SETUP_MODEM_QUEUED;
+	av_sip_admit_dequeued(&sstate->admit);
+}
+
+/*
+ * Forgets about a SIP call. The audio engine is only stopped along with the
+ * last call on this modem.
+*/
+static void av_sip_protocol_call_end_call(struct av_sip_call *c) {
+	struct av_sip_line *l = av_sip_call_line(c);
+
+	av_sip_protocol_call_dequeue(c);
+
+	/* If a modem call was started for this SIP call, it's no longer needed. */
+	if (c->path)
+		av_sip_core_call_ended(l->id, c->path);
+
+	av_timer_cancel(&sstate->timers, &c->session_timer.timer);
+	av_timer_cancel(&sstate->timers, &c->fork.timer);
+
+	/* What the SIM carried, for the pool to spread minutes over SIMs. */
+	if (c->timing.answered)
+		l->pool.call_time += g_get_monotonic_time() - c->timing.answered;
+
+	av_sip_call_release(&l->calls, c);
+
+	if (!l->calls.n_calls)
+		av_sip_audio_stop(l);
+}
+
+static void av_sip_line_calls_end(struct av_sip_line *l) {
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_CALLS; i++)
+		if (l->calls.calls[i].in_use)
+			av_sip_protocol_call_end_call(&l->calls.calls[i]);
+}
+
+/*
+ * Ends the call the given eXosip event relates to, queued ones included, or
+ * all calls of all lines and of the queue when no event is given.
+*/
+static void av_sip_protocol_call_end(eXosip_event_t *e) {
+	struct av_sip_call *c;
+	struct av_sip_queued *q;
+	int i;
+
+	if (e) {
+		c = av_sip_find_call_by_cid(e->cid);
+		if (c)
+			av_sip_protocol_call_end_call(c);
+		else if ( (q = av_sip_queued_find_by_cid(e->cid)) )
+			av_sip_queued_release(q);
+		return;
+	}
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		if (sstate->lines[i].in_use)
+			av_sip_line_calls_end(&sstate->lines[i]);
+
+	for (i = 0; i < AV_SIP_QUEUE_MAX; i++)
+		if (sstate->queued[i].in_use)
+			av_sip_queued_release(&sstate->queued[i]);
+}
+
+/*
+ * Sends a final error response for the given call, and ends it.
+*/
+static void av_sip_protocol_call_reject(struct av_sip_call *c, int status) {
+	eXosip_lock(sstate->sipctx);
+	if (eXosip_call_send_answer(sstate->sipctx, c->event->tid, status, NULL))
+		g_printerr("Failure sending %d answer\n",status);
+	eXosip_unlock(sstate->sipctx);
+
+	av_sip_protocol_call_end_call(c);
+}
+
+/*
+ * Cancels the INVITEs of a call from the GSM network still waiting for an
+ * answer. The caller must hold eXosip lock.
+*/
+static void av_sip_bridge_cancel(struct av_sip_call *c) {
+	struct av_sip_fork *f = &c->fork;
+	guint k;
+
+	for (k = 0; k < f->n_cids; k++) {
+		if (f->cids[k] < 0)
+			continue;
+
+		if (eXosip_call_terminate(sstate->sipctx, f->cids[k], 0))
+			g_printerr("Failure cancelling call %d\n",f->cids[k]);
+		f->cids[k] = -1;
+	}
+
+	f->n_pending = 0;
+}
+
+/*
+ * Media is gone for good: drop every call of the line, with a BYE if it was
+ * already answered, or with a 500 otherwise. Calls from the GSM network
+ * nobody answered yet just stop ringing on SIP.
+*/
+static void av_sip_protocol_call_drop_all(struct av_sip_line *l) {
+	struct av_sip_call *c;
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_CALLS; i++) {
+		c = &l->calls.calls[i];
+		if (!c->in_use)
+			continue;
+
+		if ( (c->setup_flags & AV_SIP_SETUP_BRIDGED) && !(c->setup_flags & AV_SIP_SETUP_ANSWERED) ) {
+			eXosip_lock(sstate->sipctx);
+			av_sip_bridge_cancel(c);
+			eXosip_unlock(sstate->sipctx);
+			av_sip_protocol_call_end_call(c);
+			continue;
+		}
+
+		if (!(c->setup_flags & AV_SIP_SETUP_ANSWERED)) {
+			av_sip_protocol_call_reject(c, 500);
+			continue;
+		}
+
+		eXosip_lock(sstate->sipctx);
+		if (eXosip_call_terminate(sstate->sipctx, c->event->cid, c->event->did))
+			g_printerr("Failure terminating call %d\n",c->event->cid);
+		eXosip_unlock(sstate->sipctx);
+		av_sip_protocol_call_end_call(c);
 	}
+}
+
+/*
+ * Starts the audio thread of a line. If the previous one is still shutting
+ * down, the new one is started as soon as it's gone (it would fight for the
+ * same modem audio port).
+*/
+static gint av_sip_start_audio_thread(struct av_sip_line *l) {
+	if (l->audiothread_stopping)
+		return 0;
+
+	l->audiothread = av_thread_setup("AudioThread", av_audiothread_startup);
+	if (!l->audiothread)
+		return 1;
 
+	sstate->poll_data[AV_SIP_POLL_AUDIO(l->id)].fd = av_thread_eventfd(l->audiothread, 0);
+	sstate->poll_data[AV_SIP_POLL_AUDIO(l->id)].events = POLLIN;
 	return 0;
 }
 
-static gint av_sip_stackconfig(struct av_modem_config *mc) {
+static void av_sip_teardown_stats_bye(gint64 elapsed) {
+	struct av_sip_teardown_stats *st = &sstate->teardown;
+
+	st->n_byes++;
+	st->bye_total += elapsed;
+	if (elapsed > st->bye_max)
+		st->bye_max = elapsed;
+}
+
+static void av_sip_teardown_stats_report(void) {
+	struct av_sip_teardown_stats *st = &sstate->teardown;
+
+	if (st->n_byes)
+		g_print("BYE: %u handled in %" G_GINT64_FORMAT " us on average, max %" G_GINT64_FORMAT " us\n",
+			st->n_byes, st->bye_total/st->n_byes, st->bye_max);
+	if (st->n_media)
+		g_print("Audio threads: %u shut down in background in %" G_GINT64_FORMAT " ms on average, max %" G_GINT64_FORMAT " ms\n",
+			st->n_media, st->media_total/st->n_media/1000, st->media_max/1000);
+}
+
+/* Forgets about the settings of a line, which isn't in use anymore. */
+static void av_sip_line_clear(struct av_sip_line *l) {
+	int id = l->id;
+
+	av_config_free(&l->sipconf);
+	av_config_free(&l->sipconf_next);
+	g_clear_pointer(&l->reg_host, g_free);
+	g_clear_pointer(&l->forward, g_strfreev);
+	av_sip_sdp_deinit(&l->sdp);
+	memset(l, 0, sizeof *l);
+	l->id = id;
+	g_snprintf(l->name, sizeof l->name, "audio %d", id);
+	sstate->n_lines--;
+}
+
+/*
+ * The line is gone as far as we are concerned: let the main thread know it
+ * can reuse its number.
+*/
+static void av_sip_line_removed(struct av_sip_line *l) {
+	int id = l->id;
+
+	av_sip_line_clear(l);
+
+	g_print("SIP line %d removed (%u left)\n",id,sstate->n_lines);
+	av_sip_core_send(id, SIP_EVENT_LINE_REMOVED, NULL);
+}
+
+/*
+ * Takes a line out of its pool, and off its registrar: eXosip forgets about
+ * its registration and credentials too, or a new password would never be
+ * used (eXosip picks the first credentials matching). The unREGISTER goes
+ * out once: should the registrar challenge it, the binding just expires.
+ *
+ * Lines of a pool add credentials for the same username: each of them
+ * removes one, the newest ones staying first.
+*/
+static void av_sip_line_unregister(struct av_sip_line *l) {
 	osip_message_t *regmsg;
-	int send_reg_retval;
 
-	if (eXosip_add_authentication_info(sstate->sipctx, mc->username, mc->username, mc->password, NULL, NULL)) {
-		g_printerr("Failure adding authentication infos\n");
+	av_sip_pool_leave(&sstate->pools, &l->pool);
+	l->pool.registered = FALSE;
+	av_sip_reg_stop(&l->reg);
+	av_dns_cancel(&sstate->dns, l);
+
+	eXosip_lock(sstate->sipctx);
+	if (l->reg_id > 0) {
+		if (!eXosip_register_build_register(sstate->sipctx, l->reg_id, 0, &regmsg)) {
+			if (eXosip_register_send_register(sstate->sipctx, l->reg_id, regmsg))
+				g_printerr("Failure unregistering line %d\n",l->id);
+		}
+
+		if (eXosip_register_remove(sstate->sipctx, l->reg_id))
+			g_printerr("Failure removing registration of line %d\n",l->id);
+		l->reg_id = 0;
+	}
+
+	/* Added with no realm: eXosip keeps that as an empty one. */
+	if (l->sipconf && eXosip_remove_authentication_info(sstate->sipctx, l->sipconf->username, ""))
+		g_printerr("Failure removing authentication infos of line %d\n",l->id);
+	eXosip_unlock(sstate->sipctx);
+}
+
+/*
+ * The modem of a line went away: drop its calls, unregister it, and wait for
+ * its audio thread to be gone before forgetting about it.
+*/
+static void av_sip_line_remove(int id) {
+	struct av_sip_line *l;
+
+	l = av_sip_line_get(id);
+	if (!l) {
+		/* Never configured: nothing to undo. */
+		av_sip_core_send(id, SIP_EVENT_LINE_REMOVED, NULL);
+		return;
+	}
+
+	l->removing = TRUE;
+	av_sip_line_unregister(l);
+	av_sip_protocol_call_drop_all(l);
+
+	if (!l->audiothread_stopping)
+		av_sip_line_removed(l);
+}
+
+/*
+ * The audio thread we asked to exit is done: join it, which doesn't block
+ * anymore, and start a new one if calls came in meanwhile (and we're allowed
+ * to).
+*/
+static void av_sip_audio_stopped(struct av_sip_line *l, gboolean restart) {
+	struct av_sip_teardown_stats *st = &sstate->teardown;
+	gint64 elapsed;
+
+	g_clear_pointer(&l->audiothread_stopping, av_thread_teardown);
+	sstate->poll_data[AV_SIP_POLL_AUDIO(l->id)].fd = -1;
+
+	elapsed = g_get_monotonic_time() - l->media_stop_start;
+	st->n_media++;
+	st->media_total += elapsed;
+	if (elapsed > st->media_max)
+		st->media_max = elapsed;
+
+	if (l->removing) {
+		av_sip_line_removed(l);
+		return;
+	}
+
+	if (!l->calls.n_calls) {
+		/* Waiting calls get the line as it's configured now. */
+		if (l->reconfigure)
+			av_sip_line_reconfigure(l);
+		av_sip_queue_kick();
+		return;
+	}
+
+	if (restart && !av_sip_start_audio_thread(l))
+		return;
+
+	av_sip_protocol_call_drop_all(l);
+}
+
+/*
+ * Asks the main thread to place the modem call right away, without waiting
+ * for media setup to complete.
+*/
+static gint av_sip_protocol_call_request_modem_call(struct av_sip_call *c) {
+	struct av_thread_cmd *cmd;
+
+	cmd = av_thread_cmd_str(SIP_EVENT_INCOMING_CALL, c->event->cid, c->number);
+	if (!cmd)
+		return 1;
+
+	cmd->line = c->line;
+	if (av_thread_txcmd(sstate->self, cmd, 1))
 		return 1;
+
+	c->setup_flags |= AV_SIP_SETUP_MODEM_QUEUED;
+	av_sip_admit_queued(&sstate->admit);
+
+	return 0;
+}
+
+/*
+ * Early 180 without SDP: the caller gets feedback while we set things up.
+ * The 183 carrying the SDP for early media follows.
+*/
+static void av_sip_protocol_call_ringing(struct av_sip_call *c) {
+	osip_message_t *ringing;
+
+	if (eXosip_call_build_answer(sstate->sipctx, c->event->tid, 180, &ringing)) {
+		g_printerr("Failure building 180 answer\n");
+		return;
+	}
+
+	if (eXosip_call_send_answer(sstate->sipctx, c->event->tid, 180, ringing))
+		g_printerr("Failure sending 180 answer\n");
+
+	c->timing.ringing = g_get_monotonic_time();
+}
+
+/*
+ * Hands the first call queued for the pool of a line over to it, if the line
+ * is free: no call, no audio thread (the modem audio port is closed). The
+ * call keeps its audio thread, and RTP port, so that the SDP the caller got
+ * still holds: the modem audio port just joins in. Any modem of the pool
+ * will do, whatever the dial plan target of the number.
+*/
+static void av_sip_queue_dispatch(struct av_sip_line *l) {
+	struct av_sip_queued *q = NULL;
+	struct av_sip_call *c;
+	struct av_thread_cmd *cmd;
+	GList *link;
+	gint64 session_deadline = 0;
+	int p;
+
+	if (!l->in_use || l->removing || l->calls.n_calls || l->audiothread || l->audiothread_stopping)
+		return;
+
+	if (!l->pool.pool || !av_sip_pool_available(&sstate->pools, &l->pool))
+		return;
+
+	av_sip_queue_foreach(&sstate->queue, p, link) {
+		if (!g_strcmp0(((struct av_sip_queued *)link->data)->identity, l->pool.pool->identity)) {
+			q = link->data;
+			goto found;
+		}
+	}
+
+	return;
+
+found:
+	c = av_sip_call_alloc(&l->calls, NULL);
+	if (!c)
+		return;
+
+	av_sip_queue_dispatched(&sstate->queue, &q->entry);
+	g_print("Queued call %d goes to line %d\n",q->call.event->cid,l->id);
+
+	/* The wheel links timers in place: they can't move along with the call, they're armed again. */
+	if (av_timer_pending(&q->call.session_timer.timer))
+		session_deadline = q->call.session_timer.timer.deadline;
+	av_timer_cancel(&sstate->timers, &q->call.session_timer.timer);
+	av_timer_cancel(&sstate->timers, &q->call.fork.timer);
+
+	*c = q->call;
+	c->line = l->id;
+	av_timer_init(&c->session_timer.timer, av_sip_protocol_session_timer_expired, c);
+	av_timer_init(&c->fork.timer, av_sip_bridge_timeout, c);
+	if (session_deadline)
+		av_timer_arm(&sstate->timers, &c->session_timer.timer, session_deadline);
+	c->connection->serial_device = g_strdup(l->sipconf->modem_audio_port);
+	memset(&q->call, 0, sizeof q->call);
+	l->calls.media_owner = c;
+
+	l->audiothread = g_steal_pointer(&q->audiothread);
+	l->local_rtp_port = q->local_rtp_port;
+	sstate->poll_data[AV_SIP_POLL_AUDIO(l->id)].fd = sstate->poll_data[AV_SIP_POLL_QUEUE(q->id)].fd;
+	sstate->poll_data[AV_SIP_POLL_AUDIO(l->id)].events = POLLIN;
+	sstate->poll_data[AV_SIP_POLL_QUEUE(q->id)].fd = -1;
+	av_sip_queued_release(q);
+
+	cmd = av_thread_cmd_str(CMD_AUDIO_SERIAL, 0, c->connection->serial_device);
+	if (cmd)
+		av_thread_txcmd(l->audiothread, cmd, 0);
+
+	if (av_sip_protocol_call_request_modem_call(c))
+		av_sip_protocol_call_reject(c, 500);
+}
+
+static void av_sip_queue_dispatch_lines(struct av_timer *t, gpointer data) {
+	int i;
+
+	for (i = 0; (i < AV_SIP_MAX_LINES) && sstate->queue.n; i++)
+		av_sip_queue_dispatch(&sstate->lines[i]);
+}
+
+/*
+ * Gets the registrar URI of a line, with the port SRV records told, unless
+ * the configured one had its own.
+*/
+static gchar *av_sip_line_registrar(struct av_sip_line *l, gint port) {
+	osip_uri_t *uri;
+	char *port_str;
+	char *str;
+	gchar *registrar = NULL;
+
+	if (!port || l->reg_port_explicit || osip_uri_init(&uri))
+		return g_strdup(l->sipconf->sip_host);
+
+	if (!osip_uri_parse(uri, l->sipconf->sip_host) && (port_str = osip_malloc(8))) {
+		g_snprintf(port_str, 8, "%d", port);
+		osip_uri_set_port(uri, port_str);
+		if (!osip_uri_to_str(uri, &str)) {
+			registrar = g_strdup(str);
+			osip_free(str);
+		}
 	}
 
+	osip_uri_free(uri);
+
+	return registrar ? registrar : g_strdup(l->sipconf->sip_host);
+}
+
+/*
+ * Sends the REGISTER of a line, the initial one or a refresh, its registrar
+ * being resolved.
+*/
+static void av_sip_line_send_register(struct av_sip_line *l, gint port) {
+	struct av_modem_config *mc = l->sipconf;
+	osip_message_t *regmsg;
+	gchar *registrar;
+	int retval;
+
 	eXosip_lock(sstate->sipctx);
-	sstate->reg_id = eXosip_register_build_initial_register(sstate->sipctx, mc->sip_id, mc->sip_host, NULL, 200, &regmsg);
-	if (sstate->reg_id < 1) {
-		g_printerr("Failure building initial SIP registration message\n");
-		eXosip_unlock(sstate->sipctx);
-		return 1;
+
+	if (l->reg_id < 1) {
+		registrar = av_sip_line_registrar(l, port);
+		l->reg_id = eXosip_register_build_initial_register(sstate->sipctx, mc->sip_id, registrar, NULL, AV_SIP_REG_EXPIRES, &regmsg);
+		retval = (l->reg_id < 1);
+		g_free(registrar);
 	}
+	else
+		retval = eXosip_register_build_register(sstate->sipctx, l->reg_id, AV_SIP_REG_EXPIRES, &regmsg);
+
+	if (retval)
+		g_printerr("Failure building SIP registration message (line %d)\n",l->id);
+	else if ( (retval = eXosip_register_send_register(sstate->sipctx, l->reg_id, regmsg)) )
+		g_printerr("Failure sending SIP REGISTER (line %d)\n",l->id);
+	else
+		av_sip_reg_sent(&l->reg);
+
+	eXosip_unlock(sstate->sipctx);
+
+	if (retval)
+		av_sip_reg_failure(&l->reg, 0);
+}
+
+/*
+ * Hands a resolved host over to eXosip, which looks into its own DNS cache
+ * before asking the system resolver.
+*/
+static void av_sip_dns_update(const gchar *host, const gchar *addr) {
+	struct eXosip_dns_cache entry = { 0 };
 
-	send_reg_retval = eXosip_register_send_register(sstate->sipctx, sstate->reg_id, regmsg);
+	g_strlcpy(entry.host, host, sizeof entry.host);
+	g_strlcpy(entry.ip, addr, sizeof entry.ip);
+
+	eXosip_lock(sstate->sipctx);
+	eXosip_set_option(sstate->sipctx, EXOSIP_OPT_DELETE_DNS_CACHE, &entry);
+	if (eXosip_set_option(sstate->sipctx, EXOSIP_OPT_ADD_DNS_CACHE, &entry))
+		g_printerr("Failure adding %s to eXosip DNS cache\n",host);
 	eXosip_unlock(sstate->sipctx);
+}
+
+static void av_sip_line_resolved(const gchar *addr, gint port, gpointer data) {
+	struct av_sip_line *l = data;
+
+	if (!addr) {
+		g_printerr("Unable to resolve %s (line %d)\n",l->reg_host,l->id);
+		av_sip_reg_failure(&l->reg, 0);
+		return;
+	}
+
+	av_sip_dns_update(l->reg_host, addr);
+	av_sip_line_send_register(l, port);
+}
+
+/*
+ * Registers a line, when the registration scheduler says so. Its registrar
+ * is looked up first, every time: most of the time the answer is cached, and
+ * when it's not, the reactor doesn't wait for it.
+*/
+static void av_sip_line_register(gpointer data) {
+	struct av_sip_line *l = data;
+
+	if (g_hostname_is_ip_address(l->reg_host))
+		av_sip_line_send_register(l, 0);
+	else
+		av_dns_resolve(&sstate->dns, l->reg_host, l->reg_port_explicit ? AV_DNS_A : av_sip_transport_dns[sstate->transport], av_sip_line_resolved, l);
+}
+
+/* Splits the SIP contacts calls from the GSM network ring at, dropping empty ones. */
+static gchar **av_sip_line_forward_parse(const gchar *list) {
+	gchar **contacts;
+	guint i;
+	guint n = 0;
+
+	contacts = g_strsplit(list, ",", -1);
+	for (i = 0; contacts[i]; i++) {
+		g_strstrip(contacts[i]);
+		if (!*contacts[i] || (n == AV_SIP_MAX_FORKS)) {
+			if (*contacts[i])
+				g_printerr("Only %d SIP contacts are rung at once, %s skipped\n",AV_SIP_MAX_FORKS,contacts[i]);
+			g_free(contacts[i]);
+			continue;
+		}
+		contacts[n++] = contacts[i];
+	}
+	contacts[n] = NULL;
+
+	if (!n)
+		g_clear_pointer(&contacts, g_free);
+
+	return contacts;
+}
+
+/* Registration itself is up to the scheduler: see av_sip_reg.c. */
+static gint av_sip_stackconfig(struct av_sip_line *l, struct av_modem_config *mc) {
+	osip_uri_t *uri;
+
+	if (av_sip_codec_prefs_parse(&l->codecs, mc->codecs))
+		return 1;
+
+	if (osip_uri_init(&uri))
+		return 1;
+
+	if (osip_uri_parse(uri, mc->sip_host) || !osip_uri_get_host(uri)) {
+		g_printerr("Invalid SIP host \"%s\"\n",mc->sip_host);
+		osip_uri_free(uri);
+		return 1;
+	}
+
+	l->reg_host = g_strdup(osip_uri_get_host(uri));
+	l->reg_port_explicit = (osip_uri_get_port(uri) != NULL);
+	osip_uri_free(uri);
+
+	/* Every answer of this line's calls comes from here. */
+	if (av_sip_sdp_init(&l->sdp, mc->sip_local_ip_addr)) {
+		g_clear_pointer(&l->reg_host, g_free);
+		return 1;
+	}
+
+	if (eXosip_add_authentication_info(sstate->sipctx, mc->username, mc->username, mc->password, NULL, NULL)) {
+		g_printerr("Failure adding authentication infos\n");
+		g_clear_pointer(&l->reg_host, g_free);
+		av_sip_sdp_deinit(&l->sdp);
+		return 1;
+	}
+
+	l->sipconf = mc;
+
+	/* Calls from the GSM network ring there: see av_sip_bridge_fork(). */
+	if (mc->forward_to)
+		l->forward = av_sip_line_forward_parse(mc->forward_to);
+
+	/* Lines sharing an account form a pool: see av_sip_pool.c. */
+	l->pool.n_calls = &l->calls.n_calls;
+	l->pool.group = mc->group;
+	l->pool.sim = mc->equipment_id;
+	l->pool.call_time_limit = (gint64)mc->sim_minutes * 60 * G_USEC_PER_SEC;
+	av_sip_pool_join(&sstate->pools, &l->pool, mc->username, l);
+
+	av_sip_reg_init(&l->reg, &sstate->reg_bucket, l);
+	av_sip_reg_start(&l->reg);
+
+	return 0;
+}
+
+static gboolean av_sip_config_complete(const struct av_modem_config *mc) {
+	return mc->username && mc->password && mc->sip_host && mc->sip_id && mc->modem_audio_port && mc->sip_local_ip_addr;
+}
+
+/*
+ * Sets a new line up, and registers it. A line failing to do so doesn't
+ * affect the others: it simply won't get any call.
+*/
+static gint av_sip_regconf(struct av_thread_cmd *cmd) {
+	struct av_modem_config *sipconf = cmd->payload;
+	struct av_sip_line *l;
+	gint retval = 1;
+
+	if ( (cmd->line < 0) || (cmd->line >= AV_SIP_MAX_LINES) || sstate->lines[cmd->line].in_use ) {
+		g_printerr("Invalid SIP line %d\n",cmd->line);
+		av_config_free(&sipconf);
+		return retval;
+	}
+
+	l = &sstate->lines[cmd->line];
+
+	if (av_sip_config_complete(sipconf)) {
+		if ( (retval = av_sip_stackconfig(l, sipconf)) )
+			av_config_free(&sipconf);
+	}
+	else
+		av_config_free(&sipconf);
+
+	if (!retval) {
+		l->in_use = TRUE;
+		sstate->n_lines++;
+		g_print("SIP line %d is %s (%u lines)\n",l->id,sipconf->username,sstate->n_lines);
+	}
+
+	return retval;
+}
+
+/*
+ * Switches a line without calls to the settings it was given last: it gets
+ * unregistered, then set up again and registered from scratch. Without
+ * settings, or with unusable ones, it's left unconfigured: its slot stays
+ * its modem's, for the next reload to fill.
+*/
+static void av_sip_line_reconfigure(struct av_sip_line *l) {
+	struct av_modem_config *mc = g_steal_pointer(&l->sipconf_next);
+	int id = l->id;
+
+	l->reconfigure = FALSE;
+
+	av_sip_line_unregister(l);
+
+	av_config_free(&l->sipconf);
+	g_clear_pointer(&l->reg_host, g_free);
+	g_clear_pointer(&l->forward, g_strfreev);
+	av_sip_sdp_deinit(&l->sdp);
+
+	if (mc && av_sip_config_complete(mc) && !av_sip_stackconfig(l, mc)) {
+		g_print("SIP line %d reconfigured as %s\n",id,mc->username);
+		return;
+	}
+
+	av_config_free(&mc);
+	av_sip_line_clear(l);
+	g_print("SIP line %d unconfigured (%u lines)\n",id,sstate->n_lines);
+}
+
+/*
+ * New settings for a line, after the configuration was reloaded. Lines with
+ * calls going on keep their settings until the last call is over.
+*/
+static void av_sip_line_config_changed(struct av_thread_cmd *cmd) {
+	struct av_modem_config *sipconf = cmd->payload;
+	struct av_sip_line *l;
+
+	l = av_sip_line_get(cmd->line);
+	if (!l) {
+		/* Not configured yet: it's a line like any other now. */
+		if (sipconf && av_sip_regconf(cmd))
+			g_printerr("SIP line %d not configured\n",cmd->line);
+		return;
+	}
+
+	if (l->removing) {
+		av_config_free(&sipconf);
+		return;
+	}
+
+	av_config_free(&l->sipconf_next);
+	l->sipconf_next = sipconf;
+	l->reconfigure = TRUE;
+
+	if (l->calls.n_calls || l->audiothread || l->audiothread_stopping) {
+		g_print("SIP line %d will be reconfigured once its calls are over\n",l->id);
+		return;
+	}
+
+	av_sip_line_reconfigure(l);
+}
+
+/* Compiles the configured dial plan: NULL if its routes could not be read. */
+static struct av_dialplan *av_sip_dialplan_load(void) {
+	struct av_dialplan_config conf;
+	struct av_dialplan *dp;
+
+	av_config_dialplan(&conf);
+	dp = av_dialplan_load(&conf);
+	av_config_dialplan_clear(&conf);
+
+	return dp;
+}
+
+/* Reactor-wide settings that can change while running. */
+static void av_sip_reload(void) {
+	struct av_dialplan *dp;
+
+	dp = av_sip_dialplan_load();
+	if (!dp) {
+		g_printerr("Keeping the dial plan in use\n");
+		return;
+	}
+
+	av_dialplan_free(sstate->dialplan);
+	sstate->dialplan = dp;
+}
+
+static void av_sip_core_poll_setup(void) {
+	int i;
+
+	sstate->poll_data[0].fd = av_thread_eventfd(sstate->self, 1);
+	sstate->poll_data[0].events = POLLIN;
+
+	/* No audio thread yet. */
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		sstate->poll_data[AV_SIP_POLL_AUDIO(i)].fd = -1;
+	for (i = 0; i < AV_SIP_QUEUE_MAX; i++)
+		sstate->poll_data[AV_SIP_POLL_QUEUE(i)].fd = -1;
+}
+
+static gboolean av_sip_has_calls(void) {
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		if (sstate->lines[i].calls.n_calls)
+			return TRUE;
+
+	return sstate->queue.n > 0;
+}
+
+/* Makes sure eXosip housekeeping runs within delay from now. */
+static void av_sip_automatic_action_within(gint64 delay) {
+	gint64 deadline = g_get_monotonic_time() + delay;
+
+	if (!av_timer_pending(&sstate->automatic_action) || (sstate->automatic_action.deadline > deadline))
+		av_timer_arm(&sstate->timers, &sstate->automatic_action, deadline);
+}
+
+static void av_sip_automatic_action(struct av_timer *t, gpointer data) {
+	gboolean busy;
+
+	eXosip_lock(sstate->sipctx);
+	eXosip_automatic_action(sstate->sipctx);
+	eXosip_unlock(sstate->sipctx);
+
+	busy = av_sip_has_calls() || (g_get_monotonic_time() - sstate->last_activity < AV_SIP_TRANSACTION_LIFETIME_USEC);
+	av_sip_automatic_action_within(busy ? AV_SIP_HOUSEKEEPING_BUSY_USEC : AV_SIP_HOUSEKEEPING_IDLE_USEC);
+}
+
+static gint av_sip_timers_setup(void) {
+	if (av_timer_wheel_init(&sstate->timers))
+		return 1;
+
+	sstate->poll_data[2].fd = av_timer_wheel_fd(&sstate->timers);
+	sstate->poll_data[2].events = POLLIN;
+
+	av_timer_init(&sstate->automatic_action, av_sip_automatic_action, NULL);
+	av_sip_automatic_action_within(G_USEC_PER_SEC);
+
+	return 0;
+}
+
+static void av_sip_timers_teardown(void) {
+	av_timer_wheel_deinit(&sstate->timers, "SIP");
+	sstate->poll_data[2].fd = -1;
+}
+
+/*
+ * Gets the value of a header which isn't parsed by osip, trying its compact
+ * form too, if any.
+*/
+static const char *av_sip_protocol_header_value(osip_message_t *m, const char *name, const char *compact_name, int pos) {
+	osip_header_t *h = NULL;
+
+	if ((osip_message_header_get_byname(m, name, pos, &h) < 0) && compact_name)
+		osip_message_header_get_byname(m, compact_name, pos, &h);
+
+	return h ? h->hvalue : NULL;
+}
+
+static gboolean av_sip_protocol_supports_timer(osip_message_t *m) {
+	const char *value;
+	gchar **options;
+	gboolean retval = FALSE;
+	int pos;
+	int i;
+
+	for (pos = 0; !retval && (value = av_sip_protocol_header_value(m, "supported", "k", pos)); pos++) {
+		options = g_strsplit(value, ",", -1);
+		for (i = 0; options[i]; i++)
+			if (!g_ascii_strcasecmp(g_strstrip(options[i]), "timer"))
+				retval = TRUE;
+		g_strfreev(options);
+	}
+
+	return retval;
+}
+
+/* Parses a Session-Expires value: the interval, and the refresher if any ("uac" or "uas"). */
+static gint av_sip_protocol_session_expires(const char *value, gchar *refresher, gsize size) {
+	gchar **params;
+	gchar *param;
+	gint interval;
+	int i;
+
+	*refresher = '\0';
+
+	params = g_strsplit(value, ";", -1);
+	interval = atoi(params[0]);
+	for (i = 1; params[i]; i++) {
+		param = g_strstrip(params[i]);
+		if (!g_ascii_strncasecmp(param, "refresher=", 10))
+			g_strlcpy(refresher, param + 10, size);
+	}
+	g_strfreev(params);
+
+	return interval;
+}
+
+/* The refresher goes at half the interval; the other side waits until shortly before expiration. */
+static void av_sip_protocol_session_timer_arm(struct av_sip_session_timer *st) {
+	gint interval = st->interval;
+
+	if (st->uas_refresh)
+		av_timer_arm(&sstate->timers, &st->timer, g_get_monotonic_time() + (gint64)(interval/2) * G_USEC_PER_SEC);
+	else
+		av_timer_arm(&sstate->timers, &st->timer, g_get_monotonic_time() + (gint64)(interval - MIN(32, interval/3)) * G_USEC_PER_SEC);
+}
+
+/*
+ * Session timers (RFC 4028): picks up the session interval and refresher
+ * from an INVITE, re-INVITE or UPDATE. Unless the PBX wants to refresh the
+ * session itself, we do it with UPDATE requests.
+ *
+ * Returns: non-zero if the interval is below our Min-SE, and the request must
+ * be rejected with a 422.
+*/
+static gint av_sip_protocol_session_timer_request(struct av_sip_call *c, osip_message_t *req) {
+	struct av_sip_session_timer *st = &c->session_timer;
+	const char *value;
+	gchar refresher[8];
+	gint interval;
+
+	value = av_sip_protocol_header_value(req, "session-expires", "x", 0);
+	if (!value) {
+		st->interval = 0;
+		av_timer_cancel(&sstate->timers, &st->timer);
+		return 0;
+	}
+
+	interval = av_sip_protocol_session_expires(value, refresher, sizeof refresher);
+	if (interval < AV_SIP_MIN_SE) {
+		g_printerr("Session interval of %d seconds is too short\n",interval);
+		return 1;
+	}
+
+	st->interval = interval;
+	st->peer_supported = av_sip_protocol_supports_timer(req);
+	st->uas_refresh = !st->peer_supported || !g_ascii_strcasecmp(refresher, "uas");
+
+	return 0;
+}
+
+/* Adds our session timer headers to a 2xx answer, and (re)starts the timer. */
+static void av_sip_protocol_session_timer_answer(struct av_sip_call *c, osip_message_t *answer) {
+	struct av_sip_session_timer *st = &c->session_timer;
+	gchar *value;
+	gint interval = st->interval;
+
+	if (!interval)
+		return;
+
+	value = g_strdup_printf("%d;refresher=%s",interval,st->uas_refresh ? "uas" : "uac");
+	osip_message_set_header(answer, "Session-Expires", value);
+	g_clear_pointer(&value, g_free);
+
+	if (st->peer_supported)
+		osip_message_set_header(answer, "Require", "timer");
+
+	av_sip_protocol_session_timer_arm(st);
+}
+
+/* Rejects a too short session interval, telling the PBX the one we accept. */
+static void av_sip_protocol_session_timer_reject(int tid) {
+	osip_message_t *answer;
+	gchar *min_se;
+
+	if (eXosip_call_build_answer(sstate->sipctx, tid, 422, &answer)) {
+		g_printerr("Failure building 422 answer\n");
+		return;
+	}
+
+	min_se = g_strdup_printf("%d",AV_SIP_MIN_SE);
+	osip_message_set_header(answer, "Min-SE", min_se);
+	g_clear_pointer(&min_se, g_free);
+
+	if (eXosip_call_send_answer(sstate->sipctx, tid, 422, answer))
+		g_printerr("Failure sending 422 answer\n");
+}
+
+/*
+ * Refreshes a session with an UPDATE without SDP: no media renegotiation. We
+ * are its UAC, and stay the refresher (RFC 4028, section 7.4): the 2xx
+ * re-arms the timer, see av_sip_protocol_session_refreshed(). Until then it
+ * goes off again at half the interval, for another try.
+*/
+static void av_sip_protocol_session_refresh(struct av_sip_call *c) {
+	struct av_sip_session_timer *st = &c->session_timer;
+	osip_message_t *update;
+	gchar *value;
+
+	av_timer_arm(&sstate->timers, &st->timer, g_get_monotonic_time() + (gint64)(st->interval/2) * G_USEC_PER_SEC);
+
+	if (eXosip_call_build_request(sstate->sipctx, c->event->did, "UPDATE", &update)) {
+		g_printerr("Failure building session refresh for call %d\n",c->event->cid);
+		return;
+	}
+
+	value = g_strdup_printf("%d;refresher=uac",st->interval);
+	osip_message_set_header(update, "Session-Expires", value);
+	osip_message_set_supported(update, "timer");
+	g_clear_pointer(&value, g_free);
+
+	if (eXosip_call_send_request(sstate->sipctx, c->event->did, update))
+		g_printerr("Failure sending session refresh for call %d\n",c->event->cid);
+}
+
+/*
+ * The PBX answered our session refresh: its 2xx has the last word on the
+ * interval and the refresher (RFC 4028, section 7.2). No Session-Expires in
+ * it means no session timer anymore.
+*/
+static void av_sip_protocol_session_refreshed(eXosip_event_t *e) {
+	struct av_sip_session_timer *st;
+	struct av_sip_call *c;
+	const char *value;
+	gchar refresher[8];
+	gint interval;
+
+	if (!e->request || !e->response || !MSG_IS_UPDATE(e->request))
+		return;
+
+	c = av_sip_find_call_by_cid(e->cid);
+	if (!c || !c->session_timer.interval)
+		return;
+
+	st = &c->session_timer;
+
+	value = av_sip_protocol_header_value(e->response, "session-expires", "x", 0);
+	if (!value) {
+		g_print("Session timer of call %d dropped by the PBX\n",e->cid);
+		st->interval = 0;
+		av_timer_cancel(&sstate->timers, &st->timer);
+		return;
+	}
+
+	interval = av_sip_protocol_session_expires(value, refresher, sizeof refresher);
+	if (interval > 0)
+		st->interval = interval;
+
+	/* We sent the UPDATE: "uac" is us. */
+	st->uas_refresh = (g_ascii_strcasecmp(refresher, "uas") != 0);
+
+	av_sip_protocol_session_timer_arm(st);
+}
+
+/*
+ * Session timer of an answered call: refreshes the session if we're in
+ * charge of it, or hangs up if the PBX stopped refreshing it.
+*/
+static void av_sip_protocol_session_timer_expired(struct av_timer *t, gpointer data) {
+	struct av_sip_call *c = data;
+
+	if (!c->in_use || !c->session_timer.interval)
+		return;
+
+	eXosip_lock(sstate->sipctx);
+
+	if (c->session_timer.uas_refresh)
+		av_sip_protocol_session_refresh(c);
+	else {
+		g_print("Session of call %d expired\n",c->event->cid);
+		if (eXosip_call_terminate(sstate->sipctx, c->event->cid, c->event->did))
+			g_printerr("Failure terminating call %d\n",c->event->cid);
+		av_sip_protocol_call_end_call(c);
+	}
+
+	eXosip_unlock(sstate->sipctx);
+}
+
+/* Accounts for the time it took to build an SDP answer. */
+static void av_sip_sdp_stats_answer(gint64 elapsed) {
+	struct av_sip_sdp_stats *st = &sstate->sdp;
+
+	st->n_answers++;
+	st->total += elapsed;
+	if (elapsed > st->max)
+		st->max = elapsed;
+}
+
+static void av_sip_sdp_stats_report(void) {
+	struct av_sip_sdp_stats *st = &sstate->sdp;
+
+	if (st->n_answers)
+		g_print("SDP: %u answers built in %.2f us on average, max %" G_GINT64_FORMAT " us\n",
+			st->n_answers, (gdouble)st->total/st->n_answers, st->max);
+}
+
+/* The SDP template and RTP port of a call: its line's, or its own while it's queued. */
+static struct av_sip_sdp *av_sip_call_media(struct av_sip_call *c, int *port) {
+	struct av_sip_queued *q;
+
+	if (c->line < 0) {
+		q = (struct av_sip_queued *)((gchar *)c - G_STRUCT_OFFSET(struct av_sip_queued, call));
+		*port = q->local_rtp_port;
+		return &q->sdp;
+	}
+
+	*port = sstate->lines[c->line].local_rtp_port;
+	return &sstate->lines[c->line].sdp;
+}
+
+/* Fills the SDP body of an answer in, from the template of the call's line. */
+static gint av_sip_protocol_call_answer_sdp(struct av_sip_call *c, osip_message_t *answer, const char *direction) {
+	struct av_sip_sdp *template;
+	int port;
+	const gchar *sdp;
+	gsize len;
+	gint64 start = g_get_monotonic_time();
+
+	template = av_sip_call_media(c, &port);
+	sdp = av_sip_sdp_render(template, c->sdp_session_id, c->sdp_version, port, &c->codecs, direction, &len);
+
+	/*
+	 * RFC 3264, section 8: same origin for the whole dialog, new version
+	 * whenever the body differs from the last one (direction, codec, port).
+	*/
+	if (sdp && c->sdp_sent && (g_str_hash(sdp) != c->sdp_hash)) {
+		c->sdp_version++;
+		sdp = av_sip_sdp_render(template, c->sdp_session_id, c->sdp_version, port, &c->codecs, direction, &len);
+	}
+
+	if (!sdp) {
+		g_printerr("Failure building SDP\n");
+		return 1;
+	}
+
+	c->sdp_sent = TRUE;
+	c->sdp_hash = g_str_hash(sdp);
+
+	if (osip_message_set_content_type(answer, "application/sdp")) {
+		g_printerr("Failure setting answer message content type\n");
+		return 1;
+	}
+
+	/* osip makes its own copy. */
+	if (osip_message_set_body(answer, sdp, len)) {
+		g_printerr("Failure attaching SDP to answer\n");
+		return 1;
+	}
+
+	av_sip_sdp_stats_answer(g_get_monotonic_time() - start);
+
+	return 0;
+}
+
+/*
+ * Sends an answer carrying our SDP, for the given transaction. Welcome to the
+ * F7 stage of the call, when this is a 183 message: the SDP allows for early
+ * media. The caller must hold eXosip lock.
+*/
+static gint av_sip_protocol_call_send_sdp_answer(struct av_sip_call *c, int tid, int status, const char *direction) {
+	osip_message_t *answer;
+	gint retval = 0;
+
+	if (eXosip_call_build_answer(sstate->sipctx, tid, status, &answer)) {
+		g_printerr("Failure building answer\n");
+		return ++retval;
+	}
+
+	if (av_sip_protocol_call_answer_sdp(c, answer, direction)) {
+		retval++;
+		goto out;
+	}
+
+	if ((status/100) == 2)
+		av_sip_protocol_session_timer_answer(c, answer);
+
+	if (eXosip_call_send_answer(sstate->sipctx, tid, status, answer)) {
+		g_printerr("Failure sending answer\n");
+		retval++;
+		goto out;
+	}
+
+out:
+	if (retval)
+		g_clear_pointer(&answer, osip_message_free);
+
+	return retval;
+}
+
+static gint av_sip_protocol_call_stage1(struct av_sip_call *c) {
+	gint retval;
+
+	eXosip_lock(sstate->sipctx);
+	retval = av_sip_protocol_call_send_sdp_answer(c, c->event->tid, 183, NULL);
+	eXosip_unlock(sstate->sipctx);
+
+	return retval;
+}
+
+static void av_sip_setup_timing_report(struct av_sip_call *c) {
+	struct av_sip_call_timing *t = &c->timing;
+	struct av_sip_pdd_stats *pdd = &sstate->pdd;
+	gint64 call_pdd;
+
+	call_pdd = t->early_media - t->invite;
+	pdd->n_calls++;
+	pdd->total += call_pdd;
+	if (call_pdd > pdd->max)
+		pdd->max = call_pdd;
+
+	g_print("Call setup (ms after INVITE): 180 %" G_GINT64_FORMAT ", media ready %" G_GINT64_FORMAT ", modem call started %" G_GINT64_FORMAT ", 183 %" G_GINT64_FORMAT "\n",
+		(t->ringing - t->invite)/1000,
+		(t->media_ready - t->invite)/1000,
+		t->call_started ? (t->call_started - t->invite)/1000 : -1,
+		call_pdd/1000);
+	g_print("Post-dial delay over %u calls: average %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms\n",
+		pdd->n_calls, pdd->total/pdd->n_calls/1000, pdd->max/1000);
+}
+
+/*
+ * Media setup and modem call setup run in parallel: this function is invoked
+ * each time one of them progresses, and sends the 183 when both are done.
+ * The modem will take a while before the call gets answered: early media
+ * negotiated with the 183 is there, so let the caller hear ringback
+ * meanwhile. If no modem call could be placed instead, the caller is told so
+ * with the "unavailable" announcement, and the call is rejected once it has
+ * been played (see AUDIO_EVENT_PROMPT_DONE).
+ *
+ * Prompts go where the media path points to: callers of calls waiting behind
+ * an active one hear nothing until their call becomes active.
+*/
+static void av_sip_protocol_call_setup_progress(struct av_sip_call *c) {
+	struct av_sip_line *l = av_sip_call_line(c);
+	guint flags = c->setup_flags;
+	gboolean owns_media;
+
+	if (!(flags & AV_SIP_SETUP_MEDIA_READY) || (flags & AV_SIP_SETUP_EARLY_MEDIA))
+		return;
+
+	if (!(flags & (AV_SIP_SETUP_CALL_STARTED | AV_SIP_SETUP_CALL_FAILED)))
+		return;
+
+	owns_media = (l->calls.media_owner == c);
+
+	if ( ((flags & AV_SIP_SETUP_CALL_FAILED) && !owns_media) || av_sip_protocol_call_stage1(c) ) {
+		av_sip_protocol_call_reject(c, (flags & AV_SIP_SETUP_CALL_FAILED) ? 503 : 500);
+		return;
+	}
+
+	c->setup_flags |= AV_SIP_SETUP_EARLY_MEDIA;
+	c->timing.early_media = g_get_monotonic_time();
+
+	if (flags & AV_SIP_SETUP_CALL_FAILED) {
+		av_sip_audio_cmd(l, CMD_AUDIO_PROMPT_PLAY, GINT_TO_POINTER(AV_PROMPT_UNAVAILABLE));
+		return;
+	}
+
+	if (owns_media)
+		av_sip_audio_cmd(l, CMD_AUDIO_PROMPT_PLAY, GINT_TO_POINTER(AV_PROMPT_RINGBACK));
+
+	av_sip_setup_timing_report(c);
+}
+
+static void av_sip_protocol_call_in_progress(int line, int cid, const gchar *call_path) {
+	struct av_sip_line *l;
+	struct av_sip_call *c = NULL;
+
+	/* The SIP call (or even its line) is already gone: the modem call is an orphan. */
+	if ( (l = av_sip_line_get(line)) )
+		c = av_sip_call_find_by_cid(&l->calls, cid);
+	if (!c || c->path) {
+		g_print("No SIP call waiting for %s\n",call_path);
+		av_sip_core_call_ended(line, call_path);
+		return;
+	}
+
+	av_sip_protocol_call_dequeue(c);
+	c->path = g_strdup(call_path);
+	g_print("Call @ %s\n",c->path);
+
+	c->setup_flags |= AV_SIP_SETUP_CALL_STARTED;
+	c->timing.call_started = g_get_monotonic_time();
+	av_sip_protocol_call_setup_progress(c);
+}
+
+static void av_sip_protocol_call_failed(struct av_sip_line *l, int cid) {
+	struct av_sip_call *c;
+
+	c = av_sip_call_find_by_cid(&l->calls, cid);
+	if (!c)
+		return;
+
+	av_sip_protocol_call_dequeue(c);
+	c->setup_flags |= AV_SIP_SETUP_CALL_FAILED;
+	av_sip_protocol_call_setup_progress(c);
+}
+
+static void av_sip_bridge_timing_report(struct av_sip_call *c) {
+	struct av_sip_bridge_stats *st = &sstate->bridge;
+	gint64 sip = c->fork.sip_answered - c->fork.ringing;
+	gint64 modem = c->timing.answered - c->fork.ringing;
+
+	st->n_calls++;
+	st->sip_total += sip;
+	st->modem_total += modem;
+	if (sip > st->sip_max)
+		st->sip_max = sip;
+	if (modem > st->modem_max)
+		st->modem_max = modem;
+
+	g_print("Call from the GSM network bridged (ms after ringing): SIP answer %" G_GINT64_FORMAT ", modem call active %" G_GINT64_FORMAT "\n",
+		sip/1000, modem/1000);
+	g_print("Ring to answer over %u bridged calls: SIP average %" G_GINT64_FORMAT " ms (max %" G_GINT64_FORMAT " ms), modem average %" G_GINT64_FORMAT " ms (max %" G_GINT64_FORMAT " ms)\n",
+		st->n_calls, st->sip_total/st->n_calls/1000, st->sip_max/1000, st->modem_total/st->n_calls/1000, st->modem_max/1000);
+}
+
+/*
+ * The modem made a call active: answer it if it was not yet, and switch the
+ * media path to it. Real audio replaces whatever prompt we were playing.
+ * Calls from the GSM network were answered on SIP already: the modem call
+ * getting active is the end of their setup.
+*/
+static void av_sip_protocol_call_active(struct av_sip_line *l, const gchar *call_path) {
+	struct av_sip_call *c;
+
+	c = av_sip_call_find_by_path(&l->calls, call_path);
+	if (!c)
+		return;
+
+	c->held = FALSE;
+
+	if ( (c->setup_flags & AV_SIP_SETUP_BRIDGED) && !c->timing.answered ) {
+		c->timing.answered = g_get_monotonic_time();
+		av_sip_bridge_timing_report(c);
+	}
+
+	if (!(c->setup_flags & AV_SIP_SETUP_ANSWERED)) {
+		eXosip_lock(sstate->sipctx);
+		if (av_sip_protocol_call_send_sdp_answer(c, c->event->tid, 200, NULL))
+			g_printerr("Failure answering call %d\n",c->event->cid);
+		else {
+			c->setup_flags |= AV_SIP_SETUP_ANSWERED;
+			c->timing.answered = g_get_monotonic_time();
+		}
+		eXosip_unlock(sstate->sipctx);
+	}
+
+	if (l->calls.media_owner != c)
+		av_sip_audio_retarget(c);
+
+	av_sip_audio_cmd(l, CMD_AUDIO_PROMPT_STOP, NULL);
+}
+
+/*
+ * The modem put a call on hold, e.g.: because another one was placed or
+ * retrieved. The media path follows the next active call.
+*/
+static void av_sip_protocol_call_held(struct av_sip_line *l, const gchar *call_path) {
+	struct av_sip_call *c;
+
+	c = av_sip_call_find_by_path(&l->calls, call_path);
+	if (c)
+		c->held = TRUE;
+}
+
+/*
+ * Tells whether an SDP offer puts the audio stream on hold, and if so, which
+ * direction attribute our answer should carry (RFC 3264, section 8.4). The
+ * old way of holding a call, a 0.0.0.0 connection address, is supported too.
+ *
+ * Returns: NULL if the offer doesn't hold the call.
+*/
+static const char *av_sip_protocol_sdp_hold_answer(sdp_message_t *sdp) {
+	const char *field;
+	sdp_connection_t *conn;
+	int pos;
+	int i;
+
+	for (pos = 0; !sdp_message_endof_media(sdp, pos); pos++) {
+		if (g_strcmp0(sdp_message_m_media_get(sdp, pos), "audio"))
+			continue;
+
+		for (i = 0; (field = sdp_message_a_att_field_get(sdp, pos, i)); i++) {
+			if (!g_strcmp0(field, "sendonly"))
+				return "recvonly";
+			if (!g_strcmp0(field, "inactive"))
+				return "inactive";
+		}
+	}
+
+	conn = eXosip_get_audio_connection(sdp);
+	if (conn && !g_strcmp0(conn->c_addr, "0.0.0.0"))
+		return "recvonly";
+
+	return NULL;
+}
+
+/*
+ * The caller moved its RTP stream (new address, port or payload type): the
+ * RTP session of the audio thread follows in place, without tearing anything
+ * down, so that media isn't interrupted.
+*/
+static void av_sip_protocol_call_update_media(struct av_sip_call *c, struct av_rtp_connection *connection) {
+	struct av_rtp_connection *old = c->connection;
+
+	if ( !g_strcmp0(connection->addr, old->addr) && (connection->port == old->port) && (connection->payload_type == old->payload_type) && (connection->codec == old->codec) ) {
+		av_sip_rtp_connection_free(&connection);
+		return;
+	}
+
+	g_print("Call %d RTP moves to %s:%d (%s, payload type %d)\n",c->event->cid,connection->addr,connection->port,av_sip_codec_get(connection->codec)->name,connection->payload_type);
+
+	connection->call_direction = old->call_direction;
+	connection->serial_device = g_steal_pointer(&old->serial_device);
+	av_sip_rtp_connection_free(&c->connection);
+	c->connection = connection;
+
+	if (av_sip_call_line(c)->calls.media_owner == c)
+		av_sip_audio_retarget(c);
+}
+
+/* Answers an UPDATE without SDP, i.e.: a plain session refresh. */
+static void av_sip_protocol_call_send_refresh_answer(struct av_sip_call *c, int tid) {
+	osip_message_t *answer;
+
+	if (eXosip_call_build_answer(sstate->sipctx, tid, 200, &answer)) {
+		g_printerr("Failure building refresh answer\n");
+		return;
+	}
+
+	av_sip_protocol_session_timer_answer(c, answer);
+
+	if (eXosip_call_send_answer(sstate->sipctx, tid, 200, answer))
+		g_printerr("Failure sending refresh answer\n");
+}
+
+/*
+ * Rings the SIP contacts of the line all at once, with our SDP offer: RTP
+ * goes to whoever answers first. Must be invoked once media is ready, for the
+ * offer to carry our RTP port.
+*/
+static void av_sip_bridge_fork(struct av_sip_call *c) {
+	struct av_sip_line *l = av_sip_call_line(c);
+	struct av_sip_fork *f = &c->fork;
+	osip_message_t *invite;
+	const gchar *sdp;
+	gchar *from;
+	gsize len;
+	guint i;
+	int cid;
+
+	if (f->n_cids)
+		return;
+
+	from = g_strdup_printf("sip:%s@%s",*c->number ? c->number : "anonymous",l->reg_host);
+
+	eXosip_lock(sstate->sipctx);
+
+	for (i = 0; l->forward[i]; i++) {
+		if (eXosip_call_build_initial_invite(sstate->sipctx, &invite, l->forward[i], from, NULL, NULL)) {
+			g_printerr("Failure building INVITE to %s\n",l->forward[i]);
+			continue;
+		}
+
+		sdp = av_sip_sdp_render(&l->sdp, c->sdp_session_id, c->sdp_version, l->local_rtp_port, &c->codecs, NULL, &len);
+		if (!sdp || osip_message_set_content_type(invite, "application/sdp") || osip_message_set_body(invite, sdp, len)) {
+			g_printerr("Failure attaching SDP to INVITE to %s\n",l->forward[i]);
+			osip_message_free(invite);
+			continue;
+		}
+
+		c->sdp_hash = g_str_hash(sdp);
+
+		/* eXosip takes the INVITE, whatever the outcome. */
+		cid = eXosip_call_send_initial_invite(sstate->sipctx, invite);
+		if (cid <= 0) {
+			g_printerr("Failure sending INVITE to %s\n",l->forward[i]);
+			continue;
+		}
+
+		f->cids[f->n_cids++] = cid;
+		f->n_pending++;
+	}
+
+	eXosip_unlock(sstate->sipctx);
+	g_free(from);
+
+	c->sdp_sent = TRUE;
+
+	if (!f->n_pending) {
+		g_printerr("No SIP contact could be rung for %s\n",c->path);
+		av_sip_protocol_call_end_call(c);
+		return;
+	}
+
+	g_print("Ringing %u SIP contact(s) for %s, %" G_GINT64_FORMAT " ms after the modem\n",f->n_pending,c->path,(g_get_monotonic_time() - f->ringing)/1000);
+}
+
+/*
+ * Nobody answered on SIP in time: stop ringing there, and hang the modem call
+ * up (see av_sip_protocol_call_end_call()).
+*/
+static void av_sip_bridge_timeout(struct av_timer *t, gpointer data) {
+	struct av_sip_call *c = data;
+
+	if (!c->in_use || (c->setup_flags & AV_SIP_SETUP_ANSWERED))
+		return;
+
+	g_print("No SIP answer for %s in %d s\n",c->path,av_sip_call_line(c)->sipconf->forward_timeout);
+
+	eXosip_lock(sstate->sipctx);
+	av_sip_bridge_cancel(c);
+	eXosip_unlock(sstate->sipctx);
+
+	av_sip_protocol_call_end_call(c);
+}
+
+/*
+ * A call from the GSM network is ringing on the modem of a line: offer it to
+ * the SIP contacts of the line, if any. The modem call is only answered once
+ * one of them did. RTP has no remote party until then: the audio thread gets
+ * one when the call is answered (see av_sip_bridge_answered()).
+*/
+static void av_sip_bridge_ringing(struct av_sip_line *l, const gchar *call_path, const gchar *number, gint64 ringing) {
+	struct av_rtp_connection *connection;
+	struct av_sip_codec_choice choice;
+	struct av_sip_call *c;
+
+	if (!l->forward || av_sip_call_find_by_path(&l->calls, call_path))
+		return;
+
+	if (av_sip_codec_offer(&l->codecs, &choice))
+		return;
+
+	connection = av_sip_rtp_connection_alloc(NULL, 0, l->sipconf->modem_audio_port);
+	if (!connection)
+		return;
+
+	connection->call_direction = SIP_CALL_OUTGOING;
+	connection->payload_type = choice.payload_type;
+	connection->codec = choice.codec;
+
+	c = av_sip_call_alloc(&l->calls, NULL);
+	if (!c) {
+		g_print("No room on line %d for %s\n",l->id,call_path);
+		av_sip_rtp_connection_free(&connection);
+		return;
+	}
+
+	c->line = l->id;
+	c->connection = connection;
+	c->codecs = choice;
+	c->path = g_strdup(call_path);
+	c->setup_flags = AV_SIP_SETUP_BRIDGED;
+	if (number)
+		g_strlcpy(c->number, number, sizeof c->number);
+	av_timer_init(&c->session_timer.timer, av_sip_protocol_session_timer_expired, c);
+	av_timer_init(&c->fork.timer, av_sip_bridge_timeout, c);
+	c->fork.ringing = ringing;
+	c->sdp_session_id = random();
+	c->sdp_version = random();
+
+	g_print("Call @ %s from %s on line %d\n",call_path,number ? number : "an unknown number",l->id);
+
+	av_timer_arm(&sstate->timers, &c->fork.timer, g_get_monotonic_time() + (gint64)l->sipconf->forward_timeout * G_USEC_PER_SEC);
+
+	if (!l->calls.media_owner)
+		l->calls.media_owner = c;
+
+	if (l->media_ready) {
+		c->setup_flags |= AV_SIP_SETUP_MEDIA_READY;
+		c->timing.media_ready = c->timing.invite;
+		av_sip_bridge_fork(c);
+		return;
+	}
+
+	if (!l->audiothread && av_sip_start_audio_thread(l))
+		av_sip_protocol_call_end_call(c);
+}
+
+/* Our INVITE is done with: either it failed, or another one was answered. */
+static void av_sip_bridge_fork_done(struct av_sip_fork *f, int cid) {
+	guint k;
+
+	for (k = 0; k < f->n_cids; k++) {
+		if (f->cids[k] == cid) {
+			f->cids[k] = -1;
+			f->n_pending--;
+			return;
+		}
+	}
+}
+
+static struct av_sip_call *av_sip_bridge_find(int cid) {
+	struct av_sip_call *c;
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++)
+		if (sstate->lines[i].in_use && (c = av_sip_call_find_by_fork(&sstate->lines[i].calls, cid)))
+			return c;
+
+	return NULL;
+}
+
+/* Acknowledges a 2xx to one of our INVITEs. Must be invoked with eXosip lock held. */
+static void av_sip_bridge_ack(eXosip_event_t *e) {
+	osip_message_t *ack;
+
+	if (eXosip_call_build_ack(sstate->sipctx, e->tid, &ack)) {
+		g_printerr("Failure building ACK for call %d\n",e->cid);
+		return;
+	}
+
+	if (eXosip_call_send_ack(sstate->sipctx, e->tid, ack))
+		g_printerr("Failure sending ACK for call %d\n",e->cid);
+}
+
+/*
+ * A SIP contact answered: the first one gets the call, and everybody else
+ * stops ringing. Latecomers, or answers we can't make sense of, get ACKed and
+ * hung up right away. The modem is then asked to answer the call, media
+ * following as soon as it's active. Must be invoked with eXosip lock held.
+ *
+ * Returns:
+ *   non-zero when we keep the event: the call's dialog lives in it.
+*/
+static gint av_sip_bridge_answered(eXosip_event_t *e) {
+	struct av_rtp_connection *connection;
+	struct av_sip_codec_choice choice;
+	struct av_thread_cmd *cmd;
+	struct av_sip_call *c;
+	struct av_sip_line *l;
+
+	av_sip_bridge_ack(e);
+
+	c = av_sip_bridge_find(e->cid);
+	if (!c) {
+		if (eXosip_call_terminate(sstate->sipctx, e->cid, e->did))
+			g_printerr("Failure terminating call %d\n",e->cid);
+		return 0;
+	}
+
+	l = av_sip_call_line(c);
+	av_sip_bridge_fork_done(&c->fork, e->cid);
+
+	if (av_sip_protocol_call_stage0_handle_remote_sdp(e, l, &connection, &choice)) {
+		g_printerr("Unusable SDP answer for %s\n",c->path);
+		if (eXosip_call_terminate(sstate->sipctx, e->cid, e->did))
+			g_printerr("Failure terminating call %d\n",e->cid);
+		if (!c->fork.n_pending)
+			av_sip_protocol_call_end_call(c);
+		return 0;
+	}
+
+	av_sip_bridge_cancel(c);
+	av_timer_cancel(&sstate->timers, &c->fork.timer);
+
+	c->event = e;
+	c->codecs = choice;
+	c->setup_flags |= AV_SIP_SETUP_ANSWERED;
+	c->fork.sip_answered = g_get_monotonic_time();
+	av_sip_protocol_call_update_media(c, connection);
+
+	g_print("Call %d answered %s, %" G_GINT64_FORMAT " ms after the modem started ringing\n",e->cid,c->path,(c->fork.sip_answered - c->fork.ringing)/1000);
+
+	cmd = av_thread_cmd_str(SIP_EVENT_CALL_ACCEPT, 0, c->path);
+	if (cmd) {
+		cmd->line = c->line;
+		av_thread_txcmd(sstate->self, cmd, 1);
+	}
+
+	return 1;
+}
+
+/*
+ * One of our INVITEs failed. Once all of them did, the modem call is hung
+ * up. Must be invoked with eXosip lock held.
+*/
+static void av_sip_bridge_failed(eXosip_event_t *e) {
+	struct av_sip_call *c;
+
+	/* eXosip retries by itself with our credentials. */
+	if ( e->response && ((e->response->status_code == 401) || (e->response->status_code == 407)) )
+		return;
+
+	c = av_sip_bridge_find(e->cid);
+	if (!c)
+		return;
+
+	g_print("Call %d for %s failed: %s\n",e->cid,c->path,e->textinfo ? e->textinfo : "no event text");
+
+	av_sip_bridge_fork_done(&c->fork, e->cid);
+	if (!c->fork.n_pending && !(c->setup_flags & AV_SIP_SETUP_ANSWERED))
+		av_sip_protocol_call_end_call(c);
+}
+
+/*
+ * The modem call of a SIP call ended, e.g.: the other party hung up. The SIP
+ * side follows: BYE if answered, 480 otherwise, or CANCEL for calls from the
+ * GSM network still ringing on SIP.
+*/
+static void av_sip_protocol_call_terminated(struct av_sip_line *l, const gchar *call_path) {
+	struct av_sip_call *c;
+
+	c = av_sip_call_find_by_path(&l->calls, call_path);
+	if (!c)
+		return;
+
+	g_print("%s terminated\n",call_path);
+
+	eXosip_lock(sstate->sipctx);
+	if (c->setup_flags & AV_SIP_SETUP_ANSWERED) {
+		if (eXosip_call_terminate(sstate->sipctx, c->event->cid, c->event->did))
+			g_printerr("Failure terminating call %d\n",c->event->cid);
+	}
+	else if (c->setup_flags & AV_SIP_SETUP_BRIDGED)
+		av_sip_bridge_cancel(c);
+	else if (eXosip_call_send_answer(sstate->sipctx, c->event->tid, 480, NULL))
+		g_printerr("Failure sending 480 answer\n");
+	eXosip_unlock(sstate->sipctx);
+
+	/* Nothing to hang up anymore. */
+	g_clear_pointer(&c->path, g_free);
+	av_sip_protocol_call_end_call(c);
+}
+
+/*
+ * Mid-dialog re-INVITE and UPDATE requests: hold and resume, media moving
+ * elsewhere or changing codec, and session refreshes. Hold and resume ask the
+ * modem to swap calls, which holds the active call and retrieves the held
+ * (or waiting) one, if any: media will follow as soon as the modem reports
+ * the new call states. Anything else is applied to the running RTP session.
+ * Must be invoked with eXosip lock held.
+*/
+static void av_sip_protocol_call_offer(eXosip_event_t *e) {
+	struct av_sip_call *c;
+	struct av_rtp_connection *connection;
+	struct av_sip_codec_choice choice;
+	sdp_message_t *sdp;
+	const char *answer_direction = NULL;
+	gboolean hold;
+
+	c = av_sip_find_call_by_cid(e->cid);
+	if (!c) {
+		if (eXosip_call_send_answer(sstate->sipctx, e->tid, 481, NULL))
+			g_printerr("Failure sending 481 answer\n");
+		return;
+	}
+
+	if (av_sip_protocol_session_timer_request(c, e->request)) {
+		av_sip_protocol_session_timer_reject(e->tid);
+		return;
+	}
+
+	sdp = eXosip_get_sdp_info(e->request);
+	if (!sdp && MSG_IS_UPDATE(e->request)) {
+		av_sip_protocol_call_send_refresh_answer(c, e->tid);
+		return;
+	}
+
+	if (sdp) {
+		answer_direction = av_sip_protocol_sdp_hold_answer(sdp);
+		hold = (answer_direction != NULL);
+
+		if ( (hold && !c->held && (av_sip_call_line(c)->calls.media_owner == c)) || (!hold && c->held) ) {
+			g_print("%s request for call %d\n",hold ? "Hold" : "Resume",e->cid);
+			av_sip_core_send(c->line, SIP_EVENT_CALL_SWAP, NULL);
+		}
+
+		/* A held stream has nowhere to go: keep the last good address. */
+		if (!hold) {
+			connection = NULL;
+			if (av_sip_protocol_sdp_audio_connection(sdp, &av_sip_call_line(c)->codecs, &connection, &choice) || !connection) {
+				g_printerr("No acceptable audio in offer for call %d\n",e->cid);
+				if (eXosip_call_send_answer(sstate->sipctx, e->tid, 488, NULL))
+					g_printerr("Failure sending 488 answer\n");
+				g_clear_pointer(&sdp, sdp_message_free);
+				return;
+			}
+
+			c->codecs = choice;
+			av_sip_protocol_call_update_media(c, connection);
+		}
+	}
+
+	/* Offerless re-INVITEs get our offer in the 200. */
+	if (av_sip_protocol_call_send_sdp_answer(c, e->tid, 200, answer_direction))
+		g_printerr("Failure answering offer for call %d\n",e->cid);
+
+	g_clear_pointer(&sdp, sdp_message_free);
+}
+
+/*
+ * Puts a call no modem of its pool can take in the queue: the caller gets a
+ * 180 right away, then early media from an audio thread of its own. Codecs
+ * are negotiated against the preferences of the first modem of the pool.
+ *
+ * Returns: 0 if the call is queued, -1 if it was turned down already (the
+ * event being freed), or the status to turn it down with.
+*/
+static gint av_sip_queue_call(eXosip_event_t *e, struct av_sip_pool *p, const gchar *number) {
+	struct av_sip_queued *q = NULL;
+	struct av_sip_line *lt;
+	struct av_sip_call *c;
+	struct av_rtp_connection *connection;
+	struct av_sip_codec_choice choice;
+	enum av_sip_queue_priority priority = AV_SIP_QUEUE_NORMAL;
+	const char *value;
+	int i;
 
-	if (send_reg_retval) {
-		g_printerr("Failure sending SIP REGISTER\n");
-		return 1;
-	}
+	if (av_sip_queue_full(&sstate->queue))
+		return 486;
 
-	sstate->sipconf = mc;
+	/* A slot may still wait for the audio thread of its last call to be gone. */
+	for (i = 0; (i < AV_SIP_QUEUE_MAX) && !q; i++)
+		if (!sstate->queued[i].in_use && !sstate->queued[i].audiothread_stopping)
+			q = &sstate->queued[i];
+	if (!q)
+		return 486;
 
-	return 0;
-}
+	lt = ((struct av_sip_pool_member *)g_ptr_array_index(p->members, 0))->data;
+	if (av_sip_protocol_call_stage0_handle_remote_sdp(e, lt, &connection, &choice))
+		return 488;
 
-static gint av_sip_regconf(struct av_thread_cmd *cmd) {
-	struct av_modem_config *sipconf = cmd->payload;
-	gint retval = 1;
+	connection->call_direction = SIP_CALL_INCOMING;
 
-	if (sipconf->username && sipconf->password && sipconf->sip_host && sipconf->sip_id && sipconf->modem_audio_port && sipconf->sip_local_ip_addr) {
-		if ( (retval = av_sip_stackconfig(sipconf)) )
-			av_config_free(&sipconf);
+	q->in_use = TRUE;
+	q->identity = g_strdup(p->identity);
+
+	c = &q->call;
+	memset(c, 0, sizeof *c);
+	c->in_use = TRUE;
+	c->line = -1;
+	c->event = e;
+	c->connection = connection;
+	c->codecs = choice;
+	c->timing.invite = g_get_monotonic_time();
+	g_strlcpy(c->number, number, sizeof c->number);
+	av_timer_init(&c->session_timer.timer, av_sip_protocol_session_timer_expired, c);
+	c->sdp_session_id = random();
+	c->sdp_version = random();
+
+	if (av_sip_protocol_session_timer_request(c, e->request)) {
+		av_sip_protocol_session_timer_reject(e->tid);
+		av_sip_queued_release(q);
+		return -1;
 	}
-	else
-		av_config_free(&sipconf);
-
-	return retval;
-}
-
-static void av_sip_core_poll_setup(void) {
-	sstate->poll_data[0].fd = sstate->self->sockets[1];
-	sstate->poll_data[0].events = POLLIN;
-}
 
-static gint av_sip_timerfd_setup(void) {
-	sstate->poll_data[2].fd = timerfd_create(CLOCK_MONOTONIC, 0);
-	if (sstate->poll_data[2].fd < 0) {
-		g_printerr("timerfd_create: %s\n",strerror(errno));
-		return 1;
+	if (av_sip_sdp_init(&q->sdp, lt->sipconf->sip_local_ip_addr)) {
+		av_sip_queued_reject(q, 500);
+		return -1;
 	}
 
-	sstate->poll_data[2].events = POLLIN;
-	sstate->automatic_action_timer.it_value.tv_sec = 1;
-	sstate->automatic_action_timer.it_value.tv_nsec = 0;
-	sstate->automatic_action_timer.it_interval.tv_sec = 5;
-	sstate->automatic_action_timer.it_interval.tv_nsec = 0;
+	av_sip_protocol_call_ringing(c);
 
-	if (timerfd_settime(sstate->poll_data[2].fd, 0, &sstate->automatic_action_timer, NULL)) {
-		g_printerr("timerfd_settime: %s\n",strerror(errno));
-		return 1;
+	q->audiothread = av_thread_setup("QueueAudio", av_audiothread_startup);
+	if (!q->audiothread) {
+		av_sip_queued_reject(q, 500);
+		return -1;
 	}
 
-	return 0;
-}
+	sstate->poll_data[AV_SIP_POLL_QUEUE(q->id)].fd = av_thread_eventfd(q->audiothread, 0);
+	sstate->poll_data[AV_SIP_POLL_QUEUE(q->id)].events = POLLIN;
 
-static void av_sip_timerfd_teardown(void) {
-	/*
-	 * This should not happen, because we're not calling this function if timerfd init fails.
-	 * Still, it seems more efficient to avoid trying to close an fd with value -1, a bad fd, even tough this won't have
-	 * consequences probably.
-	*/
-	if (sstate->poll_data[2].fd < 0)
-		return;
+	/* RFC 3261, section 20.26. */
+	value = av_sip_protocol_header_value(e->request, "priority", NULL, 0);
+	if (value && (!g_ascii_strcasecmp(value, "emergency") || !g_ascii_strcasecmp(value, "urgent")))
+		priority = AV_SIP_QUEUE_URGENT;
 
-	if (close(sstate->poll_data[2].fd))
-		g_printerr("Failure closing SIP events socket: %s\n",strerror(errno));
+	av_sip_queue_push(&sstate->queue, &q->entry, priority, q);
+	g_print("Call %d to %s queued for pool %s%s, position %u\n",e->cid,number,p->identity,
+		(priority == AV_SIP_QUEUE_URGENT) ? " (urgent)" : "",av_sip_queue_position(&sstate->queue, &q->entry));
 
-	sstate->poll_data[2].fd = -1;
+	return 0;
 }
 
 /*
- * You will find some comments along this function, describing the conclusions I arrived to while trying to understand the way
- * things might go wrong here. However, I guess those details may be susceptible to changes in OSIP.
+ * For the better or the worse, I tried to understand how things are supposed to work from here:
+ * https://tools.ietf.org/html/rfc3666#section-2.1
+ * and here we are at F5, so you shouldn't be "basito" yet! :)
+ * Infact, eXosip2 answers for us with a "100 Trying" message to stop the other party from re-transmitting (when using something like UDP).
+ *
+ * The INVITE is routed to a modem line first. Several calls may be going on
+ * at once on the same line (call waiting): they all share its audio engine.
+ *
+ * Returns:
+ *   non-zero when we know we're going to use our event structure; zero in any other case.
 */
-static gint av_sip_protocol_call_build_sdp(osip_message_t *a, int local_port, sdp_message_t **answer_sdp_message) {
-	sdp_message_t *sdpm;
-	int retval = 0;
-	gchar *session_id;
-	gchar *session_version;
-	gchar *port_str;
-	gchar *media_type_audio = g_strdup("audio");
-	gchar *media_rtp_profile = g_strdup("RTP/AVP");
-	gchar *sdp_nettype = g_strdup("IN");
-	gchar *sdp_addrtype = g_strdup("IP4");
-	gchar *sdp_addr = g_strdup(sstate->sipconf->sip_local_ip_addr);
-	gchar *rtpmap0_field = g_strdup("rtpmap");
-	gchar *rtpmap0_value = g_strdup("0 PCMU/8000");
+static gint av_sip_protocol_call_stage0(eXosip_event_t *e) {
+	struct av_rtp_connection *connection;
+	struct av_sip_codec_choice choice;
+	struct av_sip_pool *p = NULL;
+	struct av_sip_line *l;
+	struct av_sip_call *c;
+	gchar number[AV_DIALPLAN_NUMBER_LEN];
+	int status;
+
+	/* Before anything else: under overload, every microsecond counts. */
+	if ( (status = av_sip_admit_invite(&sstate->admit, av_sip_protocol_request_source(e->request))) ) {
+		av_sip_protocol_call_shed(e, status);
+		return 0;
+	}
 
-	/*
-	 * This function might return OSIP_NOMEM if a call to osip_malloc or osip_list_init fails.
-	*/
-	if (sdp_message_init(&sdpm))
-		return ++retval;
+	l = av_sip_protocol_call_stage0_route(e, number, &p, &status);
 
-	/* This won't return OSIP_BADPARAMETER, because we know sdpm isn't NULL. */
-	sdp_message_v_version_set(sdpm, g_strdup("0"));
+	/* All modems busy: the caller may wait for one. */
+	if (!l && (status == 486) && p) {
+		status = av_sip_queue_call(e, p, number);
+		if (status <= 0)
+			return 1;
+	}
 
-	session_id = g_strdup_printf("%ld",random());
-	session_version = g_strdup_printf("%ld",random());
-	port_str = g_strdup_printf("%d",local_port);
+	if (!l) {
+		if (eXosip_call_send_answer(sstate->sipctx, e->tid, status, NULL))
+			g_printerr("Failure sending %d answer\n",status);
+		return 0;
+	}
 
-	/* This won't return OSIP_BADPARAMETER as well, because we know sdpm isn't NULL. */
-	sdp_message_o_origin_set(sdpm, g_strdup("airvoice"), session_id, session_version, g_strdup(sdp_nettype), g_strdup(sdp_addrtype), g_strdup(sdp_addr));
+	if (av_sip_protocol_call_stage0_handle_remote_sdp(e, l, &connection, &choice)) {
+		if (eXosip_call_send_answer(sstate->sipctx, e->tid, 488, NULL))
+			g_printerr("Failure sending 488 answer\n");
+		return 0;
+	}
 
-	/* Returns -1 if sdpm is NULL. But it shouldn't be. */
-	sdp_message_s_name_set(sdpm, g_strdup("DongleCall"));
+	g_print("RTP (%s:%d) on line %d...\n",connection->addr,connection->port,l->id);
 
-	/*
-	 * Add the classic payload 0 audio media.
-	 *
-	 * Note: here sdp_media_init gets called, which in turns calls osip_malloc and osip_list_init. This can definitely fail.
-	*/
-	if (sdp_message_m_media_add(sdpm, media_type_audio, port_str, NULL, media_rtp_profile)) {
-		g_printerr("Failure adding SDP payload 0 media\n");
-		retval++;
-		goto out;
+	connection->call_direction = SIP_CALL_INCOMING;
+	connection->serial_device = g_strdup(l->sipconf->modem_audio_port);
+
+	/* Can't happen while av_sip_pool_available() keeps calls under AV_SIP_MAX_CALLS. */
+	c = av_sip_call_alloc(&l->calls, e);
+	if (!c) {
+		av_sip_rtp_connection_free(&connection);
+		if (eXosip_call_send_answer(sstate->sipctx, e->tid, 486, NULL))
+			g_printerr("Failure sending 486 answer\n");
+		return 0;
 	}
-	else
-		media_rtp_profile = media_type_audio = port_str = NULL;
 
-	/* -1 = global c= field */
-	if (sdp_message_c_connection_add(sdpm, -1, sdp_nettype, sdp_addrtype, sdp_addr, NULL, NULL)) {
-		g_printerr("Failure adding SDP connection\n");
-		retval++;
-		goto out;
+	c->line = l->id;
+	c->connection = connection;
+	c->codecs = choice;
+	g_strlcpy(c->number, number, sizeof c->number);
+	av_timer_init(&c->session_timer.timer, av_sip_protocol_session_timer_expired, c);
+	c->sdp_session_id = random();
+	c->sdp_version = random();
+
+	if (av_sip_protocol_session_timer_request(c, e->request)) {
+		av_sip_protocol_session_timer_reject(e->tid);
+		/* e is freed here, so make sure our caller doesn't free it again. */
+		av_sip_call_release(&l->calls, c);
+		return 1;
 	}
-	else
-		sdp_nettype = sdp_addrtype = sdp_addr = NULL;
 
-	/* Fails if sdpm is NULL. */
-	sdp_message_m_payload_add(sdpm, 0, g_strdup("0"));
+	/* The first call sets the media path up; later ones find it ready. */
+	if (!l->calls.media_owner)
+		l->calls.media_owner = c;
 
-	if (sdp_message_a_attribute_add(sdpm, 0, rtpmap0_field, rtpmap0_value)) {
-		g_print("Failure adding %s attribute\n",rtpmap0_field);
-		retval++;
-		goto out;
+	if (l->media_ready) {
+		c->setup_flags |= AV_SIP_SETUP_MEDIA_READY;
+		c->timing.media_ready = c->timing.invite;
 	}
-	else
-		rtpmap0_field = rtpmap0_value = NULL;
 
-out:
+	av_sip_protocol_call_ringing(c);
 
-	if (retval) {
-		g_clear_pointer(&port_str, g_free);
-		g_clear_pointer(&media_type_audio, g_free);
-		g_clear_pointer(&media_rtp_profile, g_free);
-		g_clear_pointer(&sdp_nettype, g_free);
-		g_clear_pointer(&sdp_addrtype, g_free);
-		g_clear_pointer(&sdp_addr, g_free);
-		g_clear_pointer(&rtpmap0_field, g_free);
-		g_clear_pointer(&rtpmap0_value, g_free);
-		g_clear_pointer(&sdpm, sdp_message_free);
-	}
+	/* Modem call and media setup go in parallel from here on. */
+	if (av_sip_protocol_call_request_modem_call(c) || (!l->audiothread && av_sip_start_audio_thread(l))) {
+		/* We already hold eXosip lock here. */
+		if (eXosip_call_send_answer(sstate->sipctx, e->tid, 500, NULL))
+			g_printerr("Failure sending 500 answer\n");
 
-	*answer_sdp_message = sdpm;
+		/* e is freed here, so make sure our caller doesn't free it again. */
+		av_sip_protocol_call_end_call(c);
+		return 1;
+	}
 
-	return retval;
+	return 1;
 }
 
-/*
- * Welcome to the F7 stage of the call, where we send a 183 message, to which we append an SDP description to allow for early
- * media.
-*/
-static gint av_sip_protocol_call_stage1(int rtp_local_port) {
-	osip_message_t *answer;
-	gint retval = 0;
-	sdp_message_t *sdpm = NULL;
-	char *sdp_string = NULL;
+static void av_sip_protocol_registered(eXosip_event_t *e) {
+	struct av_sip_line *l;
+	const char *value;
+	gint expires = AV_SIP_REG_EXPIRES;
+	gint64 ttr;
 
-	if (eXosip_call_build_answer(sstate->sipctx, sstate->current_call_event->tid, 183, &answer)) {
-		g_printerr("Failure building answer\n");
-		return ++retval;
+	l = av_sip_line_find_by_rid(e->rid);
+	if (!l) {
+		g_print("SIP registration was successful (unknown line)\n");
+		return;
 	}
 
-	if (av_sip_protocol_call_build_sdp(answer, rtp_local_port, &sdpm)) {
-		g_printerr("Failure building SDP\n");
-		retval++;
-		goto out;
-	}
+	/* The registrar may have shortened the lifetime we asked for. */
+	if ( e->response && (value = av_sip_protocol_header_value(e->response, "expires", NULL, 0)) && (atoi(value) > 0) )
+		expires = atoi(value);
+
+	ttr = av_sip_reg_success(&l->reg, expires);
+	if (!l->pool.registered)
+		av_sip_core_line_up(l->id, TRUE);
+	l->pool.registered = TRUE;
+	av_sip_queue_kick();
+	g_print("SIP registration was successful (line %d, %d seconds): registered in %" G_GINT64_FORMAT " ms after %u attempt(s), max %" G_GINT64_FORMAT " ms\n",
+		l->id, expires, ttr/1000, l->reg.n_attempts, l->reg.ttr_max/1000);
+}
 
-	if (sdp_message_to_str(sdpm, &sdp_string)) {
-		g_printerr("Failure building SDP message string\n");
-		retval++;
-		goto out;
-	}
+static void av_sip_protocol_registration_failed(eXosip_event_t *e) {
+	struct av_sip_line *l;
+	const char *value;
+	int status;
+	gint retry_after = 0;
 
-	if (osip_message_set_content_type(answer, "application/sdp")) {
-		g_printerr("Failure setting answer message content type\n");
-		retval++;
-		goto out;
-	}
+	l = av_sip_line_find_by_rid(e->rid);
+	status = e->response ? e->response->status_code : 0;
+	g_printerr("SIP registration failure occurred (line %d, status %d)\n",l ? l->id : -1,status);
+	if (!l)
+		return;
 
-	if (osip_message_set_body(answer, sdp_string, strlen(sdp_string))) {
-		g_printerr("Failure attaching SDP to answer\n");
-		retval++;
-		goto out;
+	/* Authentication challenges are answered by eXosip housekeeping: don't let them wait. */
+	if ( ((status == 401) || (status == 407)) && av_sip_reg_challenge(&l->reg) ) {
+		av_sip_automatic_action_within(0);
+		return;
 	}
 
-	if (eXosip_call_send_answer(sstate->sipctx, sstate->current_call_event->tid, 183, answer)) {
-		g_printerr("Failure sending answer\n");
-		retval++;
-		goto out;
+	if ( e->response && (value = av_sip_protocol_header_value(e->response, "retry-after", NULL, 0)) )
+		retry_after = atoi(value);
+
+	/* Calls to the pool go to other modems meanwhile. */
+	l->pool.registered = FALSE;
+	av_sip_reg_failure(&l->reg, retry_after);
+}
+
+static gint av_sip_protocol_events(gpointer data, guint budget, gboolean *more) {
+	eXosip_event_t *event;
+	gint keep_event;
+	gint64 bye_start;
+	gint64 start = g_get_monotonic_time();
+
+	while ( budget && (event = eXosip_event_wait(sstate->sipctx, 0, 0) )) {
+		budget--;
+		keep_event = 0;
+		eXosip_lock(sstate->sipctx);
+
+		switch(event->type) {
+			case EXOSIP_REGISTRATION_SUCCESS:
+				av_sip_protocol_registered(event);
+				break;
+			case EXOSIP_REGISTRATION_FAILURE:
+				av_sip_protocol_registration_failed(event);
+				break;
+			case EXOSIP_CALL_ACK:
+				g_print("Call ACK received\n");
+				break;
+			case EXOSIP_CALL_CLOSED:
+			case EXOSIP_CALL_CANCELLED:
+			case EXOSIP_CALL_RELEASED:
+				g_print("Call termination event (%d): %s\n",event->type, event->textinfo ? event->textinfo : "no event text");
+				bye_start = g_get_monotonic_time();
+				av_sip_protocol_call_end(event);
+				if (event->type == EXOSIP_CALL_CLOSED)
+					av_sip_teardown_stats_bye(g_get_monotonic_time() - bye_start);
+				break;
+			case EXOSIP_CALL_INVITE:
+				g_print("SIP INVITE received\n");
+				keep_event = av_sip_protocol_call_stage0(event);
+				break;
+			case EXOSIP_CALL_PROCEEDING:
+			case EXOSIP_CALL_RINGING:
+				g_print("SIP call %d progressing (%d)\n",event->cid,event->type);
+				break;
+			case EXOSIP_CALL_ANSWERED:
+				keep_event = av_sip_bridge_answered(event);
+				break;
+			case EXOSIP_CALL_NOANSWER:
+			case EXOSIP_CALL_REDIRECTED:
+			case EXOSIP_CALL_REQUESTFAILURE:
+			case EXOSIP_CALL_SERVERFAILURE:
+			case EXOSIP_CALL_GLOBALFAILURE:
+				av_sip_bridge_failed(event);
+				break;
+			case EXOSIP_CALL_REINVITE:
+				g_print("SIP re-INVITE received\n");
+				av_sip_protocol_call_offer(event);
+				break;
+			case EXOSIP_CALL_MESSAGE_ANSWERED:
+				av_sip_protocol_session_refreshed(event);
+				break;
+			case EXOSIP_CALL_MESSAGE_NEW:
+				if (MSG_IS_UPDATE(event->request)) {
+					g_print("SIP UPDATE received\n");
+					av_sip_protocol_call_offer(event);
+				}
+				else
+					g_printerr("Unhandled in-dialog %s request\n",event->request->sip_method);
+				break;
+			default:
+				g_printerr("Unknown SIP event (%d): %s\n",event->type, event->textinfo ? event->textinfo : "no event text");
+				break;
+		}
+
+		eXosip_unlock(sstate->sipctx);
+
+		if (!keep_event)
+			g_clear_pointer(&event, eXosip_event_free);
 	}
 
-out:
-	if (retval)
-		g_clear_pointer(&answer, osip_message_free);
+	/* Transactions are going on: housekeeping can't be idle. */
+	sstate->last_activity = g_get_monotonic_time();
+	av_sip_automatic_action_within(AV_SIP_HOUSEKEEPING_BUSY_USEC);
 
-	g_clear_pointer(&sdpm, sdp_message_free);
-	g_clear_pointer(&sdp_string, g_free);
+	/* eXosip already drained its event socket: we have to come back by ourselves. */
+	*more = !budget;
 
-	return retval;
+	/* Events left for later are how we tell we're overloaded. */
+	av_sip_admit_backlog(&sstate->admit, *more, start);
+
+	return 0;
 }
 
-static gint av_sip_core_msg(void) {
+static gint av_sip_core_msg(gpointer data, guint budget, gboolean *more) {
 	struct av_thread_cmd *cmd;
+	struct av_sip_line *l;
 	gint retval = 0;
 
-	cmd = av_thread_rxcmd(sstate->self, 1);
-	if (!cmd)
-		return retval;
+	while (!retval && budget && (cmd = av_thread_rxcmd(sstate->self, 1))) {
+		budget--;
+		l = av_sip_line_get(cmd->line);
+		switch(cmd->msgtype) {
+			case SIP_CMD_EXIT:
+				g_print("SIP thread exiting...\n");
+				retval++;
+				break;
+			case SIP_CMD_REGISTER:
+				if (av_sip_regconf(cmd)) {
+					g_printerr("SIP line %d not configured\n",cmd->line);
+					av_sip_core_line_up(cmd->line, FALSE);
+				}
+				break;
+			case SIP_CMD_LINE_REMOVE:
+				av_sip_line_remove(cmd->line);
+				break;
+			case SIP_CMD_LINE_RECONFIGURE:
+				av_sip_line_config_changed(cmd);
+				break;
+			case SIP_CMD_RELOAD:
+				av_sip_reload();
+				break;
+			case SIP_CMD_CALL_IN_PROGRESS:
+				av_sip_protocol_call_in_progress(cmd->line, cmd->arg, cmd->data);
+				break;
+			case SIP_CMD_CALL_ACTIVE:
+				if (l)
+					av_sip_protocol_call_active(l, cmd->data);
+				break;
+			case SIP_CMD_CALL_FAILED:
+				if (l)
+					av_sip_protocol_call_failed(l, cmd->arg);
+				break;
+			case SIP_CMD_CALL_HELD:
+				if (l)
+					av_sip_protocol_call_held(l, cmd->data);
+				break;
+			case SIP_CMD_LINE_SIGNAL:
+				if (l)
+					l->pool.signal_quality = cmd->arg;
+				break;
+			case SIP_CMD_CALL_RINGING_IN:
+				if (l)
+					av_sip_bridge_ringing(l, cmd->data, cmd->payload, cmd->sent);
+				g_free(cmd->payload);
+				break;
+			case SIP_CMD_CALL_TERMINATED:
+				if (l)
+					av_sip_protocol_call_terminated(l, cmd->data);
+				break;
+			default:
+				g_printerr("Unknown command received (%d)!\n",cmd->msgtype);
+				retval++;
+				break;
+		}
 
-	switch(cmd->msgtype) {
-		case SIP_CMD_EXIT:
-			g_print("SIP thread exiting...\n");
-			retval++;
-			break;
-		case SIP_CMD_REGISTER:
-			retval = av_sip_regconf(cmd);
-			break;
-		case SIP_CMD_CALL_IN_PROGRESS:
-			sstate->current_call_path = cmd->payload;
-			g_print("Call @ %s\n",sstate->current_call_path);
-			retval = av_sip_protocol_call_stage1(sstate->local_rtp_port);
-			break;
-		default:
-			g_printerr("Unknown command received (%d)!\n",cmd->msgtype);
-			retval++;
-			break;
+		g_clear_pointer(&cmd, av_thread_cmd_free);
 	}
 
-	g_clear_pointer(&cmd, g_free);
+	*more = !budget;
 
 	return retval;
 }
 
-static const char *av_sip_protocol_call_stage0_extract_dest_number(osip_message_t *req) {
+static gint av_sip_audio_msg(gpointer data, guint budget, gboolean *more) {
+	struct av_sip_line *l = data;
+	struct av_thread_cmd *cmd;
+	struct av_thread_cmd *call_cmd;
+	struct av_rtp_connection *connection;
+	struct av_sip_call *c;
+	struct av_thread *t;
+	gboolean restart;
+	gint retval = 0;
+	int i;
 
-	/*
-	 * Can this happen?
-	*/
-	if (!req->req_uri) {
-		g_print("Request contained no URI; please report this back.\n");
-		return NULL;
+	while (!retval && budget) {
+		/* Only one of them is polled at any given time. */
+		t = l->audiothread ? l->audiothread : l->audiothread_stopping;
+		if (!t || !(cmd = av_thread_rxcmd(t, 0)))
+			break;
+
+		budget--;
+
+		if (cmd->msgtype == AUDIO_EVENT_EXITED) {
+			g_clear_pointer(&cmd, av_thread_cmd_free);
+
+			/* An audio thread exiting on its own failed: don't try again and again. */
+			restart = (t != l->audiothread);
+			if (!restart) {
+				g_printerr("Audio thread of line %d exited on its own\n",l->id);
+				av_sip_audio_stop(l);
+			}
+			av_sip_audio_stopped(l, restart);
+			continue;
+		}
+
+		/* Leftovers from an audio thread on its way out. */
+		if (t != l->audiothread) {
+			g_clear_pointer(&cmd, av_thread_cmd_free);
+			continue;
+		}
+
+		switch(cmd->msgtype) {
+			case AUDIO_EVENT_READY:
+				g_print("Audio thread talks to us! :)\nWill the dongle be with us?\n");
+				c = l->calls.media_owner;
+				if (!c || !(connection = av_sip_rtp_connection_dup(c->connection)))
+					break;
+
+				call_cmd = av_thread_cmd(CMD_AUDIO_INIT, connection);
+				if (call_cmd)
+					av_thread_txcmd(l->audiothread, call_cmd, 0);
+				else
+					av_sip_rtp_connection_free(&connection);
+				break;
+			case AUDIO_EVENT_RTP_OK:
+				g_print("Audio init OK\n");
+				l->local_rtp_port = cmd->arg;
+				l->media_ready = TRUE;
+
+				for (i = 0; i < AV_SIP_MAX_CALLS; i++) {
+					c = &l->calls.calls[i];
+					if (!c->in_use)
+						continue;
+
+					c->setup_flags |= AV_SIP_SETUP_MEDIA_READY;
+					c->timing.media_ready = g_get_monotonic_time();
+					if (c->setup_flags & AV_SIP_SETUP_BRIDGED)
+						av_sip_bridge_fork(c);
+					else
+						av_sip_protocol_call_setup_progress(c);
+				}
+				break;
+			case AUDIO_EVENT_PROMPT_DONE:
+				c = l->calls.media_owner;
+				if (c && (c->setup_flags & AV_SIP_SETUP_CALL_FAILED))
+					av_sip_protocol_call_reject(c, 503);
+				break;
+			default:
+				g_printerr("Unknown audio event received (%d)!\n",cmd->msgtype);
+				retval++;
+				break;
+		}
+
+		g_clear_pointer(&cmd, av_thread_cmd_free);
 	}
 
-	return osip_uri_get_username(req->req_uri);
+	*more = !budget;
+
+	return retval;
 }
 
-static gint av_sip_audio_msg(void) {
+/*
+ * Messages from the audio thread of a queued call: once RTP is up the caller
+ * gets a 183 with our SDP, and the queue music.
+*/
+static gint av_sip_queue_audio_msg(gpointer data, guint budget, gboolean *more) {
+	struct av_sip_queued *q = data;
+	struct av_sip_call *c = &q->call;
 	struct av_thread_cmd *cmd;
 	struct av_thread_cmd *call_cmd;
+	struct av_rtp_connection *connection;
+	struct av_thread *t;
 	gint retval = 0;
-	const char *dest_number;
-	int *rtp_local_port;
-
-	cmd = av_thread_rxcmd(sstate->audiothread, 0);
-	if (!cmd)
-		return retval;
 
-	switch(cmd->msgtype) {
-		case AUDIO_EVENT_READY:
-			g_print("Audio thread talks to us! :)\nWill the dongle be with us?\n");
-			call_cmd = av_thread_cmd(CMD_AUDIO_INIT, sstate->current_call_connection);
-			if (call_cmd) {
-				av_thread_txcmd(sstate->audiothread, call_cmd, 0);
-				g_clear_pointer(&call_cmd, g_free);
-			}
+	while (!retval && budget) {
+		/* Only one of them is polled at any given time. */
+		t = q->audiothread ? q->audiothread : q->audiothread_stopping;
+		if (!t || !(cmd = av_thread_rxcmd(t, 0)))
 			break;
-		case AUDIO_EVENT_RTP_OK:
-			g_print("Audio init OK\n");
-			rtp_local_port = cmd->payload;
-			sstate->local_rtp_port = *rtp_local_port;
-			g_clear_pointer(&rtp_local_port, g_free);
-			dest_number = av_sip_protocol_call_stage0_extract_dest_number(sstate->current_call_event->request);
-			if (!dest_number)
-				break;
-
-			call_cmd = av_thread_cmd(SIP_EVENT_INCOMING_CALL, NULL);
-			if (call_cmd) {
-				call_cmd->payload = g_strdup(dest_number);
-				av_thread_txcmd(sstate->self, call_cmd, 1);
-				g_clear_pointer(&call_cmd, g_free);
+
+		budget--;
+
+		if (cmd->msgtype == AUDIO_EVENT_EXITED) {
+			g_clear_pointer(&cmd, av_thread_cmd_free);
+
+			if (t == q->audiothread) {
+				g_printerr("Audio thread of queued call %d exited on its own\n",c->event->cid);
+				eXosip_lock(sstate->sipctx);
+				av_sip_queued_reject(q, 500);
+				eXosip_unlock(sstate->sipctx);
 			}
-			break;
-		default:
-			g_printerr("Unknown audio event received (%d)!\n",cmd->msgtype);
-			retval++;
-			break;
+
+			g_clear_pointer(&q->audiothread_stopping, av_thread_teardown);
+			sstate->poll_data[AV_SIP_POLL_QUEUE(q->id)].fd = -1;
+			continue;
+		}
+
+		/* Leftovers from an audio thread on its way out. */
+		if (t != q->audiothread) {
+			g_clear_pointer(&cmd, av_thread_cmd_free);
+			continue;
+		}
+
+		switch(cmd->msgtype) {
+			case AUDIO_EVENT_READY:
+				connection = av_sip_rtp_connection_dup(c->connection);
+				if (!connection)
+					break;
+
+				call_cmd = av_thread_cmd(CMD_AUDIO_INIT, connection);
+				if (call_cmd)
+					av_thread_txcmd(q->audiothread, call_cmd, 0);
+				else
+					av_sip_rtp_connection_free(&connection);
+				break;
+			case AUDIO_EVENT_RTP_OK:
+				q->local_rtp_port = cmd->arg;
+				c->setup_flags |= AV_SIP_SETUP_MEDIA_READY;
+				c->timing.media_ready = g_get_monotonic_time();
+
+				eXosip_lock(sstate->sipctx);
+				if (av_sip_protocol_call_send_sdp_answer(c, c->event->tid, 183, NULL)) {
+					av_sip_queued_reject(q, 500);
+					eXosip_unlock(sstate->sipctx);
+					break;
+				}
+				eXosip_unlock(sstate->sipctx);
+
+				call_cmd = av_thread_cmd(CMD_AUDIO_PROMPT_PLAY, GINT_TO_POINTER(AV_PROMPT_QUEUE));
+				if (call_cmd)
+					av_thread_txcmd(q->audiothread, call_cmd, 0);
+				break;
+			case AUDIO_EVENT_PROMPT_DONE:
+				break;
+			default:
+				g_printerr("Unknown audio event received (%d)!\n",cmd->msgtype);
+				retval++;
+				break;
+		}
+
+		g_clear_pointer(&cmd, av_thread_cmd_free);
 	}
 
-	g_clear_pointer(&cmd, g_free);
+	*more = !budget;
 
 	return retval;
 }
 
-static gint av_sip_protocol_automatic_action(void) {
-	uint64_t n_expirations;
-
-	(void) read(sstate->poll_data[2].fd, &n_expirations, sizeof n_expirations);
-	if (n_expirations > 1)
-		g_printerr("WARNING: %lu event(s) missed\n",(n_expirations-1));
-
-	eXosip_lock(sstate->sipctx);
-	eXosip_automatic_action(sstate->sipctx);
-	eXosip_unlock(sstate->sipctx);
+static gint av_sip_timers_dispatch(gpointer data, guint budget, gboolean *more) {
+	av_timer_wheel_run(&sstate->timers);
 
 	return 0;
 }
 
-static gint av_sip_loop(void) {
-	gint n_events;
+/*
+ * Poll sources, in poll_data order, and how much work each of them may do
+ * per wakeup. Core and audio messages are call control: they get a budget
+ * large enough to never wait behind a burst of SIP events for long. Audio
+ * sources follow, one per line then one per queued call, see
+ * av_sip_poll_setup().
+*/
+static const struct av_poll_source av_sip_poll_sources[AV_SIP_POLL_FIXED_FDS] = {
+	{ .name = "core", .dispatch = av_sip_core_msg, .budget = 16 },
+	{ .name = "SIP", .dispatch = av_sip_protocol_events, .budget = 8 },
+	{ .name = "timer", .dispatch = av_sip_timers_dispatch, .budget = 1 },
+	{ .name = "DNS", .dispatch = av_dns_dispatch, .budget = 16 },
+};
 
-	n_events = poll(sstate->poll_data, 4, -1);
-	if (n_events < 0) {
-		g_printerr("Failure while poll()ing: %s\n",strerror(errno));
-		return -1;
-	}
+/* Idle lines cost nothing but an fd set to -1 in the poll() set. */
+static void av_sip_poll_setup(void) {
+	struct av_poll_source templates[AV_SIP_POLL_NUM_FDS] = { 0 };
+	struct av_sip_line *l;
+	struct av_sip_queued *q;
+	int i;
 
-	/* Did we get a message from AV main thread? */
-	if (sstate->poll_data[0].revents == POLLIN) {
-		sstate->poll_data[0].revents = 0;
-		return av_sip_core_msg();
-	}
+	for (i = 0; i < AV_SIP_POLL_FIXED_FDS; i++)
+		templates[i] = av_sip_poll_sources[i];
+	templates[AV_SIP_POLL_DNS].data = &sstate->dns;
 
-	/* ... A SIP-related event? */
-	if (sstate->poll_data[1].revents == POLLIN) {
-		sstate->poll_data[1].revents = 0;
-		return av_sip_protocol_events();
-	}
+	for (i = 0; i < AV_SIP_MAX_LINES; i++) {
+		l = &sstate->lines[i];
+		l->id = i;
+		g_snprintf(l->name, sizeof l->name, "audio %d", i);
 
-	/* ... timerfd? */
-	if (sstate->poll_data[2].revents == POLLIN) {
-		sstate->poll_data[2].revents = 0;
-		return av_sip_protocol_automatic_action();
+		templates[AV_SIP_POLL_AUDIO(i)].name = l->name;
+		templates[AV_SIP_POLL_AUDIO(i)].dispatch = av_sip_audio_msg;
+		templates[AV_SIP_POLL_AUDIO(i)].data = l;
+		templates[AV_SIP_POLL_AUDIO(i)].budget = 16;
 	}
 
-	/* or audio thread? */
-	if (sstate->poll_data[3].revents == POLLIN) {
-		sstate->poll_data[3].revents = 0;
-		return av_sip_audio_msg();
+	for (i = 0; i < AV_SIP_QUEUE_MAX; i++) {
+		q = &sstate->queued[i];
+		q->id = i;
+		g_snprintf(q->name, sizeof q->name, "queue %d", i);
+
+		templates[AV_SIP_POLL_QUEUE(i)].name = q->name;
+		templates[AV_SIP_POLL_QUEUE(i)].dispatch = av_sip_queue_audio_msg;
+		templates[AV_SIP_POLL_QUEUE(i)].data = q;
+		templates[AV_SIP_POLL_QUEUE(i)].budget = 16;
 	}
 
-	return 0;
+	av_poll_init(&sstate->poll, sstate->poll_data, sstate->poll_sources, templates, AV_SIP_POLL_NUM_FDS);
+}
+
+static gint av_sip_loop(void) {
+	return av_poll_run(&sstate->poll, -1);
 }
 
 void *av_sip_init(gpointer data) {
 	struct av_thread *t = data;
 	struct av_thread_cmd *ready;
+	gchar *dns_server;
+	gdouble reg_rate;
+	gint reg_burst;
+	guint queue_size;
+	gint ret;
+	int i;
 
 	sstate = g_try_malloc0(sizeof *sstate);
 	if (!sstate) {
@@ -754,27 +3124,70 @@ void *av_sip_init(gpointer data) {
 	if (av_sip_stacksetup())
 		goto out;
 
-	if (av_sip_timerfd_setup())
+	if (av_sip_timers_setup())
 		goto out_notimerfd;
 
-	/* Inform core we are ready to proceed. */
-	ready = av_thread_cmd(SIP_EVENT_READY, NULL);
-	if (ready) {
-		av_thread_txcmd(t, ready, 1);
-		g_clear_pointer(&ready, g_free);
-	}
+	dns_server = av_config_dns_server();
+	ret = av_dns_init(&sstate->dns, &sstate->timers, dns_server, av_config_dns_cache());
+	g_free(dns_server);
+	if (ret)
+		goto out_nodns;
+	sstate->poll_data[AV_SIP_POLL_DNS].fd = av_dns_fd(&sstate->dns);
+	sstate->poll_data[AV_SIP_POLL_DNS].events = POLLIN;
+
+	av_config_register_limits(&reg_rate, &reg_burst);
+	av_sip_reg_bucket_init(&sstate->reg_bucket, &sstate->timers, reg_rate, reg_burst, av_sip_line_register);
+	/* With a queue, callers wait for a free modem rather than behind another call. */
+	queue_size = av_config_call_queue();
+	av_sip_queue_init(&sstate->queue, queue_size);
+	av_timer_init(&sstate->queue_dispatch, av_sip_queue_dispatch_lines, NULL);
+	av_sip_pools_init(&sstate->pools, queue_size ? 1 : AV_SIP_MAX_CALLS);
+	av_sip_admit_init(&sstate->admit);
+
+	/* Without a dial plan, numbers are dialed as they come. */
+	sstate->dialplan = av_sip_dialplan_load();
 
 	/* Setup poll-based communications with AV thread. */
 	av_sip_core_poll_setup();
+	av_sip_poll_setup();
+
+	/* Inform core we are ready to proceed. */
+	ready = av_thread_cmd(SIP_EVENT_READY, NULL);
+	if (ready)
+		av_thread_txcmd(t, ready, 1);
 
 	/* do poll() */
 	while(!av_sip_loop());
 
+	av_poll_report(&sstate->poll, "SIP");
+	av_sip_sdp_stats_report();
+	av_sip_teardown_stats_report();
+
 	av_sip_protocol_call_end(NULL);
 
+	/* We're going away: nothing else to do, so just wait for the audio threads. */
+	for (i = 0; i < AV_SIP_MAX_LINES; i++) {
+		g_clear_pointer(&sstate->lines[i].audiothread_stopping, av_thread_teardown);
+		av_config_free(&sstate->lines[i].sipconf);
+		av_config_free(&sstate->lines[i].sipconf_next);
+		g_clear_pointer(&sstate->lines[i].reg_host, g_free);
+		g_clear_pointer(&sstate->lines[i].forward, g_strfreev);
+		av_sip_sdp_deinit(&sstate->lines[i].sdp);
+	}
+	for (i = 0; i < AV_SIP_QUEUE_MAX; i++)
+		g_clear_pointer(&sstate->queued[i].audiothread_stopping, av_thread_teardown);
+
 	g_print("SIP: BYE BYE!\n");
 
-	av_sip_timerfd_teardown();
+	g_clear_pointer(&sstate->dialplan, av_dialplan_free);
+	av_sip_admit_deinit(&sstate->admit);
+	av_sip_queue_deinit(&sstate->queue);
+	av_sip_pools_deinit(&sstate->pools);
+	av_sip_reg_bucket_deinit(&sstate->reg_bucket);
+	av_dns_deinit(&sstate->dns);
+
+out_nodns:
+	av_sip_timers_teardown();
 
 out_notimerfd:
 	av_sip_stackteardown();
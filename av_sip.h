@@ -9,24 +9,47 @@
 #error "This code has not been tested with MONOTHREAD configuration."
 #endif
 
+/* How many modem lines a single SIP reactor serves. */
+#define AV_SIP_MAX_LINES 64
+
 enum SIP_CMDs {
 	SIP_CMD_EXIT = 0,
 	SIP_CMD_REGISTER = 1,
 	SIP_CMD_CALL_IN_PROGRESS = 2,
+	SIP_CMD_CALL_ACTIVE = 3,
+	SIP_CMD_CALL_FAILED = 4,
+	SIP_CMD_CALL_HELD = 5,
+	SIP_CMD_LINE_REMOVE = 6,
+	SIP_CMD_LINE_SIGNAL = 7,
+	SIP_CMD_CALL_RINGING_IN = 8,
+	SIP_CMD_CALL_TERMINATED = 9,
+	SIP_CMD_LINE_RECONFIGURE = 16,
+	SIP_CMD_RELOAD = 17,
 };
 
 enum CORE_MSG {
 	SIP_EVENT_READY = 10,
-	SIP_EVENT_INCOMING_CALL = 11
+	SIP_EVENT_INCOMING_CALL = 11,
+	SIP_EVENT_CALL_ENDED = 12,
+	SIP_EVENT_CALL_SWAP = 13,
+	SIP_EVENT_LINE_REMOVED = 14,
+	SIP_EVENT_CALL_ACCEPT = 15,
+	SIP_EVENT_LINE_REGISTERED = 18
 };
 
 struct av_rtp_connection {
 	char *addr;
 	int port;
 	int call_direction;
+	int payload_type;
+	/* enum av_sip_codec_id of payload_type */
+	int codec;
 	gchar *serial_device;
 };
 
+struct av_rtp_connection *av_sip_rtp_connection_dup(const struct av_rtp_connection *c);
+void av_sip_rtp_connection_free(struct av_rtp_connection **c);
+
 void *av_sip_init(gpointer data);
 
 #endif
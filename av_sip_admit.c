@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Admission control of INVITEs. A flood of them (a PBX gone wild, a scanner)
+ * must not keep the SIP reactor from serving the calls it already has, so
+ * new calls are turned down before anything costly (SDP, dial plan, modem
+ * requests) is done for them:
+ * - while SIP events have been waiting for us longer than we allow, i.e.:
+ *   we're not keeping up, with a 503;
+ * - while too many modem calls are being created already, with a 486: the
+ *   modems won't take them any sooner;
+ * - when their source, or everybody, sends them faster than allowed: both
+ *   go through token buckets, with a 503.
+*/
+
+/* AV headers */
+#include <av_sip_admit.h>
+
+/* Sources tracked at most, before forgetting about the quiet ones. */
+#define AV_SIP_ADMIT_MAX_SOURCES 1024
+
+/* Shed calls are summed up once every so many of them. */
+#define AV_SIP_ADMIT_REPORT_EVERY 100
+
+static void av_sip_admit_bucket_init(struct av_sip_admit_bucket *b, gdouble burst, gint64 now) {
+	b->tokens = burst;
+	b->refill = now;
+}
+
+static gboolean av_sip_admit_bucket_take(struct av_sip_admit_bucket *b, gdouble rate, gdouble burst, gint64 now) {
+	b->tokens = MIN(burst, b->tokens + (gdouble)(now - b->refill) * rate / G_USEC_PER_SEC);
+	b->refill = now;
+
+	if (b->tokens < 1)
+		return FALSE;
+
+	b->tokens -= 1;
+
+	return TRUE;
+}
+
+/* Buckets that had time to fill up again tell nothing a new one wouldn't. */
+static gboolean av_sip_admit_source_full(gpointer key, gpointer value, gpointer user_data) {
+	struct av_sip_admit *a = user_data;
+	struct av_sip_admit_bucket *b = value;
+
+	return (b->refill + (gint64)(a->conf.source_burst * G_USEC_PER_SEC / a->conf.source_rate)) < g_get_monotonic_time();
+}
+
+static struct av_sip_admit_bucket *av_sip_admit_source(struct av_sip_admit *a, const gchar *source, gint64 now) {
+	struct av_sip_admit_bucket *b;
+
+	b = g_hash_table_lookup(a->sources, source);
+	if (b)
+		return b;
+
+	if (g_hash_table_size(a->sources) >= AV_SIP_ADMIT_MAX_SOURCES)
+		g_hash_table_foreach_remove(a->sources, av_sip_admit_source_full, a);
+
+	/* Still too many of them: only the global limit applies. */
+	if (g_hash_table_size(a->sources) >= AV_SIP_ADMIT_MAX_SOURCES)
+		return NULL;
+
+	b = g_new(struct av_sip_admit_bucket, 1);
+	av_sip_admit_bucket_init(b, a->conf.source_burst, now);
+	g_hash_table_insert(a->sources, g_strdup(source), b);
+
+	return b;
+}
+
+static void av_sip_admit_report(struct av_sip_admit *a) {
+	struct av_sip_admit_stats *st = &a->stats;
+
+	g_print("Admission: %" G_GUINT64_FORMAT " calls admitted, %" G_GUINT64_FORMAT " shed (%" G_GUINT64_FORMAT " backlog, %" G_GUINT64_FORMAT " modems busy, %" G_GUINT64_FORMAT " per source, %" G_GUINT64_FORMAT " overall rate), %u queued (max %u), max backlog %" G_GINT64_FORMAT " ms\n",
+		st->n_admitted, st->n_shed_delay + st->n_shed_busy + st->n_shed_source + st->n_shed_rate,
+		st->n_shed_delay, st->n_shed_busy, st->n_shed_source, st->n_shed_rate,
+		a->n_queued, st->max_queued, st->max_delay/1000);
+}
+
+static gint av_sip_admit_shed(struct av_sip_admit *a, guint64 *counter, gint status, const gchar *source, const gchar *why) {
+	struct av_sip_admit_stats *st = &a->stats;
+	guint64 n_shed;
+
+	(*counter)++;
+	n_shed = st->n_shed_delay + st->n_shed_busy + st->n_shed_source + st->n_shed_rate;
+
+	if ( (n_shed == 1) || !(n_shed % AV_SIP_ADMIT_REPORT_EVERY) ) {
+		g_print("INVITE from %s shed (%s)\n",source,why);
+		av_sip_admit_report(a);
+	}
+
+	return status;
+}
+
+void av_sip_admit_init(struct av_sip_admit *a) {
+	memset(a, 0, sizeof *a);
+
+	av_config_admission(&a->conf);
+	av_sip_admit_bucket_init(&a->global, a->conf.burst, g_get_monotonic_time());
+	a->sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+void av_sip_admit_deinit(struct av_sip_admit *a) {
+	if (a->stats.n_admitted || a->stats.n_shed_delay || a->stats.n_shed_busy || a->stats.n_shed_source || a->stats.n_shed_rate)
+		av_sip_admit_report(a);
+
+	g_clear_pointer(&a->sources, g_hash_table_destroy);
+}
+
+/*
+ * Decides about a new INVITE from the given source address.
+ *
+ * Returns: 0 if the call may go on, the status to reject it with otherwise.
+*/
+gint av_sip_admit_invite(struct av_sip_admit *a, const gchar *source) {
+	struct av_sip_admit_bucket *b;
+	gint64 now = g_get_monotonic_time();
+	gint64 delay;
+
+	delay = a->backlog_since ? now - a->backlog_since : 0;
+	if (delay > a->stats.max_delay)
+		a->stats.max_delay = delay;
+
+	if (delay > (gint64)a->conf.max_delay * 1000)
+		return av_sip_admit_shed(a, &a->stats.n_shed_delay, 503, source, "backlog");
+
+	if (a->n_queued >= a->conf.max_queued)
+		return av_sip_admit_shed(a, &a->stats.n_shed_busy, 486, source, "modems busy");
+
+	b = av_sip_admit_source(a, source, now);
+	if (b && !av_sip_admit_bucket_take(b, a->conf.source_rate, a->conf.source_burst, now))
+		return av_sip_admit_shed(a, &a->stats.n_shed_source, 503, source, "source rate");
+
+	if (!av_sip_admit_bucket_take(&a->global, a->conf.rate, a->conf.burst, now))
+		return av_sip_admit_shed(a, &a->stats.n_shed_rate, 503, source, "overall rate");
+
+	a->stats.n_admitted++;
+
+	return 0;
+}
+
+/*
+ * Tells whether SIP events were left waiting by the last round, started at
+ * the given time: the backlog is as old as the first round of a row that
+ * didn't get through all of them.
+*/
+void av_sip_admit_backlog(struct av_sip_admit *a, gboolean backlog, gint64 since) {
+	if (!backlog)
+		a->backlog_since = 0;
+	else if (!a->backlog_since)
+		a->backlog_since = since;
+}
+
+/* A call is waiting for its modem call. */
+void av_sip_admit_queued(struct av_sip_admit *a) {
+	a->n_queued++;
+	if (a->n_queued > a->stats.max_queued)
+		a->stats.max_queued = a->n_queued;
+}
+
+/* A call got its modem call, or gave up on it. */
+void av_sip_admit_dequeued(struct av_sip_admit *a) {
+	if (a->n_queued)
+		a->n_queued--;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_admit_h__
+#define __av_sip_admit_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_config.h>
+
+/* Token bucket of INVITEs: refilled when looked at, nothing to schedule. */
+struct av_sip_admit_bucket {
+	gdouble tokens;
+	gint64 refill;
+};
+
+struct av_sip_admit_stats {
+	guint64 n_admitted;
+	guint64 n_shed_delay;
+	guint64 n_shed_busy;
+	guint64 n_shed_source;
+	guint64 n_shed_rate;
+	guint max_queued;
+	gint64 max_delay;
+};
+
+/*
+ * Admission control of new calls. Sources are tracked by address, the ones
+ * quiet for long enough being forgotten when there are too many.
+*/
+struct av_sip_admit {
+	struct av_admission_config conf;
+	struct av_sip_admit_bucket global;
+	GHashTable *sources;
+
+	/* Calls waiting for their modem call to be created and started. */
+	guint n_queued;
+
+	/* Since when SIP events are waiting for us, 0 if they're not. */
+	gint64 backlog_since;
+
+	struct av_sip_admit_stats stats;
+};
+
+void av_sip_admit_init(struct av_sip_admit *a);
+void av_sip_admit_deinit(struct av_sip_admit *a);
+gint av_sip_admit_invite(struct av_sip_admit *a, const gchar *source);
+void av_sip_admit_backlog(struct av_sip_admit *a, gboolean backlog, gint64 since);
+void av_sip_admit_queued(struct av_sip_admit *a);
+void av_sip_admit_dequeued(struct av_sip_admit *a);
+
+#endif
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * SIP calls table. Each modem line (struct av_sip_line) of the SIP reactor
+ * owns one of these, mapping SIP dialogs (by eXosip call ID) to MMCall
+ * objects (by object path). The table is a small fixed array: a modem line
+ * won't carry more than a handful of calls, so lookups are a short linear
+ * scan without any allocation.
+*/
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_sip_call.h>
+
+struct av_sip_call *av_sip_call_alloc(struct av_sip_calltable *t, eXosip_event_t *e) {
+	int i;
+	struct av_sip_call *c;
+
+	for (i = 0; i < AV_SIP_MAX_CALLS; i++) {
+		c = &t->calls[i];
+		if (c->in_use)
+			continue;
+
+		memset(c, 0, sizeof *c);
+		c->in_use = TRUE;
+		c->event = e;
+		c->timing.invite = g_get_monotonic_time();
+		t->n_calls++;
+		return c;
+	}
+
+	return NULL;
+}
+
+/*
+ * Frees everything a call holds, including its INVITE event, and gives the
+ * slot back.
+*/
+void av_sip_call_release(struct av_sip_calltable *t, struct av_sip_call *c) {
+	if (!c->in_use)
+		return;
+
+	g_clear_pointer(&c->event, eXosip_event_free);
+	av_sip_rtp_connection_free(&c->connection);
+	g_clear_pointer(&c->path, g_free);
+
+	if (t->media_owner == c)
+		t->media_owner = NULL;
+
+	c->in_use = FALSE;
+	t->n_calls--;
+}
+
+struct av_sip_call *av_sip_call_find_by_cid(struct av_sip_calltable *t, int cid) {
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_CALLS; i++)
+		if (t->calls[i].in_use && t->calls[i].event && (t->calls[i].event->cid == cid))
+			return &t->calls[i];
+
+	return NULL;
+}
+
+struct av_sip_call *av_sip_call_find_by_path(struct av_sip_calltable *t, const gchar *path) {
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_CALLS; i++)
+		if (t->calls[i].in_use && t->calls[i].path && !g_strcmp0(t->calls[i].path, path))
+			return &t->calls[i];
+
+	return NULL;
+}
+
+/* Finds the call from the GSM network one of our INVITEs is for. */
+struct av_sip_call *av_sip_call_find_by_fork(struct av_sip_calltable *t, int cid) {
+	struct av_sip_fork *f;
+	guint k;
+	int i;
+
+	for (i = 0; i < AV_SIP_MAX_CALLS; i++) {
+		if (!t->calls[i].in_use || !(t->calls[i].setup_flags & AV_SIP_SETUP_BRIDGED))
+			continue;
+
+		f = &t->calls[i].fork;
+		for (k = 0; k < f->n_cids; k++)
+			if (f->cids[k] == cid)
+				return &t->calls[i];
+	}
+
+	return NULL;
+}
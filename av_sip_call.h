@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_call_h__
+#define __av_sip_call_h__
+
+/* AV headers */
+#include <av_sip.h>
+#include <av_timer.h>
+#include <av_sip_codec.h>
+#include <av_dialplan.h>
+
+/*
+ * How many SIP dialogs a single modem line may carry at once: one active call,
+ * plus held and waiting ones.
+*/
+#define AV_SIP_MAX_CALLS 4
+
+/* How many SIP contacts a call from the GSM network may ring at once. */
+#define AV_SIP_MAX_FORKS 8
+
+/*
+ * Call setup steps. Media setup (audio thread, RTP, serial port) and modem
+ * call setup (ModemManager, on the main thread) proceed in parallel once the
+ * INVITE has been validated.
+*/
+enum AV_SIP_SETUP_FLAGS {
+	AV_SIP_SETUP_MEDIA_READY = 1 << 0,
+	AV_SIP_SETUP_CALL_STARTED = 1 << 1,
+	AV_SIP_SETUP_CALL_FAILED = 1 << 2,
+	AV_SIP_SETUP_EARLY_MEDIA = 1 << 3,
+	AV_SIP_SETUP_ANSWERED = 1 << 4,
+	AV_SIP_SETUP_BRIDGED = 1 << 5,
+	AV_SIP_SETUP_MODEM_QUEUED = 1 << 6,
+};
+
+/* Call setup instrumentation: monotonic timestamps of call setup steps. */
+struct av_sip_call_timing {
+	gint64 invite;
+	gint64 ringing;
+	gint64 media_ready;
+	gint64 call_started;
+	gint64 early_media;
+	gint64 answered;
+};
+
+/*
+ * RFC 4028 session timer of a dialog. The interval is 0 when the PBX didn't
+ * ask for one. Whoever refreshes, the timer fires when we must act: send a
+ * refresh if it's up to us, or give up on the session otherwise.
+*/
+struct av_sip_session_timer {
+	gint interval;
+	gboolean uas_refresh;
+	gboolean peer_supported;
+	struct av_timer timer;
+};
+
+/*
+ * A call from the GSM network, ringing SIP contacts in parallel: eXosip call
+ * IDs of the INVITEs still pending, -1 once they're done with. The first one
+ * answering gets the call.
+*/
+struct av_sip_fork {
+	int cids[AV_SIP_MAX_FORKS];
+	guint n_cids;
+	guint n_pending;
+	struct av_timer timer;
+
+	/* Monotonic timestamps: modem ringing, and SIP answer. */
+	gint64 ringing;
+	gint64 sip_answered;
+};
+
+/* A SIP dialog, and the MMCall object it's mapped to. */
+struct av_sip_call {
+	gboolean in_use;
+
+	/* Modem line carrying it. */
+	int line;
+
+	/*
+	 * The INVITE that started it all: eXosip transaction and dialog IDs. For
+	 * calls from the GSM network, the answer to ours, NULL until there's one.
+	*/
+	eXosip_event_t *event;
+
+	/* Where the caller wants its RTP stream. */
+	struct av_rtp_connection *connection;
+
+	/* Number the modem dials, as the dial plan normalized it. */
+	gchar number[AV_DIALPLAN_NUMBER_LEN];
+
+	/* MMCall object path, once the modem call has been started. */
+	gchar *path;
+
+	guint setup_flags;
+	gboolean held;
+	struct av_sip_call_timing timing;
+	struct av_sip_session_timer session_timer;
+
+	/* Origin of the SDP we send: the version only moves when our SDP changes. */
+	gulong sdp_session_id;
+	gulong sdp_version;
+	gboolean sdp_sent;
+	guint sdp_hash;
+
+	/* Codecs agreed on with the caller, which our SDP answers with. */
+	struct av_sip_codec_choice codecs;
+
+	/* INVITEs we sent, for calls from the GSM network (AV_SIP_SETUP_BRIDGED). */
+	struct av_sip_fork fork;
+};
+
+/*
+ * Per-modem call table. Only one call at a time owns the media path (the
+ * modem audio port and our RTP session): that's the one the modem reports as
+ * active.
+*/
+struct av_sip_calltable {
+	struct av_sip_call calls[AV_SIP_MAX_CALLS];
+	struct av_sip_call *media_owner;
+	guint n_calls;
+};
+
+struct av_sip_call *av_sip_call_alloc(struct av_sip_calltable *t, eXosip_event_t *e);
+void av_sip_call_release(struct av_sip_calltable *t, struct av_sip_call *c);
+struct av_sip_call *av_sip_call_find_by_cid(struct av_sip_calltable *t, int cid);
+struct av_sip_call *av_sip_call_find_by_path(struct av_sip_calltable *t, const gchar *path);
+struct av_sip_call *av_sip_call_find_by_fork(struct av_sip_calltable *t, int cid);
+
+#endif
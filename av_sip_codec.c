@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * SDP offer/answer codec negotiation (RFC 3264). An offer lists payload
+ * types, static ones meaning a codec by themselves (RFC 3551), dynamic ones
+ * getting theirs from rtpmap attributes. The first codec of the line
+ * preferences the offer has wins, telephone-event (RFC 4733) coming along if
+ * both sides want it.
+ *
+ * The media path is G.711 from the modem: PCMU as is, PCMA transcoded by the
+ * audio thread.
+*/
+
+/* AV headers */
+#include <av_sip_codec.h>
+
+/* Payload types of a single media line we care about. */
+#define AV_SIP_CODEC_MAX_OFFERED 32
+
+/* Where we put telephone-event in our offers (RFC 4733 suggests nothing). */
+#define AV_SIP_CODEC_OFFER_DTMF_PT 101
+
+/* Line preferences when not configured. */
+#define AV_SIP_CODEC_DEFAULT_PREFS "PCMU,PCMA"
+
+static const struct av_sip_codec av_sip_codecs[AV_SIP_CODEC_MAX] = {
+	[AV_SIP_CODEC_PCMU] = { "PCMU", 8000, 0, TRUE },
+	[AV_SIP_CODEC_PCMA] = { "PCMA", 8000, 8, TRUE },
+	[AV_SIP_CODEC_TELEPHONE_EVENT] = { "telephone-event", 8000, -1, FALSE },
+};
+
+/* A payload type of the offer, and what we found out about it. */
+struct av_sip_codec_offered {
+	int pt;
+	enum av_sip_codec_id codec;
+	const char *fmtp;
+};
+
+const struct av_sip_codec *av_sip_codec_get(enum av_sip_codec_id id) {
+	if ( (id < 0) || (id >= AV_SIP_CODEC_MAX) )
+		return NULL;
+
+	return &av_sip_codecs[id];
+}
+
+/* Looks a codec up by encoding name, len characters of it. */
+static enum av_sip_codec_id av_sip_codec_by_name(const char *name, gsize len) {
+	int i;
+
+	for (i = 0; i < AV_SIP_CODEC_MAX; i++)
+		if (!g_ascii_strncasecmp(name, av_sip_codecs[i].name, len) && !av_sip_codecs[i].name[len])
+			return i;
+
+	return AV_SIP_CODEC_NONE;
+}
+
+static enum av_sip_codec_id av_sip_codec_by_static_pt(int pt) {
+	int i;
+
+	for (i = 0; i < AV_SIP_CODEC_MAX; i++)
+		if (av_sip_codecs[i].static_pt == pt)
+			return i;
+
+	return AV_SIP_CODEC_NONE;
+}
+
+/*
+ * Parses the payload type an attribute value starts with.
+ *
+ * Returns: the payload type, -1 if there's none; *rest points to what
+ * follows it.
+*/
+static int av_sip_codec_pt(const char *value, const char **rest) {
+	char *end;
+	long pt;
+
+	pt = strtol(value, &end, 10);
+	if ( (end == value) || (pt < 0) || (pt > 127) )
+		return -1;
+
+	while (*end == ' ')
+		end++;
+	*rest = end;
+
+	return pt;
+}
+
+static struct av_sip_codec_offered *av_sip_codec_offered_find(struct av_sip_codec_offered *offered, guint n, int pt) {
+	guint i;
+
+	for (i = 0; i < n; i++)
+		if (offered[i].pt == pt)
+			return &offered[i];
+
+	return NULL;
+}
+
+/* "<encoding name>/<clock rate>[/<channels>]": only mono codecs are known. */
+static enum av_sip_codec_id av_sip_codec_rtpmap(const char *rtpmap) {
+	const char *slash;
+	enum av_sip_codec_id id;
+
+	slash = strchr(rtpmap, '/');
+	if (!slash)
+		return AV_SIP_CODEC_NONE;
+
+	id = av_sip_codec_by_name(rtpmap, slash - rtpmap);
+	if ( (id == AV_SIP_CODEC_NONE) || (strtoul(slash + 1, NULL, 10) != av_sip_codecs[id].clock_rate) )
+		return AV_SIP_CODEC_NONE;
+
+	return id;
+}
+
+/*
+ * Reads a comma separated list of codec names, most preferred first. NULL
+ * gets the default ones.
+ *
+ * Returns: non-zero if no audio codec is left.
+*/
+gint av_sip_codec_prefs_parse(struct av_sip_codec_prefs *p, const gchar *list) {
+	enum av_sip_codec_id id;
+	gchar **names;
+	gchar *name;
+	gboolean audio = FALSE;
+	guint i;
+	guint k;
+
+	memset(p, 0, sizeof *p);
+
+	names = g_strsplit(list ? list : AV_SIP_CODEC_DEFAULT_PREFS, ",", -1);
+	for (i = 0; names[i] && (p->n < AV_SIP_CODEC_MAX); i++) {
+		name = g_strstrip(names[i]);
+		id = av_sip_codec_by_name(name, strlen(name));
+		if (id == AV_SIP_CODEC_NONE) {
+			g_printerr("Unknown codec \"%s\"\n",name);
+			continue;
+		}
+
+		for (k = 0; (k < p->n) && (p->ids[k] != id); k++);
+		if (k < p->n)
+			continue;
+
+		p->ids[p->n++] = id;
+		audio |= av_sip_codecs[id].audio;
+	}
+	g_strfreev(names);
+
+	if (!audio)
+		g_printerr("No audio codec in \"%s\"\n",list);
+
+	return !audio;
+}
+
+/*
+ * Picks the codecs to answer an audio media line of an offer with. Payload
+ * types are gone through once, then attributes once, nothing gets copied but
+ * the events of telephone-event.
+ *
+ * Returns: non-zero if nothing we can handle is offered.
+*/
+gint av_sip_codec_negotiate(sdp_message_t *sdp, int pos_media, const struct av_sip_codec_prefs *p, struct av_sip_codec_choice *choice) {
+	struct av_sip_codec_offered offered[AV_SIP_CODEC_MAX_OFFERED];
+	struct av_sip_codec_offered *o;
+	sdp_attribute_t *a;
+	const char *payload;
+	const char *rest;
+	guint n = 0;
+	guint k;
+	guint i;
+	int pt;
+
+	memset(choice, 0, sizeof *choice);
+	choice->codec = AV_SIP_CODEC_NONE;
+	choice->payload_type = -1;
+	choice->dtmf_payload_type = -1;
+
+	/* Static payload types stand for their codec, unless an rtpmap says otherwise. */
+	for (i = 0; (payload = sdp_message_m_payload_get(sdp, pos_media, i)) && (n < AV_SIP_CODEC_MAX_OFFERED); i++) {
+		if ( (pt = av_sip_codec_pt(payload, &rest)) < 0 )
+			continue;
+
+		offered[n].pt = pt;
+		offered[n].codec = av_sip_codec_by_static_pt(pt);
+		offered[n].fmtp = NULL;
+		n++;
+	}
+
+	for (i = 0; (a = sdp_message_attribute_get(sdp, pos_media, i)); i++) {
+		if (!a->a_att_field || !a->a_att_value)
+			continue;
+
+		if (!g_ascii_strcasecmp(a->a_att_field, "ptime")) {
+			choice->ptime = strtoul(a->a_att_value, NULL, 10);
+			continue;
+		}
+
+		if (g_ascii_strcasecmp(a->a_att_field, "rtpmap") && g_ascii_strcasecmp(a->a_att_field, "fmtp"))
+			continue;
+
+		if ( ((pt = av_sip_codec_pt(a->a_att_value, &rest)) < 0) || !(o = av_sip_codec_offered_find(offered, n, pt)) )
+			continue;
+
+		if (!g_ascii_strcasecmp(a->a_att_field, "rtpmap"))
+			o->codec = av_sip_codec_rtpmap(rest);
+		else
+			o->fmtp = rest;
+	}
+
+	/* Our preferences first, the offer order breaking ties. */
+	for (k = 0; (k < p->n) && (choice->codec == AV_SIP_CODEC_NONE); k++) {
+		if (!av_sip_codecs[p->ids[k]].audio)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (offered[i].codec == p->ids[k]) {
+				choice->codec = offered[i].codec;
+				choice->payload_type = offered[i].pt;
+				break;
+			}
+		}
+	}
+
+	if (choice->codec == AV_SIP_CODEC_NONE)
+		return 1;
+
+	for (k = 0; k < p->n; k++) {
+		if (p->ids[k] != AV_SIP_CODEC_TELEPHONE_EVENT)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (offered[i].codec != AV_SIP_CODEC_TELEPHONE_EVENT)
+				continue;
+
+			/* No fmtp means 0-15 (RFC 4733, section 7.1.1). */
+			choice->dtmf_payload_type = offered[i].pt;
+			g_strlcpy(choice->dtmf_events, offered[i].fmtp ? offered[i].fmtp : "0-15", sizeof choice->dtmf_events);
+			break;
+		}
+	}
+
+	g_print("Codec %s (payload type %d)%s, ptime %u\n",av_sip_codecs[choice->codec].name,choice->payload_type,
+		(choice->dtmf_payload_type >= 0) ? " with telephone-event" : "",choice->ptime);
+
+	return 0;
+}
+
+/*
+ * Picks what our own offers carry: the most preferred audio codec at its
+ * static payload type, which is all the modem path handles at once anyway,
+ * and telephone-event if the line wants it.
+ *
+ * Returns: non-zero if the line has no audio codec.
+*/
+gint av_sip_codec_offer(const struct av_sip_codec_prefs *p, struct av_sip_codec_choice *choice) {
+	guint k;
+
+	memset(choice, 0, sizeof *choice);
+	choice->codec = AV_SIP_CODEC_NONE;
+	choice->payload_type = -1;
+	choice->dtmf_payload_type = -1;
+
+	for (k = 0; k < p->n; k++) {
+		if (av_sip_codecs[p->ids[k]].audio && (choice->codec == AV_SIP_CODEC_NONE)) {
+			choice->codec = p->ids[k];
+			choice->payload_type = av_sip_codecs[p->ids[k]].static_pt;
+		}
+		else if (p->ids[k] == AV_SIP_CODEC_TELEPHONE_EVENT) {
+			choice->dtmf_payload_type = AV_SIP_CODEC_OFFER_DTMF_PT;
+			g_strlcpy(choice->dtmf_events, "0-15", sizeof choice->dtmf_events);
+		}
+	}
+
+	return choice->codec == AV_SIP_CODEC_NONE;
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_codec_h__
+#define __av_sip_codec_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_sip.h>
+
+/* Codecs we know about: see av_sip_codecs[]. */
+enum av_sip_codec_id {
+	AV_SIP_CODEC_NONE = -1,
+	AV_SIP_CODEC_PCMU = 0,
+	AV_SIP_CODEC_PCMA,
+	AV_SIP_CODEC_TELEPHONE_EVENT,
+	AV_SIP_CODEC_MAX
+};
+
+struct av_sip_codec {
+	const gchar *name;
+	guint clock_rate;
+
+	/* Static RTP payload type, -1 if it only comes with a dynamic one. */
+	int static_pt;
+
+	/* Audio, as opposed to RFC 4733 events. */
+	gboolean audio;
+};
+
+/* Codecs a line accepts, most preferred first. */
+struct av_sip_codec_prefs {
+	enum av_sip_codec_id ids[AV_SIP_CODEC_MAX];
+	guint n;
+};
+
+/* What an offer and our preferences agreed on. */
+struct av_sip_codec_choice {
+	enum av_sip_codec_id codec;
+	int payload_type;
+
+	/* RFC 4733 events, if both sides want them: -1 otherwise. */
+	int dtmf_payload_type;
+	gchar dtmf_events[32];
+
+	/* What the offerer would like to receive, 0 if it didn't say. */
+	guint ptime;
+};
+
+const struct av_sip_codec *av_sip_codec_get(enum av_sip_codec_id id);
+gint av_sip_codec_prefs_parse(struct av_sip_codec_prefs *p, const gchar *list);
+gint av_sip_codec_negotiate(sdp_message_t *sdp, int pos_media, const struct av_sip_codec_prefs *p, struct av_sip_codec_choice *choice);
+gint av_sip_codec_offer(const struct av_sip_codec_prefs *p, struct av_sip_codec_choice *choice);
+
+#endif
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Modem pools. Every modem line registers its own SIP account, but lines may
+ * share one: the PBX then sees a single identity fronting a group of modems,
+ * and doesn't have to know which of them is free. Inbound calls to the
+ * identity go to the best member, by live state:
+ * - registered, with room for another call and with SIM minutes left;
+ * - then the fewest calls going on (free modems first);
+ * - then the best signal, in steps of 10% so that small swings don't matter;
+ * - then the SIM that carried the fewest call minutes.
+ *
+ * When the dial plan has a target for the number called (a group of modems,
+ * or a single one), members outside of it are only used if none of those in
+ * it can take the call: a pricier route is still better than no call.
+ *
+ * Pools are looked up by identity in a hash table, and members are gone
+ * through once per call: that's a few hundred of them at most.
+*/
+
+/* AV headers */
+#include <av_sip_pool.h>
+
+#define AV_SIP_POOL_SIGNAL_STEP 10
+
+static void av_sip_pool_free(gpointer data) {
+	struct av_sip_pool *p = data;
+	struct av_sip_pool_stats *st = &p->stats;
+
+	if (st->n_routed)
+		g_print("Pool %s: %" G_GUINT64_FORMAT " calls routed in %.2f us on average (max %" G_GINT64_FORMAT " us), %" G_GUINT64_FORMAT " found no modem available\n",
+			p->identity, st->n_routed, (gdouble)st->route_total/st->n_routed, st->route_max, st->n_unavailable);
+
+	g_ptr_array_free(p->members, TRUE);
+	g_free(p->identity);
+	g_free(p);
+}
+
+void av_sip_pools_init(struct av_sip_pools *ps, guint max_calls) {
+	ps->pools = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, av_sip_pool_free);
+	ps->max_calls = max_calls;
+}
+
+void av_sip_pools_deinit(struct av_sip_pools *ps) {
+	g_clear_pointer(&ps->pools, g_hash_table_destroy);
+}
+
+void av_sip_pool_join(struct av_sip_pools *ps, struct av_sip_pool_member *m, const gchar *identity, gpointer data) {
+	struct av_sip_pool *p;
+
+	p = g_hash_table_lookup(ps->pools, identity);
+	if (!p) {
+		p = g_new0(struct av_sip_pool, 1);
+		p->identity = g_strdup(identity);
+		p->members = g_ptr_array_new();
+		g_hash_table_insert(ps->pools, p->identity, p);
+	}
+
+	m->pool = p;
+	m->data = data;
+	g_ptr_array_add(p->members, m);
+
+	g_print("Pool %s has %u modem(s)\n",p->identity,p->members->len);
+}
+
+/* The pool goes away with its last member, its stats printed. */
+void av_sip_pool_leave(struct av_sip_pools *ps, struct av_sip_pool_member *m) {
+	struct av_sip_pool *p = m->pool;
+
+	if (!p)
+		return;
+
+	m->pool = NULL;
+	g_ptr_array_remove_fast(p->members, m);
+	if (!p->members->len)
+		g_hash_table_remove(ps->pools, p->identity);
+}
+
+struct av_sip_pool *av_sip_pool_find(struct av_sip_pools *ps, const gchar *identity) {
+	return g_hash_table_lookup(ps->pools, identity);
+}
+
+gboolean av_sip_pool_available(struct av_sip_pools *ps, const struct av_sip_pool_member *m) {
+	if (!m->registered || (*m->n_calls >= ps->max_calls))
+		return FALSE;
+
+	return !m->call_time_limit || (m->call_time < m->call_time_limit);
+}
+
+static gboolean av_sip_pool_better(const struct av_sip_pool_member *a, const struct av_sip_pool_member *b) {
+	guint a_signal = a->signal_quality / AV_SIP_POOL_SIGNAL_STEP;
+	guint b_signal = b->signal_quality / AV_SIP_POOL_SIGNAL_STEP;
+
+	if (*a->n_calls != *b->n_calls)
+		return *a->n_calls < *b->n_calls;
+
+	if (a_signal != b_signal)
+		return a_signal > b_signal;
+
+	return a->call_time < b->call_time;
+}
+
+static gboolean av_sip_pool_targeted(const struct av_sip_pool_member *m, const gchar *target) {
+	return !g_strcmp0(m->group, target) || !g_strcmp0(m->sim, target);
+}
+
+/*
+ * Picks the member of a pool an inbound call should go to, within the
+ * dial plan target if any.
+ *
+ * Returns: its data, NULL if no member can take the call.
+*/
+gpointer av_sip_pool_route(struct av_sip_pools *ps, struct av_sip_pool *p, const gchar *target) {
+	struct av_sip_pool_stats *st = &p->stats;
+	struct av_sip_pool_member *best = NULL;
+	struct av_sip_pool_member *best_targeted = NULL;
+	struct av_sip_pool_member *m;
+	gint64 start = g_get_monotonic_time();
+	gint64 elapsed;
+	guint i;
+
+	for (i = 0; i < p->members->len; i++) {
+		m = g_ptr_array_index(p->members, i);
+		if (!av_sip_pool_available(ps, m))
+			continue;
+
+		if (!best || av_sip_pool_better(m, best))
+			best = m;
+		if (target && av_sip_pool_targeted(m, target) && (!best_targeted || av_sip_pool_better(m, best_targeted)))
+			best_targeted = m;
+	}
+
+	if (best_targeted)
+		best = best_targeted;
+	else if (target && best)
+		g_print("Pool %s: no modem of %s available\n",p->identity,target);
+
+	elapsed = g_get_monotonic_time() - start;
+	st->n_routed++;
+	st->route_total += elapsed;
+	if (elapsed > st->route_max)
+		st->route_max = elapsed;
+
+	if (!best) {
+		st->n_unavailable++;
+		g_print("Pool %s: none of %u modem(s) available\n",p->identity,p->members->len);
+		return NULL;
+	}
+
+	return best->data;
+}
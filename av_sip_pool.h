@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_pool_h__
+#define __av_sip_pool_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/*
+ * A modem line as a member of the pool of its SIP identity, and the live
+ * state calls get routed by. The line keeps it up to date.
+*/
+struct av_sip_pool_member {
+	struct av_sip_pool *pool;
+	gpointer data;
+
+	/* Dial plan targets the modem answers to: see av_dialplan.c. */
+	const gchar *group;
+	const gchar *sim;
+
+	gboolean registered;
+
+	/* The call table of the line counts them already. */
+	const guint *n_calls;
+
+	/* Signal quality as ModemManager reports it, in percent. */
+	guint signal_quality;
+
+	/* Calls carried by the SIM, and how much of them it may carry (0: no limit). */
+	gint64 call_time;
+	gint64 call_time_limit;
+};
+
+struct av_sip_pool_stats {
+	guint64 n_routed;
+	guint64 n_unavailable;
+	gint64 route_total;
+	gint64 route_max;
+};
+
+/* Modem lines sharing a SIP identity: calls to it go to any of them. */
+struct av_sip_pool {
+	gchar *identity;
+	GPtrArray *members;
+	struct av_sip_pool_stats stats;
+};
+
+struct av_sip_pools {
+	GHashTable *pools;
+	guint max_calls;
+};
+
+void av_sip_pools_init(struct av_sip_pools *ps, guint max_calls);
+void av_sip_pools_deinit(struct av_sip_pools *ps);
+void av_sip_pool_join(struct av_sip_pools *ps, struct av_sip_pool_member *m, const gchar *identity, gpointer data);
+void av_sip_pool_leave(struct av_sip_pools *ps, struct av_sip_pool_member *m);
+struct av_sip_pool *av_sip_pool_find(struct av_sip_pools *ps, const gchar *identity);
+gboolean av_sip_pool_available(struct av_sip_pools *ps, const struct av_sip_pool_member *m);
+gpointer av_sip_pool_route(struct av_sip_pools *ps, struct av_sip_pool *p, const gchar *target);
+
+#endif
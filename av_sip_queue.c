@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Call queue. When no modem can take a call, the caller waits in line
+ * listening to early media instead of being turned down, until a modem of
+ * its pool is free again. The queue is small and bounded: entries are linked
+ * in place (no allocation), one list per priority, and leaving it from
+ * anywhere is O(1).
+*/
+
+/* AV headers */
+#include <av_sip_queue.h>
+
+void av_sip_queue_init(struct av_sip_queue *q, guint size) {
+	int i;
+
+	memset(q, 0, sizeof *q);
+
+	for (i = 0; i < AV_SIP_QUEUE_PRIORITIES; i++)
+		g_queue_init(&q->levels[i]);
+	q->size = MIN(size, AV_SIP_QUEUE_MAX);
+}
+
+void av_sip_queue_deinit(struct av_sip_queue *q) {
+	struct av_sip_queue_stats *st = &q->stats;
+
+	if (!st->n_queued && !st->n_full)
+		return;
+
+	g_print("Call queue: %" G_GUINT64_FORMAT " calls queued (max depth %u), %" G_GUINT64_FORMAT " turned down with the queue full\n",
+		st->n_queued, st->max_depth, st->n_full);
+	if (st->n_dispatched)
+		g_print("Call queue: %" G_GUINT64_FORMAT " dispatched after %" G_GINT64_FORMAT " ms on average (max %" G_GINT64_FORMAT " ms)\n",
+			st->n_dispatched, st->dispatch_wait_total/st->n_dispatched/1000, st->dispatch_wait_max/1000);
+	if (st->n_abandoned)
+		g_print("Call queue: %" G_GUINT64_FORMAT " abandoned after %" G_GINT64_FORMAT " ms on average (max %" G_GINT64_FORMAT " ms)\n",
+			st->n_abandoned, st->abandon_wait_total/st->n_abandoned/1000, st->abandon_wait_max/1000);
+}
+
+/* Tells whether there's no room for another call (or no queue at all). */
+gboolean av_sip_queue_full(struct av_sip_queue *q) {
+	if (!q->size)
+		return TRUE;
+
+	if (q->n < q->size)
+		return FALSE;
+
+	q->stats.n_full++;
+
+	return TRUE;
+}
+
+/* Puts a call in line, data standing for it: there must be room for it. */
+void av_sip_queue_push(struct av_sip_queue *q, struct av_sip_queue_entry *e, enum av_sip_queue_priority priority, gpointer data) {
+	e->link.data = data;
+	e->link.prev = e->link.next = NULL;
+	e->priority = priority;
+	e->enqueued = g_get_monotonic_time();
+	e->queued = TRUE;
+	g_queue_push_tail_link(&q->levels[priority], &e->link);
+
+	q->n++;
+	q->stats.n_queued++;
+	if (q->n > q->stats.max_depth)
+		q->stats.max_depth = q->n;
+}
+
+/* Where the call stands, 1 being next. */
+guint av_sip_queue_position(struct av_sip_queue *q, struct av_sip_queue_entry *e) {
+	GList *l;
+	guint position = 1;
+	int p;
+
+	av_sip_queue_foreach(q, p, l) {
+		if (l == &e->link)
+			return position;
+		position++;
+	}
+
+	return 0;
+}
+
+static gint64 av_sip_queue_remove(struct av_sip_queue *q, struct av_sip_queue_entry *e) {
+	g_queue_unlink(&q->levels[e->priority], &e->link);
+	e->queued = FALSE;
+	q->n--;
+
+	return g_get_monotonic_time() - e->enqueued;
+}
+
+/* The call got a modem. */
+void av_sip_queue_dispatched(struct av_sip_queue *q, struct av_sip_queue_entry *e) {
+	struct av_sip_queue_stats *st = &q->stats;
+	gint64 wait;
+
+	if (!e->queued)
+		return;
+
+	wait = av_sip_queue_remove(q, e);
+	st->n_dispatched++;
+	st->dispatch_wait_total += wait;
+	if (wait > st->dispatch_wait_max)
+		st->dispatch_wait_max = wait;
+
+	g_print("Queued call dispatched after %" G_GINT64_FORMAT " ms, %u left waiting\n",wait/1000,q->n);
+}
+
+/* The caller hung up, or we had to give up on the call. */
+void av_sip_queue_abandoned(struct av_sip_queue *q, struct av_sip_queue_entry *e) {
+	struct av_sip_queue_stats *st = &q->stats;
+	gint64 wait;
+
+	if (!e->queued)
+		return;
+
+	wait = av_sip_queue_remove(q, e);
+	st->n_abandoned++;
+	st->abandon_wait_total += wait;
+	if (wait > st->abandon_wait_max)
+		st->abandon_wait_max = wait;
+
+	g_print("Queued call abandoned after %" G_GINT64_FORMAT " ms, %u left waiting\n",wait/1000,q->n);
+}
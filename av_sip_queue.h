@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_queue_h__
+#define __av_sip_queue_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* Calls waiting for a modem at most: each of them has its own media. */
+#define AV_SIP_QUEUE_MAX 16
+
+/* Urgent calls (SIP Priority header) go first, then everybody else. */
+enum av_sip_queue_priority {
+	AV_SIP_QUEUE_URGENT = 0,
+	AV_SIP_QUEUE_NORMAL,
+	AV_SIP_QUEUE_PRIORITIES
+};
+
+/* A waiting call, linked into the queue of its priority. */
+struct av_sip_queue_entry {
+	GList link;
+	enum av_sip_queue_priority priority;
+	gint64 enqueued;
+	gboolean queued;
+};
+
+struct av_sip_queue_stats {
+	guint64 n_queued;
+	guint64 n_full;
+	guint64 n_dispatched;
+	gint64 dispatch_wait_total;
+	gint64 dispatch_wait_max;
+	guint64 n_abandoned;
+	gint64 abandon_wait_total;
+	gint64 abandon_wait_max;
+	guint max_depth;
+};
+
+struct av_sip_queue {
+	GQueue levels[AV_SIP_QUEUE_PRIORITIES];
+	guint size;
+	guint n;
+	struct av_sip_queue_stats stats;
+};
+
+/* Goes through waiting calls, first come first served within each priority. */
+#define av_sip_queue_foreach(q, p, l) \
+	for ((p) = 0; (p) < AV_SIP_QUEUE_PRIORITIES; (p)++) \
+		for ((l) = (q)->levels[(p)].head; (l); (l) = (l)->next)
+
+void av_sip_queue_init(struct av_sip_queue *q, guint size);
+void av_sip_queue_deinit(struct av_sip_queue *q);
+gboolean av_sip_queue_full(struct av_sip_queue *q);
+void av_sip_queue_push(struct av_sip_queue *q, struct av_sip_queue_entry *e, enum av_sip_queue_priority priority, gpointer data);
+guint av_sip_queue_position(struct av_sip_queue *q, struct av_sip_queue_entry *e);
+void av_sip_queue_dispatched(struct av_sip_queue *q, struct av_sip_queue_entry *e);
+void av_sip_queue_abandoned(struct av_sip_queue *q, struct av_sip_queue_entry *e);
+
+#endif
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * REGISTER scheduling. When ModemManager restarts or the box boots, every
+ * modem line comes up at once: sending all REGISTERs right away gets us rate
+ * limited by the registrar. So:
+ * - initial REGISTERs go out after a random delay, and refreshes at a random
+ *   point between half and three quarters of the registration lifetime, so
+ *   that accounts registered together don't stay in lockstep;
+ * - all of them go through a token bucket;
+ * - failures are retried with exponential backoff (with jitter as well), or
+ *   after the Retry-After the registrar asked for.
+ *
+ * Authentication challenges are not failures: eXosip answers them.
+*/
+
+/* AV headers */
+#include <av_sip_reg.h>
+
+/* Initial REGISTERs are spread over this much time. */
+#define AV_SIP_REG_JITTER_USEC (3 * G_USEC_PER_SEC)
+
+static void av_sip_reg_after(struct av_sip_reg *r, gint64 delay) {
+	av_timer_arm(r->bucket->wheel, &r->timer, g_get_monotonic_time() + delay);
+}
+
+/* Sends as many queued REGISTERs as there are tokens, and waits for the next token if needed. */
+static void av_sip_reg_bucket_drain(struct av_sip_reg_bucket *b) {
+	struct av_sip_reg *r;
+	gint64 now = g_get_monotonic_time();
+
+	b->tokens = MIN(b->burst, b->tokens + (gdouble)(now - b->refill) * b->rate / G_USEC_PER_SEC);
+	b->refill = now;
+
+	while ( (b->tokens >= 1) && (r = g_queue_pop_head(&b->queue)) ) {
+		b->tokens -= 1;
+		b->n_sent++;
+
+		r->queued = FALSE;
+		r->challenges = 0;
+		if (!r->attempt_start) {
+			r->attempt_start = now;
+			r->n_attempts = 0;
+		}
+		r->n_attempts++;
+
+		b->send(r->data);
+	}
+
+	if (!g_queue_is_empty(&b->queue))
+		av_timer_arm(b->wheel, &b->timer, now + (gint64)((1 - b->tokens) * G_USEC_PER_SEC / b->rate) + 1);
+}
+
+static void av_sip_reg_bucket_refilled(struct av_timer *t, gpointer data) {
+	av_sip_reg_bucket_drain(data);
+}
+
+static void av_sip_reg_enqueue(struct av_timer *t, gpointer data) {
+	struct av_sip_reg *r = data;
+	struct av_sip_reg_bucket *b = r->bucket;
+	guint depth;
+
+	if (r->queued)
+		return;
+
+	r->queued = TRUE;
+	g_queue_push_tail(&b->queue, r);
+	av_sip_reg_bucket_drain(b);
+
+	if (!r->queued)
+		return;
+
+	b->n_throttled++;
+	depth = g_queue_get_length(&b->queue);
+	if (depth > b->max_depth)
+		b->max_depth = depth;
+
+	g_print("REGISTER throttled, queue depth %u\n",depth);
+}
+
+void av_sip_reg_bucket_init(struct av_sip_reg_bucket *b, struct av_timer_wheel *wheel, gdouble rate, gint burst, av_sip_reg_send_func send) {
+	memset(b, 0, sizeof *b);
+
+	b->wheel = wheel;
+	b->send = send;
+	b->rate = rate;
+	b->burst = MAX(burst, 1);
+	b->tokens = b->burst;
+	b->refill = g_get_monotonic_time();
+	g_queue_init(&b->queue);
+	av_timer_init(&b->timer, av_sip_reg_bucket_refilled, b);
+}
+
+void av_sip_reg_bucket_deinit(struct av_sip_reg_bucket *b) {
+	av_timer_cancel(b->wheel, &b->timer);
+	g_queue_clear(&b->queue);
+
+	g_print("REGISTER: %" G_GUINT64_FORMAT " sent, %" G_GUINT64_FORMAT " throttled, max queue depth %u, round trip average %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms\n",
+		b->n_sent, b->n_throttled, b->max_depth, b->n_answered ? b->rtt_total/(gint64)b->n_answered/1000 : 0, b->rtt_max/1000);
+}
+
+void av_sip_reg_init(struct av_sip_reg *r, struct av_sip_reg_bucket *b, gpointer data) {
+	memset(r, 0, sizeof *r);
+
+	r->bucket = b;
+	r->data = data;
+	av_timer_init(&r->timer, av_sip_reg_enqueue, r);
+}
+
+/* Schedules the initial REGISTER of an account. */
+void av_sip_reg_start(struct av_sip_reg *r) {
+	av_sip_reg_after(r, (gint64)(g_random_double() * AV_SIP_REG_JITTER_USEC));
+}
+
+void av_sip_reg_stop(struct av_sip_reg *r) {
+	av_timer_cancel(r->bucket->wheel, &r->timer);
+
+	if (r->queued)
+		g_queue_remove(&r->bucket->queue, r);
+	r->queued = FALSE;
+}
+
+/* A REGISTER went out: its round trip starts now. */
+void av_sip_reg_sent(struct av_sip_reg *r) {
+	r->sent = g_get_monotonic_time();
+}
+
+/*
+ * The account is registered for expires seconds: schedules the refresh.
+ *
+ * Returns: the time it took to get registered, in microseconds.
+*/
+gint64 av_sip_reg_success(struct av_sip_reg *r, gint expires) {
+	struct av_sip_reg_bucket *b = r->bucket;
+	gint64 now = g_get_monotonic_time();
+	gint64 ttr = 0;
+	gint64 rtt;
+
+	/* Authentication challenges included. */
+	if (r->sent) {
+		rtt = now - r->sent;
+		b->n_answered++;
+		b->rtt_total += rtt;
+		if (rtt > b->rtt_max)
+			b->rtt_max = rtt;
+	}
+	r->sent = 0;
+
+	if (r->attempt_start) {
+		ttr = now - r->attempt_start;
+		if (ttr > r->ttr_max)
+			r->ttr_max = ttr;
+	}
+
+	r->attempt_start = 0;
+	r->failures = 0;
+	r->challenges = 0;
+
+	av_sip_reg_after(r, (gint64)(expires * G_USEC_PER_SEC * (0.5 + 0.25 * g_random_double())));
+
+	return ttr;
+}
+
+/*
+ * A REGISTER was challenged.
+ *
+ * Returns: TRUE if eXosip should answer the challenge, FALSE if it already
+ * did and our credentials were refused.
+*/
+gboolean av_sip_reg_challenge(struct av_sip_reg *r) {
+	return (++r->challenges <= 1);
+}
+
+/* Schedules the next attempt after a failure. */
+void av_sip_reg_failure(struct av_sip_reg *r, gint retry_after) {
+	gint64 delay;
+
+	if (r->failures < 16)
+		r->failures++;
+
+	/* Doubling from the minimum reaches the maximum well before the shift could overflow. */
+	delay = MIN(AV_SIP_REG_BACKOFF_MAX_USEC, (gint64)AV_SIP_REG_BACKOFF_MIN_USEC << MIN(r->failures - 1, AV_SIP_REG_BACKOFF_MAX_SHIFT));
+	delay = delay/2 + (gint64)(g_random_double() * (delay/2));
+
+	if ( (retry_after > 0) && ((gint64)retry_after * G_USEC_PER_SEC > delay) )
+		delay = (gint64)retry_after * G_USEC_PER_SEC;
+
+	g_print("REGISTER retry in %" G_GINT64_FORMAT " ms (failure %u)\n",delay/1000,r->failures);
+
+	av_sip_reg_after(r, delay);
+}
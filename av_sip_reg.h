@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_reg_h__
+#define __av_sip_reg_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_timer.h>
+
+/* Retries after failures: 2 s doubling up to 5 minutes, before jitter. */
+#define AV_SIP_REG_BACKOFF_MIN_USEC (2 * G_USEC_PER_SEC)
+#define AV_SIP_REG_BACKOFF_MAX_USEC (300 * G_USEC_PER_SEC)
+#define AV_SIP_REG_BACKOFF_MAX_SHIFT 8
+
+/* Sends a REGISTER for the account the given data stands for. */
+typedef void (*av_sip_reg_send_func)(gpointer data);
+
+/*
+ * Token bucket all REGISTERs go through, whatever the account: rate tokens
+ * per second, up to burst of them saved up. REGISTERs finding no token wait
+ * in line.
+*/
+struct av_sip_reg_bucket {
+	struct av_timer_wheel *wheel;
+	struct av_timer timer;
+	av_sip_reg_send_func send;
+	gdouble rate;
+	gdouble burst;
+	gdouble tokens;
+	gint64 refill;
+	GQueue queue;
+
+	guint64 n_sent;
+	guint64 n_throttled;
+	guint max_depth;
+
+	/*
+	 * REGISTER round trips, from the request going out to the registrar
+	 * accepting it: a new connection (and TLS handshake) shows up here.
+	 */
+	guint64 n_answered;
+	gint64 rtt_total;
+	gint64 rtt_max;
+};
+
+/* Registration scheduling state of an account. */
+struct av_sip_reg {
+	struct av_sip_reg_bucket *bucket;
+	struct av_timer timer;
+	gpointer data;
+	gboolean queued;
+	guint failures;
+	guint challenges;
+
+	/* Time-to-registered: from the first attempt to success. */
+	gint64 attempt_start;
+	guint n_attempts;
+	gint64 ttr_max;
+
+	/* When the last REGISTER went out, 0 once answered. */
+	gint64 sent;
+};
+
+void av_sip_reg_bucket_init(struct av_sip_reg_bucket *b, struct av_timer_wheel *wheel, gdouble rate, gint burst, av_sip_reg_send_func send);
+void av_sip_reg_bucket_deinit(struct av_sip_reg_bucket *b);
+
+void av_sip_reg_init(struct av_sip_reg *r, struct av_sip_reg_bucket *b, gpointer data);
+void av_sip_reg_start(struct av_sip_reg *r);
+void av_sip_reg_stop(struct av_sip_reg *r);
+void av_sip_reg_sent(struct av_sip_reg *r);
+gint64 av_sip_reg_success(struct av_sip_reg *r, gint expires);
+gboolean av_sip_reg_challenge(struct av_sip_reg *r);
+void av_sip_reg_failure(struct av_sip_reg *r, gint retry_after);
+
+#endif
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * SDP answers. They used to be built as an osip SDP tree, a dozen strings
+ * allocated for it, and then printed, for every answer of every call. Our
+ * answer never changes but for a few numbers, so it's rendered once per line
+ * as text, and answers get written into a buffer allocated along with it:
+ *
+ * v=0
+ * o=airvoice <session id> <version> IN IP4 <address>
+ * s=DongleCall
+ * c=IN IP4 <address>
+ * t=0 0
+ * m=audio <port> RTP/AVP <payload type> [<telephone-event payload type>]
+ * a=rtpmap:<payload type> <codec>/8000
+ * a=rtpmap:<telephone-event payload type> telephone-event/8000, and
+ * a=fmtp:<telephone-event payload type> <events>, if negotiated
+ * a=ptime:20
+ * a=<direction>, when answering a hold or resume request
+*/
+
+/* AV headers */
+#include <av_sip_sdp.h>
+
+/* Longest numbers and media direction attribute that can be patched in. */
+#define AV_SIP_SDP_NUMBER_LEN 20
+#define AV_SIP_SDP_DIRECTION_LEN 16
+
+/*
+ * Codec lines at their longest: the codec name, the events of
+ * telephone-event, payload types and the text around them.
+*/
+#define AV_SIP_SDP_CODECS_LEN 192
+
+/* What we send at: 160 bytes from the modem every read. */
+#define AV_SIP_SDP_PTIME "a=ptime:20\r\n"
+
+static gchar *av_sip_sdp_number(gchar *p, gulong n) {
+	gchar digits[AV_SIP_SDP_NUMBER_LEN];
+	int i = 0;
+
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	while (i)
+		*p++ = digits[--i];
+
+	return p;
+}
+
+static gchar *av_sip_sdp_copy(gchar *p, const gchar *s, gsize len) {
+	memcpy(p, s, len);
+	return p + len;
+}
+
+gint av_sip_sdp_init(struct av_sip_sdp *s, const gchar *addr) {
+	memset(s, 0, sizeof *s);
+
+	s->origin = g_strdup("v=0\r\no=airvoice ");
+	s->media = g_strdup_printf(" IN IP4 %s\r\ns=DongleCall\r\nc=IN IP4 %s\r\nt=0 0\r\nm=audio ",addr,addr);
+
+	s->origin_len = strlen(s->origin);
+	s->media_len = strlen(s->media);
+
+	/* Session ID, version, port, codecs and direction at their longest, and a NUL. */
+	s->size = s->origin_len + s->media_len + 3 * AV_SIP_SDP_NUMBER_LEN + 2 + AV_SIP_SDP_CODECS_LEN + AV_SIP_SDP_DIRECTION_LEN + 5;
+	s->buf = g_try_malloc(s->size);
+	if (!s->buf) {
+		g_printerr("Failure allocating SDP buffer\n");
+		av_sip_sdp_deinit(s);
+		return 1;
+	}
+
+	return 0;
+}
+
+void av_sip_sdp_deinit(struct av_sip_sdp *s) {
+	g_clear_pointer(&s->origin, g_free);
+	g_clear_pointer(&s->media, g_free);
+	g_clear_pointer(&s->buf, g_free);
+}
+
+/* The payload types of the media line, and what they stand for. */
+static gchar *av_sip_sdp_codecs(gchar *p, const struct av_sip_codec_choice *choice) {
+	const struct av_sip_codec *codec = av_sip_codec_get(choice->codec);
+	gsize events_len;
+
+	p = av_sip_sdp_copy(p, " RTP/AVP ", 9);
+	p = av_sip_sdp_number(p, (gulong)choice->payload_type);
+	if (choice->dtmf_payload_type >= 0) {
+		*p++ = ' ';
+		p = av_sip_sdp_number(p, (gulong)choice->dtmf_payload_type);
+	}
+
+	p = av_sip_sdp_copy(p, "\r\na=rtpmap:", 11);
+	p = av_sip_sdp_number(p, (gulong)choice->payload_type);
+	*p++ = ' ';
+	p = av_sip_sdp_copy(p, codec->name, strlen(codec->name));
+	*p++ = '/';
+	p = av_sip_sdp_number(p, codec->clock_rate);
+	p = av_sip_sdp_copy(p, "\r\n", 2);
+
+	if (choice->dtmf_payload_type >= 0) {
+		p = av_sip_sdp_copy(p, "a=rtpmap:", 9);
+		p = av_sip_sdp_number(p, (gulong)choice->dtmf_payload_type);
+		p = av_sip_sdp_copy(p, " telephone-event/8000\r\na=fmtp:", 30);
+		p = av_sip_sdp_number(p, (gulong)choice->dtmf_payload_type);
+		*p++ = ' ';
+		events_len = strnlen(choice->dtmf_events, sizeof choice->dtmf_events);
+		p = av_sip_sdp_copy(p, choice->dtmf_events, events_len);
+		p = av_sip_sdp_copy(p, "\r\n", 2);
+	}
+
+	return av_sip_sdp_copy(p, AV_SIP_SDP_PTIME, sizeof AV_SIP_SDP_PTIME - 1);
+}
+
+/*
+ * Writes an answer, or an offer of ours. The buffer is the line's own and gets overwritten by the
+ * next answer: whoever sends it has to copy it (osip does).
+ *
+ * Returns: the SDP text, or NULL if the direction doesn't fit or no codec
+ * was agreed on (or on a payload type RTP can't have).
+*/
+const gchar *av_sip_sdp_render(struct av_sip_sdp *s, gulong session_id, gulong version, int port, const struct av_sip_codec_choice *choice, const char *direction, gsize *len) {
+	gchar *p = s->buf;
+	gsize direction_len = 0;
+
+	if (direction && ((direction_len = strlen(direction)) > AV_SIP_SDP_DIRECTION_LEN))
+		return NULL;
+
+	if (!av_sip_codec_get(choice->codec))
+		return NULL;
+
+	/* RTP payload types are 7 bits: the buffer is sized for that. */
+	if ( (choice->payload_type < 0) || (choice->payload_type > 127) || (choice->dtmf_payload_type > 127) )
+		return NULL;
+
+	p = av_sip_sdp_copy(p, s->origin, s->origin_len);
+	p = av_sip_sdp_number(p, session_id);
+	*p++ = ' ';
+	p = av_sip_sdp_number(p, version);
+	p = av_sip_sdp_copy(p, s->media, s->media_len);
+	p = av_sip_sdp_number(p, (gulong)port);
+	p = av_sip_sdp_codecs(p, choice);
+
+	if (direction) {
+		p = av_sip_sdp_copy(p, "a=", 2);
+		p = av_sip_sdp_copy(p, direction, direction_len);
+		p = av_sip_sdp_copy(p, "\r\n", 2);
+	}
+
+	*p = '\0';
+	*len = p - s->buf;
+
+	return s->buf;
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_sip_sdp_h__
+#define __av_sip_sdp_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_sip_codec.h>
+
+/*
+ * SDP answer of a line, rendered once: answers only differ in origin session
+ * ID and version, media port, codecs and direction, which get patched into
+ * buf.
+*/
+struct av_sip_sdp {
+	gchar *origin;
+	gsize origin_len;
+	gchar *media;
+	gsize media_len;
+
+	gchar *buf;
+	gsize size;
+};
+
+gint av_sip_sdp_init(struct av_sip_sdp *s, const gchar *addr);
+void av_sip_sdp_deinit(struct av_sip_sdp *s);
+const gchar *av_sip_sdp_render(struct av_sip_sdp *s, gulong session_id, gulong version, int port, const struct av_sip_codec_choice *choice, const char *direction, gsize *len);
+
+#endif
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Startup timing. The system bus connection, ModemManager and the SIP
+ * reactor all come up at once, modems being brought up as soon as both of
+ * the latter are there: how long it takes until the lines of all modems
+ * present at startup are registered gets printed, along with when each of
+ * those got ready, so that slow boots can be told apart.
+*/
+
+/* AV headers */
+#include <av.h>
+#include <av_startup.h>
+
+static const gchar *av_startup_phases[AV_STARTUP_PHASES] = {
+	[AV_STARTUP_BUS] = "system bus",
+	[AV_STARTUP_MANAGER] = "ModemManager",
+	[AV_STARTUP_SIP] = "SIP reactor",
+};
+
+void av_startup_init(void) {
+	memset(&ll->startup, 0, sizeof ll->startup);
+	ll->startup.start = g_get_monotonic_time();
+}
+
+/* Prints how long startup took, once every line is up. */
+static void av_startup_check(void) {
+	struct av_startup *s = &ll->startup;
+	guint n_lines = 0;
+	guint n_registered = 0;
+	gint64 now;
+	int i;
+
+	if (s->reported)
+		return;
+
+	for (i = 0; i < AV_STARTUP_PHASES; i++)
+		if (!s->done[i])
+			return;
+
+	for (i = 0; i < AV_SIP_MAX_LINES; i++) {
+		if (!ll->sip_lines[i].m)
+			continue;
+		if (!ll->sip_lines[i].up)
+			return;
+
+		n_lines++;
+		if (ll->sip_lines[i].registered)
+			n_registered++;
+	}
+
+	s->reported = TRUE;
+	now = g_get_monotonic_time();
+
+	g_print("Startup: %u of %u modem line(s) registered in %" G_GINT64_FORMAT " ms (%s %" G_GINT64_FORMAT " ms, %s %" G_GINT64_FORMAT " ms, %s %" G_GINT64_FORMAT " ms)\n",
+		n_registered, n_lines, (now - s->start)/1000,
+		av_startup_phases[AV_STARTUP_BUS], (s->done[AV_STARTUP_BUS] - s->start)/1000,
+		av_startup_phases[AV_STARTUP_MANAGER], (s->done[AV_STARTUP_MANAGER] - s->start)/1000,
+		av_startup_phases[AV_STARTUP_SIP], (s->done[AV_STARTUP_SIP] - s->start)/1000);
+}
+
+void av_startup_mark(enum av_startup_phase phase) {
+	struct av_startup *s = &ll->startup;
+
+	if (s->done[phase])
+		return;
+
+	s->done[phase] = g_get_monotonic_time();
+	g_print("Startup: %s ready after %" G_GINT64_FORMAT " ms\n",av_startup_phases[phase],(s->done[phase] - s->start)/1000);
+
+	av_startup_check();
+}
+
+/*
+ * A line is as far as it gets: registered, or found to have no usable
+ * settings (those stay down until reconfigured).
+*/
+void av_startup_line_up(gint line, gboolean registered) {
+	if ( (line < 0) || (line >= AV_SIP_MAX_LINES) || !ll->sip_lines[line].m || ll->sip_lines[line].up )
+		return;
+
+	ll->sip_lines[line].up = TRUE;
+	ll->sip_lines[line].registered = registered;
+
+	av_startup_check();
+}
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_startup_h__
+#define __av_startup_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+enum av_startup_phase {
+	AV_STARTUP_BUS = 0,
+	AV_STARTUP_MANAGER,
+	AV_STARTUP_SIP,
+	AV_STARTUP_PHASES
+};
+
+/* When we started, and when each phase was done (0: not yet). */
+struct av_startup {
+	gint64 start;
+	gint64 done[AV_STARTUP_PHASES];
+	gboolean reported;
+};
+
+void av_startup_init(void);
+void av_startup_mark(enum av_startup_phase phase);
+void av_startup_line_up(gint line, gboolean registered);
+
+#endif
@@ -1,61 +1,131 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+/*
+ * Modems registry. Every ModemManager signal looks a modem up, some of them
+ * more than once: lookups are hash tables, by D-Bus path (what both the
+ * object manager and lean mode know modems by) and by equipment ID (what
+ * configuration knows modems by). Modems are also kept in the order they
+ * came, which is the order they're gone through in: a list link per modem,
+ * indexed by path, so that removals don't scan anything either.
+*/
+
 /* GLib2 headers */
 #include <glib.h>
 
 /* AV headers */
 #include <av.h>
 #include <av_mm.h>
+#include <av_storage.h>
 
-AvModem *av_storage_find_mmobject(MMObject *object) {
-	GList *l;
-	AvModem *m;
+void av_storage_init(void) {
+	struct av_storage *s = &ll->storage;
 
-	m = NULL;
+	g_queue_init(&s->modems);
+	s->by_path = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	s->by_equipment_id = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
 
-	for (l = ll->av_modems; l; l = g_list_next(l)) {
-		m = AV_MODEM(l->data);
-		if (avmodem_get_mmobject(m) == object)
-			break;
-	}
+void av_storage_deinit(void) {
+	struct av_storage *s = &ll->storage;
 
-	return m;
+	av_storage_clear();
+
+	g_clear_pointer(&s->by_path, g_hash_table_destroy);
+	g_clear_pointer(&s->by_equipment_id, g_hash_table_destroy);
 }
 
-AvModem *av_storage_find_mmobject_by_path(const gchar *object_path) {
-	GList *l;
-	AvModem *m;
+AvModem *av_storage_find_path(const gchar *object_path) {
+	GList *link;
+
+	link = g_hash_table_lookup(ll->storage.by_path, object_path);
 
-	m = NULL;
+	return link ? AV_MODEM(link->data) : NULL;
+}
+
+AvModem *av_storage_find_equipment_id(const gchar *equipment_id) {
+	return g_hash_table_lookup(ll->storage.by_equipment_id, equipment_id);
+}
+
+/* Equipment ID of a modem, as ModemManager last told it. */
+static const gchar *av_storage_equipment_id(AvModem *m) {
+	MMModem *modem;
+
+	modem = avmodem_get_mmmodem(m);
+
+	return modem ? mm_modem_get_equipment_identifier(modem) : NULL;
+}
 
-	for (l = ll->av_modems; l; l = g_list_next(l)) {
-		m = AV_MODEM(l->data);
-		if (!g_strcmp0(mm_object_get_path(avmodem_get_mmobject(m)), object_path))
-			break;
+/* The registry takes the reference passed along with the modem. */
+AvModem *av_storage_add(AvModem *m) {
+	struct av_storage *s = &ll->storage;
+	const gchar *equipment_id;
+
+	g_queue_push_tail(&s->modems, m);
+	g_hash_table_insert(s->by_path, g_strdup(avmodem_get_path(m)), s->modems.tail);
+
+	/* Two modems claiming the same one are misconfigured: the last one wins. */
+	equipment_id = av_storage_equipment_id(m);
+	if (equipment_id) {
+		if (g_hash_table_contains(s->by_equipment_id, equipment_id))
+			g_printerr("Equipment ID %s is not unique\n",equipment_id);
+		g_hash_table_insert(s->by_equipment_id, g_strdup(equipment_id), m);
 	}
 
 	return m;
 }
 
-AvModem *av_storage_add_mmobject(MMObject *object) {
+static gboolean av_storage_is_modem(gpointer key, gpointer value, gpointer m) {
+	return value == m;
+}
+
+/* Forgets about a modem, leaving its reference to the caller. */
+static void av_storage_unindex(AvModem *m, GList *link) {
+	struct av_storage *s = &ll->storage;
+	const gchar *equipment_id;
+
+	g_hash_table_remove(s->by_path, avmodem_get_path(m));
+
+	/* Unless it changed meanwhile, or it was never indexed (or taken over). */
+	equipment_id = av_storage_equipment_id(m);
+	if (equipment_id && (g_hash_table_lookup(s->by_equipment_id, equipment_id) == m))
+		g_hash_table_remove(s->by_equipment_id, equipment_id);
+	else
+		g_hash_table_foreach_remove(s->by_equipment_id, av_storage_is_modem, m);
+
+	g_queue_delete_link(&s->modems, link);
+}
+
+gint av_storage_remove_path(const gchar *object_path) {
+	GList *link;
 	AvModem *m;
 
-	m = av_modem_new(object);
-	ll->av_modems = g_list_append(ll->av_modems, m);
+	link = g_hash_table_lookup(ll->storage.by_path, object_path);
+	if (!link)
+		return 1;
 
-	return m;
+	m = AV_MODEM(link->data);
+	av_storage_unindex(m, link);
+	g_object_unref(m);
+
+	return 0;
 }
 
-gint av_storage_remove_avmodem(MMObject *object) {
+/* Drops all modems, in the order they came. */
+void av_storage_clear(void) {
 	AvModem *m;
-	gint retval = 1;
 
-	m = av_storage_find_mmobject(object);
-	if (m) {
-		ll->av_modems = g_list_remove(ll->av_modems, m);
+	while (ll->storage.modems.head) {
+		m = AV_MODEM(ll->storage.modems.head->data);
+		av_storage_unindex(m, ll->storage.modems.head);
 		g_object_unref(m);
-		retval = 0;
 	}
+}
+
+guint av_storage_count(void) {
+	return ll->storage.modems.length;
+}
 
-	return retval;
+/* Modems in the order they came, for going through them: the list is ours. */
+GList *av_storage_modems(void) {
+	return ll->storage.modems.head;
 }
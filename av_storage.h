@@ -4,11 +4,28 @@
 
 #include <av_gobjects.h>
 
-AvModem *av_storage_find_mmobject(MMObject *object);
-AvModem *av_storage_find_mmobject_by_path(const gchar *object_path);
+/*
+ * Modems we manage, in the order they came, indexed by D-Bus path and
+ * equipment ID.
+*/
+struct av_storage {
+	GQueue modems;
+	GHashTable *by_path;
+	GHashTable *by_equipment_id;
+};
 
-AvModem *av_storage_add_mmobject(MMObject *object);
+void av_storage_init(void);
+void av_storage_deinit(void);
 
-gint av_storage_remove_avmodem(MMObject *object);
+AvModem *av_storage_find_path(const gchar *object_path);
+AvModem *av_storage_find_equipment_id(const gchar *equipment_id);
+
+AvModem *av_storage_add(AvModem *m);
+
+gint av_storage_remove_path(const gchar *object_path);
+void av_storage_clear(void);
+
+guint av_storage_count(void);
+GList *av_storage_modems(void);
 
 #endif
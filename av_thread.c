@@ -1,34 +1,19 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
-/* System headers for SOCKETPAIR(2) usage */
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-
-/* errno */
-#include <errno.h>
-
 /* GLib2 headers */
 #include <glib.h>
 
 /* AV headers */
-#include <av_gobjects.h>
-#include <av_utils.h>
 #include <av_thread.h>
+#include <av_threadcomm.h>
 
-static void av_thread_close_fd(int fd) {
-	if (fd > 0)
-		if (close(fd))
-			g_printerr("Error while closing thread communication FD: %s",strerror(errno));
-}
+static const gchar *av_thread_queue_names[2] = { "Parent", "Thread" };
 
-static void av_thread_close_fds(struct av_thread *t) {
+static void av_thread_deinit_queues(struct av_thread *t) {
 	int i;
 
-	for (i=0;i<2;i++) {
-		av_thread_close_fd(t->sockets[i]);
-		t->sockets[i] = -1;
-	}
+	for (i=0;i<2;i++)
+		av_thread_queue_deinit(&t->queues[i], av_thread_queue_names[i]);
 }
 
 struct av_thread *av_thread_setup(gchar *name, GThreadFunc entry) {
@@ -41,17 +26,20 @@ struct av_thread *av_thread_setup(gchar *name, GThreadFunc entry) {
 		return t;
 	}
 
-	/* Create socket pairs we'll use to communicate with this thread. */
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, t->sockets)) {
-		g_printerr("Unable to obtain socket pairs for thread communication: %s\n",strerror(errno));
+	t->queues[0].eventfd = t->queues[1].eventfd = -1;
+
+	/* Create the queues we'll use to communicate with this thread. */
+	if (av_thread_queue_init(&t->queues[0]) || av_thread_queue_init(&t->queues[1])) {
+		av_thread_deinit_queues(t);
 		g_clear_pointer(&t, g_free);
 		return t;
 	}
 
 	t->thread = g_thread_try_new(name, entry, t, &e);
 	if (!t->thread) {
-		av_utils_print_gerror(&e);
-		av_thread_close_fds(t);
+		g_printerr("Failure starting thread %s: %s\n",name,e->message);
+		g_clear_error(&e);
+		av_thread_deinit_queues(t);
 		g_clear_pointer(&t, g_free);
 	}
 
@@ -65,8 +53,15 @@ gint av_thread_teardown(struct av_thread *t) {
 	g_thread_join(t->thread);
 	t->thread = NULL;
 
-	av_thread_close_fds(t);
+	av_thread_deinit_queues(t);
 
 	g_clear_pointer(&t, g_free);
 	return 0;
 }
+
+/* The FD to poll for messages to the given side. */
+int av_thread_eventfd(struct av_thread *t, int side) {
+	g_assert(side == 0 || side == 1);
+
+	return t->queues[side].eventfd;
+}
@@ -6,12 +6,37 @@
 /* GLib2 headers */
 #include <glib.h>
 
+struct av_thread_cmd;
+
+/* Latency histogram buckets: under 1 us, under 2 us, ... and 32 ms or more. */
+#define AV_THREAD_QUEUE_HIST 17
+
+/*
+ * Inbox of one side of a thread pair: a lock-free MPSC queue. Producers push
+ * messages onto head, the consumer grabs all of them at once and drains them
+ * in order from batch. An eventfd wakes the consumer up.
+*/
+struct av_thread_queue {
+	struct av_thread_cmd *head;
+	struct av_thread_cmd *batch;
+	int eventfd;
+
+	/* Consumer side statistics. */
+	guint64 n_msgs;
+	guint64 n_batches;
+	gint64 latency_total;
+	gint64 latency_max;
+	guint64 latency_hist[AV_THREAD_QUEUE_HIST];
+};
+
+/* queues[0] is the parent inbox, queues[1] the thread one. */
 struct av_thread {
-	int sockets[2];
+	struct av_thread_queue queues[2];
 	GThread *thread;
 };
 
 struct av_thread *av_thread_setup(gchar *name, GThreadFunc entry);
 gint av_thread_teardown(struct av_thread *t);
+int av_thread_eventfd(struct av_thread *t, int side);
 
 #endif
@@ -1,79 +1,252 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
-/* System headers for SOCKETPAIR(2) usage */
+/*
+ * Inter-thread messaging.
+ *
+ * Each side of a thread pair has an inbox, which is a lock-free multiple
+ * producers, single consumer queue: producers push messages onto a list with
+ * a compare-and-swap, and the consumer takes the whole list at once, then
+ * hands messages out in FIFO order. Only a producer finding the queue empty
+ * writes to the eventfd, so a burst of messages costs a single wakeup.
+ *
+ * Messages come from a process-wide pool of slots, grabbed with an atomic
+ * flag, so producers don't allocate anything unless the pool runs dry.
+*/
+
+/* System headers */
 #include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 /* AV headers */
 #include <av_thread.h>
 #include <av_threadcomm.h>
 
+#define AV_THREAD_CMD_POOL_SIZE 256
+
+static struct av_thread_cmd av_thread_cmd_pool[AV_THREAD_CMD_POOL_SIZE];
+static gint av_thread_cmd_pool_hint;
+static gint av_thread_cmd_pool_misses;
+
+static struct av_thread_cmd *av_thread_cmd_get(void) {
+	struct av_thread_cmd *c;
+	guint start;
+	guint i;
+
+	start = (guint)g_atomic_int_add(&av_thread_cmd_pool_hint, 1);
+	for (i = 0; i < AV_THREAD_CMD_POOL_SIZE; i++) {
+		c = &av_thread_cmd_pool[(start + i) % AV_THREAD_CMD_POOL_SIZE];
+		if (g_atomic_int_compare_and_exchange(&c->busy, 0, 1)) {
+			c->pooled = TRUE;
+			return c;
+		}
+	}
+
+	/* Pool exhausted: fall back to the heap. */
+	g_atomic_int_inc(&av_thread_cmd_pool_misses);
+	c = g_try_malloc0(sizeof *c);
+	if (!c)
+		g_printerr("Failure allocating thead command structure\n");
+
+	return c;
+}
+
 struct av_thread_cmd *av_thread_cmd(int msg, void *payload) {
 	struct av_thread_cmd *cmd;
 
-	cmd = g_try_malloc0(sizeof *cmd);
-	if (!cmd)
-		g_printerr("Failure allocating thead command structure\n");
-	else {
+	cmd = av_thread_cmd_get();
+	if (cmd) {
 		cmd->msgtype = msg;
 		cmd->payload = payload;
+		cmd->arg = 0;
+		cmd->data = cmd->inline_data;
+		cmd->data[0] = '\0';
+		cmd->line = 0;
+		cmd->next = NULL;
 	}
 
 	return cmd;
 }
 
-int av_thread_txcmd(struct av_thread *t, struct av_thread_cmd *c, int mysocket) {
-	int remaining_data = (sizeof *c);
-	ssize_t written_data;
-	char *bufptr = (char*)c;
-	int retval;
-
-	g_assert(mysocket == 0 || mysocket == 1);
-	retval = 0;
-
-	while (remaining_data) {
-		written_data = write(t->sockets[mysocket], bufptr, remaining_data);
-		if (written_data<0) {
-			if (errno == EAGAIN)
-				continue;
-			g_printerr("Error while writing command to thread socket: %s\n",strerror(errno));
-			retval++;
-			break;
-		}
-		remaining_data -= written_data;
-		bufptr += written_data;
+/*
+ * A message carrying an integer and a string, e.g.: a call ID and a MMCall
+ * object path. str may be NULL. Short strings travel inline, longer ones
+ * cost an allocation.
+*/
+struct av_thread_cmd *av_thread_cmd_str(int msg, int arg, const gchar *str) {
+	struct av_thread_cmd *cmd;
+
+	cmd = av_thread_cmd(msg, NULL);
+	if (cmd) {
+		cmd->arg = arg;
+		if (str && (strlen(str) >= sizeof cmd->inline_data))
+			cmd->data = g_strdup(str);
+		else if (str)
+			g_strlcpy(cmd->inline_data, str, sizeof cmd->inline_data);
 	}
 
-	return retval;
+	return cmd;
+}
+
+void av_thread_cmd_free(struct av_thread_cmd *c) {
+	if (c->data != c->inline_data)
+		g_free(c->data);
+
+	if (c->pooled)
+		g_atomic_int_set(&c->busy, 0);
+	else
+		g_free(c);
+}
+
+/*
+ * Queues a message to the other side. The message belongs to the receiver
+ * from now on, whatever the outcome.
+ *
+ * Returns: 0, always: the message can't fail to be queued.
+*/
+int av_thread_txcmd(struct av_thread *t, struct av_thread_cmd *c, int myside) {
+	struct av_thread_queue *q;
+	struct av_thread_cmd *head;
+	guint64 wakeup = 1;
+
+	g_assert(myside == 0 || myside == 1);
+	q = &t->queues[!myside];
+
+	c->sent = g_get_monotonic_time();
+
+	do {
+		head = g_atomic_pointer_get(&q->head);
+		c->next = head;
+	} while (!g_atomic_pointer_compare_and_exchange(&q->head, head, c));
+
+	/*
+	 * Whoever finds the queue empty wakes the consumer up; the others ride
+	 * along. The message is queued already: it will be consumed at the next
+	 * wakeup whatever happens here, so this is no failure for the caller.
+	*/
+	if (!head && (write(q->eventfd, &wakeup, sizeof wakeup) < 0))
+		g_printerr("Error while waking thread up: %s\n",strerror(errno));
+
+	return 0;
 }
 
-struct av_thread_cmd *av_thread_rxcmd(struct av_thread *t, int mysocket) {
-	ssize_t bytes_read;
-	struct av_thread_cmd *rxc;
-	int remaining_data = (sizeof *rxc);
-	char *bufptr;
+/* Bucket i holds latencies under 2^i us, the last one everything else. */
+static guint av_thread_latency_bucket(gint64 latency) {
+	guint i;
 
-	g_assert(mysocket == 0 || mysocket == 1);
+	for (i = 0; (i < AV_THREAD_QUEUE_HIST - 1) && (latency >= ((gint64)1 << i)); i++);
 
-	rxc = g_try_malloc0(sizeof *rxc);
-	if (!rxc) {
-		g_printerr("Failure while allocating buffer for receiving message\n");
-		return rxc;
+	return i;
+}
+
+/* How long messages waited for the consumer loop to get to them, e.g. behind other sources. */
+static void av_thread_latency_print(struct av_thread_queue *q, const gchar *name) {
+	GString *s;
+	guint i;
+
+	s = g_string_new(NULL);
+	for (i = 0; i < AV_THREAD_QUEUE_HIST; i++) {
+		if (!q->latency_hist[i])
+			continue;
+		if (i < AV_THREAD_QUEUE_HIST - 1)
+			g_string_append_printf(s, " <%u:%" G_GUINT64_FORMAT, 1u << i, q->latency_hist[i]);
+		else
+			g_string_append_printf(s, " >=%u:%" G_GUINT64_FORMAT, 1u << (i - 1), q->latency_hist[i]);
 	}
 
-	bufptr = (char*)rxc;
+	g_print("%s queue latency histogram (us):%s\n",name,s->str);
+	g_string_free(s, TRUE);
+}
+
+/*
+ * Gets the next message for our side, if any. Consumers are expected to call
+ * this until it returns NULL each time they're woken up.
+*/
+struct av_thread_cmd *av_thread_rxcmd(struct av_thread *t, int myside) {
+	struct av_thread_queue *q;
+	struct av_thread_cmd *list;
+	struct av_thread_cmd *next;
+	struct av_thread_cmd *c;
+	guint64 wakeups;
+	gint64 latency;
+
+	g_assert(myside == 0 || myside == 1);
+	q = &t->queues[myside];
+
+	if (!q->batch) {
+		/*
+		 * Reset the wakeup before looking at the queue: whatever gets pushed
+		 * after this finds the queue empty and wakes us up again.
+		*/
+		if ((read(q->eventfd, &wakeups, sizeof wakeups) < 0) && (errno != EAGAIN))
+			g_printerr("Unable to read thread wakeup: %s\n",strerror(errno));
 
-	while(remaining_data) {
-		bytes_read = read(t->sockets[mysocket], bufptr, remaining_data);
-		if (bytes_read < 0) {
-			if (errno == EAGAIN)
-				continue;
-			g_printerr("Unable to read message from socket: %s\n",strerror(errno));
-			g_clear_pointer(&rxc, g_free);
-			break;
+		do {
+			list = g_atomic_pointer_get(&q->head);
+		} while (list && !g_atomic_pointer_compare_and_exchange(&q->head, list, NULL));
+
+		if (!list)
+			return NULL;
+
+		/* Producers push in LIFO order. */
+		for (; list; list = next) {
+			next = list->next;
+			list->next = q->batch;
+			q->batch = list;
 		}
-		remaining_data -= bytes_read;
-		bufptr += bytes_read;
+		q->n_batches++;
+	}
+
+	c = q->batch;
+	q->batch = c->next;
+	c->next = NULL;
+
+	latency = g_get_monotonic_time() - c->sent;
+	q->n_msgs++;
+	q->latency_total += latency;
+	if (latency > q->latency_max)
+		q->latency_max = latency;
+	q->latency_hist[av_thread_latency_bucket(latency)]++;
+
+	return c;
+}
+
+gint av_thread_queue_init(struct av_thread_queue *q) {
+	q->head = q->batch = NULL;
+
+	q->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->eventfd < 0) {
+		g_printerr("Unable to obtain eventfd for thread communication: %s\n",strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drops whatever is left in a queue (nobody is going to receive it), closes
+ * its eventfd, and tells how the queue performed.
+*/
+void av_thread_queue_deinit(struct av_thread_queue *q, const gchar *name) {
+	struct av_thread_cmd *c;
+
+	if (q->n_msgs) {
+		g_print("%s queue: %" G_GUINT64_FORMAT " messages in %" G_GUINT64_FORMAT " wakeups, latency average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us, %d pool misses overall\n",
+			name, q->n_msgs, q->n_batches, q->latency_total/(gint64)q->n_msgs, q->latency_max, g_atomic_int_get(&av_thread_cmd_pool_misses));
+		av_thread_latency_print(q, name);
+	}
+
+	while ( (c = q->batch) ) {
+		q->batch = c->next;
+		av_thread_cmd_free(c);
+	}
+
+	while ( (c = q->head) ) {
+		q->head = c->next;
+		av_thread_cmd_free(c);
 	}
 
-	return rxc;
+	if ((q->eventfd >= 0) && close(q->eventfd))
+		g_printerr("Error while closing thread communication FD: %s",strerror(errno));
+	q->eventfd = -1;
 }
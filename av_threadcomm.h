@@ -3,14 +3,49 @@
 #ifndef __av_threadcomm_h__
 #define __av_threadcomm_h__
 
-/* Is it worth to use __attribute__((__packed__)) or not? */
+/* GLib2 headers */
+#include <glib.h>
+
+/* AV headers */
+#include <av_thread.h>
+
+/* Enough for MMCall object paths and phone numbers. */
+#define AV_THREAD_CMD_DATA_LEN 128
+
+/*
+ * Messages come from a preallocated pool, and are handed over between threads
+ * as they are: no copies and, most of the time, no allocations. Whoever
+ * receives a message gives it back with av_thread_cmd_free().
+*/
 struct av_thread_cmd {
 	int msgtype;
 	void *payload;
+
+	/*
+	 * Small payloads travel inline: call IDs, object paths, numbers. data
+	 * points to the inline buffer, or to a copy of strings too long for it.
+	*/
+	int arg;
+	gchar *data;
+	gchar inline_data[AV_THREAD_CMD_DATA_LEN];
+
+	/* SIP reactor line the message is about, if any. */
+	int line;
+
+	/* Queue internals. */
+	struct av_thread_cmd *next;
+	gint64 sent;
+	gboolean pooled;
+	gint busy;
 };
 
 struct av_thread_cmd *av_thread_cmd(int msg, void *payload);
-int av_thread_txcmd(struct av_thread *t, struct av_thread_cmd *c, int mysocket);
-struct av_thread_cmd *av_thread_rxcmd(struct av_thread *t, int mysocket);
+struct av_thread_cmd *av_thread_cmd_str(int msg, int arg, const gchar *str);
+void av_thread_cmd_free(struct av_thread_cmd *c);
+int av_thread_txcmd(struct av_thread *t, struct av_thread_cmd *c, int myside);
+struct av_thread_cmd *av_thread_rxcmd(struct av_thread *t, int myside);
+
+gint av_thread_queue_init(struct av_thread_queue *q);
+void av_thread_queue_deinit(struct av_thread_queue *q, const gchar *name);
 
 #endif
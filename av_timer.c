@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Timers of the SIP reactor (eXosip housekeeping, RFC 4028 session timers of
+ * every call of every line) live in a hierarchical timer wheel: arming and
+ * cancelling a timer is O(1) whatever the number of calls, and a single
+ * timerfd is armed for the next deadline, instead of waking up at a fixed
+ * pace to look for something to do.
+ *
+ * Timers far in the future sit in the upper levels, and move down a level
+ * (cascade) when the lower one wraps, as in the classic Linux kernel timers.
+*/
+
+/* System headers */
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+/* AV headers */
+#include <av_timer.h>
+
+/* Timers firing later than this get reported right away. */
+#define AV_TIMER_LATE_USEC 50000
+
+#define AV_TIMER_SLOT_MASK (AV_TIMER_SLOTS - 1)
+
+/* Span of a level, in ticks. */
+#define AV_TIMER_LEVEL_SPAN(level) (G_GUINT64_CONSTANT(1) << (AV_TIMER_LEVEL_BITS * ((level) + 1)))
+
+static guint64 av_timer_usec_to_tick(struct av_timer_wheel *w, gint64 usec) {
+	if (usec <= w->base)
+		return 0;
+
+	/* Rounded up: a timer never fires early. */
+	return (usec - w->base + AV_TIMER_TICK_USEC - 1) / AV_TIMER_TICK_USEC;
+}
+
+static gint64 av_timer_tick_to_usec(struct av_timer_wheel *w, guint64 tick) {
+	return w->base + (gint64)tick * AV_TIMER_TICK_USEC;
+}
+
+static void av_timer_link(struct av_timer_wheel *w, struct av_timer *t, struct av_timer **head) {
+	t->next = *head;
+	if (*head)
+		(*head)->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+	w->n_timers++;
+}
+
+static void av_timer_unlink(struct av_timer_wheel *w, struct av_timer *t) {
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	w->n_timers--;
+}
+
+/* Files a timer in the level its distance from now belongs to. */
+static void av_timer_insert(struct av_timer_wheel *w, struct av_timer *t) {
+	guint64 delta;
+	int level;
+
+	if (t->tick <= w->now_tick)
+		t->tick = w->now_tick + 1;
+
+	delta = t->tick - w->now_tick;
+
+	/* Beyond the wheel: parked at its far end, and filed again from there. */
+	if (delta >= AV_TIMER_LEVEL_SPAN(AV_TIMER_LEVELS - 1)) {
+		t->tick = w->now_tick + AV_TIMER_LEVEL_SPAN(AV_TIMER_LEVELS - 1) - 1;
+		delta = t->tick - w->now_tick;
+	}
+
+	for (level = 0; delta >= AV_TIMER_LEVEL_SPAN(level); level++);
+
+	av_timer_link(w, t, &w->slots[level][(t->tick >> (AV_TIMER_LEVEL_BITS * level)) & AV_TIMER_SLOT_MASK]);
+}
+
+/*
+ * Gets the next tick something has to be done at: a timer expiring, or an
+ * upper level slot cascading down.
+ *
+ * Returns: 0 if no timer is pending.
+*/
+static guint64 av_timer_next_tick(struct av_timer_wheel *w) {
+	guint64 next = 0;
+	guint64 cur;
+	guint64 candidate;
+	int level;
+	int k;
+
+	if (!w->n_timers)
+		return 0;
+
+	for (k = 1; k < AV_TIMER_SLOTS; k++) {
+		if (w->slots[0][(w->now_tick + k) & AV_TIMER_SLOT_MASK]) {
+			next = w->now_tick + k;
+			break;
+		}
+	}
+
+	for (level = 1; level < AV_TIMER_LEVELS; level++) {
+		cur = w->now_tick >> (AV_TIMER_LEVEL_BITS * level);
+		for (k = 1; k <= AV_TIMER_SLOTS; k++) {
+			if (!w->slots[level][(cur + k) & AV_TIMER_SLOT_MASK])
+				continue;
+
+			candidate = (cur + k) << (AV_TIMER_LEVEL_BITS * level);
+			if (!next || (candidate < next))
+				next = candidate;
+			break;
+		}
+	}
+
+	return next;
+}
+
+/* Arms the timerfd for the next deadline, or disarms it when idle. */
+static void av_timer_wheel_rearm(struct av_timer_wheel *w) {
+	struct itimerspec its = { 0 };
+	guint64 next;
+	gint64 deadline = 0;
+
+	next = av_timer_next_tick(w);
+	if (next)
+		deadline = av_timer_tick_to_usec(w, next);
+
+	if (deadline == w->armed)
+		return;
+
+	its.it_value.tv_sec = deadline / G_USEC_PER_SEC;
+	its.it_value.tv_nsec = (deadline % G_USEC_PER_SEC) * 1000;
+
+	/* g_get_monotonic_time() is CLOCK_MONOTONIC. */
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		g_printerr("timerfd_settime: %s\n",strerror(errno));
+		return;
+	}
+
+	w->armed = deadline;
+}
+
+gint av_timer_wheel_init(struct av_timer_wheel *w) {
+	memset(w, 0, sizeof *w);
+
+	w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd < 0) {
+		g_printerr("timerfd_create: %s\n",strerror(errno));
+		return 1;
+	}
+
+	w->base = g_get_monotonic_time();
+	w->stats.start = w->base;
+
+	return 0;
+}
+
+void av_timer_wheel_deinit(struct av_timer_wheel *w, const gchar *name) {
+	struct av_timer_wheel_stats *st = &w->stats;
+	gint64 uptime;
+
+	if (w->fd < 0)
+		return;
+
+	if (close(w->fd))
+		g_printerr("Failure closing timerfd: %s\n",strerror(errno));
+	w->fd = -1;
+
+	uptime = MAX(g_get_monotonic_time() - st->start, 1);
+	g_print("%s timers: %" G_GUINT64_FORMAT " wakeups (%.3f per second), %" G_GUINT64_FORMAT " expired, lateness average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n",
+		name, st->n_wakeups, (gdouble)st->n_wakeups * G_USEC_PER_SEC / uptime, st->n_expired,
+		st->n_expired ? st->lateness_total/(gint64)st->n_expired : 0, st->lateness_max);
+}
+
+int av_timer_wheel_fd(struct av_timer_wheel *w) {
+	return w->fd;
+}
+
+static void av_timer_cascade(struct av_timer_wheel *w, int level) {
+	struct av_timer **slot;
+	struct av_timer *t;
+
+	slot = &w->slots[level][(w->now_tick >> (AV_TIMER_LEVEL_BITS * level)) & AV_TIMER_SLOT_MASK];
+	while ( (t = *slot) ) {
+		av_timer_unlink(w, t);
+		av_timer_insert(w, t);
+	}
+}
+
+static void av_timer_expire(struct av_timer_wheel *w, gint64 now) {
+	struct av_timer_wheel_stats *st = &w->stats;
+	struct av_timer **slot;
+	struct av_timer *t;
+	gint64 lateness;
+
+	/* Callbacks may arm and cancel timers: always start over from the slot head. */
+	slot = &w->slots[0][w->now_tick & AV_TIMER_SLOT_MASK];
+	while ( (t = *slot) ) {
+		av_timer_unlink(w, t);
+
+		/* A parked timer: not there yet. */
+		if (av_timer_usec_to_tick(w, t->deadline) > w->now_tick) {
+			t->tick = av_timer_usec_to_tick(w, t->deadline);
+			av_timer_insert(w, t);
+			continue;
+		}
+
+		lateness = now - t->deadline;
+		st->n_expired++;
+		st->lateness_total += lateness;
+		if (lateness > st->lateness_max)
+			st->lateness_max = lateness;
+		if (lateness > AV_TIMER_LATE_USEC)
+			g_printerr("Timer fired %" G_GINT64_FORMAT " ms late\n",lateness/1000);
+
+		t->func(t, t->data);
+	}
+}
+
+/*
+ * Runs every timer that's due, walking the wheel up to now. Ticks with
+ * nothing to do are skipped altogether.
+*/
+void av_timer_wheel_run(struct av_timer_wheel *w) {
+	uint64_t n_expirations;
+	guint64 target;
+	guint64 next;
+	gint64 now;
+	int level;
+
+	if ( (read(w->fd, &n_expirations, sizeof n_expirations) < 0) && (errno != EAGAIN) )
+		g_printerr("Failure reading timerfd: %s\n",strerror(errno));
+
+	w->armed = 0;
+	w->stats.n_wakeups++;
+
+	now = g_get_monotonic_time();
+	target = (now - w->base) / AV_TIMER_TICK_USEC;
+
+	while (w->now_tick < target) {
+		next = av_timer_next_tick(w);
+		if (!next || (next > target))
+			break;
+
+		w->now_tick = next;
+
+		for (level = 1; level < AV_TIMER_LEVELS; level++) {
+			if (w->now_tick & ((G_GUINT64_CONSTANT(1) << (AV_TIMER_LEVEL_BITS * level)) - 1))
+				break;
+			av_timer_cascade(w, level);
+		}
+
+		av_timer_expire(w, now);
+	}
+
+	w->now_tick = MAX(w->now_tick, target);
+
+	av_timer_wheel_rearm(w);
+}
+
+void av_timer_init(struct av_timer *t, av_timer_func func, gpointer data) {
+	memset(t, 0, sizeof *t);
+	t->func = func;
+	t->data = data;
+}
+
+gboolean av_timer_pending(const struct av_timer *t) {
+	return t->pprev != NULL;
+}
+
+/* (Re)arms a timer for the given monotonic time. */
+void av_timer_arm(struct av_timer_wheel *w, struct av_timer *t, gint64 deadline) {
+	if (av_timer_pending(t))
+		av_timer_unlink(w, t);
+
+	/* Nothing pending: the wheel may have fallen behind, catch up for free. */
+	if (!w->n_timers)
+		w->now_tick = MAX(w->now_tick, (guint64)((g_get_monotonic_time() - w->base) / AV_TIMER_TICK_USEC));
+
+	t->deadline = deadline;
+	t->tick = av_timer_usec_to_tick(w, deadline);
+	av_timer_insert(w, t);
+
+	if (!w->armed || (av_timer_tick_to_usec(w, t->tick) < w->armed))
+		av_timer_wheel_rearm(w);
+}
+
+void av_timer_cancel(struct av_timer_wheel *w, struct av_timer *t) {
+	/* The timerfd may still fire for it: that's a harmless empty wakeup. */
+	if (av_timer_pending(t))
+		av_timer_unlink(w, t);
+}
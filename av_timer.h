@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef __av_timer_h__
+#define __av_timer_h__
+
+/* GLib2 headers */
+#include <glib.h>
+
+/* Wheel resolution: deadlines are rounded up to the next tick. */
+#define AV_TIMER_TICK_USEC 10000
+
+/* 4 levels of 64 slots: 640 ms, 41 s, 44 min, 46 h. */
+#define AV_TIMER_LEVELS 4
+#define AV_TIMER_LEVEL_BITS 6
+#define AV_TIMER_SLOTS (1 << AV_TIMER_LEVEL_BITS)
+
+struct av_timer;
+
+typedef void (*av_timer_func)(struct av_timer *t, gpointer data);
+
+/*
+ * A one-shot timer. It's embedded in whatever it times (a call, the reactor
+ * state...): the wheel never allocates anything.
+*/
+struct av_timer {
+	struct av_timer *next;
+	struct av_timer **pprev;
+	guint64 tick;
+	gint64 deadline;
+	av_timer_func func;
+	gpointer data;
+};
+
+struct av_timer_wheel_stats {
+	gint64 start;
+	guint64 n_wakeups;
+	guint64 n_expired;
+	gint64 lateness_total;
+	gint64 lateness_max;
+};
+
+/*
+ * Hierarchical timer wheel, driving a single timerfd armed for the next
+ * deadline: nothing wakes us up unless something is due.
+*/
+struct av_timer_wheel {
+	struct av_timer *slots[AV_TIMER_LEVELS][AV_TIMER_SLOTS];
+	guint64 now_tick;
+	gint64 base;
+	guint n_timers;
+	int fd;
+	gint64 armed;
+	struct av_timer_wheel_stats stats;
+};
+
+gint av_timer_wheel_init(struct av_timer_wheel *w);
+void av_timer_wheel_deinit(struct av_timer_wheel *w, const gchar *name);
+int av_timer_wheel_fd(struct av_timer_wheel *w);
+void av_timer_wheel_run(struct av_timer_wheel *w);
+
+void av_timer_init(struct av_timer *t, av_timer_func func, gpointer data);
+void av_timer_arm(struct av_timer_wheel *w, struct av_timer *t, gint64 deadline);
+void av_timer_cancel(struct av_timer_wheel *w, struct av_timer *t);
+gboolean av_timer_pending(const struct av_timer *t);
+
+#endif
@@ -21,7 +21,8 @@ void av_utils_print_gerror(GError **current_error) {
 gint av_utils_async_start(GObject *o) {
 	ll->async_counter++;
 
-	if (ll->async_counter > 2)
+	/* Modems are set up in parallel, a few operations each. */
+	if (ll->async_counter > 4 * AV_SIP_MAX_LINES)
 		g_printerr("WARNING - suspicious async_counter value (%" G_GINT16_FORMAT")\n",ll->async_counter);
 
 	if (o)
@@ -41,17 +42,3 @@ gint av_utils_async_end(GObject *o) {
 
 	return ll->async_counter;
 }
-
-MMCall *av_utils_mm_call_search(GList *l, const gchar *object_path) {
-	MMCall *c = NULL;
-	GList *k; /* because I always use l, but it's already in use ... :) like I am in high school again */
-
-	for (k = l; k; k = g_list_next(k)) {
-		if (!g_strcmp0(mm_call_get_path(MM_CALL(k->data)), object_path)) {
-			c = MM_CALL(k->data);
-			break;
-		}
-	}
-
-	return c;
-}
@@ -7,6 +7,4 @@ void av_utils_print_gerror(GError **current_error);
 gint av_utils_async_start(GObject *o);
 gint av_utils_async_end(GObject *o);
 
-MMCall *av_utils_mm_call_search(GList *l, const gchar *object_path);
-
 #endif
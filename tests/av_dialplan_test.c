@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Dial plan tests: see av_dialplan.c. Routes are written to a temporary file
+ * and compiled from there, as the configured ones are.
+*/
+
+/* System headers */
+#include <unistd.h>
+#include <string.h>
+
+/* AV headers */
+#include <av_dialplan.h>
+
+/* As large as the biggest dial plans we were asked about. */
+#define AV_DIALPLAN_TEST_PREFIXES 100000
+#define AV_DIALPLAN_TEST_LOOKUPS 1000000
+
+static struct av_dialplan *av_dialplan_test_load(gchar *country_code, const gchar *routes) {
+	struct av_dialplan_config conf = {
+		.country_code = country_code,
+		.national_prefix = "0",
+		.international_prefix = "00",
+	};
+	struct av_dialplan *dp;
+	gint fd;
+
+	fd = g_file_open_tmp("av_dialplan_XXXXXX", &conf.routes_file, NULL);
+	g_assert_cmpint(fd, >=, 0);
+	close(fd);
+	g_assert_true(g_file_set_contents(conf.routes_file, routes, -1, NULL));
+
+	dp = av_dialplan_load(&conf);
+	g_assert_nonnull(dp);
+
+	unlink(conf.routes_file);
+	g_free(conf.routes_file);
+
+	return dp;
+}
+
+static const gchar *av_dialplan_test_normalized(struct av_dialplan *dp, const gchar *number) {
+	static gchar buf[AV_DIALPLAN_NUMBER_LEN];
+
+	if (av_dialplan_normalize(dp, number, buf, sizeof buf))
+		return NULL;
+
+	return buf;
+}
+
+static void av_dialplan_test_normalize(void) {
+	gchar number[AV_DIALPLAN_NUMBER_LEN + 1];
+	gchar small[8];
+	struct av_dialplan *dp;
+
+	dp = av_dialplan_test_load("44", "");
+
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "+39 (06) 1234-567"), ==, "+39061234567");
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "0044 20.7946/0000"), ==, "+442079460000");
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "020 7946 0000"), ==, "+442079460000");
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "*123#"), ==, "*123#");
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "112"), ==, "112");
+
+	g_assert_null(av_dialplan_test_normalized(dp, ""));
+	g_assert_null(av_dialplan_test_normalized(dp, " - "));
+	g_assert_null(av_dialplan_test_normalized(dp, "06 1234 ext 5"));
+	g_assert_null(av_dialplan_test_normalized(dp, "39+06"));
+
+	/* Too long for us, or for the caller buffer. */
+	memset(number, '1', sizeof number - 1);
+	number[sizeof number - 1] = '\0';
+	g_assert_null(av_dialplan_test_normalized(dp, number));
+	g_assert_cmpint(av_dialplan_normalize(dp, "020 7946 0000", small, sizeof small), !=, 0);
+
+	av_dialplan_free(dp);
+
+	/* No country code: national numbers stay as they are. */
+	dp = av_dialplan_test_load(NULL, "");
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "020 7946 0000"), ==, "02079460000");
+	g_assert_cmpstr(av_dialplan_test_normalized(dp, "0044 20 7946 0000"), ==, "+442079460000");
+	av_dialplan_free(dp);
+}
+
+static void av_dialplan_test_route(void) {
+	struct av_dialplan *dp;
+
+	dp = av_dialplan_test_load("39",
+		"# Italy, then its mobiles\n"
+		"+39 italy\n"
+		"+393 mobile # comment\n"
+		"393 mobile3\n"
+		"+44\tuk\n"
+		"+44x broken\n"
+		"+49\n");
+
+	/* The last one of a prefix listed twice wins, invalid ones are skipped. */
+	g_assert_cmpuint(dp->n_prefixes, ==, 3);
+	g_assert_cmpuint(dp->targets->len, ==, 4);
+
+	g_assert_cmpstr(av_dialplan_route(dp, "+39061234567"), ==, "italy");
+	g_assert_cmpstr(av_dialplan_route(dp, "+393331234567"), ==, "mobile3");
+	g_assert_cmpstr(av_dialplan_route(dp, "+39"), ==, "italy");
+	g_assert_cmpstr(av_dialplan_route(dp, "+442079460000"), ==, "uk");
+
+	g_assert_null(av_dialplan_route(dp, "+3"));
+	g_assert_null(av_dialplan_route(dp, "+4912345"));
+	g_assert_null(av_dialplan_route(dp, "39061234567"));
+	g_assert_null(av_dialplan_route(dp, "*123#"));
+
+	av_dialplan_free(dp);
+}
+
+/* A lone "+" catches the E.164 numbers no other prefix does. */
+static void av_dialplan_test_root(void) {
+	struct av_dialplan *dp;
+
+	dp = av_dialplan_test_load(NULL, "+ anywhere\n+44 uk\n");
+
+	g_assert_cmpstr(av_dialplan_route(dp, "+442079460000"), ==, "uk");
+	g_assert_cmpstr(av_dialplan_route(dp, "+15550100"), ==, "anywhere");
+	g_assert_cmpstr(av_dialplan_route(dp, "+4"), ==, "anywhere");
+	g_assert_null(av_dialplan_route(dp, "061234567"));
+
+	av_dialplan_free(dp);
+}
+
+/* Longest matching prefix, the slow way: one hash lookup per length. */
+static const gchar *av_dialplan_test_expected(GHashTable *prefixes, const gchar *number) {
+	gchar prefix[AV_DIALPLAN_NUMBER_LEN];
+	const gchar *target;
+	gsize len;
+
+	for (len = strlen(number); len > 1; len--) {
+		g_strlcpy(prefix, number, len + 1);
+		if ( (target = g_hash_table_lookup(prefixes, prefix)) )
+			return target;
+	}
+
+	return NULL;
+}
+
+/*
+ * 100k prefixes, 4 to 7 digits long, some of them prefixes of others, to 64
+ * targets. Lookups of random numbers must give what a brute force search
+ * gives, and are timed.
+*/
+static void av_dialplan_test_large(void) {
+	struct av_dialplan *dp;
+	GHashTable *prefixes;
+	GString *routes;
+	GRand *rand;
+	gchar **numbers;
+	gchar *prefix;
+	gint64 start;
+	gint64 elapsed;
+	guint n_matches = 0;
+	guint i;
+
+	prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	routes = g_string_new(NULL);
+
+	for (i = 0; i < AV_DIALPLAN_TEST_PREFIXES; i++) {
+		prefix = g_strdup_printf("+%u",1000 + i * 37);
+		g_string_append_printf(routes, "%s pool%u\n",prefix,i % 64);
+		g_hash_table_insert(prefixes, prefix, g_strdup_printf("pool%u",i % 64));
+	}
+
+	start = g_get_monotonic_time();
+	dp = av_dialplan_test_load(NULL, routes->str);
+	elapsed = g_get_monotonic_time() - start;
+	g_string_free(routes, TRUE);
+
+	g_assert_cmpuint(dp->n_prefixes, ==, AV_DIALPLAN_TEST_PREFIXES);
+	g_assert_cmpuint(dp->targets->len, ==, 64);
+	g_test_message("%u prefixes compiled in %" G_GINT64_FORMAT " ms, %u nodes (%zu KiB)",
+		dp->n_prefixes, elapsed/1000, dp->nodes->len, (gsize)dp->nodes->len * sizeof(struct av_dialplan_node) / 1024);
+
+	rand = g_rand_new_with_seed(3263);
+	numbers = g_new(gchar *, AV_DIALPLAN_TEST_LOOKUPS);
+	for (i = 0; i < AV_DIALPLAN_TEST_LOOKUPS; i++)
+		numbers[i] = g_strdup_printf("+%u%06u",g_rand_int_range(rand, 1000, 4000000),g_rand_int_range(rand, 0, 1000000));
+
+	for (i = 0; i < 10000; i++)
+		g_assert_cmpstr(av_dialplan_route(dp, numbers[i]), ==, av_dialplan_test_expected(prefixes, numbers[i]));
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < AV_DIALPLAN_TEST_LOOKUPS; i++)
+		if (av_dialplan_route(dp, numbers[i]))
+			n_matches++;
+	elapsed = g_get_monotonic_time() - start;
+
+	g_assert_cmpuint(n_matches, >, 0);
+	g_test_message("%u lookups (%u matched) in %" G_GINT64_FORMAT " ms: %.0f ns each",
+		AV_DIALPLAN_TEST_LOOKUPS, n_matches, elapsed/1000, elapsed * 1000.0 / AV_DIALPLAN_TEST_LOOKUPS);
+
+	for (i = 0; i < AV_DIALPLAN_TEST_LOOKUPS; i++)
+		g_free(numbers[i]);
+	g_free(numbers);
+	g_rand_free(rand);
+	g_hash_table_destroy(prefixes);
+	av_dialplan_free(dp);
+}
+
+gint main(gint argc, gchar *argv[]) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/dialplan/normalize", av_dialplan_test_normalize);
+	g_test_add_func("/dialplan/route", av_dialplan_test_route);
+	g_test_add_func("/dialplan/root", av_dialplan_test_root);
+	g_test_add_func("/dialplan/large", av_dialplan_test_large);
+
+	return g_test_run();
+}
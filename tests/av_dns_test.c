@@ -0,0 +1,506 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * SIP hosts resolution tests: see av_dns.c. The resolver asks a stub server of
+ * ours, on 127.0.0.1, serving a few test zones; how many queries reached it
+ * tells whether answers came from the cache.
+*/
+
+/* System headers */
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+/* AV headers */
+#include <av_dns.h>
+#include <av_poll.h>
+
+/* Negative answers of the stub are good for this long (the least av_dns allows). */
+#define AV_DNS_TEST_SOA_MINIMUM 5
+
+/* Lookups taking longer than this are broken ones. */
+#define AV_DNS_TEST_TIMEOUT_USEC (5 * G_USEC_PER_SEC)
+
+/* The stub zones: names it knows of, one record each. */
+static const struct {
+	const gchar *name;
+	int type;
+	guint ttl;
+	const gchar *data;
+	gint port;
+} av_dns_test_zone[] = {
+	{ "sip.test", ns_t_naptr, 60, "_sip._udp.sip.test", 0 },
+	{ "_sip._udp.sip.test", ns_t_srv, 60, "host1.sip.test", 5070 },
+	{ "host1.sip.test", ns_t_a, 60, "192.0.2.1", 0 },
+	{ "prefetch.test", ns_t_a, 10, "192.0.2.2", 0 },
+	{ "expiring.test", ns_t_a, 2, "192.0.2.3", 0 },
+};
+
+struct av_dns_test_stub {
+	int fd;
+	gint port;
+	GThread *thread;
+	gint queries;
+	gint delay;
+	gint stop;
+};
+
+/* Reactor side: the resolver messages and the timer wheel, as the SIP reactor polls them. */
+struct av_dns_test {
+	struct av_dns_test_stub stub;
+	struct av_timer_wheel wheel;
+	struct av_dns dns;
+	struct pollfd poll_data[2];
+	struct av_poll_source poll_sources[2];
+	struct av_poll poll;
+};
+
+struct av_dns_test_result {
+	gboolean done;
+	gchar addr[48];
+	gint port;
+	gint64 at;
+};
+
+/* Stub server side. */
+
+static guchar *av_dns_test_rr(guchar *p, const guchar *end, const gchar *name, int type, guint ttl, const guchar *rdata, guint rdlen) {
+	int n;
+
+	if ( (n = dn_comp(name, p, end - p, NULL, NULL)) < 0 )
+		return NULL;
+	p += n;
+
+	if (end - p < 10 + (int)rdlen)
+		return NULL;
+
+	NS_PUT16(type, p);
+	NS_PUT16(ns_c_in, p);
+	NS_PUT32(ttl, p);
+	NS_PUT16(rdlen, p);
+	memcpy(p, rdata, rdlen);
+
+	return p + rdlen;
+}
+
+static guint av_dns_test_string(guchar *p, const gchar *s) {
+	*p = strlen(s);
+	memcpy(p + 1, s, *p);
+	return 1 + *p;
+}
+
+/* RDATA of a zone record. */
+static guint av_dns_test_rdata(guint i, guchar *rdata, gsize size) {
+	guchar *p = rdata;
+	int n;
+
+	switch (av_dns_test_zone[i].type) {
+		case ns_t_naptr:
+			NS_PUT16(10, p);
+			NS_PUT16(10, p);
+			p += av_dns_test_string(p, "s");
+			p += av_dns_test_string(p, "SIP+D2U");
+			p += av_dns_test_string(p, "");
+			break;
+		case ns_t_srv:
+			NS_PUT16(0, p);
+			NS_PUT16(0, p);
+			NS_PUT16(av_dns_test_zone[i].port, p);
+			break;
+		case ns_t_a:
+			inet_pton(AF_INET, av_dns_test_zone[i].data, p);
+			return 4;
+		default:
+			return 0;
+	}
+
+	n = dn_comp(av_dns_test_zone[i].data, p, size - (p - rdata), NULL, NULL);
+	g_assert_cmpint(n, >, 0);
+
+	return p + n - rdata;
+}
+
+/* No such record: the zone SOA goes in the authority section. */
+static guchar *av_dns_test_soa(guchar *p, const guchar *end) {
+	guchar rdata[128];
+	guchar *r = rdata;
+
+	r += dn_comp("ns.test", r, sizeof rdata, NULL, NULL);
+	r += dn_comp("hostmaster.test", r, sizeof rdata - (r - rdata), NULL, NULL);
+	NS_PUT32(1, r);
+	NS_PUT32(3600, r);
+	NS_PUT32(600, r);
+	NS_PUT32(86400, r);
+	NS_PUT32(AV_DNS_TEST_SOA_MINIMUM, r);
+
+	return av_dns_test_rr(p, end, "test", ns_t_soa, AV_DNS_TEST_SOA_MINIMUM, rdata, r - rdata);
+}
+
+static gint av_dns_test_reply(const guchar *query, int len, guchar *reply, gsize size) {
+	guchar rdata[NS_MAXDNAME + 16];
+	const gchar *name;
+	guchar *p;
+	int qlen;
+	int type;
+	gboolean known = FALSE;
+	guint an = 0;
+	guint i;
+	ns_msg msg;
+	ns_rr rr;
+
+	if (ns_initparse(query, len, &msg) || ns_parserr(&msg, ns_s_qd, 0, &rr))
+		return -1;
+
+	name = ns_rr_name(rr);
+	type = ns_rr_type(rr);
+
+	/* The question goes back as it came. */
+	qlen = dn_skipname(query + NS_HFIXEDSZ, query + len);
+	if ( (qlen < 0) || (len - qlen < NS_HFIXEDSZ + NS_QFIXEDSZ) )
+		return -1;
+	qlen += NS_HFIXEDSZ + NS_QFIXEDSZ;
+	memcpy(reply, query, qlen);
+	p = reply + qlen;
+
+	for (i = 0; i < G_N_ELEMENTS(av_dns_test_zone); i++) {
+		if (g_ascii_strcasecmp(av_dns_test_zone[i].name, name))
+			continue;
+
+		known = TRUE;
+		if (av_dns_test_zone[i].type != type)
+			continue;
+
+		p = av_dns_test_rr(p, reply + size, name, type, av_dns_test_zone[i].ttl, rdata, av_dns_test_rdata(i, rdata, sizeof rdata));
+		if (!p)
+			return -1;
+		an++;
+	}
+
+	if (!an && !(p = av_dns_test_soa(p, reply + size)))
+		return -1;
+
+	/* QR, AA, RD as asked, RA, then NXDOMAIN for names we never heard of. */
+	reply[2] = 0x84 | (query[2] & 0x01);
+	reply[3] = 0x80 | (known ? ns_r_noerror : ns_r_nxdomain);
+	ns_put16(1, reply + 4);
+	ns_put16(an, reply + 6);
+	ns_put16(an ? 0 : 1, reply + 8);
+	ns_put16(0, reply + 10);
+
+	return p - reply;
+}
+
+static gpointer av_dns_test_stub_run(gpointer data) {
+	struct av_dns_test_stub *s = data;
+	guchar query[NS_PACKETSZ];
+	guchar reply[NS_PACKETSZ];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+	int len;
+
+	while (!g_atomic_int_get(&s->stop)) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		fromlen = sizeof from;
+		len = recvfrom(s->fd, query, sizeof query, 0, (struct sockaddr *)&from, &fromlen);
+		if (len < NS_HFIXEDSZ)
+			continue;
+
+		g_atomic_int_inc(&s->queries);
+
+		/* As far away as a real server. */
+		if (g_atomic_int_get(&s->delay))
+			g_usleep(g_atomic_int_get(&s->delay));
+
+		len = av_dns_test_reply(query, len, reply, sizeof reply);
+		if (len > 0)
+			sendto(s->fd, reply, len, 0, (struct sockaddr *)&from, fromlen);
+	}
+
+	return NULL;
+}
+
+static void av_dns_test_stub_start(struct av_dns_test_stub *s) {
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addrlen = sizeof addr;
+
+	memset(s, 0, sizeof *s);
+
+	s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	g_assert_cmpint(s->fd, >=, 0);
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	g_assert_cmpint(bind(s->fd, (struct sockaddr *)&addr, sizeof addr), ==, 0);
+	g_assert_cmpint(getsockname(s->fd, (struct sockaddr *)&addr, &addrlen), ==, 0);
+	s->port = ntohs(addr.sin_port);
+
+	s->thread = g_thread_new("DNSStub", av_dns_test_stub_run, s);
+}
+
+static void av_dns_test_stub_stop(struct av_dns_test_stub *s) {
+	g_atomic_int_set(&s->stop, 1);
+	g_thread_join(s->thread);
+	close(s->fd);
+}
+
+/* Reactor side. */
+
+static gint av_dns_test_timers(gpointer data, guint budget, gboolean *more) {
+	av_timer_wheel_run(data);
+
+	return 0;
+}
+
+static void av_dns_test_setup(struct av_dns_test *t, gboolean caching, gint delay) {
+	struct av_poll_source templates[2] = {
+		{ .name = "timer", .dispatch = av_dns_test_timers, .budget = 1 },
+		{ .name = "DNS", .dispatch = av_dns_dispatch, .budget = 16 },
+	};
+	gchar *server;
+
+	av_dns_test_stub_start(&t->stub);
+	t->stub.delay = delay;
+
+	g_assert_cmpint(av_timer_wheel_init(&t->wheel), ==, 0);
+
+	server = g_strdup_printf("127.0.0.1:%d",t->stub.port);
+	g_assert_cmpint(av_dns_init(&t->dns, &t->wheel, server, caching), ==, 0);
+	g_free(server);
+
+	t->poll_data[0].fd = av_timer_wheel_fd(&t->wheel);
+	t->poll_data[0].events = POLLIN;
+	t->poll_data[1].fd = av_dns_fd(&t->dns);
+	t->poll_data[1].events = POLLIN;
+	templates[0].data = &t->wheel;
+	templates[1].data = &t->dns;
+
+	av_poll_init(&t->poll, t->poll_data, t->poll_sources, templates, 2);
+}
+
+static void av_dns_test_teardown(struct av_dns_test *t) {
+	av_dns_deinit(&t->dns);
+	av_timer_wheel_deinit(&t->wheel, "test");
+	av_dns_test_stub_stop(&t->stub);
+}
+
+/* Runs the reactor side for that long, or until done is set. */
+static void av_dns_test_run(struct av_dns_test *t, gint64 usec, const gboolean *done) {
+	gint64 deadline = g_get_monotonic_time() + usec;
+
+	while ( !(done && *done) && (g_get_monotonic_time() < deadline) )
+		g_assert_cmpint(av_poll_run(&t->poll, 10), ==, 0);
+}
+
+static void av_dns_test_resolved(const gchar *addr, gint port, gpointer data) {
+	struct av_dns_test_result *r = data;
+
+	r->done = TRUE;
+	g_strlcpy(r->addr, addr ? addr : "", sizeof r->addr);
+	r->port = port;
+	r->at = g_get_monotonic_time();
+}
+
+/*
+ * Resolves a host: returns the result, and whether the answer was there
+ * right away, from the cache.
+*/
+static gboolean av_dns_test_resolve(struct av_dns_test *t, const gchar *host, enum av_dns_service service, struct av_dns_test_result *r) {
+	gboolean cached;
+
+	memset(r, 0, sizeof *r);
+	av_dns_resolve(&t->dns, host, service, av_dns_test_resolved, r);
+	cached = r->done;
+
+	av_dns_test_run(t, AV_DNS_TEST_TIMEOUT_USEC, &r->done);
+	g_assert_true(r->done);
+
+	return cached;
+}
+
+/* NAPTR, then SRV, then A: three queries the first time, none after that. */
+static void av_dns_test_srv(void) {
+	struct av_dns_test t;
+	struct av_dns_test_result r;
+
+	av_dns_test_setup(&t, TRUE, 0);
+
+	g_assert_false(av_dns_test_resolve(&t, "sip.test", AV_DNS_SIP_UDP, &r));
+	g_assert_cmpstr(r.addr, ==, "192.0.2.1");
+	g_assert_cmpint(r.port, ==, 5070);
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 3);
+
+	g_assert_true(av_dns_test_resolve(&t, "sip.test", AV_DNS_SIP_UDP, &r));
+	g_assert_cmpstr(r.addr, ==, "192.0.2.1");
+	g_assert_cmpint(r.port, ==, 5070);
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 3);
+
+	/* Another service is another answer. */
+	g_assert_false(av_dns_test_resolve(&t, "host1.sip.test", AV_DNS_A, &r));
+	g_assert_cmpstr(r.addr, ==, "192.0.2.1");
+	g_assert_cmpint(r.port, ==, 0);
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 4);
+
+	g_assert_cmpuint(t.dns.stats.n_requests, ==, 3);
+	g_assert_cmpuint(t.dns.stats.n_hits, ==, 1);
+	g_assert_cmpuint(t.dns.stats.n_lookups, ==, 2);
+
+	av_dns_test_teardown(&t);
+}
+
+/* Asking twice while the lookup is on its way: one lookup, two answers. */
+static void av_dns_test_waiters(void) {
+	struct av_dns_test t;
+	struct av_dns_test_result r1 = { 0 };
+	struct av_dns_test_result r2 = { 0 };
+
+	av_dns_test_setup(&t, TRUE, 0);
+
+	av_dns_resolve(&t.dns, "host1.sip.test", AV_DNS_A, av_dns_test_resolved, &r1);
+	av_dns_resolve(&t.dns, "host1.sip.test", AV_DNS_A, av_dns_test_resolved, &r2);
+	av_dns_test_run(&t, AV_DNS_TEST_TIMEOUT_USEC, &r2.done);
+
+	g_assert_true(r1.done);
+	g_assert_cmpstr(r1.addr, ==, "192.0.2.1");
+	g_assert_cmpstr(r2.addr, ==, "192.0.2.1");
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 1);
+
+	av_dns_test_teardown(&t);
+}
+
+/* Names that don't exist don't get asked about again until the SOA says so. */
+static void av_dns_test_negative(void) {
+	struct av_dns_test t;
+	struct av_dns_test_result r;
+
+	av_dns_test_setup(&t, TRUE, 0);
+
+	g_assert_false(av_dns_test_resolve(&t, "nx.test", AV_DNS_A, &r));
+	g_assert_cmpstr(r.addr, ==, "");
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 1);
+
+	g_assert_true(av_dns_test_resolve(&t, "nx.test", AV_DNS_A, &r));
+	g_assert_cmpstr(r.addr, ==, "");
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 1);
+	g_assert_cmpuint(t.dns.stats.n_negative_hits, ==, 1);
+
+	/* No prefetch of what doesn't exist: it's asked about again once expired. */
+	av_dns_test_run(&t, AV_DNS_TEST_SOA_MINIMUM * G_USEC_PER_SEC + G_USEC_PER_SEC/2, NULL);
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 1);
+
+	g_assert_false(av_dns_test_resolve(&t, "nx.test", AV_DNS_A, &r));
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 2);
+	g_assert_cmpuint(t.dns.stats.n_prefetches, ==, 0);
+
+	av_dns_test_teardown(&t);
+}
+
+/* Too short a TTL for a prefetch: the answer is just gone once expired. */
+static void av_dns_test_expiry(void) {
+	struct av_dns_test t;
+	struct av_dns_test_result r;
+
+	av_dns_test_setup(&t, TRUE, 0);
+
+	g_assert_false(av_dns_test_resolve(&t, "expiring.test", AV_DNS_A, &r));
+	g_assert_true(av_dns_test_resolve(&t, "expiring.test", AV_DNS_A, &r));
+	g_assert_cmpstr(r.addr, ==, "192.0.2.3");
+
+	av_dns_test_run(&t, 2 * G_USEC_PER_SEC + G_USEC_PER_SEC/2, NULL);
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 1);
+	g_assert_cmpuint(g_hash_table_size(t.dns.cache), ==, 0);
+
+	g_assert_false(av_dns_test_resolve(&t, "expiring.test", AV_DNS_A, &r));
+	g_assert_cmpstr(r.addr, ==, "192.0.2.3");
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 2);
+
+	av_dns_test_teardown(&t);
+}
+
+/*
+ * An answer that got used is looked up again at 80% of its TTL, nobody
+ * asking: whoever asks after it expired finds it in the cache.
+*/
+static void av_dns_test_prefetch(void) {
+	struct av_dns_test t;
+	struct av_dns_test_result r;
+
+	av_dns_test_setup(&t, TRUE, 0);
+
+	g_assert_false(av_dns_test_resolve(&t, "prefetch.test", AV_DNS_A, &r));
+	g_assert_true(av_dns_test_resolve(&t, "prefetch.test", AV_DNS_A, &r));
+
+	av_dns_test_run(&t, 10 * G_USEC_PER_SEC + G_USEC_PER_SEC/2, NULL);
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, 2);
+	g_assert_cmpuint(t.dns.stats.n_prefetches, ==, 1);
+
+	g_assert_true(av_dns_test_resolve(&t, "prefetch.test", AV_DNS_A, &r));
+	g_assert_cmpstr(r.addr, ==, "192.0.2.2");
+
+	av_dns_test_teardown(&t);
+}
+
+/*
+ * What a line waits for before sending a REGISTER: its registrar address.
+ * Lines registering one after the other to the same registrar, with a server
+ * a few ms away, with and without the cache.
+*/
+static gint64 av_dns_test_register_wait(gboolean caching, guint lines, gint64 *first) {
+	struct av_dns_test t;
+	struct av_dns_test_result r;
+	gint64 total = 0;
+	gint64 start;
+	guint i;
+
+	av_dns_test_setup(&t, caching, 5000);
+
+	for (i = 0; i < lines; i++) {
+		start = g_get_monotonic_time();
+		av_dns_test_resolve(&t, "sip.test", AV_DNS_SIP_UDP, &r);
+		g_assert_cmpstr(r.addr, ==, "192.0.2.1");
+
+		if (!i)
+			*first = r.at - start;
+		total += r.at - start;
+	}
+
+	g_assert_cmpint(g_atomic_int_get(&t.stub.queries), ==, caching ? 3 : 3 * lines);
+
+	av_dns_test_teardown(&t);
+
+	return total / lines;
+}
+
+static void av_dns_test_register(void) {
+	gint64 cached_first;
+	gint64 uncached_first;
+	gint64 cached;
+	gint64 uncached;
+
+	cached = av_dns_test_register_wait(TRUE, 32, &cached_first);
+	uncached = av_dns_test_register_wait(FALSE, 32, &uncached_first);
+
+	g_test_message("Time to REGISTER, 32 lines: first %" G_GINT64_FORMAT " us, average %" G_GINT64_FORMAT " us with the cache; first %" G_GINT64_FORMAT " us, average %" G_GINT64_FORMAT " us without",
+		cached_first, cached, uncached_first, uncached);
+
+	g_assert_cmpint(cached, <, uncached);
+}
+
+gint main(gint argc, gchar *argv[]) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/dns/srv", av_dns_test_srv);
+	g_test_add_func("/dns/waiters", av_dns_test_waiters);
+	g_test_add_func("/dns/negative", av_dns_test_negative);
+	g_test_add_func("/dns/expiry", av_dns_test_expiry);
+	g_test_add_func("/dns/prefetch", av_dns_test_prefetch);
+	g_test_add_func("/dns/register", av_dns_test_register);
+
+	return g_test_run();
+}
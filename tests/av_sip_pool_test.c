@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Modem pools tests: see av_sip_pool.c. Members stand for modem lines, their
+ * data is the name the test gave them.
+*/
+
+/* System headers */
+#include <string.h>
+
+/* AV headers */
+#include <av_sip_pool.h>
+
+#define AV_SIP_POOL_TEST_MEMBERS 4
+
+struct av_sip_pool_test {
+	struct av_sip_pools pools;
+	struct av_sip_pool *pool;
+	struct av_sip_pool_member members[AV_SIP_POOL_TEST_MEMBERS];
+	guint n_calls[AV_SIP_POOL_TEST_MEMBERS];
+};
+
+static gchar av_sip_pool_test_names[AV_SIP_POOL_TEST_MEMBERS][2] = { "a", "b", "c", "d" };
+
+/* Idle modems, all alike: a and b in the "cheap" group, c and d in "pricey". */
+static void av_sip_pool_test_setup(struct av_sip_pool_test *t, guint max_calls) {
+	struct av_sip_pool_member *m;
+	guint i;
+
+	memset(t, 0, sizeof *t);
+	av_sip_pools_init(&t->pools, max_calls);
+
+	for (i = 0; i < AV_SIP_POOL_TEST_MEMBERS; i++) {
+		m = &t->members[i];
+		m->group = (i < 2) ? "cheap" : "pricey";
+		m->sim = av_sip_pool_test_names[i];
+		m->registered = TRUE;
+		m->n_calls = &t->n_calls[i];
+		m->signal_quality = 50;
+		av_sip_pool_join(&t->pools, m, "pbx", av_sip_pool_test_names[i]);
+	}
+
+	t->pool = av_sip_pool_find(&t->pools, "pbx");
+	g_assert_nonnull(t->pool);
+}
+
+static const gchar *av_sip_pool_test_route(struct av_sip_pool_test *t, const gchar *target) {
+	return av_sip_pool_route(&t->pools, t->pool, target);
+}
+
+/* Fewest calls, then best signal (by steps of 10%), then fewest call minutes. */
+static void av_sip_pool_test_ranking(void) {
+	struct av_sip_pool_test t;
+
+	av_sip_pool_test_setup(&t, 4);
+
+	t.n_calls[0] = 1;
+	t.n_calls[1] = 1;
+	t.n_calls[2] = 1;
+	g_assert_cmpstr(av_sip_pool_test_route(&t, NULL), ==, "d");
+
+	t.n_calls[3] = 1;
+	t.members[1].signal_quality = 80;
+	g_assert_cmpstr(av_sip_pool_test_route(&t, NULL), ==, "b");
+
+	/* 81% is no better than 80%. */
+	t.members[2].signal_quality = 81;
+	t.members[1].call_time = 600 * G_USEC_PER_SEC;
+	t.members[2].call_time = 60 * G_USEC_PER_SEC;
+	g_assert_cmpstr(av_sip_pool_test_route(&t, NULL), ==, "c");
+
+	/* Calls come first. */
+	t.n_calls[0] = 0;
+	g_assert_cmpstr(av_sip_pool_test_route(&t, NULL), ==, "a");
+
+	g_assert_cmpuint(t.pool->stats.n_routed, ==, 4);
+	g_assert_cmpuint(t.pool->stats.n_unavailable, ==, 0);
+
+	av_sip_pools_deinit(&t.pools);
+}
+
+/* Unregistered, busy, or out of SIM minutes: not available. */
+static void av_sip_pool_test_available(void) {
+	struct av_sip_pool_test t;
+
+	av_sip_pool_test_setup(&t, 1);
+
+	t.members[0].registered = FALSE;
+	t.n_calls[1] = 1;
+	t.members[2].call_time_limit = 60 * G_USEC_PER_SEC;
+	t.members[2].call_time = 60 * G_USEC_PER_SEC;
+	t.members[3].call_time_limit = 60 * G_USEC_PER_SEC;
+	t.members[3].call_time = 59 * G_USEC_PER_SEC;
+
+	g_assert_false(av_sip_pool_available(&t.pools, &t.members[0]));
+	g_assert_false(av_sip_pool_available(&t.pools, &t.members[1]));
+	g_assert_false(av_sip_pool_available(&t.pools, &t.members[2]));
+	g_assert_true(av_sip_pool_available(&t.pools, &t.members[3]));
+	g_assert_cmpstr(av_sip_pool_test_route(&t, NULL), ==, "d");
+
+	t.n_calls[3] = 1;
+	g_assert_null(av_sip_pool_test_route(&t, NULL));
+	g_assert_cmpuint(t.pool->stats.n_unavailable, ==, 1);
+
+	av_sip_pools_deinit(&t.pools);
+}
+
+/*
+ * Dial plan targets: their members win over better ones outside of them,
+ * which are still used when none of theirs is available.
+*/
+static void av_sip_pool_test_target(void) {
+	struct av_sip_pool_test t;
+
+	av_sip_pool_test_setup(&t, 2);
+
+	t.n_calls[0] = 1;
+	t.n_calls[1] = 1;
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "cheap"), ==, "a");
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "b"), ==, "b");
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "pricey"), ==, "c");
+
+	/* Fallback: cheap modems are all busy. */
+	t.n_calls[0] = 2;
+	t.n_calls[1] = 2;
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "cheap"), ==, "c");
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "a"), ==, "c");
+
+	/* Unknown targets are just no preference. */
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "nowhere"), ==, "c");
+
+	av_sip_pools_deinit(&t.pools);
+}
+
+/* A pool goes away with its last member. */
+static void av_sip_pool_test_leave(void) {
+	struct av_sip_pool_test t;
+	guint i;
+
+	av_sip_pool_test_setup(&t, 1);
+
+	av_sip_pool_leave(&t.pools, &t.members[0]);
+	g_assert_null(t.members[0].pool);
+	g_assert_cmpuint(t.pool->members->len, ==, 3);
+	g_assert_cmpstr(av_sip_pool_test_route(&t, "a"), !=, "a");
+
+	/* Leaving twice is harmless. */
+	av_sip_pool_leave(&t.pools, &t.members[0]);
+
+	for (i = 1; i < AV_SIP_POOL_TEST_MEMBERS; i++)
+		av_sip_pool_leave(&t.pools, &t.members[i]);
+	g_assert_null(av_sip_pool_find(&t.pools, "pbx"));
+
+	av_sip_pools_deinit(&t.pools);
+}
+
+gint main(gint argc, gchar *argv[]) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/sip_pool/ranking", av_sip_pool_test_ranking);
+	g_test_add_func("/sip_pool/available", av_sip_pool_test_available);
+	g_test_add_func("/sip_pool/target", av_sip_pool_test_target);
+	g_test_add_func("/sip_pool/leave", av_sip_pool_test_leave);
+
+	return g_test_run();
+}
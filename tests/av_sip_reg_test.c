@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * REGISTER scheduling tests: see av_sip_reg.c. Nothing gets sent, only the
+ * retry timers are looked at.
+*/
+
+/* AV headers */
+#include <av_sip_reg.h>
+
+static void av_sip_reg_test_send(gpointer data) {
+}
+
+/* A registrar refusing us for good: retries never come sooner than the jitter allows, nor later than the cap. */
+static void av_sip_reg_test_backoff(void) {
+	struct av_timer_wheel wheel;
+	struct av_sip_reg_bucket b;
+	struct av_sip_reg r;
+	gint64 delay;
+	guint i;
+
+	g_assert_cmpint(av_timer_wheel_init(&wheel), ==, 0);
+	av_sip_reg_bucket_init(&b, &wheel, 1, 1, av_sip_reg_test_send);
+	av_sip_reg_init(&r, &b, NULL);
+
+	for (i = 1; i <= 20; i++) {
+		av_sip_reg_failure(&r, 0);
+		g_assert_true(av_timer_pending(&r.timer));
+
+		delay = r.timer.deadline - g_get_monotonic_time();
+		g_assert_cmpint(delay, >, 0);
+		g_assert_cmpint(delay, <=, AV_SIP_REG_BACKOFF_MAX_USEC);
+
+		/* Capped: it stays there, it doesn't wrap around. */
+		if (i > AV_SIP_REG_BACKOFF_MAX_SHIFT)
+			g_assert_cmpint(delay, >=, AV_SIP_REG_BACKOFF_MAX_USEC/2 - G_USEC_PER_SEC);
+	}
+
+	g_assert_cmpuint(r.failures, ==, 16);
+
+	av_sip_reg_stop(&r);
+	av_sip_reg_bucket_deinit(&b);
+	av_timer_wheel_deinit(&wheel, "test");
+}
+
+/* Retry-After wins over backoff when it asks for more. */
+static void av_sip_reg_test_retry_after(void) {
+	struct av_timer_wheel wheel;
+	struct av_sip_reg_bucket b;
+	struct av_sip_reg r;
+	gint64 delay;
+
+	g_assert_cmpint(av_timer_wheel_init(&wheel), ==, 0);
+	av_sip_reg_bucket_init(&b, &wheel, 1, 1, av_sip_reg_test_send);
+	av_sip_reg_init(&r, &b, NULL);
+
+	av_sip_reg_failure(&r, 600);
+	delay = r.timer.deadline - g_get_monotonic_time();
+	g_assert_cmpint(delay, >, 599 * G_USEC_PER_SEC);
+	g_assert_cmpint(delay, <=, 600 * G_USEC_PER_SEC);
+
+	av_sip_reg_stop(&r);
+	av_sip_reg_bucket_deinit(&b);
+	av_timer_wheel_deinit(&wheel, "test");
+}
+
+/* Round trips are accounted for once per REGISTER, challenges included. */
+static void av_sip_reg_test_round_trip(void) {
+	struct av_timer_wheel wheel;
+	struct av_sip_reg_bucket b;
+	struct av_sip_reg r;
+
+	g_assert_cmpint(av_timer_wheel_init(&wheel), ==, 0);
+	av_sip_reg_bucket_init(&b, &wheel, 1, 1, av_sip_reg_test_send);
+	av_sip_reg_init(&r, &b, NULL);
+
+	av_sip_reg_sent(&r);
+	g_usleep(1000);
+	av_sip_reg_success(&r, 3600);
+	g_assert_cmpuint(b.n_answered, ==, 1);
+	g_assert_cmpint(b.rtt_max, >=, 1000);
+	g_assert_cmpint(b.rtt_total, ==, b.rtt_max);
+
+	/* A refresh nobody sent: nothing to account for. */
+	av_sip_reg_success(&r, 3600);
+	g_assert_cmpuint(b.n_answered, ==, 1);
+
+	av_sip_reg_stop(&r);
+	av_sip_reg_bucket_deinit(&b);
+	av_timer_wheel_deinit(&wheel, "test");
+}
+
+gint main(gint argc, gchar *argv[]) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/sip_reg/backoff", av_sip_reg_test_backoff);
+	g_test_add_func("/sip_reg/retry_after", av_sip_reg_test_retry_after);
+	g_test_add_func("/sip_reg/round_trip", av_sip_reg_test_round_trip);
+
+	return g_test_run();
+}
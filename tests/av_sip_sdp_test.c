@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * SDP answer tests: see av_sip_sdp.c. Answers are compared to what they
+ * should read, and rendered at their longest into the line's buffer.
+*/
+
+/* System headers */
+#include <string.h>
+
+/* AV headers */
+#include <av_sip_sdp.h>
+
+#define AV_SIP_SDP_TEST_ADDR "192.0.2.10"
+
+static void av_sip_sdp_test_choice(struct av_sip_codec_choice *choice, const gchar *prefs) {
+	struct av_sip_codec_prefs p;
+
+	g_assert_cmpint(av_sip_codec_prefs_parse(&p, prefs), ==, 0);
+	g_assert_cmpint(av_sip_codec_offer(&p, choice), ==, 0);
+}
+
+static void av_sip_sdp_test_render(void) {
+	struct av_sip_codec_choice choice;
+	struct av_sip_sdp s;
+	const gchar *sdp;
+	gsize len;
+
+	g_assert_cmpint(av_sip_sdp_init(&s, AV_SIP_SDP_TEST_ADDR), ==, 0);
+
+	av_sip_sdp_test_choice(&choice, "PCMA");
+	sdp = av_sip_sdp_render(&s, 1234, 1, 40000, &choice, NULL, &len);
+	g_assert_cmpstr(sdp, ==,
+		"v=0\r\n"
+		"o=airvoice 1234 1 IN IP4 " AV_SIP_SDP_TEST_ADDR "\r\n"
+		"s=DongleCall\r\n"
+		"c=IN IP4 " AV_SIP_SDP_TEST_ADDR "\r\n"
+		"t=0 0\r\n"
+		"m=audio 40000 RTP/AVP 8\r\n"
+		"a=rtpmap:8 PCMA/8000\r\n"
+		"a=ptime:20\r\n");
+	g_assert_cmpuint(len, ==, strlen(sdp));
+
+	/* Another answer of the same line: only the numbers change. */
+	av_sip_sdp_test_choice(&choice, "PCMU,telephone-event");
+	sdp = av_sip_sdp_render(&s, 0, 2, 0, &choice, "sendonly", &len);
+	g_assert_cmpstr(sdp, ==,
+		"v=0\r\n"
+		"o=airvoice 0 2 IN IP4 " AV_SIP_SDP_TEST_ADDR "\r\n"
+		"s=DongleCall\r\n"
+		"c=IN IP4 " AV_SIP_SDP_TEST_ADDR "\r\n"
+		"t=0 0\r\n"
+		"m=audio 0 RTP/AVP 0 101\r\n"
+		"a=rtpmap:0 PCMU/8000\r\n"
+		"a=rtpmap:101 telephone-event/8000\r\n"
+		"a=fmtp:101 0-15\r\n"
+		"a=ptime:20\r\n"
+		"a=sendonly\r\n");
+	g_assert_cmpuint(len, ==, strlen(sdp));
+
+	av_sip_sdp_deinit(&s);
+}
+
+/*
+ * Everything at its longest: the largest numbers, the longest codec name,
+ * payload types and direction, and events filling their buffer with no NUL.
+ * Running it under AddressSanitizer tells whether the buffer is large enough.
+*/
+static void av_sip_sdp_test_bounds(void) {
+	gchar direction[32];
+	struct av_sip_codec_choice choice;
+	struct av_sip_sdp s;
+	const gchar *sdp;
+	gsize len;
+
+	g_assert_cmpint(av_sip_sdp_init(&s, "255.255.255.255"), ==, 0);
+
+	memset(&choice, 0, sizeof choice);
+	choice.codec = AV_SIP_CODEC_TELEPHONE_EVENT;
+	choice.payload_type = 127;
+	choice.dtmf_payload_type = 127;
+	memset(choice.dtmf_events, '9', sizeof choice.dtmf_events);
+
+	memset(direction, 'x', 16);
+	direction[16] = '\0';
+
+	sdp = av_sip_sdp_render(&s, G_MAXULONG, G_MAXULONG, -1, &choice, direction, &len);
+	g_assert_nonnull(sdp);
+	g_assert_cmpuint(len, ==, strlen(sdp));
+	g_assert_cmpuint(len, <, s.size);
+	g_assert_nonnull(strstr(sdp, "a=fmtp:127 99999999999999999999999999999999\r\n"));
+
+	/* Too long a direction, payload types RTP doesn't have, no codec: no answer. */
+	direction[16] = 'x';
+	direction[17] = '\0';
+	g_assert_null(av_sip_sdp_render(&s, 1, 1, 1, &choice, direction, &len));
+
+	choice.payload_type = 128;
+	g_assert_null(av_sip_sdp_render(&s, 1, 1, 1, &choice, NULL, &len));
+	choice.payload_type = -1;
+	g_assert_null(av_sip_sdp_render(&s, 1, 1, 1, &choice, NULL, &len));
+	choice.payload_type = 0;
+	choice.dtmf_payload_type = 128;
+	g_assert_null(av_sip_sdp_render(&s, 1, 1, 1, &choice, NULL, &len));
+
+	choice.dtmf_payload_type = -1;
+	choice.codec = AV_SIP_CODEC_NONE;
+	g_assert_null(av_sip_sdp_render(&s, 1, 1, 1, &choice, NULL, &len));
+
+	av_sip_sdp_deinit(&s);
+}
+
+gint main(gint argc, gchar *argv[]) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/sip_sdp/render", av_sip_sdp_test_render);
+	g_test_add_func("/sip_sdp/bounds", av_sip_sdp_test_bounds);
+
+	return g_test_run();
+}
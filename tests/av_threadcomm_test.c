@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Inter-thread messaging tests: see av_threadcomm.c. The test itself is the
+ * consumer, producers are threads it starts, or the test again.
+*/
+
+/* System headers */
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+/* AV headers */
+#include <av_thread.h>
+#include <av_threadcomm.h>
+
+/* Not exported: how many messages the pool has. */
+#define AV_THREADCOMM_TEST_POOL_SIZE 256
+
+#define AV_THREADCOMM_TEST_PRODUCERS 4
+#define AV_THREADCOMM_TEST_MSGS 20000
+
+struct av_threadcomm_test_producer {
+	struct av_thread *t;
+	gint id;
+	GThread *thread;
+};
+
+static void av_threadcomm_test_setup(struct av_thread *t) {
+	memset(t, 0, sizeof *t);
+	g_assert_cmpint(av_thread_queue_init(&t->queues[0]), ==, 0);
+	g_assert_cmpint(av_thread_queue_init(&t->queues[1]), ==, 0);
+}
+
+static void av_threadcomm_test_teardown(struct av_thread *t) {
+	av_thread_queue_deinit(&t->queues[0], "Parent");
+	av_thread_queue_deinit(&t->queues[1], "Thread");
+}
+
+/* A burst of messages: one wakeup, handed out in the order they were sent. */
+static void av_threadcomm_test_fifo(void) {
+	struct av_thread t;
+	struct av_thread_cmd *c;
+	guint64 wakeups;
+	int i;
+
+	av_threadcomm_test_setup(&t);
+
+	for (i = 0; i < 100; i++) {
+		c = av_thread_cmd(i, NULL);
+		g_assert_nonnull(c);
+		g_assert_cmpint(av_thread_txcmd(&t, c, 0), ==, 0);
+	}
+
+	g_assert_cmpint(read(av_thread_eventfd(&t, 1), &wakeups, sizeof wakeups), ==, sizeof wakeups);
+	g_assert_cmpuint(wakeups, ==, 1);
+
+	for (i = 0; i < 100; i++) {
+		c = av_thread_rxcmd(&t, 1);
+		g_assert_nonnull(c);
+		g_assert_cmpint(c->msgtype, ==, i);
+		av_thread_cmd_free(c);
+	}
+
+	g_assert_null(av_thread_rxcmd(&t, 1));
+	g_assert_null(av_thread_rxcmd(&t, 0));
+	g_assert_cmpuint(t.queues[1].n_msgs, ==, 100);
+	g_assert_cmpuint(t.queues[1].n_batches, ==, 1);
+
+	av_threadcomm_test_teardown(&t);
+}
+
+static gpointer av_threadcomm_test_produce(gpointer data) {
+	struct av_threadcomm_test_producer *p = data;
+	struct av_thread_cmd *c;
+	int i;
+
+	for (i = 0; i < AV_THREADCOMM_TEST_MSGS; i++) {
+		c = av_thread_cmd_str(p->id, i, "/org/freedesktop/ModemManager1/Call/0");
+		g_assert_nonnull(c);
+		av_thread_txcmd(p->t, c, 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * Producers racing each other: no message is lost, and each producer's ones
+ * come in the order it sent them.
+*/
+static void av_threadcomm_test_producers(void) {
+	struct av_threadcomm_test_producer producers[AV_THREADCOMM_TEST_PRODUCERS];
+	gint next[AV_THREADCOMM_TEST_PRODUCERS] = { 0 };
+	struct av_thread t;
+	struct av_thread_cmd *c;
+	struct pollfd pfd;
+	guint received = 0;
+	int i;
+
+	av_threadcomm_test_setup(&t);
+	pfd.fd = av_thread_eventfd(&t, 1);
+	pfd.events = POLLIN;
+
+	for (i = 0; i < AV_THREADCOMM_TEST_PRODUCERS; i++) {
+		producers[i].t = &t;
+		producers[i].id = i;
+		producers[i].thread = g_thread_new("producer", av_threadcomm_test_produce, &producers[i]);
+	}
+
+	while (received < AV_THREADCOMM_TEST_PRODUCERS * AV_THREADCOMM_TEST_MSGS) {
+		g_assert_cmpint(poll(&pfd, 1, 5000), ==, 1);
+
+		while ( (c = av_thread_rxcmd(&t, 1)) ) {
+			g_assert_cmpint(c->msgtype, >=, 0);
+			g_assert_cmpint(c->msgtype, <, AV_THREADCOMM_TEST_PRODUCERS);
+			g_assert_cmpint(c->arg, ==, next[c->msgtype]);
+			g_assert_cmpstr(c->data, ==, "/org/freedesktop/ModemManager1/Call/0");
+			next[c->msgtype]++;
+			received++;
+			av_thread_cmd_free(c);
+		}
+	}
+
+	for (i = 0; i < AV_THREADCOMM_TEST_PRODUCERS; i++)
+		g_thread_join(producers[i].thread);
+
+	g_assert_null(av_thread_rxcmd(&t, 1));
+	g_test_message("%u messages in %" G_GUINT64_FORMAT " wakeups, latency average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us",
+		received, t.queues[1].n_batches, t.queues[1].latency_total/(gint64)t.queues[1].n_msgs, t.queues[1].latency_max);
+
+	av_threadcomm_test_teardown(&t);
+}
+
+/* Once the pool is exhausted, messages come from the heap, and work the same. */
+static void av_threadcomm_test_pool(void) {
+	struct av_thread_cmd *pooled[AV_THREADCOMM_TEST_POOL_SIZE];
+	struct av_thread_cmd *c;
+	struct av_thread t;
+	int i;
+
+	av_threadcomm_test_setup(&t);
+
+	for (i = 0; i < AV_THREADCOMM_TEST_POOL_SIZE; i++) {
+		pooled[i] = av_thread_cmd(i, NULL);
+		g_assert_nonnull(pooled[i]);
+		g_assert_true(pooled[i]->pooled);
+	}
+
+	c = av_thread_cmd_str(1, 2, "+442079460000");
+	g_assert_nonnull(c);
+	g_assert_false(c->pooled);
+	av_thread_txcmd(&t, c, 1);
+
+	c = av_thread_rxcmd(&t, 0);
+	g_assert_nonnull(c);
+	g_assert_false(c->pooled);
+	g_assert_cmpint(c->arg, ==, 2);
+	g_assert_cmpstr(c->data, ==, "+442079460000");
+	av_thread_cmd_free(c);
+
+	/* Slots given back are taken again. */
+	av_thread_cmd_free(pooled[42]);
+	pooled[42] = av_thread_cmd(42, NULL);
+	g_assert_true(pooled[42]->pooled);
+
+	for (i = 0; i < AV_THREADCOMM_TEST_POOL_SIZE; i++)
+		av_thread_cmd_free(pooled[i]);
+
+	av_threadcomm_test_teardown(&t);
+}
+
+/* Strings too long to travel inline are copied, and freed along with the message. */
+static void av_threadcomm_test_strings(void) {
+	gchar str[AV_THREAD_CMD_DATA_LEN + 1];
+	struct av_thread_cmd *c;
+
+	memset(str, 'x', sizeof str - 1);
+	str[sizeof str - 1] = '\0';
+
+	c = av_thread_cmd_str(0, 0, str);
+	g_assert_true(c->data != c->inline_data);
+	g_assert_cmpstr(c->data, ==, str);
+	av_thread_cmd_free(c);
+
+	str[sizeof str - 2] = '\0';
+	c = av_thread_cmd_str(0, 0, str);
+	g_assert_true(c->data == c->inline_data);
+	g_assert_cmpstr(c->data, ==, str);
+	av_thread_cmd_free(c);
+
+	c = av_thread_cmd_str(0, 0, NULL);
+	g_assert_cmpstr(c->data, ==, "");
+	av_thread_cmd_free(c);
+}
+
+gint main(gint argc, gchar *argv[]) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/threadcomm/fifo", av_threadcomm_test_fifo);
+	g_test_add_func("/threadcomm/producers", av_threadcomm_test_producers);
+	g_test_add_func("/threadcomm/pool", av_threadcomm_test_pool);
+	g_test_add_func("/threadcomm/strings", av_threadcomm_test_strings);
+
+	return g_test_run();
+}